@@ -1,30 +1,229 @@
 #include "azure.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <applibs/log.h>
+#include <applibs/networking.h>
+#include <applibs/storage.h>
 
+#include "json_writer.h"
 #include "parson.h" // used to parse Device Twin messages.
+#include "trace.h"
 extern void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
 	size_t payloadSize, void* userContextCallback);
-extern void MethodCallback(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size, void* userContextCallback);
+extern int MethodCallback(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size, void* userContextCallback);
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* context);
+static void destroyClient(AzureClient* client);
+static int startSetup(AzureClient* client);
+static void* setupWorker(void* context);
+static int finishSetup(AzureClient* client, AZURE_SPHERE_PROV_RETURN_VALUE provResult);
+static void flushTelemetry(AzureClient* client);
+static void dispatchTelemetry(AzureClient* client, const char* message, uint16_t length, unsigned int count,
+	const TelemetryBatchLane* lanes, uint32_t startMs);
+static int sendTelemetryMessage(AzureClient* client, const char* message, uint16_t length, TelemetryDelivery* delivery);
+static bool isBinaryTelemetry(const char* message, uint16_t length);
+static int deliverTelemetry(AzureClient* client, const char* message, uint16_t length, bool critical, uint32_t queuedMs);
+static TelemetryDelivery* findFreeDelivery(AzureClient* client);
+static int handOverDelivery(AzureClient* client, TelemetryDelivery* delivery);
+static void confirmDelivery(AzureClient* client, TelemetryDelivery* delivery, IOTHUB_CLIENT_CONFIRMATION_RESULT result);
+static int storeDelivery(AzureClient* client, TelemetryDelivery* delivery);
+static void retryDeliveries(AzureClient* client);
+static void addDeliveryLatency(DeliveryStats* stats, uint32_t ms);
+static void logDeliveryStats(const char* name, const DeliveryStats* stats);
+static void writeDeliveryStats(JsonWriter* writer, const char* key, const DeliveryStats* stats);
+static void drainTelemetryStore(AzureClient* client);
+static bool isTelemetryBackedUp(AzureClient* client);
+static int formatTelemetryEvent(char* eventBuffer, const char* key, const char* value);
+static void queueTelemetry(AzureClient* client, uint8_t code, uint16_t argument, const char* eventBuffer, int len,
+	TelemetryLane lane);
+static TelemetryLimit* findTelemetryLimit(AzureClient* client, const char* key);
+static bool takeTelemetryToken(TelemetryLimit* limit, uint32_t now);
+static void summarizeHeldBackTelemetry(AzureClient* client);
+static void countFlushedEvents(AzureClient* client, const TelemetryBatchLane* lanes, uint32_t ageMs, int outcome);
+static void flushReportedState(AzureClient* client);
+static void flush(AzureClient* client);
+static bool isReportedDirty(const ReportedProperty* property);
+static void doWork(AzureClient* client);
+static uint32_t getTimeMs(void);
 static void ReportStatusCallback(int result, void* context);
+static void reportedStateCallback(int result, void* context);
+static void setAuthenticated(AzureClient* client, bool authenticated);
+static bool canSend(const AzureClient* client);
+static int sendReportedPatch(AzureClient* client, const char* patch, size_t length);
+static int clientSendTelemetry(AzureClient* client, const char* message, uint16_t length, TelemetryDelivery* delivery);
+static int clientSendReportedState(AzureClient* client, const char* patch, size_t length);
+static void clientDoWork(AzureClient* client);
+static void scheduleDoWork(AzureClient* client);
+static int pushOutbound(AzureClient* client, uint8_t type, const void* first, size_t firstLength,
+	const void* second, size_t secondLength);
+static int pushInbound(AzureClient* client, uint8_t type, const void* first, size_t firstLength,
+	const void* second, size_t secondLength);
+static void* workerThread(void* context);
+static void workerWakeHandler(EventData* eventData);
+static void workerPollHandler(EventData* eventData);
+static void workerMethodTimerHandler(EventData* eventData);
+static void workerPoll(AzureClient* client);
+static void workerArmPollTimer(AzureClient* client);
+static void workerTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
+	size_t size, void* context);
+static int workerMethodCallback(const char* name, const unsigned char* payload, size_t size,
+	unsigned char** response, size_t* responseSize, void* context);
+static void answerMethod(AzureClient* client, const uint8_t* record, size_t length);
 static const char* GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
+static HubConnectionReason connectionReason(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason);
+static HubConnectionReason provisioningReason(AZURE_SPHERE_PROV_RESULT result);
 static const char* getAzureSphereProvisioningResultString(
 	AZURE_SPHERE_PROV_RETURN_VALUE provisioningResult);
 
-IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle = NULL;
+char scopeId[SCOPEID_LENGTH];
 
 const int keepalivePeriodSeconds = 20;
-bool iothubAuthenticated = false;
 
-// Azure IoT poll periods
+// Azure IoT poll period; a failed connection waits for client->connection's backoff, see hub_connection.h
 const int AzureIoTDefaultPollPeriodSeconds = 5;
-const int AzureIoTMinReconnectPeriodSeconds = 60;
-const int AzureIoTMaxReconnectPeriodSeconds = 10 * 60;
-static int azureIoTPollPeriodSeconds = -1;
+
+// A telemetry batch or reported-state change is sent at the latest this long after it was queued.
+static const uint32_t telemetryLingerMs = 2000;
+
+// Stored messages are sent at most this often after reconnecting, so a backlog doesn't
+// crowd out live traffic.
+static const uint32_t storeDrainIntervalMs = 250;
+
+// While the client holds unacknowledged messages DoWork runs this often instead of waiting for
+// the next poll, so confirmations and replies come back within a round trip...
+static const uint32_t doWorkBusyIntervalMs = 20;
+// ...for this long after the last send. A slower hub gets a doubling interval, up to the poll period.
+static const uint32_t doWorkBusyWindowMs = 1000;
+
+// A telemetry message is handed to the client at most this many times, deliveryRetryMs after
+// the first failure and twice as long after each further one.
+static const uint8_t maxDeliveryAttempts = 4;
+static const uint32_t deliveryRetryMs = 1000;
+
+// The IoT worker answers 503 to a direct method the app thread hasn't taken up within this
+// long, rather than hold up the connection any longer.
+static const uint32_t workerMethodTimeoutMs = 5000;
+
+// Direct method names longer than this are unknown; IoT Hub allows 128 characters.
+#define METHOD_NAME_MAX 128
+
+// Events held back by a TelemetryLimit are summed up in one event this often.
+static const uint32_t telemetrySummaryMs = 60000;
+
+// The client reports messages it couldn't deliver within this long as timed out.
+static const uint64_t messageTimeoutMs = 30000;// tickcounter_ms_t
+
+// What happened to the events of a flushed telemetry batch, for the lane counters.
+enum {
+	FLUSHED_SENT,
+	FLUSHED_STORED,
+	FLUSHED_DROPPED
+};
+
+// Record types on the IoT worker's rings.
+enum {
+	WORKER_TELEMETRY,// outbound: u8 delivery slot or NO_DELIVERY, message bytes
+	WORKER_REPORTED,// outbound: patch text
+	WORKER_NETWORK,// outbound: u8 ready
+	WORKER_CONNECTION,// inbound: u8 authenticated, the worker's HubConnection
+	WORKER_REPORT_STATUS,// inbound: int result of the patch in flight
+	WORKER_TWIN,// inbound: WorkerTwin
+	WORKER_METHOD,// inbound: u32 call number, method name, '\0', payload
+	WORKER_DELIVERY// inbound: u8 delivery slot, u8 confirmation result
+};
+
+// A twin can be larger than a record, so the worker passes a heap copy the app thread frees.
+typedef struct WorkerTwin {
+	uint8_t updateState;
+	unsigned char* payload;
+	size_t size;
+} WorkerTwin;
+
+#define NO_DELIVERY 0xFF
+
+void InitAzureClient(AzureClient* client, void* context)
+{
+	client->handle = NULL;
+	client->context = context;
+	client->pollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
+	// Locks that booted together, after a power cut, still differ in the nanoseconds.
+	struct timespec boot;
+	clock_gettime(CLOCK_REALTIME, &boot);
+	HubConnection_Init(&client->connection, (uint32_t)boot.tv_nsec ^ (uint32_t)boot.tv_sec, getTimeMs());
+	client->authenticated = false;
+	client->connected = false;
+	client->working = false;
+	client->patchInFlight = false;
+	client->sendMs = 0;
+	client->doWorkIntervalMs = 0;
+	client->worker = NULL;
+	client->setupEventFd = -1;
+	client->setupPending = false;
+	client->setupHandle = NULL;
+	client->telemetryEncoding = TELEMETRY_ENCODING_JSON;
+	client->telemetryBatch[0] = '[';
+	client->telemetryBatchLength = 1;
+	client->telemetryBatchCount = 0;
+	memset(client->telemetryBatchLanes, 0, sizeof(client->telemetryBatchLanes));
+	memset(client->lanes, 0, sizeof(client->lanes));
+	memset(client->limits, 0, sizeof(client->limits));
+	client->store.fd = -1;
+	client->deliverySequence = 0;
+	for (int i = 0; i < TELEMETRY_DELIVERY_SLOTS; i++) {
+		client->deliveries[i].client = client;
+		client->deliveries[i].sequence = 0;
+	}
+	memset(&client->telemetryDelivery, 0, sizeof(client->telemetryDelivery));
+	memset(&client->reportedDelivery, 0, sizeof(client->reportedDelivery));
+	client->reportedDirty = false;
+	client->reportInFlight = false;
+	memset(client->reported, 0, sizeof(client->reported));
+}
+
+/// <summary>
+///     Opens the telemetry store in mutable storage and recovers the messages it kept. The
+///     client works without it, as before, if it can't be opened.
+/// </summary>
+/// <returns>0 on success, -1 on failure</returns>
+int OpenTelemetryStore(AzureClient* client)
+{
+	int fd = Storage_OpenMutableFile();
+	if (fd < 0) {
+		Log_Debug("ERROR: Could not open mutable storage: %s (%d).\n", strerror(errno), errno);
+		return -1;
+	}
+	int count = EventQueue_Open(&client->store, fd, 0, TELEMETRY_STORE_SIZE);
+	if (count < 0) {
+		Log_Debug("ERROR: Could not read the telemetry store.\n");
+		close(fd);
+		return -1;
+	}
+	Log_Debug("INFO: Telemetry store holds %d messages.\n", count);
+	return 0;
+}
+
+void CloseTelemetryStore(AzureClient* client)
+{
+	if (client->store.fd < 0)
+		return;
+	// Messages not confirmed yet are sent again after a restart, so they may arrive twice.
+	for (int i = 0; i < TELEMETRY_DELIVERY_SLOTS; i++) {
+		TelemetryDelivery* delivery = &client->deliveries[i];
+		if (delivery->sequence != 0 && EventQueue_Push(&client->store, delivery->critical ?
+			EVENT_PRIORITY_CRITICAL : EVENT_PRIORITY_NORMAL, delivery->message, delivery->length) == 0)
+			delivery->sequence = 0;
+	}
+	EventQueue_Commit(&client->store);
+	close(client->store.fd);
+	client->store.fd = -1;
+}
 
 /// <summary>
 ///     Sets the IoT Hub authentication state for the app
@@ -34,89 +233,735 @@ void HubConnectionStatusCallback(IOTHUB_CLIENT_CONNECTION_STATUS result,
 	IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason,
 	void* userContextCallback)
 {
-	iothubAuthenticated = (result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED);
+	AzureClient* client = userContextCallback;
+	client->connected = (result == IOTHUB_CLIENT_CONNECTION_AUTHENTICATED);
+	if (client->connected)
+		HubConnection_Connected(&client->connection, getTimeMs());
+	else
+		HubConnection_Lost(&client->connection, connectionReason(reason), getTimeMs());
+	setAuthenticated(client, client->connected);
 	Log_Debug("IoT Hub Authenticated: %s\n", GetReasonString(reason));
 }
 
+// Tells the app thread about the connection, directly unless the worker owns the client. The
+// worker also passes a copy of client->connection, which only it may read from then on.
+static void setAuthenticated(AzureClient* client, bool authenticated)
+{
+	if (client->worker == NULL) {
+		client->authenticated = authenticated;
+		return;
+	}
+	uint8_t value = authenticated;
+	pushInbound(client, WORKER_CONNECTION, &value, sizeof(value), &client->connection, sizeof(client->connection));
+}
+
+// Result of the patch the client held, passed on to ReportStatusCallback on the app thread.
+static void reportedStateCallback(int result, void* context)
+{
+	AzureClient* client = context;
+	client->patchInFlight = false;
+	if (client->worker == NULL) {
+		ReportStatusCallback(result, client);
+		return;
+	}
+	int32_t value = result;
+	pushInbound(client, WORKER_REPORT_STATUS, &value, sizeof(value), NULL, 0);
+}
+
+/// <summary>
+///     Callback for the reported-state patch in flight. The properties it carried are
+///     acknowledged on success, otherwise they are dirty again and go out with the next patch.
+/// </summary>
 static void ReportStatusCallback(int result, void* context)
 {
+	AzureClient* client = context;
+	bool accepted = result >= 200 && result < 300;
 	Log_Debug("INFO: Device Twin reported properties update result: HTTP status code %d\n", result);
+	if (accepted)
+		addDeliveryLatency(&client->reportedDelivery, getTimeMs() - client->reportSentMs);
+	else
+		client->reportedDelivery.failed++;
+
+	for (int i = 0; i < REPORTED_PROPERTY_COUNT; i++) {
+		ReportedProperty* property = &client->reported[i];
+		if (!property->inFlight)
+			continue;
+		property->inFlight = false;
+		property->acknowledged = accepted;
+		if (isReportedDirty(property) && !client->reportedDirty) {
+			client->reportedDirty = true;
+			client->reportedStartMs = getTimeMs();
+		}
+	}
+	client->reportInFlight = false;
 }
 
-void TwinReportState(const char* propertyName, const char*propertyValue)
+/// <summary>
+///     Sets a reported property in the shadow. Changes are merged into one patch that is sent
+///     with the next telemetry flush, a value equal to the one the hub acknowledged is not sent.
+/// </summary>
+/// <param name="propertyName">String constant naming the property</param>
+/// <param name="propertyValue">JSON value of the property</param>
+void TwinReportState(AzureClient* client, const char* propertyName, const char*propertyValue)
 {
-	if (iothubClientHandle == NULL) {
-		Log_Debug("ERROR: client not initialized\n");
+	char reportedPropertiesString[50];
+	JsonWriter writer;
+	JsonWriter_Init(&writer, reportedPropertiesString, sizeof(reportedPropertiesString));
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_Raw(&writer, propertyName, propertyValue);
+	JsonWriter_EndObject(&writer);
+	if (JsonWriter_Finish(&writer) < 0) {
+		Log_Debug("ERROR: reported state for '%s' doesn't fit in %zu bytes.\n", propertyName,
+			sizeof(reportedPropertiesString));
+		return;
 	}
-	else {
-		static char reportedPropertiesString[50] = { 0 };
-		int len = snprintf(reportedPropertiesString, 50, "{\"%s\":%s}", propertyName,propertyValue);
-		if (len < 0)
-			return;
+	Trace_RecordHash(TRACE_OUT_REPORTED, reportedPropertiesString);
 
-		if (IoTHubDeviceClient_LL_SendReportedState(
-			iothubClientHandle, (unsigned char*)reportedPropertiesString,
-			strlen(reportedPropertiesString), ReportStatusCallback, 0) != IOTHUB_CLIENT_OK) {
-			Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
-		}
-		else {
-			Log_Debug("INFO: Reported state for '%s' to value '%s'.\n", propertyName,propertyValue);
-		}
+	ReportedProperty* property = NULL;
+	for (int i = 0; i < REPORTED_PROPERTY_COUNT && property == NULL; i++) {
+		if (client->reported[i].name == NULL || strcmp(client->reported[i].name, propertyName) == 0)
+			property = &client->reported[i];
+	}
+	if (property == NULL || strlen(propertyValue) >= REPORTED_VALUE_SIZE) {
+		Log_Debug("ERROR: failed to set reported state for '%s'.\n", propertyName);
+		return;
+	}
+	property->name = propertyName;
+	strcpy(property->value, propertyValue);
+
+	if (isReportedDirty(property) && !client->reportedDirty) {
+		client->reportedDirty = true;
+		client->reportedStartMs = getTimeMs();
 	}
+	Log_Debug("INFO: Reported state for '%s' to value '%s' queued.\n", propertyName, propertyValue);
+}
+
+// A property is sent when its value is not what the hub acknowledged, unless it is in flight.
+static bool isReportedDirty(const ReportedProperty* property)
+{
+	return !property->inFlight && (!property->acknowledged || strcmp(property->value, property->sent) != 0);
 }
 
 /// <summary>
-///     Sets up the Azure IoT Hub connection (creates the iothubClientHandle)
+///     Sends the dirty reported properties as one patch. Only one patch is in flight at a
+///     time; changes made meanwhile wait for its ReportStatusCallback.
+/// </summary>
+static void flushReportedState(AzureClient* client)
+{
+	if (!client->reportedDirty || client->reportInFlight || !canSend(client))
+		return;
+
+	// room for every property, so the patch only overflows if a name is unexpectedly long
+	char patch[REPORTED_PROPERTY_COUNT * (REPORTED_VALUE_SIZE + 32)];
+	JsonWriter writer;
+	JsonWriter_Init(&writer, patch, sizeof(patch));
+	JsonWriter_BeginObject(&writer, NULL);
+	unsigned int count = 0;
+	for (int i = 0; i < REPORTED_PROPERTY_COUNT; i++) {
+		ReportedProperty* property = &client->reported[i];
+		if (property->name == NULL || !isReportedDirty(property))
+			continue;
+		JsonWriter_Raw(&writer, property->name, property->value);
+		strcpy(property->sent, property->value);
+		property->inFlight = true;
+		count++;
+	}
+	JsonWriter_EndObject(&writer);
+	int length = JsonWriter_Finish(&writer);
+	client->reportedDirty = false;
+	if (count == 0)
+		return;
+
+	if (length < 0 || sendReportedPatch(client, patch, (size_t)length) < 0) {
+		Log_Debug("ERROR: failed to send %u reported properties.\n", count);
+		ReportStatusCallback(0, client);
+	}
+	else {
+		client->reportInFlight = true;
+		client->reportSentMs = getTimeMs();
+		Log_Debug("INFO: Reported state patch with %u properties: %s\n", count, patch);
+	}
+}
+
+/// <summary>
+///     Sets up the Azure IoT Hub connection (creates client->handle)
 ///     When the SAS Token for a device expires the connection needs to be recreated
 ///     which is why this is not simply a one time call.
+///     Provisioning blocks for up to 10 seconds while the hub can't be reached; with a setup
+///     event PollAzureClient runs it on a worker thread instead.
 /// </summary>
-int SetupAzureClient(void)
+int SetupAzureClient(AzureClient* client)
 {
-	if (iothubClientHandle != NULL)
-		IoTHubDeviceClient_LL_Destroy(iothubClientHandle);
-
+	destroyClient(client);
+	HubConnection_Connecting(&client->connection, getTimeMs());
 	AZURE_SPHERE_PROV_RETURN_VALUE provResult =
 		IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(scopeId, 10000,
-			&iothubClientHandle);
+			&client->handle);
+	return finishSetup(client, provResult);
+}
+
+static void destroyClient(AzureClient* client)
+{
+	if (client->handle != NULL) {
+		IoTHubDeviceClient_LL_Destroy(client->handle);
+		client->handle = NULL;
+	}
+	client->doWorkIntervalMs = 0;
+	// A patch lost with the old connection goes out again on the new one.
+	if (client->patchInFlight)
+		reportedStateCallback(0, client);
+}
+
+/// <summary>
+///     Creates the eventfd the provisioning worker signals. The caller registers it with
+///     its epoll and calls CompleteAzureClientSetup when it is readable.
+/// </summary>
+/// <returns>The eventfd, or -1 on failure (provisioning then blocks the caller)</returns>
+int OpenAzureSetupEvent(AzureClient* client)
+{
+	client->setupEventFd = eventfd(0, EFD_NONBLOCK);
+	if (client->setupEventFd < 0) {
+		Log_Debug("ERROR: Could not create the setup eventfd: %s (%d).\n", strerror(errno), errno);
+	}
+	return client->setupEventFd;
+}
+
+/// <summary>
+///     Takes the handle the provisioning worker created and finishes the setup.
+/// </summary>
+/// <returns>The poll period to use from now on in seconds, 0 if there was nothing to finish or -1 on failure</returns>
+int CompleteAzureClientSetup(AzureClient* client)
+{
+	eventfd_t value;
+	if (eventfd_read(client->setupEventFd, &value) != 0) {
+		Log_Debug("ERROR: Could not read the setup eventfd: %s (%d).\n", strerror(errno), errno);
+		return -1;
+	}
+	if (!client->setupPending)
+		return 0;
+	client->setupPending = false;
+	client->handle = client->setupHandle;
+	client->setupHandle = NULL;
+	int period = finishSetup(client, client->setupResult);
+	if (client->authenticated)
+		flush(client);
+	return period;
+}
+
+void CloseAzureSetupEvent(AzureClient* client)
+{
+	// A worker still provisioning writes to the eventfd when it is done, so it stays open
+	// until the process exits.
+	if (client->setupPending)
+		return;
+	CloseFdAndPrintError(client->setupEventFd, "AzureSetupEvent");
+	client->setupEventFd = -1;
+}
+
+//provisions on a detached thread, the event loop keeps running meanwhile
+static int startSetup(AzureClient* client)
+{
+	destroyClient(client);
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	client->setupPending = true;
+	int result = pthread_create(&thread, &attributes, setupWorker, client);
+	pthread_attr_destroy(&attributes);
+	if (result != 0) {
+		client->setupPending = false;
+		Log_Debug("ERROR: Could not start the provisioning thread: %s (%d).\n", strerror(result), result);
+		return -1;
+	}
+	HubConnection_Connecting(&client->connection, getTimeMs());
+	return 0;
+}
+
+static void* setupWorker(void* context)
+{
+	AzureClient* client = context;
+	client->setupResult = IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(
+		scopeId, 10000, &client->setupHandle);
+	if (eventfd_write(client->setupEventFd, 1) != 0) {
+		Log_Debug("ERROR: Could not signal the setup eventfd: %s (%d).\n", strerror(errno), errno);
+	}
+	return NULL;
+}
+
+static int finishSetup(AzureClient* client, AZURE_SPHERE_PROV_RETURN_VALUE provResult)
+{
 	Log_Debug("IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning returned '%s'.\n",
 		getAzureSphereProvisioningResultString(provResult));
 
 	if (provResult.result != AZURE_SPHERE_PROV_RESULT_OK) {
+		// The poll keeps its period and skips attempts until the backoff is over.
+		uint32_t backoffMs = HubConnection_Failed(&client->connection, provisioningReason(provResult.result), getTimeMs());
+		Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %u.%03u seconds.\n",
+			backoffMs / 1000, backoffMs % 1000);
+		return client->pollPeriodSeconds;
+	}
 
-		// If we fail to connect, reduce the polling frequency, starting at
-		// AzureIoTMinReconnectPeriodSeconds and with a backoff up to
-		// AzureIoTMaxReconnectPeriodSeconds
-		if (azureIoTPollPeriodSeconds == AzureIoTDefaultPollPeriodSeconds) {
-			azureIoTPollPeriodSeconds = AzureIoTMinReconnectPeriodSeconds;
-		}
-		else {
-			azureIoTPollPeriodSeconds *= 2;
-			if (azureIoTPollPeriodSeconds > AzureIoTMaxReconnectPeriodSeconds) {
-				azureIoTPollPeriodSeconds = AzureIoTMaxReconnectPeriodSeconds;
+	HubConnection_Connected(&client->connection, getTimeMs());
+	client->connected = true;
+	setAuthenticated(client, true);
+
+	if (IoTHubDeviceClient_LL_SetOption(client->handle, OPTION_KEEP_ALIVE,
+		&keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
+		Log_Debug("ERROR: failure setting option \"%s\"\n", OPTION_KEEP_ALIVE);
+		return client->pollPeriodSeconds;
+	}
+
+	if (IoTHubDeviceClient_LL_SetOption(client->handle, OPTION_MESSAGE_TIMEOUT,
+		&messageTimeoutMs) != IOTHUB_CLIENT_OK) {
+		Log_Debug("ERROR: failure setting option \"%s\"\n", OPTION_MESSAGE_TIMEOUT);
+	}
+
+	if (client->worker != NULL) {
+		IoTHubDeviceClient_LL_SetDeviceMethodCallback(client->handle, workerMethodCallback, client);
+		IoTHubDeviceClient_LL_SetDeviceTwinCallback(client->handle, workerTwinCallback, client);
+	}
+	else {
+		IoTHubDeviceClient_LL_SetDeviceMethodCallback(client->handle, MethodCallback, client->context);
+		IoTHubDeviceClient_LL_SetDeviceTwinCallback(client->handle, TwinCallback, client->context);
+	}
+	IoTHubDeviceClient_LL_SetConnectionStatusCallback(client->handle,
+		HubConnectionStatusCallback, client);
+	return client->pollPeriodSeconds;
+}
+
+/// <summary>
+///     Connects when the network is up and the client is not authenticated, then lets the
+///     client send and receive. Called from the Azure timer. With the IoT worker running the
+///     worker connects on its own poll timer and is only told the network state.
+/// </summary>
+/// <returns>The poll period to use from now on in seconds if a connection was attempted, otherwise 0</returns>
+int PollAzureClient(AzureClient* client)
+{
+	int period = 0;
+	bool isNetworkReady = false;
+	if (Networking_IsNetworkingReady(&isNetworkReady) != -1) {
+		Trace_RecordNetwork(isNetworkReady);
+		if (client->worker != NULL) {
+			if (isNetworkReady != client->worker->networkReady) {
+				uint8_t ready = isNetworkReady;
+				if (pushOutbound(client, WORKER_NETWORK, &ready, sizeof(ready), NULL, 0) == 0)
+					client->worker->networkReady = isNetworkReady;
+				doWork(client);
 			}
 		}
+		else if (isNetworkReady && !client->authenticated && !client->setupPending
+			&& HubConnection_ShouldConnect(&client->connection, getTimeMs())) {
+			// the result arrives through the setup event, without one the call blocks here
+			if (client->setupEventFd < 0 || startSetup(client) < 0)
+				period = SetupAzureClient(client);
+		}
+	}
+	else {
+		Log_Debug("Failed to get Network state\n");
+	}
+
+	if (client->authenticated)
+		flush(client);
+	return period;
+}
 
-		Log_Debug("ERROR: failure to create IoTHub Handle - will retry in %i seconds.\n",
-			azureIoTPollPeriodSeconds);
-		return azureIoTPollPeriodSeconds;
+/// <summary>
+///     Starts a thread that owns the IoT Hub client: it connects, sends and runs DoWork on its
+///     own event loop, so none of that happens on the caller's thread. From then on this
+///     client's functions push telemetry, reported-state patches and the network state to the
+///     worker through a lock-free ring, and the worker pushes the connection state, patch
+///     results, twin updates and method calls back through a second one. The caller registers
+///     the returned eventfd with its epoll and calls ProcessAzureWorkerEvents when it is readable.
+///     The worker answers the GetQueueStats direct method itself, with the depth and drop
+///     counters of both rings, so it works while the app thread is busy.
+/// </summary>
+/// <returns>The eventfd, or -1 on failure (the client then runs on the caller's thread)</returns>
+int StartAzureWorker(AzureClient* client)
+{
+	AzureWorker* worker = calloc(1, sizeof(*worker));
+	uint8_t* buffers = malloc(AZURE_WORKER_OUTBOUND_SIZE + AZURE_WORKER_INBOUND_SIZE);
+	if (worker == NULL || buffers == NULL) {
+		Log_Debug("ERROR: Could not allocate the IoT worker.\n");
+		free(worker);
+		free(buffers);
+		return -1;
 	}
+	SpscRing_Init(&worker->outbound, buffers, AZURE_WORKER_OUTBOUND_SIZE);
+	SpscRing_Init(&worker->inbound, buffers + AZURE_WORKER_OUTBOUND_SIZE, AZURE_WORKER_INBOUND_SIZE);
+	worker->connection = client->connection;
+	worker->wakeEvent = (AzureWorkerEvent){ .eventData = {.eventHandler = &workerWakeHandler}, .client = client };
+	worker->pollEvent = (AzureWorkerEvent){ .eventData = {.eventHandler = &workerPollHandler}, .client = client };
+	worker->methodTimerEvent = (AzureWorkerEvent){ .eventData = {.eventHandler = &workerMethodTimerHandler}, .client = client };
+	worker->pollTimerFd = -1;
+	worker->methodTimerFd = -1;
+	worker->wakeFd = eventfd(0, EFD_NONBLOCK);
+	worker->eventFd = eventfd(0, EFD_NONBLOCK);
+	worker->epollFd = CreateEpollFd();
 
-	// Successfully connected, so make sure the polling frequency is back to the default
-	azureIoTPollPeriodSeconds = AzureIoTDefaultPollPeriodSeconds;
+	struct timespec pollPeriod = { AzureIoTDefaultPollPeriodSeconds, 0 };
+	if (worker->wakeFd >= 0 && worker->eventFd >= 0 && worker->epollFd >= 0
+		&& RegisterEventHandlerToEpoll(worker->epollFd, worker->wakeFd, &worker->wakeEvent.eventData, EPOLLIN) == 0) {
+		worker->pollTimerFd = CreateTimerFdAndAddToEpoll(worker->epollFd, &pollPeriod,
+			&worker->pollEvent.eventData, EPOLLIN);
+		struct timespec disarmed = { 0, 0 };
+		worker->methodTimerFd = CreateTimerFdAndAddToEpoll(worker->epollFd, &disarmed,
+			&worker->methodTimerEvent.eventData, EPOLLIN);
+	}
 
-	iothubAuthenticated = true;
+	client->worker = worker;
+	int result = -1;
+	if (worker->pollTimerFd >= 0 && worker->methodTimerFd >= 0) {
+		result = pthread_create(&worker->thread, NULL, workerThread, client);
+		if (result != 0)
+			Log_Debug("ERROR: Could not start the IoT worker: %s (%d).\n", strerror(result), result);
+	}
+	if (result != 0) {
+		client->worker = NULL;
+		CloseFdAndPrintError(worker->pollTimerFd, "WorkerPollTimer");
+		CloseFdAndPrintError(worker->methodTimerFd, "WorkerMethodTimer");
+		CloseFdAndPrintError(worker->epollFd, "WorkerEpoll");
+		CloseFdAndPrintError(worker->wakeFd, "WorkerWake");
+		CloseFdAndPrintError(worker->eventFd, "WorkerEvent");
+		free(buffers);
+		free(worker);
+		return -1;
+	}
+	return worker->eventFd;
+}
 
-	if (IoTHubDeviceClient_LL_SetOption(iothubClientHandle, OPTION_KEEP_ALIVE,
-		&keepalivePeriodSeconds) != IOTHUB_CLIENT_OK) {
-		Log_Debug("ERROR: failure setting option \"%s\"\n", OPTION_KEEP_ALIVE);
-		return azureIoTPollPeriodSeconds;
+/// <summary>
+///     Stops the IoT worker and waits for it, which takes up to the provisioning timeout if
+///     it is connecting.
+/// </summary>
+void StopAzureWorker(AzureClient* client)
+{
+	AzureWorker* worker = client->worker;
+	if (worker == NULL)
+		return;
+	atomic_store(&worker->stop, true);
+	worker->wakePending = true;
+	doWork(client);
+	pthread_join(worker->thread, NULL);
+	//records the app thread didn't get to: only twin updates own memory
+	uint8_t record[AZURE_WORKER_RECORD_SIZE];
+	uint8_t type;
+	while (SpscRing_Pop(&worker->inbound, &type, record, sizeof(record)) >= 0) {
+		if (type == WORKER_TWIN) {
+			WorkerTwin twin;
+			memcpy(&twin, record, sizeof(twin));
+			free(twin.payload);
+		}
 	}
 
-	IoTHubDeviceClient_LL_SetDeviceMethodCallback(iothubClientHandle, MethodCallback, NULL);
-	IoTHubDeviceClient_LL_SetDeviceTwinCallback(iothubClientHandle, TwinCallback, NULL);
-	IoTHubDeviceClient_LL_SetConnectionStatusCallback(iothubClientHandle,
-		HubConnectionStatusCallback, NULL);
-	return azureIoTPollPeriodSeconds;
+	Log_Debug("INFO: IoT worker queues: outbound max %u bytes, %u dropped; inbound max %u bytes, %u dropped\n",
+		atomic_load(&worker->outbound.maxDepth), atomic_load(&worker->outbound.dropped),
+		atomic_load(&worker->inbound.maxDepth), atomic_load(&worker->inbound.dropped));
+	CloseFdAndPrintError(worker->pollTimerFd, "WorkerPollTimer");
+	CloseFdAndPrintError(worker->methodTimerFd, "WorkerMethodTimer");
+	CloseFdAndPrintError(worker->epollFd, "WorkerEpoll");
+	CloseFdAndPrintError(worker->wakeFd, "WorkerWake");
+	CloseFdAndPrintError(worker->eventFd, "WorkerEvent");
+	free(worker->outbound.buffer);
+	free(worker);
+	client->worker = NULL;
+	client->authenticated = false;
+}
+
+/// <summary>
+///     Handles what the IoT worker pushed: connection changes, patch results, twin updates
+///     and direct method calls, which run TwinCallback and MethodCallback on this thread.
+/// </summary>
+/// <returns>0 on success, -1 if the worker's eventfd can't be read</returns>
+int ProcessAzureWorkerEvents(AzureClient* client)
+{
+	AzureWorker* worker = client->worker;
+	eventfd_t value;
+	if (eventfd_read(worker->eventFd, &value) != 0) {
+		Log_Debug("ERROR: Could not read the IoT worker eventfd: %s (%d).\n", strerror(errno), errno);
+		return -1;
+	}
+
+	bool wasAuthenticated = client->authenticated;
+	uint8_t record[AZURE_WORKER_RECORD_SIZE];
+	uint8_t type;
+	int length;
+	while ((length = SpscRing_Pop(&worker->inbound, &type, record, sizeof(record))) >= 0) {
+		switch (type) {
+		case WORKER_CONNECTION:
+			client->authenticated = record[0] != 0;
+			memcpy(&worker->connection, record + 1, sizeof(worker->connection));
+			break;
+		case WORKER_REPORT_STATUS: {
+			int32_t result;
+			memcpy(&result, record, sizeof(result));
+			ReportStatusCallback(result, client);
+			break;
+		}
+		case WORKER_TWIN: {
+			WorkerTwin twin;
+			memcpy(&twin, record, sizeof(twin));
+			TwinCallback((DEVICE_TWIN_UPDATE_STATE)twin.updateState, twin.payload, twin.size, client->context);
+			free(twin.payload);
+			break;
+		}
+		case WORKER_METHOD:
+			answerMethod(client, record, (size_t)length);
+			break;
+		case WORKER_DELIVERY:
+			if (record[0] < TELEMETRY_DELIVERY_SLOTS)
+				confirmDelivery(client, &client->deliveries[record[0]], (IOTHUB_CLIENT_CONFIRMATION_RESULT)record[1]);
+			break;
+		}
+	}
+
+	//what the callbacks queued goes out with the next flush, as it does after a DoWork
+	if (client->authenticated && !wasAuthenticated)
+		flush(client);
+	return 0;
+}
+
+static void answerMethod(AzureClient* client, const uint8_t* record, size_t length)
+{
+	AzureWorker* worker = client->worker;
+	uint32_t call;
+	memcpy(&call, record, sizeof(call));
+	record += sizeof(call);
+	length -= sizeof(call);
+	//a call the worker has given up on was answered 503 and must not run
+	uint32_t unclaimed = call - 1;
+	if (!atomic_compare_exchange_strong(&worker->methodClaimed, &unclaimed, call)) {
+		Log_Debug("WARNING: direct method %.*s timed out before it ran, skipped\n",
+			(int)strnlen((const char*)record, length), record);
+		return;
+	}
+
+	const uint8_t* end = memchr(record, '\0', length);
+	unsigned char* response = NULL;
+	size_t responseSize = 0;
+	int status = 500;
+	if (end != NULL) {
+		size_t nameLength = (size_t)(end - record) + 1;
+		status = MethodCallback((const char*)record, record + nameLength, length - nameLength,
+			&response, &responseSize, client->context);
+	}
+	worker->methodStatus = status;
+	worker->methodResponse = response;
+	worker->methodResponseSize = responseSize;
+	atomic_store_explicit(&worker->methodAnswered, call, memory_order_release);
+	worker->wakePending = true;
+	doWork(client);
+}
+
+static int pushOutbound(AzureClient* client, uint8_t type, const void* first, size_t firstLength,
+	const void* second, size_t secondLength)
+{
+	AzureWorker* worker = client->worker;
+	if (firstLength + secondLength > AZURE_WORKER_RECORD_SIZE || SpscRing_Push(&worker->outbound, type,
+		first, (uint16_t)firstLength, second, (uint16_t)secondLength) < 0) {
+		Log_Debug("WARNING: IoT worker queue full, record dropped\n");
+		return -1;
+	}
+	worker->wakePending = true;
+	return 0;
+}
+
+static int pushInbound(AzureClient* client, uint8_t type, const void* first, size_t firstLength,
+	const void* second, size_t secondLength)
+{
+	AzureWorker* worker = client->worker;
+	if (firstLength + secondLength > AZURE_WORKER_RECORD_SIZE || SpscRing_Push(&worker->inbound, type,
+		first, (uint16_t)firstLength, second, (uint16_t)secondLength) < 0) {
+		Log_Debug("WARNING: app queue full, record dropped\n");
+		return -1;
+	}
+	if (eventfd_write(worker->eventFd, 1) != 0) {
+		Log_Debug("ERROR: Could not signal the IoT worker eventfd: %s (%d).\n", strerror(errno), errno);
+	}
+	return 0;
+}
+
+static void* workerThread(void* context)
+{
+	AzureClient* client = context;
+	AzureWorker* worker = client->worker;
+	while (!atomic_load(&worker->stop)) {
+		if (WaitForEventAndCallHandler(worker->epollFd) != 0)
+			break;
+	}
+	destroyClient(client);
+	client->connected = false;
+	return NULL;
+}
+
+//the app thread pushed records
+static void workerWakeHandler(EventData* eventData)
+{
+	AzureClient* client = ((AzureWorkerEvent*)eventData)->client;
+	AzureWorker* worker = client->worker;
+	eventfd_t value;
+	if (eventfd_read(worker->wakeFd, &value) != 0) {
+		Log_Debug("ERROR: Could not read the IoT worker wake eventfd: %s (%d).\n", strerror(errno), errno);
+	}
+
+	bool networkChanged = false;
+	uint8_t record[AZURE_WORKER_RECORD_SIZE + 1];
+	uint8_t type;
+	int length;
+	while ((length = SpscRing_Pop(&worker->outbound, &type, record, AZURE_WORKER_RECORD_SIZE)) >= 0) {
+		record[length] = '\0';
+		switch (type) {
+		case WORKER_TELEMETRY: {
+			TelemetryDelivery* delivery = record[0] < TELEMETRY_DELIVERY_SLOTS ? &client->deliveries[record[0]] : NULL;
+			if (length < 1 || clientSendTelemetry(client, (const char*)record + 1, (uint16_t)(length - 1), delivery) < 0)
+				SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_ERROR, delivery);
+			break;
+		}
+		case WORKER_REPORTED:
+			if (clientSendReportedState(client, (const char*)record, (size_t)length) < 0)
+				reportedStateCallback(0, client);
+			break;
+		case WORKER_NETWORK:
+			worker->workerNetworkReady = record[0] != 0;
+			networkChanged = true;
+			break;
+		}
+	}
+
+	if (networkChanged)
+		workerPoll(client);
+	else
+		clientDoWork(client);
+	workerArmPollTimer(client);
+}
+
+static void workerPollHandler(EventData* eventData)
+{
+	AzureClient* client = ((AzureWorkerEvent*)eventData)->client;
+	if (ConsumeTimerFdEvent(client->worker->pollTimerFd) != 0)
+		return;
+	workerPoll(client);
+	workerArmPollTimer(client);
+}
+
+//wakes a direct method call waiting on its deadline, which it checks itself
+static void workerMethodTimerHandler(EventData* eventData)
+{
+	AzureClient* client = ((AzureWorkerEvent*)eventData)->client;
+	ConsumeTimerFdEvent(client->worker->methodTimerFd);
+}
+
+// PollAzureClient's work on the worker: connect when the network is up, then DoWork.
+static void workerPoll(AzureClient* client)
+{
+	AzureWorker* worker = client->worker;
+	if (worker->workerNetworkReady && !client->connected && HubConnection_ShouldConnect(&client->connection, getTimeMs())) {
+		struct timespec period = { SetupAzureClient(client), 0 };
+		SetTimerFdToPeriod(worker->pollTimerFd, &period);
+		//a failed attempt changes the counters too
+		if (!client->connected)
+			setAuthenticated(client, false);
+	}
+	clientDoWork(client);
+}
+
+// The worker's DoWork pacing: the next DoWork while messages are in flight, else the poll period.
+static void workerArmPollTimer(AzureClient* client)
+{
+	AzureWorker* worker = client->worker;
+	bool busy = client->connected && client->doWorkIntervalMs != 0;
+	if (busy) {
+		struct timespec expiry = { client->doWorkIntervalMs / 1000, (long)(client->doWorkIntervalMs % 1000) * 1000000 };
+		SetTimerFdToSingleExpiry(worker->pollTimerFd, &expiry);
+	}
+	else if (worker->pollTimerBusy) {
+		struct timespec period = { client->pollPeriodSeconds, 0 };
+		SetTimerFdToPeriod(worker->pollTimerFd, &period);
+	}
+	worker->pollTimerBusy = busy;
+}
+
+static void workerTwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
+	size_t size, void* context)
+{
+	WorkerTwin twin = { .updateState = (uint8_t)updateState, .payload = malloc(size), .size = size };
+	if (twin.payload == NULL) {
+		Log_Debug("ERROR: no memory for a twin update of %zu bytes, dropped\n", size);
+		return;
+	}
+	memcpy(twin.payload, payload, size);
+	if (pushInbound(context, WORKER_TWIN, &twin, sizeof(twin), NULL, 0) < 0) {
+		Log_Debug("ERROR: twin update of %zu bytes dropped\n", size);
+		free(twin.payload);
+	}
+}
+
+// Runs the call on the app thread and waits for its answer, handling what the app thread
+// pushes meanwhile.
+static int workerMethodCallback(const char* name, const unsigned char* payload, size_t size,
+	unsigned char** response, size_t* responseSize, void* context)
+{
+	AzureClient* client = context;
+	AzureWorker* worker = client->worker;
+	*response = NULL;
+	*responseSize = 0;
+
+	if (strcmp(name, "GetQueueStats") == 0) {
+		char stats[256];
+		JsonWriter writer;
+		JsonWriter_Init(&writer, stats, sizeof(stats));
+		JsonWriter_BeginObject(&writer, NULL);
+		JsonWriter_String(&writer, "Response", "Ok");
+		WriteQueueStats(client, &writer);
+		JsonWriter_EndObject(&writer);
+		int length = JsonWriter_Finish(&writer);
+		if (length < 0)
+			return 500;
+		*response = malloc((size_t)length);
+		if (*response == NULL)
+			return 500;
+		memcpy(*response, stats, (size_t)length);
+		*responseSize = (size_t)length;
+		return 200;
+	}
+
+	size_t nameSize = strlen(name) + 1;
+	if (nameSize > METHOD_NAME_MAX + 1)
+		return 404;
+	uint8_t head[sizeof(uint32_t) + METHOD_NAME_MAX + 1];
+	//the call number is only taken once the call is queued, so a dropped one leaves no gap
+	uint32_t call = worker->methodCall + 1;
+	memcpy(head, &call, sizeof(call));
+	memcpy(head + sizeof(call), name, nameSize);
+	if (pushInbound(client, WORKER_METHOD, head, sizeof(call) + nameSize, payload, size) < 0)
+		return 503;
+	worker->methodCall = call;
+
+	struct timespec timeout = { workerMethodTimeoutMs / 1000, (long)(workerMethodTimeoutMs % 1000) * 1000000 };
+	SetTimerFdToSingleExpiry(worker->methodTimerFd, &timeout);
+	uint32_t deadlineMs = getTimeMs() + workerMethodTimeoutMs;
+	while (atomic_load_explicit(&worker->methodAnswered, memory_order_acquire) != call && !atomic_load(&worker->stop)) {
+		//past the deadline the call is given up, unless the app thread has already started it
+		uint32_t unclaimed = call - 1;
+		if ((int32_t)(getTimeMs() - deadlineMs) >= 0
+			&& atomic_compare_exchange_strong(&worker->methodClaimed, &unclaimed, call))
+			break;
+		if (WaitForEventAndCallHandler(worker->epollFd) != 0)
+			break;
+	}
+	struct timespec disarmed = { 0, 0 };
+	SetTimerFdToSingleExpiry(worker->methodTimerFd, &disarmed);
+	//a wait cut short still claims the call, so the app thread skips it and takes up the next
+	uint32_t unclaimed = call - 1;
+	atomic_compare_exchange_strong(&worker->methodClaimed, &unclaimed, call);
+	if (atomic_load_explicit(&worker->methodAnswered, memory_order_acquire) != call) {
+		Log_Debug("WARNING: direct method %s not answered within %u ms\n", name, workerMethodTimeoutMs);
+		return 503;
+	}
+	*response = worker->methodResponse;
+	*responseSize = worker->methodResponseSize;
+	return worker->methodStatus;
 }
 
 /// <summary>
@@ -124,7 +969,7 @@ int SetupAzureClient(void)
 /// </summary>
 static const char* GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
 {
-	static char* reasonString = "unknown reason";
+	const char* reasonString = "unknown reason";
 	switch (reason) {
 	case IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN:
 		reasonString = "IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN";
@@ -151,6 +996,42 @@ static const char* GetReasonString(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason
 	return reasonString;
 }
 
+// What a lost connection means for the backoff.
+static HubConnectionReason connectionReason(IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
+{
+	switch (reason) {
+	case IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN:
+		return HUB_REASON_EXPIRED_TOKEN;
+	case IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED:
+	case IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL:
+		return HUB_REASON_CREDENTIAL;
+	case IOTHUB_CLIENT_CONNECTION_NO_NETWORK:
+		return HUB_REASON_NO_NETWORK;
+	case IOTHUB_CLIENT_CONNECTION_RETRY_EXPIRED:
+	case IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR:
+		return HUB_REASON_COMMUNICATION;
+	default:
+		return HUB_REASON_OTHER;
+	}
+}
+
+// Same for a failed provisioning.
+static HubConnectionReason provisioningReason(AZURE_SPHERE_PROV_RESULT result)
+{
+	switch (result) {
+	case AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY:
+		return HUB_REASON_NO_NETWORK;
+	case AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY:
+		return HUB_REASON_DEVICE_AUTH;
+	case AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR:
+		return HUB_REASON_COMMUNICATION;
+	case AZURE_SPHERE_PROV_RESULT_INVALID_PARAM:
+		return HUB_REASON_CREDENTIAL;
+	default:
+		return HUB_REASON_OTHER;
+	}
+}
+
 
 /// <summary>
 ///     Converts AZURE_SPHERE_PROV_RETURN_VALUE to a string.
@@ -178,36 +1059,760 @@ static const char* getAzureSphereProvisioningResultString(
 
 
 /// <summary>
-///     Sends telemetry to IoT Hub
+///     Queues telemetry for IoT Hub. Events are collected into one message, which is sent
+///     when the next event would not fit, when the first event has waited telemetryLingerMs,
+///     at the next Azure poll, or at once for a critical event. Diagnostic events are dropped
+///     while messages can't go straight to the client, so they never take store space or
+///     delay the backlog. Events with a key passed to LimitTelemetry are held back once the
+///     key is out of tokens, and counted in a summary event instead.
 /// </summary>
+/// <param name="code">event code for the binary encoding, 1 to 0x7F</param>
+/// <param name="argument">for the binary encoding, already formatted into `value`</param>
 /// <param name="key">The telemetry item to update</param>
 /// <param name="value">new telemetry value</param>
-void SendTelemetry(const unsigned char* key, const unsigned char* value)
+/// <param name="lane">how urgent the event is</param>
+void SendTelemetry(AzureClient* client, uint8_t code, uint16_t argument, const char* key,
+	const char* value, TelemetryLane lane)
 {
-	static char eventBuffer[100] = { 0 };
-	static const char* EventMsgTemplate = "{ \"%s\": \"%s\" }";
-	int len = snprintf(eventBuffer, sizeof(eventBuffer), EventMsgTemplate, key, value);
-	if (len < 0)
+	char eventBuffer[TELEMETRY_EVENT_SIZE];
+	int len = formatTelemetryEvent(eventBuffer, key, value);
+	if (len < 0) {
+		client->lanes[lane].queued++;
+		client->lanes[lane].dropped++;
+		Log_Debug("ERROR: telemetry event '%s' doesn't fit in %d bytes, dropped\n", key, TELEMETRY_EVENT_SIZE);
+		return;
+	}
+	Trace_RecordHash(TRACE_OUT_TELEMETRY, eventBuffer);
+
+	TelemetryLimit* limit = lane == TELEMETRY_LANE_CRITICAL ? NULL : findTelemetryLimit(client, key);
+	uint32_t now = getTimeMs();
+	if (limit != NULL && !takeTelemetryToken(limit, now)) {
+		if (limit->heldBack++ == 0)
+			limit->heldBackMs = now;
+		limit->code = code;
+		limit->lane = lane;
+		client->lanes[lane].limited++;
+		Log_Debug("INFO: %s rate limited, %u held back: %s\n", limit->key, limit->heldBack, eventBuffer);
 		return;
+	}
+	queueTelemetry(client, code, argument, eventBuffer, len, lane);
+}
+
+/// <summary>
+///     Sends a message the app made whole, such as the lock's metrics summary, as one event of
+///     the lane. It isn't batched, otherwise it is delivered, stored or dropped like a batch.
+///     The message must be JSON of less than TELEMETRY_BATCH_SIZE bytes, longer ones are dropped.
+/// </summary>
+void SendTelemetryDocument(AzureClient* client, const char* message, uint16_t length, TelemetryLane lane)
+{
+	client->lanes[lane].queued++;
+	if (length >= TELEMETRY_BATCH_SIZE || (lane == TELEMETRY_LANE_DIAGNOSTIC && isTelemetryBackedUp(client))) {
+		client->lanes[lane].dropped++;
+		Log_Debug("INFO: telemetry message of %u bytes dropped\n", length);
+		return;
+	}
+	Log_Debug("Sending IoT Hub Message: %.*s\n", (int)length, message);
+
+	TelemetryBatchLane lanes[TELEMETRY_LANE_COUNT] = { 0 };
+	lanes[lane].count = 1;
+	dispatchTelemetry(client, message, length, 1, lanes, getTimeMs());
+	doWork(client);
+}
+
+/// <summary>
+///     Telemetry messages handed to the client and not confirmed yet, or waiting to be
+///     handed over again.
+/// </summary>
+unsigned int CountDeliveriesInFlight(const AzureClient* client)
+{
+	unsigned int count = 0;
+	for (int i = 0; i < TELEMETRY_DELIVERY_SLOTS; i++)
+		count += client->deliveries[i].sequence != 0;
+	return count;
+}
+
+/// <summary>
+///     Writes the depth, high-water mark and drops of the IoT worker's rings as members of the
+///     writer's open object, all 0 without the worker. The counters are atomic, so either
+///     thread can call it.
+/// </summary>
+/// <returns>0, or -1 if the writer overflowed</returns>
+int WriteQueueStats(AzureClient* client, JsonWriter* writer)
+{
+	static const char* const names[] = { "Outbound", "Inbound" };
+	AzureWorker* worker = client->worker;
+	SpscRing* rings[] = { worker != NULL ? &worker->outbound : NULL, worker != NULL ? &worker->inbound : NULL };
+	for (int i = 0; i < 2; i++) {
+		JsonWriter_BeginObject(writer, names[i]);
+		JsonWriter_Uint(writer, "Depth", rings[i] != NULL ? SpscRing_Depth(rings[i]) : 0);
+		JsonWriter_Uint(writer, "MaxDepth", rings[i] != NULL ? atomic_load(&rings[i]->maxDepth) : 0);
+		JsonWriter_Uint(writer, "Dropped", rings[i] != NULL ? atomic_load(&rings[i]->dropped) : 0);
+		JsonWriter_EndObject(writer);
+	}
+	return writer->overflow ? -1 : 0;
+}
+
+/// <summary>
+///     The hub connection's state and counters as the calling app thread may read them: with
+///     the IoT worker, the copy it last pushed.
+/// </summary>
+const HubConnection* GetHubConnection(const AzureClient* client)
+{
+	return client->worker != NULL ? &client->worker->connection : &client->connection;
+}
+
+// Writes {"key":"value"} into TELEMETRY_EVENT_SIZE bytes, returns its length or -1 if it doesn't fit.
+static int formatTelemetryEvent(char* eventBuffer, const char* key, const char* value)
+{
+	JsonWriter writer;
+	JsonWriter_Init(&writer, eventBuffer, TELEMETRY_EVENT_SIZE);
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_String(&writer, key, value);
+	JsonWriter_EndObject(&writer);
+	return JsonWriter_Finish(&writer);
+}
+
+// Adds an event to the telemetry batch, in the client's encoding; eventBuffer is its JSON.
+static void queueTelemetry(AzureClient* client, uint8_t code, uint16_t argument, const char* eventBuffer, int len,
+	TelemetryLane lane)
+{
+	client->lanes[lane].queued++;
+	if (lane == TELEMETRY_LANE_DIAGNOSTIC && isTelemetryBackedUp(client)) {
+		client->lanes[lane].dropped++;
+		Log_Debug("INFO: IoT Hub not keeping up, diagnostic message dropped: %s\n", eventBuffer);
+		return;
+	}
 
 	Log_Debug("Sending IoT Hub Message: %s\n", eventBuffer);
 
-	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromString(eventBuffer);
+	// JSON leaves room for the comma before the event and the closing ']' and terminator.
+	bool binary = client->telemetryEncoding == TELEMETRY_ENCODING_BINARY;
+	int needed = binary ? TELEMETRY_BINARY_EVENT_SIZE : 1 + len + 2;
+	if (client->telemetryBatchCount > 0 && client->telemetryBatchLength + needed > TELEMETRY_BATCH_SIZE)
+		flush(client);
+
+	if (client->telemetryBatchCount == 0)
+		client->telemetryBatchStartMs = getTimeMs();
+	else if (!binary)
+		client->telemetryBatch[client->telemetryBatchLength++] = ',';
+	char* event = client->telemetryBatch + client->telemetryBatchLength;
+	if (binary) {
+		event[0] = (char)code;
+		event[1] = (char)(argument & 0xFF);
+		event[2] = (char)(argument >> 8);
+		client->telemetryBatchLength += TELEMETRY_BINARY_EVENT_SIZE;
+	}
+	else {
+		memcpy(event, eventBuffer, (size_t)len + 1);
+		client->telemetryBatchLength += (uint16_t)len;
+	}
+	client->telemetryBatchCount++;
+
+	TelemetryBatchLane* batchLane = &client->telemetryBatchLanes[lane];
+	uint32_t queuedMs = getTimeMs() - client->telemetryBatchStartMs;
+	if (batchLane->count++ == 0)
+		batchLane->firstMs = queuedMs;
+	batchLane->sumMs += queuedMs;
+
+	if (lane == TELEMETRY_LANE_CRITICAL || client->telemetryBatchCount == UINT8_MAX)
+		flush(client);
+}
+
+/// <summary>
+///     Lets events with this key through at most `burst` at a time, and one more every
+///     `refillMs` after that. The ones held back are reported as a count in one event of
+///     the same key every telemetrySummaryMs. Critical events are never held back.
+/// </summary>
+/// <param name="key">string constant, compared with the key passed to SendTelemetry</param>
+/// <returns>0 on success, or -1 if TELEMETRY_LIMIT_COUNT keys are limited already</returns>
+int LimitTelemetry(AzureClient* client, const char* key, uint8_t burst, uint32_t refillMs)
+{
+	TelemetryLimit* limit = findTelemetryLimit(client, NULL);
+	if (limit == NULL || burst == 0 || refillMs == 0)
+		return -1;
+	limit->key = key;
+	limit->burst = burst;
+	limit->tokens = burst;
+	limit->refillMs = refillMs;
+	limit->refilledMs = getTimeMs();
+	limit->heldBack = 0;
+	return 0;
+}
+
+// Finds the limit of a key, or a free one for NULL.
+static TelemetryLimit* findTelemetryLimit(AzureClient* client, const char* key)
+{
+	for (int i = 0; i < TELEMETRY_LIMIT_COUNT; i++) {
+		const char* limitKey = client->limits[i].key;
+		if (limitKey == NULL ? key == NULL : key != NULL && strcmp(limitKey, key) == 0)
+			return &client->limits[i];
+	}
+	return NULL;
+}
+
+// Token bucket: tokens come back one per refillMs up to burst; an event takes one.
+static bool takeTelemetryToken(TelemetryLimit* limit, uint32_t now)
+{
+	if (limit->tokens == limit->burst) {
+		limit->refilledMs = now;// a full bucket doesn't save up
+	}
+	else {
+		uint32_t added = (now - limit->refilledMs) / limit->refillMs;
+		if (added >= (uint32_t)(limit->burst - limit->tokens))
+			limit->tokens = limit->burst;
+		else
+			limit->tokens += (uint8_t)added;
+		limit->refilledMs += added * limit->refillMs;
+	}
+	if (limit->tokens == 0)
+		return false;
+	limit->tokens--;
+	return true;
+}
+
+// Queues one event per limited key that held events back for telemetrySummaryMs, with their count.
+static void summarizeHeldBackTelemetry(AzureClient* client)
+{
+	uint32_t now = getTimeMs();
+	for (int i = 0; i < TELEMETRY_LIMIT_COUNT; i++) {
+		TelemetryLimit* limit = &client->limits[i];
+		if (limit->heldBack == 0 || now - limit->heldBackMs < telemetrySummaryMs)
+			continue;
+		char text[40];
+		snprintf(text, sizeof(text), "%u more in the last %u s.", limit->heldBack, (now - limit->heldBackMs) / 1000);
+		char eventBuffer[TELEMETRY_EVENT_SIZE];
+		int len = formatTelemetryEvent(eventBuffer, limit->key, text);
+		if (len < 0)
+			continue;
+		uint16_t count = limit->heldBack;
+		limit->heldBack = 0;
+		queueTelemetry(client, limit->code | TELEMETRY_CODE_HELD_BACK, count, eventBuffer, len, limit->lane);
+	}
+}
+
+/// <summary>
+///     Switches the telemetry encoding. Events queued before keep theirs: the batch is sent
+///     first. Stored messages are sent with the content type of their own encoding.
+/// </summary>
+void SetTelemetryEncoding(AzureClient* client, TelemetryEncoding encoding)
+{
+	if (encoding == client->telemetryEncoding)
+		return;
+	if (client->telemetryBatchCount > 0)
+		flush(client);
+	client->telemetryEncoding = encoding;
+	client->telemetryBatch[0] = encoding == TELEMETRY_ENCODING_BINARY ? (char)TELEMETRY_BINARY_FORMAT : '[';
+}
+
+// Messages can't go straight to the client: it isn't connected, or older ones wait in the store.
+static bool isTelemetryBackedUp(AzureClient* client)
+{
+	return !client->authenticated || (client->store.fd >= 0 && EventQueue_Count(&client->store) > 0);
+}
+
+/// <summary>
+///     Logs what each telemetry lane queued, sent, stored, dropped and held back, how long its events
+///     waited for the client, and how long IoT Hub took to confirm messages and patches.
+/// </summary>
+void LogTelemetryStats(const AzureClient* client)
+{
+	static const char* const names[TELEMETRY_LANE_COUNT] = { "critical", "operational", "diagnostic" };
+	for (int i = 0; i < TELEMETRY_LANE_COUNT; i++) {
+		const TelemetryLaneStats* stats = &client->lanes[i];
+		Log_Debug("INFO: telemetry lane %s: %u queued, %u sent, %u stored, %u dropped, %u limited, wait mean %u ms max %u ms\n",
+			names[i], stats->queued, stats->sent, stats->stored, stats->dropped, stats->limited,
+			stats->sent > 0 ? (unsigned int)(stats->totalWaitMs / stats->sent) : 0, stats->maxWaitMs);
+	}
+	logDeliveryStats("telemetry", &client->telemetryDelivery);
+	logDeliveryStats("reported state", &client->reportedDelivery);
+	const HubConnection* connection = GetHubConnection(client);
+	Log_Debug("INFO: hub connection %s, connected %llu s, %u attempts, %u connects, %u breaks, last reason %s\n",
+		HubConnection_StateName(connection->state),
+		(unsigned long long)(HubConnection_ConnectedMs(connection, getTimeMs()) / 1000), connection->attempts,
+		connection->connects, connection->breaks, HubConnection_ReasonName(connection->lastReason));
+}
+
+static void logDeliveryStats(const char* name, const DeliveryStats* stats)
+{
+	Log_Debug("INFO: %s delivery: %u confirmed, %u failed, %u dropped, latency mean %u ms p50 %u ms p99 %u ms max %u ms\n",
+		name, stats->confirmed, stats->failed, stats->deadLettered,
+		stats->confirmed > 0 ? (unsigned int)(stats->totalMs / stats->confirmed) : 0,
+		GetDeliveryPercentileMs(stats, 50), GetDeliveryPercentileMs(stats, 99), stats->maxMs);
+}
+
+static void writeDeliveryStats(JsonWriter* writer, const char* key, const DeliveryStats* stats)
+{
+	JsonWriter_BeginObject(writer, key);
+	JsonWriter_Uint(writer, "Confirmed", stats->confirmed);
+	JsonWriter_Uint(writer, "Failed", stats->failed);
+	JsonWriter_Uint(writer, "Dropped", stats->deadLettered);
+	JsonWriter_Uint(writer, "MeanMs", stats->confirmed > 0 ? stats->totalMs / stats->confirmed : 0);
+	JsonWriter_Uint(writer, "P50Ms", GetDeliveryPercentileMs(stats, 50));
+	JsonWriter_Uint(writer, "P99Ms", GetDeliveryPercentileMs(stats, 99));
+	JsonWriter_Uint(writer, "MaxMs", stats->maxMs);
+	JsonWriter_EndObject(writer);
+}
+
+/// <summary>
+///     Writes the counters LogTelemetryStats logs as members of the writer's open object:
+///     one object per telemetry lane, the delivery latencies and the hub connection.
+/// </summary>
+/// <returns>0, or -1 if the writer overflowed</returns>
+int WriteTelemetryStats(const AzureClient* client, JsonWriter* writer)
+{
+	static const char* const names[TELEMETRY_LANE_COUNT] = { "Critical", "Operational", "Diagnostic" };
+	JsonWriter_BeginObject(writer, "Lanes");
+	for (int i = 0; i < TELEMETRY_LANE_COUNT; i++) {
+		const TelemetryLaneStats* stats = &client->lanes[i];
+		JsonWriter_BeginObject(writer, names[i]);
+		JsonWriter_Uint(writer, "Queued", stats->queued);
+		JsonWriter_Uint(writer, "Sent", stats->sent);
+		JsonWriter_Uint(writer, "Stored", stats->stored);
+		JsonWriter_Uint(writer, "Dropped", stats->dropped);
+		JsonWriter_Uint(writer, "Limited", stats->limited);
+		JsonWriter_Uint(writer, "MeanWaitMs", stats->sent > 0 ? stats->totalWaitMs / stats->sent : 0);
+		JsonWriter_Uint(writer, "MaxWaitMs", stats->maxWaitMs);
+		JsonWriter_EndObject(writer);
+	}
+	JsonWriter_EndObject(writer);
+	writeDeliveryStats(writer, "TelemetryDelivery", &client->telemetryDelivery);
+	writeDeliveryStats(writer, "ReportedDelivery", &client->reportedDelivery);
+
+	const HubConnection* connection = GetHubConnection(client);
+	JsonWriter_BeginObject(writer, "Connection");
+	JsonWriter_String(writer, "State", HubConnection_StateName(connection->state));
+	JsonWriter_Uint(writer, "ConnectedSeconds", HubConnection_ConnectedMs(connection, getTimeMs()) / 1000);
+	JsonWriter_Uint(writer, "Attempts", connection->attempts);
+	JsonWriter_Uint(writer, "Connects", connection->connects);
+	JsonWriter_Uint(writer, "Breaks", connection->breaks);
+	JsonWriter_Uint(writer, "BackoffMs", connection->backoffMs);
+	JsonWriter_BeginObject(writer, "Reasons");
+	for (int i = 0; i < HUB_REASON_COUNT; i++)
+		JsonWriter_Uint(writer, HubConnection_ReasonName((HubConnectionReason)i), connection->reasons[i]);
+	JsonWriter_EndObject(writer);
+	JsonWriter_EndObject(writer);
+	return writer->overflow ? -1 : 0;
+}
+
+/// <summary>
+///     Sends the telemetry batch and the reported-state changes once either has waited
+///     telemetryLingerMs, and failed and stored messages and summaries of rate-limited
+///     events when they are due. Without the IoT
+///     worker it also runs the DoWork scheduleDoWork asked for. Called from the app timer.
+/// </summary>
+void FlushDueUpdates(AzureClient* client)
+{
+	retryDeliveries(client);
+	drainTelemetryStore(client);
+	summarizeHeldBackTelemetry(client);
+
+	uint32_t now = getTimeMs();
+	bool telemetryDue = client->telemetryBatchCount > 0 && now - client->telemetryBatchStartMs >= telemetryLingerMs;
+	bool reportedDue = client->reportedDirty && !client->reportInFlight && now - client->reportedStartMs >= telemetryLingerMs;
+	if (telemetryDue || reportedDue)
+		flush(client);
+	else if (client->worker == NULL && client->doWorkIntervalMs != 0 && now - client->doWorkMs >= client->doWorkIntervalMs)
+		clientDoWork(client);
+}
+
+// Hands everything queued to the client and lets it send right away.
+static void flush(AzureClient* client)
+{
+	flushTelemetry(client);
+	flushReportedState(client);
+	doWork(client);
+}
+
+/// <summary>
+///     Hands the telemetry batch to the IoT Hub client as one message: in JSON a single event
+///     as it is, several as an array. While the hub can't be reached, older messages are still
+///     stored or every delivery slot is in use, the message goes to the telemetry store
+///     instead; critical ones go out ahead of the stored backlog.
+/// </summary>
+static void flushTelemetry(AzureClient* client)
+{
+	if (client->telemetryBatchCount == 0)
+		return;
+
+	const char* message = client->telemetryBatch;
+	uint16_t length = client->telemetryBatchLength;
+	if (client->telemetryEncoding == TELEMETRY_ENCODING_JSON) {
+		if (client->telemetryBatchCount == 1) {
+			message++;// skip the '['
+			length--;
+		}
+		else {
+			client->telemetryBatch[length++] = ']';
+			client->telemetryBatch[length] = '\0';
+		}
+	}
+	unsigned int count = client->telemetryBatchCount;
+	uint32_t startMs = client->telemetryBatchStartMs;
+	TelemetryBatchLane lanes[TELEMETRY_LANE_COUNT];
+	memcpy(lanes, client->telemetryBatchLanes, sizeof(lanes));
+	client->telemetryBatchCount = 0;
+	client->telemetryBatchLength = 1;
+	memset(client->telemetryBatchLanes, 0, sizeof(client->telemetryBatchLanes));
+	dispatchTelemetry(client, message, length, count, lanes, startMs);
+}
+
+// Stores, sends or drops a message of `count` events from `lanes`, the first queued at startMs.
+static void dispatchTelemetry(AzureClient* client, const char* message, uint16_t length, unsigned int count,
+	const TelemetryBatchLane* lanes, uint32_t startMs)
+{
+	uint32_t ageMs = getTimeMs() - startMs;
+	bool critical = lanes[TELEMETRY_LANE_CRITICAL].count > 0;
+	bool backedUp = EventQueue_Count(&client->store) > 0 || findFreeDelivery(client) == NULL;
+	if (client->store.fd >= 0 && (!client->authenticated || (!critical && backedUp))) {
+		uint8_t priority = critical ? EVENT_PRIORITY_CRITICAL : EVENT_PRIORITY_NORMAL;
+		if (EventQueue_Push(&client->store, priority, message, length) < 0) {
+			Log_Debug("WARNING: telemetry store full, %u telemetry events dropped\n", count);
+			countFlushedEvents(client, lanes, ageMs, FLUSHED_DROPPED);
+		}
+		else {
+			Log_Debug("INFO: %u telemetry events stored, %u messages waiting\n", count,
+				EventQueue_Count(&client->store));
+			countFlushedEvents(client, lanes, ageMs, FLUSHED_STORED);
+		}
+		return;
+	}
+
+	if (!canSend(client)) {
+		Log_Debug("WARNING: client not initialized, %u telemetry events dropped\n", count);
+		countFlushedEvents(client, lanes, ageMs, FLUSHED_DROPPED);
+		return;
+	}
+	if (deliverTelemetry(client, message, length, critical, startMs) == 0)
+		Log_Debug("INFO: IoTHubClient accepted %u telemetry events for delivery\n", count);
+	countFlushedEvents(client, lanes, ageMs, FLUSHED_SENT);
+}
+
+// Adds the events of a flushed batch to their lanes; ageMs is how long ago the batch was started.
+static void countFlushedEvents(AzureClient* client, const TelemetryBatchLane* lanes, uint32_t ageMs, int outcome)
+{
+	for (int i = 0; i < TELEMETRY_LANE_COUNT; i++) {
+		TelemetryLaneStats* stats = &client->lanes[i];
+		const TelemetryBatchLane* lane = &lanes[i];
+		if (lane->count == 0)
+			continue;
+		if (outcome == FLUSHED_STORED) {
+			stats->stored += lane->count;
+		}
+		else if (outcome == FLUSHED_DROPPED) {
+			stats->dropped += lane->count;
+		}
+		else {
+			stats->sent += lane->count;
+			stats->totalWaitMs += (uint64_t)ageMs * lane->count - lane->sumMs;
+			if (ageMs - lane->firstMs > stats->maxWaitMs)
+				stats->maxWaitMs = ageMs - lane->firstMs;
+		}
+	}
+}
+
+/// <summary>
+///     Hands a telemetry message to the client in a free delivery slot, which keeps it until
+///     IoT Hub confirms it. Without a free slot the message is sent once, untracked.
+/// </summary>
+/// <param name="queuedMs">when the message was made, for the delivery latency</param>
+/// <returns>0 if the client took the message, -1 if not (a tracked one is tried again)</returns>
+static int deliverTelemetry(AzureClient* client, const char* message, uint16_t length, bool critical, uint32_t queuedMs)
+{
+	TelemetryDelivery* delivery = findFreeDelivery(client);
+	if (delivery == NULL || length >= sizeof(delivery->message))
+		return sendTelemetryMessage(client, message, length, NULL);
+
+	if (++client->deliverySequence == 0)
+		client->deliverySequence = 1;
+	delivery->sequence = client->deliverySequence;
+	delivery->queuedMs = queuedMs;
+	delivery->attempts = 0;
+	delivery->critical = critical;
+	delivery->length = length;
+	memcpy(delivery->message, message, length);
+	delivery->message[length] = '\0';
+	return handOverDelivery(client, delivery);
+}
+
+static TelemetryDelivery* findFreeDelivery(AzureClient* client)
+{
+	for (int i = 0; i < TELEMETRY_DELIVERY_SLOTS; i++) {
+		if (client->deliveries[i].sequence == 0)
+			return &client->deliveries[i];
+	}
+	return NULL;
+}
+
+static int handOverDelivery(AzureClient* client, TelemetryDelivery* delivery)
+{
+	delivery->attempts++;
+	delivery->waiting = false;
+	if (sendTelemetryMessage(client, delivery->message, delivery->length, delivery) == 0)
+		return 0;
+	confirmDelivery(client, delivery, IOTHUB_CLIENT_CONFIRMATION_ERROR);
+	return -1;
+}
+
+/// <summary>
+///     Outcome of a tracked message, on the app thread. A confirmed message frees its slot and
+///     counts its latency. A failed one goes to the store while the client is offline, is
+///     handed over again after a backoff, or is dropped after maxDeliveryAttempts.
+/// </summary>
+static void confirmDelivery(AzureClient* client, TelemetryDelivery* delivery, IOTHUB_CLIENT_CONFIRMATION_RESULT result)
+{
+	if (delivery->sequence == 0 || delivery->waiting)
+		return;
+	uint32_t now = getTimeMs();
+	if (result == IOTHUB_CLIENT_CONFIRMATION_OK) {
+		addDeliveryLatency(&client->telemetryDelivery, now - delivery->queuedMs);
+		Log_Debug("INFO: telemetry message %u confirmed after %u ms\n", delivery->sequence, now - delivery->queuedMs);
+		delivery->sequence = 0;
+		return;
+	}
+
+	client->telemetryDelivery.failed++;
+	// a client torn down to reconnect isn't the message's fault
+	if (result == IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY && delivery->attempts > 0)
+		delivery->attempts--;
+	if (delivery->attempts >= maxDeliveryAttempts) {
+		client->telemetryDelivery.deadLettered++;
+		Log_Debug("WARNING: telemetry message %u failed %u times, dropped: %s\n", delivery->sequence,
+			delivery->attempts, isBinaryTelemetry(delivery->message, delivery->length) ? "(binary)" : delivery->message);
+		delivery->sequence = 0;
+		return;
+	}
+	Log_Debug("WARNING: telemetry message %u not delivered (result %d, attempt %u)\n", delivery->sequence,
+		result, delivery->attempts);
+	if (storeDelivery(client, delivery) == 0)
+		return;
+	delivery->waiting = true;
+	delivery->retryMs = now + (deliveryRetryMs << (delivery->attempts > 1 ? delivery->attempts - 1 : 0));
+}
+
+// Moves a failed message to the store while the client is offline, where it survives a restart.
+static int storeDelivery(AzureClient* client, TelemetryDelivery* delivery)
+{
+	if (client->authenticated || client->store.fd < 0 || EventQueue_Push(&client->store, delivery->critical ?
+		EVENT_PRIORITY_CRITICAL : EVENT_PRIORITY_NORMAL, delivery->message, delivery->length) < 0)
+		return -1;
+	Log_Debug("INFO: telemetry message %u stored, %u messages waiting\n", delivery->sequence,
+		EventQueue_Count(&client->store));
+	delivery->sequence = 0;
+	return 0;
+}
+
+// Hands failed messages over again once their backoff is over, or stores them while offline.
+static void retryDeliveries(AzureClient* client)
+{
+	uint32_t now = getTimeMs();
+	bool handedOver = false;
+	for (int i = 0; i < TELEMETRY_DELIVERY_SLOTS; i++) {
+		TelemetryDelivery* delivery = &client->deliveries[i];
+		if (delivery->sequence == 0 || !delivery->waiting || storeDelivery(client, delivery) == 0)
+			continue;
+		if (client->authenticated && canSend(client) && (int32_t)(now - delivery->retryMs) >= 0)
+			handedOver |= handOverDelivery(client, delivery) == 0;
+	}
+	if (handedOver)
+		doWork(client);
+}
+
+static void addDeliveryLatency(DeliveryStats* stats, uint32_t ms)
+{
+	stats->confirmed++;
+	stats->totalMs += ms;
+	if (ms > stats->maxMs)
+		stats->maxMs = ms;
+	unsigned int bucket = 0;
+	while (bucket < DELIVERY_LATENCY_BUCKETS - 1 && ms >= (16u << bucket))
+		bucket++;
+	stats->buckets[bucket]++;
+}
+
+/// <summary>
+///     Latency under which the given percentage of confirmed deliveries fell, rounded up to
+///     its power-of-two bucket and capped at the slowest one.
+/// </summary>
+uint32_t GetDeliveryPercentileMs(const DeliveryStats* stats, unsigned int percent)
+{
+	uint64_t rank = ((uint64_t)stats->confirmed * percent + 99) / 100;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < DELIVERY_LATENCY_BUCKETS - 1 && rank > 0; i++) {
+		seen += stats->buckets[i];
+		if (seen >= rank)
+			return (16u << i) < stats->maxMs ? (16u << i) : stats->maxMs;
+	}
+	return stats->maxMs;
+}
+
+// Hands a message to the client, or to the worker that owns it.
+static int sendTelemetryMessage(AzureClient* client, const char* message, uint16_t length, TelemetryDelivery* delivery)
+{
+	if (client->worker != NULL) {
+		uint8_t slot = delivery != NULL ? (uint8_t)(delivery - client->deliveries) : NO_DELIVERY;
+		return pushOutbound(client, WORKER_TELEMETRY, &slot, sizeof(slot), message, length);
+	}
+	return clientSendTelemetry(client, message, length, delivery);
+}
+
+// A message knows its own encoding, so stored ones are sent right after a switch.
+static bool isBinaryTelemetry(const char* message, uint16_t length)
+{
+	return length > 0 && (uint8_t)message[0] == TELEMETRY_BINARY_FORMAT;
+}
+
+static int sendReportedPatch(AzureClient* client, const char* patch, size_t length)
+{
+	if (client->worker != NULL)
+		return pushOutbound(client, WORKER_REPORTED, patch, length, NULL, 0);
+	return clientSendReportedState(client, patch, length);
+}
+
+// Whether the app thread can hand messages over: a client exists, or the worker is connected.
+static bool canSend(const AzureClient* client)
+{
+	return client->worker != NULL ? client->authenticated : client->handle != NULL;
+}
+
+static int clientSendTelemetry(AzureClient* client, const char* message, uint16_t length, TelemetryDelivery* delivery)
+{
+	if (client->handle == NULL) {
+		Log_Debug("WARNING: client not initialized, telemetry message dropped\n");
+		return -1;
+	}
+
+	IOTHUB_MESSAGE_HANDLE messageHandle = IoTHubMessage_CreateFromByteArray((const unsigned char*)message, length);
 
 	if (messageHandle == 0) {
 		Log_Debug("WARNING: unable to create a new IoTHubMessage\n");
-		return;
+		return -1;
 	}
 
-	if (IoTHubDeviceClient_LL_SendEventAsync(iothubClientHandle, messageHandle, SendMessageCallback,
-		/*&callback_param*/ 0) != IOTHUB_CLIENT_OK) {
+	// lets the cloud tell the encodings apart, and route on JSON bodies
+	if (isBinaryTelemetry(message, length)) {
+		IoTHubMessage_SetContentTypeSystemProperty(messageHandle, TELEMETRY_BINARY_CONTENT_TYPE);
+	}
+	else {
+		IoTHubMessage_SetContentTypeSystemProperty(messageHandle, "application/json");
+		IoTHubMessage_SetContentEncodingSystemProperty(messageHandle, "utf-8");
+	}
+
+	int result = 0;
+	if (IoTHubDeviceClient_LL_SendEventAsync(client->handle, messageHandle, SendMessageCallback,
+		delivery) != IOTHUB_CLIENT_OK) {
 		Log_Debug("WARNING: failed to hand over the message to IoTHubClient\n");
+		result = -1;
 	}
 	else {
-		Log_Debug("INFO: IoTHubClient accepted the message for delivery\n");
+		client->sendMs = getTimeMs();
 	}
 
 	IoTHubMessage_Destroy(messageHandle);
+	return result;
+}
+
+static int clientSendReportedState(AzureClient* client, const char* patch, size_t length)
+{
+	if (client->handle == NULL || IoTHubDeviceClient_LL_SendReportedState(client->handle,
+		(const unsigned char*)patch, length, reportedStateCallback, client) != IOTHUB_CLIENT_OK)
+		return -1;
+	client->patchInFlight = true;
+	client->sendMs = getTimeMs();
+	return 0;
+}
+
+/// <summary>
+///     Sends the oldest stored message once authenticated, one every storeDrainIntervalMs.
+/// </summary>
+static void drainTelemetryStore(AzureClient* client)
+{
+	if (!client->authenticated || !canSend(client) || EventQueue_Count(&client->store) == 0
+		|| findFreeDelivery(client) == NULL)
+		return;
+	uint32_t now = getTimeMs();
+	if (now - client->storeDrainMs < storeDrainIntervalMs)
+		return;
+	client->storeDrainMs = now;
+
+	char message[TELEMETRY_BATCH_SIZE];
+	uint8_t priority;
+	int length = EventQueue_Peek(&client->store, message, sizeof(message) - 1, &priority);
+	if (length < 0) {
+		Log_Debug("WARNING: stored telemetry message unreadable, dropped\n");
+		EventQueue_Pop(&client->store);
+		return;
+	}
+	message[length] = '\0';
+	// the delivery slot keeps the message from here on, even if the client doesn't take it now
+	int result = deliverTelemetry(client, message, (uint16_t)length, priority == EVENT_PRIORITY_CRITICAL, now);
+	EventQueue_Pop(&client->store);
+	if (result == 0) {
+		Log_Debug("INFO: IoTHubClient accepted a stored telemetry message, %u waiting\n",
+			EventQueue_Count(&client->store));
+		doWork(client);
+	}
+}
+
+// Lets the client send and receive, or wakes the worker if anything was pushed to it.
+static void doWork(AzureClient* client)
+{
+	if (client->worker == NULL) {
+		clientDoWork(client);
+		return;
+	}
+	if (!client->worker->wakePending)
+		return;
+	if (eventfd_write(client->worker->wakeFd, 1) != 0) {
+		Log_Debug("ERROR: Could not wake the IoT worker: %s (%d).\n", strerror(errno), errno);
+		return;
+	}
+	client->worker->wakePending = false;
+}
+
+/// <summary>
+///     Lets the client send and receive. Twin and method callbacks run inside DoWork and
+///     may queue telemetry; that is sent by the next DoWork instead of a nested one.
+/// </summary>
+static void clientDoWork(AzureClient* client)
+{
+	if (!client->connected || client->working)
+		return;
+	client->working = true;
+	IoTHubDeviceClient_LL_DoWork(client->handle);
+	client->working = false;
+	scheduleDoWork(client);
+}
+
+/// <summary>
+///     Picks when DoWork runs again after this one: every doWorkBusyIntervalMs while the client
+///     holds messages it hasn't had confirmed, doubling once the last send is doWorkBusyWindowMs
+///     old, and only at the poll period once nothing is in flight.
+/// </summary>
+static void scheduleDoWork(AzureClient* client)
+{
+	uint32_t now = getTimeMs();
+	client->doWorkMs = now;
+
+	IOTHUB_CLIENT_STATUS status;
+	bool busy = client->patchInFlight || (client->handle != NULL
+		&& IoTHubDeviceClient_LL_GetSendStatus(client->handle, &status) == IOTHUB_CLIENT_OK
+		&& status == IOTHUB_CLIENT_SEND_STATUS_BUSY);
+	uint32_t pollPeriodMs = (uint32_t)client->pollPeriodSeconds * 1000;
+	if (!busy)
+		client->doWorkIntervalMs = 0;
+	else if (now - client->sendMs < doWorkBusyWindowMs)
+		client->doWorkIntervalMs = doWorkBusyIntervalMs;
+	else if (client->doWorkIntervalMs != 0 && client->doWorkIntervalMs < pollPeriodMs / 2)
+		client->doWorkIntervalMs *= 2;
+	else
+		client->doWorkIntervalMs = 0;
+}
+
+static uint32_t getTimeMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)(now.tv_sec * 1000LL + now.tv_nsec / 1000000);
 }
 
 
@@ -215,8 +1820,18 @@ void SendTelemetry(const unsigned char* key, const unsigned char* value)
 ///     Callback confirming message delivered to IoT Hub.
 /// </summary>
 /// <param name="result">Message delivery status</param>
-/// <param name="context">User specified context</param>
+/// <param name="context">The message's delivery slot, NULL if untracked</param>
 static void SendMessageCallback(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* context)
 {
 	Log_Debug("INFO: Message received by IoT Hub. Result is: %d\n", result);
+	TelemetryDelivery* delivery = context;
+	if (delivery == NULL)
+		return;
+	AzureClient* client = delivery->client;
+	if (client->worker == NULL) {
+		confirmDelivery(client, delivery, result);
+		return;
+	}
+	uint8_t record[2] = { (uint8_t)(delivery - client->deliveries), (uint8_t)result };
+	pushInbound(client, WORKER_DELIVERY, record, sizeof(record), NULL, 0);
 }
\ No newline at end of file
@@ -1,8 +1,14 @@
 #pragma once
 
 #include "stdbool.h"
+#include <pthread.h>
+#include <stdint.h>
 
 #include "epoll_timerfd_utilities.h"
+#include "event_queue.h"
+#include "hub_connection.h"
+#include "json_writer.h"
+#include "spsc_ring.h"
 
 // Azure IoT SDK
 #include <iothub_client_core_common.h>
@@ -14,16 +20,233 @@
 
 // Azure IoT Hub/Central defines.
 #define SCOPEID_LENGTH 20
-char scopeId[SCOPEID_LENGTH]; // ScopeId for the Azure IoT Central application, set in
+extern char scopeId[SCOPEID_LENGTH]; // ScopeId for the Azure IoT Central application, set in
 									 // app_manifest.json, CmdArgs
 
-extern IOTHUB_DEVICE_CLIENT_LL_HANDLE iothubClientHandle;
 extern const int keepalivePeriodSeconds;
-extern bool iothubAuthenticated;
 
-void SendTelemetry(const unsigned char* key, const unsigned char* value);
-int SetupAzureClient(void);
-void TwinReportState(const char* propertyName, const char* propertyValue);
+// Telemetry events are batched into one message of at most this many bytes. An event's
+// JSON is at most TELEMETRY_EVENT_SIZE bytes with its terminator, longer ones are dropped.
+#define TELEMETRY_BATCH_SIZE 256
+#define TELEMETRY_EVENT_SIZE 100
+
+// How telemetry messages are encoded, see SetTelemetryEncoding.
+typedef enum TelemetryEncoding {
+	TELEMETRY_ENCODING_JSON,// { "key": "text" }, or an array of them; content type application/json
+	TELEMETRY_ENCODING_BINARY// see below; content type TELEMETRY_BINARY_CONTENT_TYPE
+} TelemetryEncoding;
+
+// A binary telemetry message is the byte TELEMETRY_BINARY_FORMAT followed by
+// TELEMETRY_BINARY_EVENT_SIZE bytes per event: the event code, then its argument as a
+// little-endian u16, 0 when it has none. A summary of events held back by a TelemetryLimit
+// has TELEMETRY_CODE_HELD_BACK added to their code and their count as argument. Codes are
+// 1 to 0x7F and defined by the app, the lock's in lock_core.h.
+#define TELEMETRY_BINARY_FORMAT 0xB1
+#define TELEMETRY_BINARY_EVENT_SIZE 3
+#define TELEMETRY_CODE_HELD_BACK 0x80
+#define TELEMETRY_BINARY_CONTENT_TYPE "application/vnd.azure-sphere-lock.telemetry.v1"
+
+// How urgent a telemetry event is, see SendTelemetry.
+typedef enum TelemetryLane {
+	TELEMETRY_LANE_CRITICAL,// alarms: sent at once, ahead of stored messages
+	TELEMETRY_LANE_OPERATIONAL,// lock, door and security events: batched, stored while offline
+	TELEMETRY_LANE_DIAGNOSTIC,// menu and config chatter: batched, dropped while offline
+	TELEMETRY_LANE_COUNT
+} TelemetryLane;
+
+typedef struct TelemetryLaneStats {
+	uint32_t queued;// events passed to SendTelemetry
+	uint32_t sent;// handed to the client
+	uint32_t stored;// put in the telemetry store
+	uint32_t dropped;
+	uint32_t limited;// held back by a TelemetryLimit and counted in its summary instead
+	uint32_t maxWaitMs;// longest an event waited before it was handed to the client
+	uint64_t totalWaitMs;
+} TelemetryLaneStats;
+
+// Repetitive events, such as the warnings of a keypad brute force, are let through at a
+// limited rate per key, see LimitTelemetry.
+#define TELEMETRY_LIMIT_COUNT 4
+
+typedef struct TelemetryLimit {
+	const char* key;// string constant, NULL for a free slot
+	uint8_t burst;// events let through back to back
+	uint8_t tokens;// events that may be sent now
+	uint32_t refillMs;// one token comes back this often
+	uint32_t refilledMs;// when tokens were last added
+	uint32_t heldBackMs;// when the first event held back since the last summary came
+	uint16_t heldBack;// events not sent since the last summary
+	uint8_t code;// of the last held-back event, for the summary
+	TelemetryLane lane;// of the held-back events, for their summary
+} TelemetryLimit;
+
+// Events of one lane in the telemetry batch, times relative to telemetryBatchStartMs.
+typedef struct TelemetryBatchLane {
+	uint8_t count;
+	uint32_t firstMs;// when the first one was queued
+	uint32_t sumMs;// sum over the events of when they were queued
+} TelemetryBatchLane;
+
+// Telemetry messages are kept in delivery slots until IoT Hub confirms them, and sent again if
+// it doesn't. While all slots are in use, new messages go to the telemetry store.
+#define TELEMETRY_DELIVERY_SLOTS 4
+
+// Delivery latencies are counted in power-of-two buckets: under 16 ms, under 32 ms, ...
+#define DELIVERY_LATENCY_BUCKETS 12
+
+struct AzureClient;
+
+typedef struct TelemetryDelivery {
+	struct AzureClient* client;// set once, the confirmation's way back to the client
+	uint32_t sequence;// numbers the messages sent, 0 for a free slot
+	uint32_t queuedMs;// when the message was made, or taken from the store
+	uint32_t retryMs;// when a failed message is handed over again
+	uint8_t attempts;
+	bool critical : 1;
+	bool waiting : 1;// failed, waits for retryMs
+	uint16_t length;
+	char message[TELEMETRY_BATCH_SIZE];
+} TelemetryDelivery;
+
+typedef struct DeliveryStats {
+	uint32_t confirmed;
+	uint32_t failed;// confirmations other than OK
+	uint32_t deadLettered;// given up on after the last attempt
+	uint32_t maxMs;
+	uint64_t totalMs;
+	uint32_t buckets[DELIVERY_LATENCY_BUCKETS];// the last one also counts everything slower
+} DeliveryStats;
+
+// Telemetry messages made while the hub can't be reached are kept in this much mutable storage.
+#define TELEMETRY_STORE_SIZE (16 * 1024)
+
+// Reported properties are kept in a shadow and sent as one patch per flush.
+#define REPORTED_PROPERTY_COUNT 10
+#define REPORTED_VALUE_SIZE 24
+
+typedef struct ReportedProperty {
+	const char* name;// string constant, NULL for a free slot
+	char value[REPORTED_VALUE_SIZE];// latest JSON value
+	char sent[REPORTED_VALUE_SIZE];// JSON value in the last patch that carried it
+	bool inFlight : 1;// in the patch waiting for ReportStatusCallback
+	bool acknowledged : 1;// `sent` was accepted by the hub
+} ReportedProperty;
+
+// The app thread and the IoT worker exchange records of at most this many bytes, through
+// rings of these sizes. Twin updates, which can be larger, are passed as a heap copy.
+#define AZURE_WORKER_RECORD_SIZE 2048
+#define AZURE_WORKER_OUTBOUND_SIZE 4096
+#define AZURE_WORKER_INBOUND_SIZE 8192
+
+typedef struct AzureWorkerEvent {
+	EventData eventData;// first, so the handler can get back to the client
+	struct AzureClient* client;
+} AzureWorkerEvent;
+
+// Thread that owns the IoT Hub client, see StartAzureWorker. It runs its own event loop with
+// the Azure poll timer and an eventfd the app thread writes after pushing to `outbound`.
+typedef struct AzureWorker {
+	pthread_t thread;
+	int epollFd;
+	int pollTimerFd;
+	int wakeFd;// written by the app thread
+	int eventFd;// written by the worker after pushing to `inbound`, read by the app thread
+	AzureWorkerEvent wakeEvent;
+	AzureWorkerEvent pollEvent;
+	SpscRing outbound;// telemetry, reported-state patches and network state
+	SpscRing inbound;// connection state, patch results, twin updates and method calls
+	_Atomic bool stop;// set by the app thread
+	bool wakePending;// app thread: records were pushed since the worker was last woken
+	bool networkReady;// app thread: the state last pushed to the worker
+	bool workerNetworkReady;// worker: the state it was told
+	bool pollTimerBusy;// worker: the poll timer is armed for the next DoWork, not the poll period
+	HubConnection connection;// app thread: the worker's client->connection, as last pushed
+	// The direct method the worker waits on, answered by the app thread. Calls are numbered;
+	// the thread that first sets methodClaimed to a call's number runs it or gives up on it.
+	uint32_t methodCall;// worker: the last call pushed
+	_Atomic uint32_t methodClaimed;
+	_Atomic uint32_t methodAnswered;// the call the fields below answer
+	int methodStatus;
+	unsigned char* methodResponse;
+	size_t methodResponseSize;
+	int methodTimerFd;// worker: the deadline of the call it waits on
+	AzureWorkerEvent methodTimerEvent;
+} AzureWorker;
+
+// IoT Hub connection of one lock.
+typedef struct AzureClient {
+	IOTHUB_DEVICE_CLIENT_LL_HANDLE handle;
+	void* context;// passed to TwinCallback and MethodCallback
+	int pollPeriodSeconds;
+	HubConnection connection;// when to connect, kept by the thread that owns `handle`
+	bool authenticated;// as seen by the app thread
+	bool connected;// as seen by the thread that owns `handle`
+	bool working;// inside DoWork
+	bool patchInFlight;// the client holds a reported-state patch
+	uint32_t sendMs;// when a message was last handed to the client
+	uint32_t doWorkMs;// when DoWork last ran
+	uint32_t doWorkIntervalMs;// time to the next DoWork while messages are in flight, else 0
+	AzureWorker* worker;// NULL unless StartAzureWorker succeeded
+
+	// Provisioning runs on a worker thread that signals setupEventFd when it is done; the
+	// handle and result are only touched by the worker until then.
+	int setupEventFd;// -1: SetupAzureClient provisions on the caller's thread
+	bool setupPending;
+	IOTHUB_DEVICE_CLIENT_LL_HANDLE setupHandle;
+	AZURE_SPHERE_PROV_RETURN_VALUE setupResult;
+
+	// Telemetry not handed to the client yet: '[' then the events separated by commas, or
+	// TELEMETRY_BINARY_FORMAT then the binary events.
+	TelemetryEncoding telemetryEncoding;
+	uint32_t telemetryBatchStartMs;// when the first event of the batch was queued
+	uint16_t telemetryBatchLength;
+	uint8_t telemetryBatchCount;
+	TelemetryBatchLane telemetryBatchLanes[TELEMETRY_LANE_COUNT];
+	char telemetryBatch[TELEMETRY_BATCH_SIZE];
+	TelemetryLaneStats lanes[TELEMETRY_LANE_COUNT];
+	TelemetryLimit limits[TELEMETRY_LIMIT_COUNT];
+
+	// Messages kept while offline, sent in order at storeDrainIntervalMs once authenticated.
+	EventQueue store;
+	uint32_t storeDrainMs;// when the last stored message was sent
+
+	// Messages handed to the client and not confirmed yet, see deliverTelemetry.
+	uint32_t deliverySequence;
+	TelemetryDelivery deliveries[TELEMETRY_DELIVERY_SLOTS];
+	DeliveryStats telemetryDelivery;// made or taken from the store -> confirmed
+	DeliveryStats reportedDelivery;// patch sent -> ReportStatusCallback
+	uint32_t reportSentMs;
+
+	uint32_t reportedStartMs;// when a property became dirty while none was
+	bool reportedDirty;// some property differs from what the hub acknowledged
+	bool reportInFlight;// a patch waits for ReportStatusCallback
+	ReportedProperty reported[REPORTED_PROPERTY_COUNT];
+} AzureClient;
+
+void InitAzureClient(AzureClient* client, void* context);
+int OpenTelemetryStore(AzureClient* client);
+void CloseTelemetryStore(AzureClient* client);
+int OpenAzureSetupEvent(AzureClient* client);
+int CompleteAzureClientSetup(AzureClient* client);
+void CloseAzureSetupEvent(AzureClient* client);
+int StartAzureWorker(AzureClient* client);
+int ProcessAzureWorkerEvents(AzureClient* client);
+void StopAzureWorker(AzureClient* client);
+void SetTelemetryEncoding(AzureClient* client, TelemetryEncoding encoding);
+void SendTelemetry(AzureClient* client, uint8_t code, uint16_t argument, const char* key,
+	const char* value, TelemetryLane lane);
+void SendTelemetryDocument(AzureClient* client, const char* message, uint16_t length, TelemetryLane lane);
+unsigned int CountDeliveriesInFlight(const AzureClient* client);
+const HubConnection* GetHubConnection(const AzureClient* client);
+int LimitTelemetry(AzureClient* client, const char* key, uint8_t burst, uint32_t refillMs);
+void LogTelemetryStats(const AzureClient* client);
+int WriteTelemetryStats(const AzureClient* client, JsonWriter* writer);
+int WriteQueueStats(AzureClient* client, JsonWriter* writer);
+uint32_t GetDeliveryPercentileMs(const DeliveryStats* stats, unsigned int percent);
+void FlushDueUpdates(AzureClient* client);
+int SetupAzureClient(AzureClient* client);
+int PollAzureClient(AzureClient* client);
+void TwinReportState(AzureClient* client, const char* propertyName, const char* propertyValue);
 
 // Azure IoT poll periods
 extern const int AzureIoTDefaultPollPeriodSeconds;
\ No newline at end of file
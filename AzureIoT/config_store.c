@@ -0,0 +1,114 @@
+#include "config_store.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+
+#define SLOT_MAGIC 0x47464343u//"CCFG"
+
+typedef struct SlotHeader {
+	uint32_t magic;
+	uint32_t generation;
+	uint8_t format;
+	uint8_t length;
+	uint16_t reserved;
+	uint32_t crc;//of the fields above and the record
+} SlotHeader;
+
+static uint32_t slotCrc(const SlotHeader* header, const void* record)
+{
+	return Crc32_Update(Crc32_Update(0, header, offsetof(SlotHeader, crc)), record, header->length);
+}
+
+//reads slot `slot` into `header` and `record`, false if it was never written or is torn
+static bool readSlot(const ConfigStore* store, int slot, SlotHeader* header, uint8_t* record)
+{
+	uint8_t buffer[CONFIG_STORE_SLOT_SIZE];
+	ssize_t n = pread(store->fd, buffer, sizeof(buffer), (off_t)store->offset + slot * CONFIG_STORE_SLOT_SIZE);
+	if (n != (ssize_t)sizeof(buffer))
+		return false;
+	memcpy(header, buffer, sizeof(*header));
+	if (header->magic != SLOT_MAGIC || header->length > CONFIG_STORE_MAX_RECORD)
+		return false;
+	memcpy(record, buffer + sizeof(*header), header->length);
+	return header->crc == slotCrc(header, record);
+}
+
+//the newest intact slot, or -1
+static int newestSlot(const ConfigStore* store, SlotHeader* header, uint8_t* record)
+{
+	SlotHeader headers[2];
+	uint8_t records[2][CONFIG_STORE_MAX_RECORD];
+	bool valid[2] = { readSlot(store, 0, &headers[0], records[0]), readSlot(store, 1, &headers[1], records[1]) };
+	int newest = -1;
+	if (valid[0] && valid[1])
+		newest = (int32_t)(headers[1].generation - headers[0].generation) > 0 ? 1 : 0;
+	else if (valid[0] || valid[1])
+		newest = valid[1] ? 1 : 0;
+	if (newest >= 0) {
+		*header = headers[newest];
+		memcpy(record, records[newest], headers[newest].length);
+	}
+	return newest;
+}
+
+int ConfigStore_Open(ConfigStore* store, int fd, uint32_t offset)
+{
+	memset(store, 0, sizeof(*store));
+	store->fd = fd;
+	store->offset = offset;
+	if (fd < 0)
+		return -1;
+	SlotHeader header;
+	uint8_t record[CONFIG_STORE_MAX_RECORD];
+	if (newestSlot(store, &header, record) >= 0)
+		store->generation = header.generation;
+	return 0;
+}
+
+int ConfigStore_Load(const ConfigStore* store, uint8_t format, void* record, size_t size)
+{
+	if (store->fd < 0)
+		return -1;
+	SlotHeader header;
+	uint8_t saved[CONFIG_STORE_MAX_RECORD];
+	if (newestSlot(store, &header, saved) < 0 || header.format != format || header.length != size)
+		return -1;
+	memcpy(record, saved, size);
+	return 0;
+}
+
+int ConfigStore_Save(ConfigStore* store, uint8_t format, const void* record, size_t size)
+{
+	if (store->fd < 0 || size > CONFIG_STORE_MAX_RECORD)
+		return -1;
+
+	uint8_t buffer[CONFIG_STORE_SLOT_SIZE] = { 0 };
+	SlotHeader header = {
+		.magic = SLOT_MAGIC,
+		.generation = store->generation + 1,
+		.format = format,
+		.length = (uint8_t)size
+	};
+	header.crc = slotCrc(&header, record);
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), record, size);
+
+	//the slot not holding the newest record, so that one survives a torn write
+	off_t position = (off_t)store->offset + (header.generation & 1) * CONFIG_STORE_SLOT_SIZE;
+	if (pwrite(store->fd, buffer, sizeof(buffer), position) != (ssize_t)sizeof(buffer) || fsync(store->fd) < 0) {
+		store->failures++;
+		return -1;
+	}
+	store->generation = header.generation;
+	store->saves++;
+	return 0;
+}
+
+void ConfigStore_Close(ConfigStore* store)
+{
+	if (store->fd >= 0)
+		close(store->fd);
+	store->fd = -1;
+}
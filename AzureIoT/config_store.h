@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One small record kept in a region of a file (the app's mutable storage), rewritten in place
+// when it changes. The region holds two slots written alternately, each with a generation
+// number, the record's format and length and a CRC-32, so a write torn by a power loss leaves
+// the previous record in the other slot. The newest intact slot is the record.
+//
+// The format is the caller's: a record of another format or length is not loaded, and the
+// caller starts as if nothing was saved.
+
+#define CONFIG_STORE_SLOT_SIZE 128
+#define CONFIG_STORE_SIZE (2 * CONFIG_STORE_SLOT_SIZE)
+#define CONFIG_STORE_RECORD_OVERHEAD 16
+#define CONFIG_STORE_MAX_RECORD (CONFIG_STORE_SLOT_SIZE - CONFIG_STORE_RECORD_OVERHEAD)
+
+typedef struct ConfigStore {
+	int fd;//-1 when the store has no storage
+	uint32_t offset;//start of the region in the file
+	uint32_t generation;//of the newest slot, 0 before the first save
+	uint32_t saves;//records written since open
+	uint32_t failures;//saves that couldn't be written
+} ConfigStore;
+
+// Reads the slots of the region at `offset` of `fd`. Returns 0, or -1 without storage.
+int ConfigStore_Open(ConfigStore* store, int fd, uint32_t offset);
+
+// Copies the saved record into `record`. Returns 0, or -1 if there is none of this format
+// and size.
+int ConfigStore_Load(const ConfigStore* store, uint8_t format, void* record, size_t size);
+
+// Writes the record into the older slot and syncs it. Returns 0, or -1 if it couldn't be written.
+int ConfigStore_Save(ConfigStore* store, uint8_t format, const void* record, size_t size);
+
+void ConfigStore_Close(ConfigStore* store);
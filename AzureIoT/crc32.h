@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE) of the records kept in mutable storage. Start with 0 and pass the result back
+// in to continue over more data.
+uint32_t Crc32_Update(uint32_t crc, const void* data, size_t length);
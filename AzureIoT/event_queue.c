@@ -0,0 +1,235 @@
+#include "event_queue.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32.h"
+
+#define HEADER_MAGIC 0x51455645u//"EVEQ"
+#define HEADER_SLOT_SIZE 32
+#define RECORD_MAGIC 0xA5
+#define MAX_PAYLOAD 512
+
+typedef struct QueueHeader {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t headOffset;
+	uint32_t headSeq;
+	uint32_t ringSize;//a region of another size starts empty
+	uint32_t crc;//of the fields above
+} QueueHeader;
+
+typedef struct RecordHeader {
+	uint32_t seq;
+	uint16_t length;
+	uint8_t priority;
+	uint8_t magic;
+	uint32_t crc;//of the fields above and the payload
+} RecordHeader;
+
+static int readAt(const EventQueue* queue, uint32_t position, void* buffer, size_t size)
+{
+	ssize_t n = pread(queue->fd, buffer, size, (off_t)queue->offset + position);
+	return n == (ssize_t)size ? 0 : -1;
+}
+
+static int writeAt(const EventQueue* queue, uint32_t position, const void* buffer, size_t size)
+{
+	ssize_t n = pwrite(queue->fd, buffer, size, (off_t)queue->offset + position);
+	return n == (ssize_t)size ? 0 : -1;
+}
+
+static bool readHeaderSlot(const EventQueue* queue, int slot, QueueHeader* header)
+{
+	if (readAt(queue, (uint32_t)slot * HEADER_SLOT_SIZE, header, sizeof(*header)) < 0)
+		return false;
+	return header->magic == HEADER_MAGIC && header->ringSize == queue->ringSize
+		&& header->headOffset <= queue->ringSize
+		&& header->crc == Crc32_Update(0, header, offsetof(QueueHeader, crc));
+}
+
+//reads the header of record `seq` at ring offset `position` and checks its CRC; a torn record can
+//leave a header that looks right, with the record rewritten at the start of the ring
+static bool readRecord(const EventQueue* queue, uint32_t position, uint32_t seq, RecordHeader* header)
+{
+	if (position + EVENT_QUEUE_RECORD_OVERHEAD > queue->ringSize)
+		return false;
+	if (readAt(queue, EVENT_QUEUE_HEADER_SIZE + position, header, sizeof(*header)) < 0)
+		return false;
+	if (header->magic != RECORD_MAGIC || header->seq != seq || header->priority >= EVENT_PRIORITY_COUNT
+		|| header->length > MAX_PAYLOAD || position + EVENT_QUEUE_RECORD_OVERHEAD + header->length > queue->ringSize)
+		return false;
+
+	uint8_t payload[MAX_PAYLOAD];
+	if (readAt(queue, EVENT_QUEUE_HEADER_SIZE + position + EVENT_QUEUE_RECORD_OVERHEAD, payload, header->length) < 0)
+		return false;
+	uint32_t crc = Crc32_Update(0, header, offsetof(RecordHeader, crc));
+	return header->crc == Crc32_Update(crc, payload, header->length);
+}
+
+//record `seq` is at `position`, or at the start of the ring if it didn't fit before the end
+static int findRecord(const EventQueue* queue, uint32_t position, uint32_t seq, RecordHeader* header)
+{
+	if (readRecord(queue, position, seq, header))
+		return (int)position;
+	if (position != 0 && readRecord(queue, 0, seq, header))
+		return 0;
+	return -1;
+}
+
+//drops the oldest record without committing the head
+static int advanceHead(EventQueue* queue)
+{
+	RecordHeader header;
+	int position = findRecord(queue, queue->headOffset, queue->headSeq, &header);
+	if (position < 0)
+		return -1;
+	queue->headOffset = (uint32_t)position + EVENT_QUEUE_RECORD_OVERHEAD + header.length;
+	queue->headSeq++;
+	return 0;
+}
+
+//ring offset a record of `size` bytes fits at, or -1 if the queue is too full
+static int64_t findSpace(const EventQueue* queue, uint32_t size)
+{
+	int64_t tail = queue->tailOffset;
+	if (EventQueue_Count(queue) == 0)
+		return tail + size <= queue->ringSize ? tail : 0;
+	if (queue->tailOffset > queue->headOffset) {
+		if (tail + size <= queue->ringSize)
+			return tail;
+		return size <= queue->headOffset ? 0 : -1;
+	}
+	return tail + size <= queue->headOffset ? tail : -1;
+}
+
+int EventQueue_Open(EventQueue* queue, int fd, uint32_t offset, uint32_t size)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->fd = fd;
+	queue->offset = offset;
+	if (fd < 0 || size <= EVENT_QUEUE_HEADER_SIZE + EVENT_QUEUE_RECORD_OVERHEAD) {
+		queue->fd = -1;
+		return -1;
+	}
+	queue->ringSize = size - EVENT_QUEUE_HEADER_SIZE;
+	queue->headSeq = 1;
+
+	//the newest intact header slot holds the head, none means the region is new
+	QueueHeader slots[2];
+	bool valid[2] = { readHeaderSlot(queue, 0, &slots[0]), readHeaderSlot(queue, 1, &slots[1]) };
+	int newest = -1;
+	if (valid[0] && valid[1])
+		newest = (int32_t)(slots[1].generation - slots[0].generation) > 0 ? 1 : 0;
+	else if (valid[0] || valid[1])
+		newest = valid[1] ? 1 : 0;
+	if (newest >= 0) {
+		queue->generation = slots[newest].generation;
+		queue->headOffset = slots[newest].headOffset;
+		queue->headSeq = slots[newest].headSeq;
+	}
+	queue->committedSeq = queue->headSeq;
+
+	//the queue ends at the first record that is missing, torn or out of sequence
+	uint32_t position = queue->headOffset;
+	uint32_t seq = queue->headSeq;
+	RecordHeader header;
+	int found;
+	while ((found = findRecord(queue, position, seq, &header)) >= 0) {
+		position = (uint32_t)found + EVENT_QUEUE_RECORD_OVERHEAD + header.length;
+		seq++;
+	}
+	queue->tailOffset = position;
+	queue->tailSeq = seq;
+	return (int)EventQueue_Count(queue);
+}
+
+int EventQueue_Push(EventQueue* queue, uint8_t priority, const void* data, uint16_t length)
+{
+	if (queue->fd < 0 || priority >= EVENT_PRIORITY_COUNT)
+		return -1;
+	uint32_t size = EVENT_QUEUE_RECORD_OVERHEAD + length;
+	if (length > MAX_PAYLOAD || size > queue->ringSize) {
+		queue->dropped[priority]++;
+		return -1;
+	}
+
+	int64_t position;
+	while ((position = findSpace(queue, size)) < 0) {
+		RecordHeader oldest;
+		if (findRecord(queue, queue->headOffset, queue->headSeq, &oldest) < 0)
+			return -1;
+		if (priority < oldest.priority) {
+			queue->dropped[priority]++;
+			return -1;
+		}
+		if (advanceHead(queue) < 0)
+			return -1;
+		queue->dropped[oldest.priority]++;
+	}
+
+	//space given up by popped or evicted records is only written over once the head past them is committed,
+	//otherwise a power loss would leave the committed head pointing into the new record
+	if (EventQueue_Commit(queue) < 0)
+		return -1;
+
+	uint8_t record[EVENT_QUEUE_RECORD_OVERHEAD + MAX_PAYLOAD];
+	RecordHeader header = { .seq = queue->tailSeq, .length = length, .priority = priority, .magic = RECORD_MAGIC };
+	header.crc = Crc32_Update(Crc32_Update(0, &header, offsetof(RecordHeader, crc)), data, length);
+	memcpy(record, &header, sizeof(header));
+	memcpy(record + sizeof(header), data, length);
+	if (writeAt(queue, EVENT_QUEUE_HEADER_SIZE + (uint32_t)position, record, size) < 0 || fsync(queue->fd) < 0)
+		return -1;
+
+	queue->tailOffset = (uint32_t)position + size;
+	queue->tailSeq++;
+	return 0;
+}
+
+int EventQueue_Peek(EventQueue* queue, void* buffer, size_t size, uint8_t* priority)
+{
+	if (queue->fd < 0 || EventQueue_Count(queue) == 0)
+		return -1;
+	RecordHeader header;
+	int position = findRecord(queue, queue->headOffset, queue->headSeq, &header);
+	if (position < 0 || header.length > size)
+		return -1;
+	if (readAt(queue, EVENT_QUEUE_HEADER_SIZE + (uint32_t)position + EVENT_QUEUE_RECORD_OVERHEAD, buffer, header.length) < 0)
+		return -1;
+	if (priority != NULL)
+		*priority = header.priority;
+	return header.length;
+}
+
+int EventQueue_Pop(EventQueue* queue)
+{
+	if (queue->fd < 0 || EventQueue_Count(queue) == 0)
+		return -1;
+	if (advanceHead(queue) < 0)
+		return -1;
+	if (EventQueue_Count(queue) == 0 || queue->headSeq - queue->committedSeq >= EVENT_QUEUE_COMMIT_EVERY)
+		return EventQueue_Commit(queue);
+	return 0;
+}
+
+int EventQueue_Commit(EventQueue* queue)
+{
+	if (queue->fd < 0)
+		return -1;
+	if (queue->headSeq == queue->committedSeq)
+		return 0;
+
+	QueueHeader header = {
+		.magic = HEADER_MAGIC,
+		.generation = queue->generation + 1,
+		.headOffset = queue->headOffset,
+		.headSeq = queue->headSeq,
+		.ringSize = queue->ringSize
+	};
+	header.crc = Crc32_Update(0, &header, offsetof(QueueHeader, crc));
+	if (writeAt(queue, (header.generation & 1) * HEADER_SLOT_SIZE, &header, sizeof(header)) < 0 || fsync(queue->fd) < 0)
+		return -1;
+	queue->generation = header.generation;
+	queue->committedSeq = queue->headSeq;
+	return 0;
+}
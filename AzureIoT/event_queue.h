@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded, append-only queue of messages in a region of a file (the app's mutable storage),
+// kept while the hub can't be reached and drained once it can.
+//
+// The region starts with two header slots holding the committed head, written alternately
+// so one is always intact. The rest is a ring of records: a 12-byte header (sequence number,
+// length, priority, CRC-32 of header and payload) followed by the payload. A record never
+// wraps; one that doesn't fit before the end of the ring starts at its beginning. On open
+// the queue is rebuilt by following records with consecutive sequence numbers from the
+// committed head, so a record torn by a power loss ends the queue and is written over.
+// Records are at least once: those popped since the last commit come back after a reboot.
+
+enum EventPriority {
+	EVENT_PRIORITY_NORMAL,//evicts the oldest normal records when the queue is full, dropped if a critical one is oldest
+	EVENT_PRIORITY_CRITICAL,//evicts the oldest records of any priority
+	EVENT_PRIORITY_COUNT
+};
+
+#define EVENT_QUEUE_HEADER_SIZE 64//two 32-byte header slots at the start of the region
+#define EVENT_QUEUE_RECORD_OVERHEAD 12
+#define EVENT_QUEUE_COMMIT_EVERY 8//pops between head commits while draining
+
+typedef struct EventQueue {
+	int fd;//-1 when the queue has no storage
+	uint32_t offset;//start of the region in the file
+	uint32_t ringSize;//bytes after the header slots
+	uint32_t headOffset;//ring offset of the oldest record
+	uint32_t tailOffset;//ring offset the next record is written at
+	uint32_t headSeq;//sequence number of the oldest record
+	uint32_t tailSeq;//sequence number of the next record, tailSeq - headSeq records are queued
+	uint32_t committedSeq;//head sequence number in the header slots
+	uint32_t generation;//of the newest header slot
+	uint32_t dropped[EVENT_PRIORITY_COUNT];//records lost to a full queue since open
+} EventQueue;
+
+// Recovers the queue from `size` bytes of `fd` at `offset`; a region that was never written
+// is an empty queue. Returns the number of queued records, or -1 if the region can't be read.
+int EventQueue_Open(EventQueue* queue, int fd, uint32_t offset, uint32_t size);
+
+// Appends a record and syncs it to storage, evicting old records as the priority allows.
+// Returns 0 when stored, -1 if it was dropped or couldn't be written.
+int EventQueue_Push(EventQueue* queue, uint8_t priority, const void* data, uint16_t length);
+
+// Copies the oldest record into `buffer`. Returns its length, or -1 if the queue is empty,
+// the record is larger than `size` or can't be read.
+int EventQueue_Peek(EventQueue* queue, void* buffer, size_t size, uint8_t* priority);
+
+// Removes the oldest record. The head is committed every EVENT_QUEUE_COMMIT_EVERY pops and
+// when the queue runs empty.
+int EventQueue_Pop(EventQueue* queue);
+
+// Writes the head to the header slots if it moved since the last commit.
+int EventQueue_Commit(EventQueue* queue);
+
+static inline uint32_t EventQueue_Count(const EventQueue* queue)
+{
+	return queue->tailSeq - queue->headSeq;
+}
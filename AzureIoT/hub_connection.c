@@ -0,0 +1,126 @@
+#include "hub_connection.h"
+
+#include <string.h>
+
+// Backoff ceilings: the first after a failure, and the highest it doubles to.
+static const uint32_t transientBackoffMs = 5000;
+static const uint32_t transientBackoffMaxMs = 10 * 60 * 1000;
+static const uint32_t credentialBackoffMs = 2 * 60 * 1000;
+static const uint32_t credentialBackoffMaxMs = 60 * 60 * 1000;
+
+static const char* const stateNames[] = {
+	[HUB_CONNECTION_IDLE] = "Idle",
+	[HUB_CONNECTION_CONNECTING] = "Connecting",
+	[HUB_CONNECTION_CONNECTED] = "Connected"
+};
+
+static const char* const reasonNames[HUB_REASON_COUNT] = {
+	[HUB_REASON_NO_NETWORK] = "NoNetwork",
+	[HUB_REASON_COMMUNICATION] = "Communication",
+	[HUB_REASON_EXPIRED_TOKEN] = "ExpiredToken",
+	[HUB_REASON_DEVICE_AUTH] = "DeviceAuth",
+	[HUB_REASON_CREDENTIAL] = "Credential",
+	[HUB_REASON_OTHER] = "Other"
+};
+
+void HubConnection_Init(HubConnection* connection, uint32_t seed, uint32_t now)
+{
+	memset(connection, 0, sizeof(*connection));
+	connection->random = seed * 2654435761u | 1;
+	connection->changedMs = now;
+	connection->retryMs = now;
+}
+
+bool HubConnection_ShouldConnect(const HubConnection* connection, uint32_t now)
+{
+	return connection->state == HUB_CONNECTION_IDLE && (int32_t)(now - connection->retryMs) >= 0;
+}
+
+static void setState(HubConnection* connection, HubConnectionState state, uint32_t now)
+{
+	if (connection->state == HUB_CONNECTION_CONNECTED)
+		connection->connectedMs += now - connection->changedMs;
+	connection->state = (uint8_t)state;
+	connection->changedMs = now;
+}
+
+void HubConnection_Connecting(HubConnection* connection, uint32_t now)
+{
+	connection->attempts++;
+	setState(connection, HUB_CONNECTION_CONNECTING, now);
+}
+
+void HubConnection_Connected(HubConnection* connection, uint32_t now)
+{
+	if (connection->state == HUB_CONNECTION_CONNECTED)
+		return;
+	connection->connects++;
+	connection->failures = 0;
+	setState(connection, HUB_CONNECTION_CONNECTED, now);
+}
+
+static uint32_t nextRandom(HubConnection* connection)
+{
+	uint32_t x = connection->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	connection->random = x;
+	return x;
+}
+
+//uniform between 0 and a ceiling that doubles with each failure in a row
+static uint32_t drawBackoff(HubConnection* connection, HubConnectionReason reason)
+{
+	uint32_t ceilingMs = reason == HUB_REASON_CREDENTIAL ? credentialBackoffMs : transientBackoffMs;
+	uint32_t maxMs = reason == HUB_REASON_CREDENTIAL ? credentialBackoffMaxMs : transientBackoffMaxMs;
+	for (uint8_t i = 1; i < connection->failures && ceilingMs < maxMs; i++)
+		ceilingMs *= 2;
+	if (ceilingMs > maxMs)
+		ceilingMs = maxMs;
+	return (uint32_t)((uint64_t)nextRandom(connection) * ceilingMs / UINT32_MAX);
+}
+
+uint32_t HubConnection_Failed(HubConnection* connection, HubConnectionReason reason, uint32_t now)
+{
+	if (connection->failures < UINT8_MAX)
+		connection->failures++;
+	connection->lastReason = (uint8_t)reason;
+	connection->reasons[reason]++;
+	connection->backoffMs = drawBackoff(connection, reason);
+	connection->retryMs = now + connection->backoffMs;
+	setState(connection, HUB_CONNECTION_IDLE, now);
+	return connection->backoffMs;
+}
+
+void HubConnection_Lost(HubConnection* connection, HubConnectionReason reason, uint32_t now)
+{
+	if (connection->state != HUB_CONNECTION_CONNECTED)
+		return;
+	connection->breaks++;
+	connection->lastReason = (uint8_t)reason;
+	connection->reasons[reason]++;
+	//waits like a first failed attempt, so that doors which lost the hub together don't all come back at once
+	connection->failures = 1;
+	connection->backoffMs = drawBackoff(connection, reason);
+	connection->retryMs = now + connection->backoffMs;
+	setState(connection, HUB_CONNECTION_IDLE, now);
+}
+
+uint64_t HubConnection_ConnectedMs(const HubConnection* connection, uint32_t now)
+{
+	uint64_t connectedMs = connection->connectedMs;
+	if (connection->state == HUB_CONNECTION_CONNECTED)
+		connectedMs += now - connection->changedMs;
+	return connectedMs;
+}
+
+const char* HubConnection_StateName(HubConnectionState state)
+{
+	return stateNames[state];
+}
+
+const char* HubConnection_ReasonName(HubConnectionReason reason)
+{
+	return reasonNames[reason];
+}
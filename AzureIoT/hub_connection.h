@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// When the IoT Hub client connects, and what happened to its connections. Failed attempts are
+// retried with full-jitter exponential backoff: the wait is drawn uniformly between 0 and a
+// ceiling that doubles with each failure, so locks that lost the hub together don't come back
+// together. Transient failures start from a ceiling of a few seconds, credential failures,
+// which a retry rarely fixes, from minutes. A connection that breaks waits like a first failure.
+// The times are the caller's milliseconds; the state machine does no I/O.
+
+typedef enum HubConnectionState {
+	HUB_CONNECTION_IDLE,//no client, connects once the network is up and retryMs has come
+	HUB_CONNECTION_CONNECTING,//provisioning
+	HUB_CONNECTION_CONNECTED
+} HubConnectionState;
+
+// Why an attempt failed or a connection broke.
+typedef enum HubConnectionReason {
+	HUB_REASON_NO_NETWORK,
+	HUB_REASON_COMMUNICATION,//the hub can't be reached, or the connection broke
+	HUB_REASON_EXPIRED_TOKEN,//the SAS token expired, a new client gets a new one
+	HUB_REASON_DEVICE_AUTH,//the device certificate isn't ready yet, after boot
+	HUB_REASON_CREDENTIAL,//bad credential, disabled device or invalid scope: retried slowly
+	HUB_REASON_OTHER,
+	HUB_REASON_COUNT
+} HubConnectionReason;
+
+typedef struct HubConnection {
+	uint8_t state;//HubConnectionState
+	uint8_t failures;//attempts failed in a row
+	uint8_t lastReason;//HubConnectionReason of the last failure or break
+	uint32_t random;//xorshift state of the backoff
+	uint32_t changedMs;//when the state last changed
+	uint32_t retryMs;//idle: no attempt before
+	uint32_t backoffMs;//wait drawn after the last failure
+	uint32_t attempts;
+	uint32_t connects;
+	uint32_t breaks;//connections lost after they were made
+	uint64_t connectedMs;//time connected, not counting the current connection
+	uint32_t reasons[HUB_REASON_COUNT];//failures and breaks by reason
+} HubConnection;
+
+// `seed` should differ between devices, any value does.
+void HubConnection_Init(HubConnection* connection, uint32_t seed, uint32_t now);
+
+// Whether to start an attempt now; the caller checks the network.
+bool HubConnection_ShouldConnect(const HubConnection* connection, uint32_t now);
+
+void HubConnection_Connecting(HubConnection* connection, uint32_t now);
+void HubConnection_Connected(HubConnection* connection, uint32_t now);
+
+// The attempt failed; returns the milliseconds until the next one.
+uint32_t HubConnection_Failed(HubConnection* connection, HubConnectionReason reason, uint32_t now);
+
+// The connection broke. Ignored unless connected.
+void HubConnection_Lost(HubConnection* connection, HubConnectionReason reason, uint32_t now);
+
+// Time connected in total, the current connection included.
+uint64_t HubConnection_ConnectedMs(const HubConnection* connection, uint32_t now);
+
+// Names for logs and counters.
+const char* HubConnection_StateName(HubConnectionState state);
+const char* HubConnection_ReasonName(HubConnectionReason reason);
@@ -0,0 +1,230 @@
+#include "json_reader.h"
+
+#include <limits.h>
+#include <string.h>
+
+static int fail(JsonReader* reader)
+{
+	reader->error = true;
+	return -1;
+}
+
+static void skipSpace(JsonReader* reader)
+{
+	while (reader->at < reader->end && (*reader->at == ' ' || *reader->at == '\t' || *reader->at == '\n' || *reader->at == '\r'))
+		reader->at++;
+}
+
+// Steps over the string starting at the reader's quote and returns where its content ends.
+static const char* skipString(JsonReader* reader)
+{
+	const char* c = reader->at + 1;
+	while (c < reader->end && *c != '"') {
+		if (*c == '\\')
+			c++;
+		c++;
+	}
+	if (c >= reader->end)
+		return NULL;
+	reader->at = c + 1;
+	return c;
+}
+
+static bool isNumberChar(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+void JsonReader_Init(JsonReader* reader, const char* json, size_t length)
+{
+	reader->at = json;
+	reader->end = json + length;
+	reader->error = false;
+	reader->first = false;
+}
+
+char JsonReader_Peek(JsonReader* reader)
+{
+	skipSpace(reader);
+	if (reader->error || reader->at == reader->end)
+		return 0;
+	return *reader->at;
+}
+
+int JsonReader_BeginObject(JsonReader* reader)
+{
+	if (JsonReader_Peek(reader) != '{')
+		return fail(reader);
+	reader->at++;
+	reader->first = true;
+	return 0;
+}
+
+int JsonReader_NextMember(JsonReader* reader, const char** key, size_t* keyLength)
+{
+	char c = JsonReader_Peek(reader);
+	if (c == '}') {
+		reader->at++;
+		reader->first = false;//back in the enclosing object, which has had a member
+		return 0;
+	}
+	if (!reader->first) {
+		if (c != ',')
+			return fail(reader);
+		reader->at++;
+		c = JsonReader_Peek(reader);
+	}
+	if (c != '"')
+		return fail(reader);
+	*key = reader->at + 1;
+	const char* keyEnd = skipString(reader);
+	if (keyEnd == NULL || JsonReader_Peek(reader) != ':')
+		return fail(reader);
+	*keyLength = (size_t)(keyEnd - *key);
+	reader->at++;
+	reader->first = false;
+	return 1;
+}
+
+int JsonReader_Skip(JsonReader* reader)
+{
+	char c = JsonReader_Peek(reader);
+	if (c == '"')
+		return skipString(reader) != NULL ? 0 : fail(reader);
+	if (c == '{' || c == '[') {
+		//brackets are counted without telling them apart, the caller doesn't look inside
+		unsigned int depth = 0;
+		do {
+			if (*reader->at == '"') {
+				if (skipString(reader) == NULL)
+					return fail(reader);
+				continue;
+			}
+			if (*reader->at == '{' || *reader->at == '[')
+				depth++;
+			else if (*reader->at == '}' || *reader->at == ']')
+				depth--;
+			reader->at++;
+		} while (depth > 0 && reader->at < reader->end);
+		return depth == 0 ? 0 : fail(reader);
+	}
+	if (c == 't' || c == 'f') {
+		bool value;
+		return JsonReader_Bool(reader, &value);
+	}
+	if (c == 'n') {
+		if (reader->end - reader->at < 4 || memcmp(reader->at, "null", 4) != 0)
+			return fail(reader);
+		reader->at += 4;
+		return 0;
+	}
+	if (c != '-' && (c < '0' || c > '9'))
+		return fail(reader);
+	while (reader->at < reader->end && isNumberChar(*reader->at))
+		reader->at++;
+	return 0;
+}
+
+int JsonReader_Bool(JsonReader* reader, bool* value)
+{
+	char c = JsonReader_Peek(reader);
+	size_t left = (size_t)(reader->end - reader->at);
+	if (c == 't' && left >= 4 && memcmp(reader->at, "true", 4) == 0) {
+		reader->at += 4;
+		*value = true;
+		return 0;
+	}
+	if (c == 'f' && left >= 5 && memcmp(reader->at, "false", 5) == 0) {
+		reader->at += 5;
+		*value = false;
+		return 0;
+	}
+	return fail(reader);
+}
+
+int JsonReader_Int(JsonReader* reader, int64_t* value)
+{
+	char c = JsonReader_Peek(reader);
+	bool negative = c == '-';
+	if (negative)
+		reader->at++;
+	if (reader->at == reader->end || *reader->at < '0' || *reader->at > '9')
+		return fail(reader);
+	uint64_t magnitude = 0;
+	while (reader->at < reader->end && *reader->at >= '0' && *reader->at <= '9') {
+		unsigned int digit = (unsigned int)(*reader->at++ - '0');
+		if (magnitude > (UINT64_MAX - digit) / 10 || magnitude * 10 + digit > (uint64_t)INT64_MAX + negative)
+			return fail(reader);
+		magnitude = magnitude * 10 + digit;
+	}
+	//a fraction or exponent is dropped
+	while (reader->at < reader->end && isNumberChar(*reader->at))
+		reader->at++;
+	*value = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+	return 0;
+}
+
+static int hexDigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int JsonReader_String(JsonReader* reader, char* buffer, size_t size)
+{
+	if (JsonReader_Peek(reader) != '"' || size == 0)
+		return fail(reader);
+	const char* c = reader->at + 1;
+	size_t length = 0;
+	size_t total = 0;//unescaped, with what didn't fit
+	while (c < reader->end && *c != '"') {
+		char out = *c++;
+		if (out == '\\') {
+			if (c == reader->end)
+				return fail(reader);
+			switch (*c++) {
+			case '"': out = '"'; break;
+			case '\\': out = '\\'; break;
+			case '/': out = '/'; break;
+			case 'b': out = '\b'; break;
+			case 'f': out = '\f'; break;
+			case 'n': out = '\n'; break;
+			case 'r': out = '\r'; break;
+			case 't': out = '\t'; break;
+			case 'u': {
+				int code = 0;
+				for (int i = 0; i < 4; i++) {
+					int digit = c < reader->end ? hexDigit(*c++) : -1;
+					if (digit < 0)
+						return fail(reader);
+					code = code << 4 | digit;
+				}
+				out = code < 0x80 ? (char)code : '?';
+				break;
+			}
+			default:
+				return fail(reader);
+			}
+		}
+		if (length + 1 < size)
+			buffer[length++] = out;
+		total++;
+	}
+	if (c >= reader->end)
+		return fail(reader);
+	buffer[length] = '\0';
+	reader->at = c + 1;
+	return total > INT_MAX ? INT_MAX : (int)total;
+}
+
+int JsonReader_Finish(JsonReader* reader)
+{
+	if (JsonReader_Peek(reader) != 0 || reader->error)
+		return fail(reader);
+	return 0;
+}
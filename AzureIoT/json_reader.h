@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Forward-only JSON reader over a buffer the caller owns, the counterpart of json_writer.h. It
+// needs no terminator and allocates nothing: objects are walked member by member and values the
+// caller doesn't want are skipped without being decoded. Keys are handed out as they appear in
+// the buffer, still escaped. Once the JSON turns out malformed, the reader is marked as failed
+// and every later call returns -1.
+
+typedef struct JsonReader {
+	const char* at;//next byte to read
+	const char* end;
+	bool error;
+	bool first;//the object entered last has no member read yet
+} JsonReader;
+
+// Starts reading `length` bytes of `json`.
+void JsonReader_Init(JsonReader* reader, const char* json, size_t length);
+
+// Enters the object that is the next value. Returns 0, or -1 if the next value isn't an object.
+int JsonReader_BeginObject(JsonReader* reader);
+
+// Moves to the next member of the object entered last and returns 1 with its key, the next value
+// is the member's. Returns 0 after the closing brace, and -1 if the JSON is malformed.
+int JsonReader_NextMember(JsonReader* reader, const char** key, size_t* keyLength);
+
+// The first character of the next value: '{', '[', '"', 't', 'f', 'n', '-' or a digit, 0 at
+// the end of the buffer.
+char JsonReader_Peek(JsonReader* reader);
+
+// Each call reads the next value and returns 0, or -1 if it isn't of that type.
+int JsonReader_Skip(JsonReader* reader);
+int JsonReader_Bool(JsonReader* reader, bool* value);
+// The integer part of a number.
+int JsonReader_Int(JsonReader* reader, int64_t* value);
+// Unescapes a string into `size` bytes of `buffer`, cut to fit and terminated. Characters
+// beyond ASCII written as \u escapes become '?'. Returns the unescaped length, which is
+// `size` or more if the string was cut, or -1.
+int JsonReader_String(JsonReader* reader, char* buffer, size_t size);
+
+// Returns 0 if nothing but whitespace is left, else -1.
+int JsonReader_Finish(JsonReader* reader);
@@ -0,0 +1,265 @@
+#include "json_writer.h"
+
+#include <string.h>
+
+static void put(JsonWriter* writer, const char* data, size_t length)
+{
+	if (writer->overflow)
+		return;
+	if (length >= writer->size - writer->length) {
+		writer->overflow = true;
+		return;
+	}
+	memcpy(writer->buffer + writer->length, data, length);
+	writer->length += length;
+	writer->buffer[writer->length] = '\0';
+}
+
+static void putChar(JsonWriter* writer, char c)
+{
+	put(writer, &c, 1);
+}
+
+static void putString(JsonWriter* writer, const char* value)
+{
+	static const char hex[] = "0123456789abcdef";
+	putChar(writer, '"');
+	const char* run = value;// characters that need no escape are copied a run at a time
+	for (const char* c = value; *c; c++) {
+		unsigned char u = (unsigned char)*c;
+		if (u >= 0x20 && u != '"' && u != '\\')
+			continue;
+		put(writer, run, (size_t)(c - run));
+		run = c + 1;
+		char escape[6] = { '\\', 0 };
+		size_t length = 2;
+		switch (u) {
+		case '"': escape[1] = '"'; break;
+		case '\\': escape[1] = '\\'; break;
+		case '\n': escape[1] = 'n'; break;
+		case '\r': escape[1] = 'r'; break;
+		case '\t': escape[1] = 't'; break;
+		case '\b': escape[1] = 'b'; break;
+		case '\f': escape[1] = 'f'; break;
+		default:
+			memcpy(escape + 1, "u00", 3);
+			escape[4] = hex[u >> 4];
+			escape[5] = hex[u & 0x0F];
+			length = 6;
+			break;
+		}
+		put(writer, escape, length);
+	}
+	put(writer, run, strlen(run));
+	putChar(writer, '"');
+}
+
+static int status(const JsonWriter* writer)
+{
+	return writer->overflow ? -1 : 0;
+}
+
+// Writes the comma before the next member of the open object or array, and its key.
+static int beginMember(JsonWriter* writer, const char* key)
+{
+	if (writer->overflow)
+		return -1;
+	uint8_t bit = (uint8_t)(1u << (writer->depth > 0 ? writer->depth - 1 : 0));
+	if (writer->depth == 0 && writer->length > 0) {
+		writer->overflow = true;// a second top-level value
+		return -1;
+	}
+	if (writer->depth > 0 && (writer->hasMembers & bit))
+		putChar(writer, ',');
+	writer->hasMembers |= bit;
+	if (key != NULL) {
+		putString(writer, key);
+		putChar(writer, ':');
+	}
+	return status(writer);
+}
+
+static int openContainer(JsonWriter* writer, const char* key, char bracket)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	if (writer->depth == JSON_WRITER_MAX_DEPTH) {
+		writer->overflow = true;
+		return -1;
+	}
+	putChar(writer, bracket);
+	writer->depth++;
+	writer->hasMembers &= (uint8_t)~(1u << (writer->depth - 1));
+	return status(writer);
+}
+
+static int closeContainer(JsonWriter* writer, char bracket)
+{
+	if (writer->overflow)
+		return -1;
+	if (writer->depth == 0) {
+		writer->overflow = true;
+		return -1;
+	}
+	writer->depth--;
+	putChar(writer, bracket);
+	return status(writer);
+}
+
+void JsonWriter_Init(JsonWriter* writer, char* buffer, size_t size)
+{
+	writer->buffer = buffer;
+	writer->size = size;
+	writer->length = 0;
+	writer->overflow = size == 0;
+	writer->depth = 0;
+	writer->hasMembers = 0;
+	if (size > 0)
+		buffer[0] = '\0';
+}
+
+int JsonWriter_BeginObject(JsonWriter* writer, const char* key)
+{
+	return openContainer(writer, key, '{');
+}
+
+int JsonWriter_EndObject(JsonWriter* writer)
+{
+	return closeContainer(writer, '}');
+}
+
+int JsonWriter_BeginArray(JsonWriter* writer, const char* key)
+{
+	return openContainer(writer, key, '[');
+}
+
+int JsonWriter_EndArray(JsonWriter* writer)
+{
+	return closeContainer(writer, ']');
+}
+
+int JsonWriter_String(JsonWriter* writer, const char* key, const char* value)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	putString(writer, value);
+	return status(writer);
+}
+
+int JsonWriter_StringFill(JsonWriter* writer, const char* key, size_t (*fill)(char* buffer, size_t capacity))
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	putChar(writer, '"');
+	if (writer->overflow)
+		return -1;
+	size_t room = writer->size - writer->length;// with the terminator
+	size_t length = fill(writer->buffer + writer->length, room);
+	if (length >= room) {
+		writer->buffer[writer->length] = '\0';
+		writer->overflow = true;
+		return -1;
+	}
+	writer->length += length;
+	writer->buffer[writer->length] = '\0';
+	putChar(writer, '"');
+	return status(writer);
+}
+
+// Writes the digits of `value` backwards from `end`, returns where they start.
+static char* formatUint(char* end, uint64_t value)
+{
+	char* at = end;
+	do {
+		*--at = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+	return at;
+}
+
+int JsonWriter_Uint(JsonWriter* writer, const char* key, uint64_t value)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	char digits[20];
+	char* start = formatUint(digits + sizeof(digits), value);
+	put(writer, start, (size_t)(digits + sizeof(digits) - start));
+	return status(writer);
+}
+
+int JsonWriter_Int(JsonWriter* writer, const char* key, int64_t value)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	char digits[21];
+	uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	char* start = formatUint(digits + sizeof(digits), magnitude);
+	if (value < 0)
+		*--start = '-';
+	put(writer, start, (size_t)(digits + sizeof(digits) - start));
+	return status(writer);
+}
+
+int JsonWriter_Bool(JsonWriter* writer, const char* key, bool value)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	if (value)
+		put(writer, "true", 4);
+	else
+		put(writer, "false", 5);
+	return status(writer);
+}
+
+static void putDigits(char* at, unsigned int value, int count)
+{
+	while (count-- > 0) {
+		at[count] = (char)('0' + value % 10);
+		value /= 10;
+	}
+}
+
+int JsonWriter_Timestamp(JsonWriter* writer, const char* key, uint64_t epochMs)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	uint64_t seconds = epochMs / 1000;
+	unsigned int secondOfDay = (unsigned int)(seconds % 86400);
+
+	// Days since 1970-01-01 to a proleptic Gregorian date, in 400-year eras from 0000-03-01.
+	int64_t days = (int64_t)(seconds / 86400) + 719468;
+	int64_t era = days / 146097;
+	unsigned int dayOfEra = (unsigned int)(days - era * 146097);
+	unsigned int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	unsigned int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+	unsigned int monthIndex = (5 * dayOfYear + 2) / 153;// 0 is March
+	unsigned int day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+	unsigned int month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+	unsigned int year = (unsigned int)(yearOfEra + era * 400) + (month <= 2);
+
+	char text[26] = "\"0000-00-00T00:00:00.000Z\"";
+	putDigits(text + 1, year, 4);
+	putDigits(text + 6, month, 2);
+	putDigits(text + 9, day, 2);
+	putDigits(text + 12, secondOfDay / 3600, 2);
+	putDigits(text + 15, secondOfDay / 60 % 60, 2);
+	putDigits(text + 18, secondOfDay % 60, 2);
+	putDigits(text + 21, (unsigned int)(epochMs % 1000), 3);
+	put(writer, text, sizeof(text));
+	return status(writer);
+}
+
+int JsonWriter_Raw(JsonWriter* writer, const char* key, const char* json)
+{
+	if (beginMember(writer, key) < 0)
+		return -1;
+	put(writer, json, strlen(json));
+	return status(writer);
+}
+
+int JsonWriter_Finish(const JsonWriter* writer)
+{
+	if (writer->overflow || writer->depth != 0)
+		return -1;
+	return (int)writer->length;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only JSON writer over storage the caller owns: it never allocates. Members are
+// written as key/value calls, and nested objects and arrays keep their own comma state up to
+// JSON_WRITER_MAX_DEPTH levels. Strings are escaped. Once something doesn't fit, the writer
+// is marked as overflowed and writes nothing more, so a caller can write a whole document
+// and check once; the buffer then holds a prefix that is still terminated but not valid JSON.
+// A key is NULL for an array element or the top-level value.
+
+#define JSON_WRITER_MAX_DEPTH 8
+
+typedef struct JsonWriter {
+	char* buffer;
+	size_t size;//of buffer, including the terminator
+	size_t length;//bytes written, buffer[length] is '\0'
+	bool overflow;//something didn't fit, or the nesting was wrong
+	uint8_t depth;//open objects and arrays
+	uint8_t hasMembers;//bit per depth: the next member needs a comma
+} JsonWriter;
+
+// Starts an empty document in `size` bytes of `buffer`.
+void JsonWriter_Init(JsonWriter* writer, char* buffer, size_t size);
+
+// Each call returns 0, or -1 if the writer has overflowed.
+int JsonWriter_BeginObject(JsonWriter* writer, const char* key);
+int JsonWriter_EndObject(JsonWriter* writer);
+int JsonWriter_BeginArray(JsonWriter* writer, const char* key);
+int JsonWriter_EndArray(JsonWriter* writer);
+int JsonWriter_String(JsonWriter* writer, const char* key, const char* value);
+int JsonWriter_Int(JsonWriter* writer, const char* key, int64_t value);
+int JsonWriter_Uint(JsonWriter* writer, const char* key, uint64_t value);
+int JsonWriter_Bool(JsonWriter* writer, const char* key, bool value);
+// A string that `fill` writes in place, for long content that needs no escaping such as
+// base64. `fill` is given the room left, terminator included, and returns the bytes written,
+// or the room if they don't fit.
+int JsonWriter_StringFill(JsonWriter* writer, const char* key, size_t (*fill)(char* buffer, size_t capacity));
+// Milliseconds since the Unix epoch as an ISO 8601 UTC string, "2019-10-16T15:26:31.000Z".
+int JsonWriter_Timestamp(JsonWriter* writer, const char* key, uint64_t epochMs);
+// `json` is written as it is, it must be a valid JSON value.
+int JsonWriter_Raw(JsonWriter* writer, const char* key, const char* json);
+
+// Returns the length of the finished document, or -1 if it overflowed or an object or
+// array is still open.
+int JsonWriter_Finish(const JsonWriter* writer);
@@ -50,20 +50,13 @@ int cleanupKeyboard()
 }
 
 /**
-* Wait given amount of microseconds
+* Scans the keypad and reports a key once when it goes down.
 *
-* @param us Number of microseconds to wait.
+* @param keyHeld whether a key was down on the previous scan, updated by the call.
+* @param c set to the pressed key, left unchanged if there is no new key press.
 */
-static void wait(int us)
+int checkForKeyPress(bool* keyHeld, char* c)
 {
-	const struct timespec sleepTime = { 0, 1000 * us };
-	nanosleep(&sleepTime, NULL);
-}
-
-int checkForKeyPress(char* c)
-{
-	static bool keyPressedAlready = false;
-
 	for (int i = 0; i < 4; i++)
 	{
 		int result = GPIO_SetValue(columnPinsFds[i], GPIO_Value_Low);
@@ -83,11 +76,11 @@ int checkForKeyPress(char* c)
 				if (result < 0)
 					return -1;
 
-				if (keyPressedAlready)
+				if (*keyHeld)
 					return 0;
 
 				*c = matrix[j][i];
-				keyPressedAlready = true;
+				*keyHeld = true;
 				return 0;
 			}
 
@@ -97,6 +90,6 @@ int checkForKeyPress(char* c)
 			return -1;
 	}
 
-	keyPressedAlready = false;
+	*keyHeld = false;
 	return 0;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+
 int initKeyboard();
 int cleanupKeyboard();
 
-int checkForKeyPress(char* c);
+int checkForKeyPress(bool* keyHeld, char* c);
@@ -0,0 +1,843 @@
+#include "lock.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "applibs_versions.h"
+#include <applibs/log.h>
+#include <applibs/gpio.h>
+#include <applibs/storage.h>
+
+#include <hw/sample_hardware.h>
+
+#include "epoll_timerfd_utilities.h"
+
+#include "display.h"
+#include "keyboard.h"
+#include "screens.h"
+#include "lock_twin.h"
+#include "trace.h"
+
+static int step(LockContext* ctx, const LockEvent* event);//runs one event through the core and performs its effects
+static int perform(LockContext* ctx, const LockEffects* effects);
+static void registerMethods(LockContext* ctx);//fills the lock's direct method table
+static uint32_t countFields(uint32_t fields);
+static int run(LockContext* ctx);
+static void registerMetrics(LockContext* ctx);
+static void countTelemetry(LockContext* ctx, uint8_t code);
+static void sampleQueues(LockContext* ctx);
+static void publishMetrics(LockContext* ctx, uint32_t now);
+static bool restoreConfig(LockContext* ctx);
+static const LockTwin* startTwin(const LockContext* ctx, LockTwin* twin);//the restored configuration for LOCK_EVENT_START, or NULL
+static GPIO_Value_Type startRelayLevel(const LockContext* ctx);
+static void noteConfig(LockContext* ctx);//starts the save delay when the configuration changed
+static void saveConfig(LockContext* ctx);
+
+static uint32_t getTimeMs();//returns system time in milliseconds
+static uint32_t getTimeUs(void);//monotonic, for durations
+static uint32_t getMonotonicMs(void);//same in milliseconds, for times that must not follow clock steps
+
+static int isDoorOpen(LockContext* ctx, bool *v);//set given bool to true if door sensor returns open
+
+//gpio
+static const int doorLockPin = MT3620_GPIO0;
+static const int doorSensorPin = MT3620_GPIO42;
+static const int alarmPin = MT3620_GPIO29;
+
+//indexed by LockScreen
+static int (*const screenDrawers[])() = {
+	[LOCK_SCREEN_WAIT] = drawWait,
+	[LOCK_SCREEN_ALARM] = drawAlarm,
+	[LOCK_SCREEN_BLANK] = drawBlank,
+	[LOCK_SCREEN_LOCKED] = drawLocked,
+	[LOCK_SCREEN_UNLOCKED] = drawUnlocked,
+	[LOCK_SCREEN_BLOCK_LOCK] = drawBlockLock,
+	[LOCK_SCREEN_CONFIG] = drawConfig,
+	[LOCK_SCREEN_CHANGE_PASSWORD] = drawChangePassword,
+	[LOCK_SCREEN_CHANGE_LOCK_MODE] = drawChangeLockMode,
+	[LOCK_SCREEN_CHANGE_CONTACT_MODE] = drawChangeContactMode,
+	[LOCK_SCREEN_CHANGE_MONO_SWITCH_TIME] = drawChangeMonoSwitchTime,
+	[LOCK_SCREEN_CHANGE_DISPLAY_MODE] = drawChangeDisplayMode,
+	[LOCK_SCREEN_FACTORY_RESET] = drawFactoryReset
+};
+
+static const char* const bootStageNames[LOCK_BOOT_STAGES] = {
+	[LOCK_BOOT_LOCKED] = "Locked",
+	[LOCK_BOOT_KEYPAD] = "Keypad",
+	[LOCK_BOOT_DISPLAY] = "Display",
+	[LOCK_BOOT_CLOUD] = "Cloud"
+};
+
+//indexed by LockTelemetryLane
+static const TelemetryLane telemetryLanes[] = {
+	[LOCK_TELEMETRY_CRITICAL] = TELEMETRY_LANE_CRITICAL,
+	[LOCK_TELEMETRY_OPERATIONAL] = TELEMETRY_LANE_OPERATIONAL,
+	[LOCK_TELEMETRY_DIAGNOSTIC] = TELEMETRY_LANE_DIAGNOSTIC
+};
+
+static const uint32_t doorOpenMsBounds[] = { 2000, 5000, 10000, 30000, 60000, 300000, 900000 };
+static const uint32_t unlockUsBounds[] = { 100, 500, 1000, 5000, 10000, 50000, 100000 };
+static const uint32_t runUsBounds[] = { 50, 100, 500, 1000, 5000, 10000, 50000 };
+
+//until the twin sets MetricsInterval
+static const uint32_t defaultMetricsIntervalMs = 300000;
+
+//a menu session or a twin that changes several settings is saved once, sparing the flash
+static const uint32_t configSaveDelayMs = 5000;
+
+void Lock_InitContext(LockContext* ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->bootMs = getMonotonicMs();
+	LockCore_Init(&ctx->core);
+	ctx->doorLockFd = -1;
+	ctx->doorSensorFd = -1;
+	ctx->alarmFd = -1;
+	ctx->configStore.fd = -1;
+	InitAzureClient(&ctx->azure, ctx);
+	registerMetrics(ctx);
+	//a keypad brute force sends a few warnings a minute and a count of the rest
+	LimitTelemetry(&ctx->azure, "ConfigWarning", 3, 20000);
+	LimitTelemetry(&ctx->azure, "LockWarning", 1, 60000);
+}
+
+int Lock_Open(LockContext* ctx)
+{
+	restoreConfig(ctx);
+
+	ctx->doorSensorFd = GPIO_OpenAsInput(doorSensorPin);
+	if (ctx->doorSensorFd < 0){
+		return -1;
+	}
+
+	ctx->doorLockFd = GPIO_OpenAsOutput(doorLockPin, GPIO_OutputMode_OpenDrain, startRelayLevel(ctx));
+	if (ctx->doorLockFd < 0) {
+		return -1;
+	}
+
+	ctx->alarmFd = GPIO_OpenAsOutput(alarmPin, GPIO_OutputMode_OpenDrain, GPIO_Value_Low);
+	if (ctx->alarmFd < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int Lock_OpenConfigStore(LockContext* ctx)
+{
+	int fd = Storage_OpenMutableFile();
+	if (fd < 0) {
+		Log_Debug("ERROR: Could not open mutable storage for the configuration: %s (%d).\n", strerror(errno), errno);
+		return -1;
+	}
+	return ConfigStore_Open(&ctx->configStore, fd, LOCK_CONFIG_OFFSET);
+}
+
+int Lock_Start(LockContext* ctx)
+{
+	ctx->startMs = getMonotonicMs();
+	registerMethods(ctx);
+	LockTwin saved;
+	LockEvent event = { .type = LOCK_EVENT_START, .twin = startTwin(ctx, &saved) };
+	if (step(ctx, &event) < 0)
+		return -1;
+	Lock_BootStage(ctx, LOCK_BOOT_LOCKED);
+	return 0;
+}
+
+void Lock_DisplayReady(LockContext* ctx)
+{
+	ctx->displayReady = true;
+	if (ctx->screenPending)
+		screenDrawers[ctx->pendingScreen]();
+	ctx->screenPending = false;
+	Lock_BootStage(ctx, LOCK_BOOT_DISPLAY);
+}
+
+void Lock_BootStage(LockContext* ctx, LockBootStage stage)
+{
+	if (ctx->bootStages & (1u << stage))
+		return;
+	ctx->bootStages |= (uint8_t)(1u << stage);
+	ctx->bootStageMs[stage] = getMonotonicMs() - ctx->bootMs;
+	Log_Debug("INFO: boot stage %s reached %u ms after boot.\n", bootStageNames[stage], ctx->bootStageMs[stage]);
+}
+
+int Lock_Run(LockContext* ctx)
+{
+	uint32_t startUs = getTimeUs();
+	int result = run(ctx);
+	sampleQueues(ctx);
+	Metrics_Observe(&ctx->metrics, ctx->metricIds.runTime, getTimeUs() - startUs);
+	publishMetrics(ctx, getTimeMs());
+	if (ctx->configDirty && getMonotonicMs() - ctx->configChangedMs >= configSaveDelayMs)
+		saveConfig(ctx);
+	return result;
+}
+
+static int run(LockContext* ctx)
+{
+	FlushDueUpdates(&ctx->azure);
+
+	if (!ctx->core.synced)//no configuration yet, neither saved nor from azure, so don't do nothing
+		return 0;
+
+	LockEvent event = { .type = LOCK_EVENT_TICK };
+	if (isDoorOpen(ctx, &event.doorOpen) < 0)
+		return -1;
+	Trace_RecordDoor(event.doorOpen);
+
+	if (checkForKeyPress(&ctx->keyHeld, &event.key) < 0) {
+		return -1;
+	}
+	uint32_t keyUs = 0;
+	if (event.key)
+	{
+		keyUs = getTimeUs();
+		Log_Debug("key pressed: %c\n", event.key);
+		Trace_RecordKey(event.key);
+	}
+
+	ctx->unlocked = false;
+	int result = step(ctx, &event);
+	if (event.key && ctx->unlocked)
+		Metrics_Observe(&ctx->metrics, ctx->metricIds.unlockLatency, ctx->unlockUs - keyUs);
+	return result;
+}
+
+void Lock_Close(LockContext* ctx)
+{
+	if (ctx->configDirty)
+		saveConfig(ctx);
+	ConfigStore_Close(&ctx->configStore);
+	CloseFdAndPrintError(ctx->doorSensorFd, "DoorSensor");
+	CloseFdAndPrintError(ctx->alarmFd, "Alarm");
+	CloseFdAndPrintError(ctx->doorLockFd, "Lock");
+	ctx->doorSensorFd = ctx->alarmFd = ctx->doorLockFd = -1;
+}
+
+static int step(LockContext* ctx, const LockEvent* event)
+{
+	LockEffects effects;
+
+	LockCore_Step(&ctx->core, event, getTimeMs(), &effects);
+	int result = perform(ctx, &effects);
+	//the keypad is read from the next tick on
+	if (!ctx->operational && ctx->core.synced) {
+		ctx->operational = true;
+		ctx->operationalMs = getMonotonicMs() - ctx->startMs;
+		Log_Debug("INFO: operational %u ms after start, on the %s configuration.\n", ctx->operationalMs,
+			ctx->configRestored ? "saved" : "twin's");
+	}
+	//a tick changes the configuration only through the keypad menus
+	if (event->type != LOCK_EVENT_TICK || event->key)
+		noteConfig(ctx);
+	return result;
+}
+
+//carries out the effects in the order the core made them
+//returns -1 if a relay couldn't be set, the remaining effects are still performed
+static int perform(LockContext* ctx, const LockEffects* effects)
+{
+	int result = 0;
+	for (int i = 0; i < effects->count; i++)
+	{
+		const LockEffect* effect = &effects->items[i];
+		switch (effect->type)
+		{
+		case LOCK_EFFECT_LOCK:
+		case LOCK_EFFECT_UNLOCK:
+			if (GPIO_SetValue(ctx->doorLockFd, effect->value ? GPIO_Value_High : GPIO_Value_Low))
+				result = -1;
+			Trace_RecordFlag(TRACE_OUT_LOCK, effect->type == LOCK_EFFECT_LOCK);
+			if (effect->type == LOCK_EFFECT_UNLOCK)
+			{
+				ctx->unlocked = true;
+				ctx->unlockUs = getTimeUs();
+			}
+			break;
+		case LOCK_EFFECT_ALARM:
+			Trace_RecordFlag(TRACE_OUT_ALARM, effect->value);
+			if (GPIO_SetValue(ctx->alarmFd, effect->value ? GPIO_Value_High : GPIO_Value_Low))
+				result = -1;
+			break;
+		case LOCK_EFFECT_DRAW:
+			//before the display is up only the last screen matters
+			if (ctx->displayReady)
+			{
+				screenDrawers[effect->value]();
+			}
+			else
+			{
+				ctx->screenPending = true;
+				ctx->pendingScreen = effect->value;
+			}
+			break;
+		case LOCK_EFFECT_REPORT:
+			TwinReportState(&ctx->azure, effect->name, effect->text);
+			break;
+		case LOCK_EFFECT_TELEMETRY:
+			countTelemetry(ctx, effect->value);
+			SendTelemetry(&ctx->azure, effect->value, effect->argument, effect->name, effect->text,
+				telemetryLanes[LockCore_TelemetryEvents[effect->value].lane]);
+			break;
+		case LOCK_EFFECT_LOG:
+			Log_Debug("%s", effect->text);
+			break;
+		}
+	}
+	return result;
+}
+
+static uint32_t getTimeMs()
+{
+	struct timeval te;
+	gettimeofday(&te, NULL); // get current time
+	long long milliseconds = te.tv_sec * 1000LL + te.tv_usec / 1000; // calculate milliseconds
+	// printf("milliseconds: %lld\n", milliseconds);
+	return milliseconds;
+}
+
+static uint32_t getTimeUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+static uint32_t getMonotonicMs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+}
+
+//set given bool to true if door is opened
+//returns 0 or -1 if error
+static int isDoorOpen(LockContext* ctx, bool* v)
+{
+	GPIO_Value_Type val;
+	if (GPIO_GetValue(ctx->doorSensorFd, &val) < 0)
+		return -1;
+
+	if (val == GPIO_Value_High)
+	{
+		*v = true;
+		return 0;
+	}
+	*v = false;
+	return 0;
+}
+
+static int respondOk(JsonWriter* response)
+{
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+static int refuse(JsonWriter* response, const char* reason)
+{
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Error");
+	JsonWriter_String(response, "Error", reason);
+	JsonWriter_EndObject(response);
+	return METHOD_CONFLICT;
+}
+
+static int resetAlarmMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockEvent event = { .type = LOCK_EVENT_RESET_ALARM };
+	step(context, &event);
+	return respondOk(response);
+}
+
+static int factoryResetMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockEvent event = { .type = LOCK_EVENT_FACTORY_RESET };
+	step(context, &event);
+	return respondOk(response);
+}
+
+static size_t fillTrace(char* buffer, size_t capacity)
+{
+	//Trace_DumpBase64 writes nothing into a short buffer
+	return capacity < Trace_DumpBase64Size() ? capacity : Trace_DumpBase64(buffer, capacity);
+}
+
+//trace ring buffer as base64, decode it and pass it to the simulator's --replay
+static int dumpTraceMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)context;
+	(void)payload;
+	(void)size;
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	JsonWriter_StringFill(response, "Trace", fillTrace);
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+//one round trip instead of setting AlwaysOpen and clearing it again
+static int unlockMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockContext* ctx = context;
+	if (!ctx->core.synced)
+		return refuse(response, "Not synced");
+	if (ctx->core.alwaysClosed)
+		return refuse(response, "AlwaysClosed is set");
+	LockEvent event = { .type = LOCK_EVENT_UNLOCK };
+	if (step(ctx, &event) < 0)
+		return METHOD_FAILED;
+	return respondOk(response);
+}
+
+static int lockMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockContext* ctx = context;
+	if (!ctx->core.synced)
+		return refuse(response, "Not synced");
+	if (ctx->core.alwaysOpen)
+		return refuse(response, "AlwaysOpen is set");
+	LockEvent event = { .type = LOCK_EVENT_LOCK };
+	if (step(ctx, &event) < 0)
+		return METHOD_FAILED;
+	return respondOk(response);
+}
+
+static int rejectConfig(JsonWriter* response, const char* reason, const char* property)
+{
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Error");
+	JsonWriter_String(response, "Error", reason);
+	if (property != NULL)
+		JsonWriter_String(response, "Property", property);
+	JsonWriter_EndObject(response);
+	return METHOD_BAD_REQUEST;
+}
+
+//a whole configuration in one call, {"LockMode": "Bistable", "MonoSwitchTime": 10, ...} with
+//the names and values of the reported properties; it is checked in full before anything is
+//applied, and what changed goes out as one reported patch
+static int applyConfigMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	LockContext* ctx = context;
+	LockTwin config;
+	const char* property;
+	if (LockTwin_ParseStrict((const char*)payload, size, LOCK_TWIN_REPORTED_FIELDS, &config, &property) < 0)
+		return rejectConfig(response, property != NULL ? "Invalid value" : "Malformed or unknown property", property);
+	if (!ctx->core.synced)
+		return refuse(response, "Not synced");
+	const char* reason = LockCore_CheckConfig(&ctx->core, &config);
+	if (reason != NULL)
+		return rejectConfig(response, reason, NULL);
+
+	uint32_t changed = countFields(LockCore_ChangedTwinFields(&ctx->core, &config));
+	LockEvent event = { .type = LOCK_EVENT_CONFIG, .twin = &config };
+	if (step(ctx, &event) < 0)
+		return METHOD_FAILED;
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	JsonWriter_Uint(response, "Changed", changed);
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+//what the door is doing and its configuration as reported in the twin, without the passwords
+static int getStatusMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockContext* ctx = context;
+	const LockCore* core = &ctx->core;
+	LockTwin config = {
+		.present = LOCK_TWIN_REPORTED_FIELDS & ~(LOCK_TWIN_USER_PASSWORD | LOCK_TWIN_CONFIG_PASSWORD),
+		.lockMode = core->lockMode,
+		.contactMode = core->contactMode,
+		.displayBacklight = core->displayBacklight,
+		.monoSwitchSeconds = core->monoSwitchTime / 1000
+	};
+
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	JsonWriter_Bool(response, "Synced", core->synced);
+	JsonWriter_Bool(response, "IsLockOpen", core->lockState == OPEN);
+	JsonWriter_Bool(response, "IsDoorOpen", core->doorWasOpen);
+	JsonWriter_Bool(response, "IsAlarm", core->isAlarm);
+	JsonWriter_Bool(response, "AlwaysOpen", core->alwaysOpen);
+	JsonWriter_Bool(response, "AlwaysClosed", core->alwaysClosed);
+	JsonWriter_Bool(response, "KeypadBlocked", core->blockLock);
+	JsonWriter_Bool(response, "Connected", ctx->azure.authenticated);
+	JsonWriter_BeginObject(response, "Config");
+	LockTwin_WriteReported(response, &config);
+	JsonWriter_EndObject(response);
+	JsonWriter_Int(response, "DesiredVersion", ctx->desiredVersion);
+	JsonWriter_Int(response, "ReportedVersion", ctx->reportedVersion);
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+//the depth and drops of the IoT worker's rings; the worker answers it itself, so this runs
+//only without the worker and reports empty rings
+static int getQueueStatsMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockContext* ctx = context;
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	WriteQueueStats(&ctx->azure, response);
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+//the counters LogTelemetryStats logs, the twin update counts, the saved configuration, the
+//milliseconds from boot to each boot stage and the calls of each method
+static int getPerfCountersMethod(void* context, const unsigned char* payload, size_t size, JsonWriter* response)
+{
+	(void)payload;
+	(void)size;
+	LockContext* ctx = context;
+	const LockTwinStats* twin = &ctx->twinStats;
+
+	JsonWriter_BeginObject(response, NULL);
+	JsonWriter_String(response, "Response", "Ok");
+	WriteTelemetryStats(&ctx->azure, response);
+	JsonWriter_BeginObject(response, "Twin");
+	JsonWriter_Uint(response, "Complete", twin->complete);
+	JsonWriter_Uint(response, "Partial", twin->partial);
+	JsonWriter_Uint(response, "Ignored", twin->ignored);
+	JsonWriter_Uint(response, "FieldsRead", twin->fieldsRead);
+	JsonWriter_Uint(response, "FieldsApplied", twin->fieldsApplied);
+	JsonWriter_EndObject(response);
+	JsonWriter_BeginObject(response, "Config");
+	JsonWriter_Bool(response, "Restored", ctx->configRestored);
+	JsonWriter_Uint(response, "OperationalMs", ctx->operationalMs);
+	JsonWriter_Uint(response, "Saves", ctx->configStore.saves);
+	JsonWriter_Uint(response, "SaveFailures", ctx->configStore.failures);
+	JsonWriter_EndObject(response);
+	JsonWriter_BeginObject(response, "Boot");
+	for (int i = 0; i < LOCK_BOOT_STAGES; i++) {
+		if (ctx->bootStages & (1u << i))
+			JsonWriter_Uint(response, bootStageNames[i], ctx->bootStageMs[i]);
+	}
+	JsonWriter_EndObject(response);
+	JsonWriter_BeginObject(response, "Methods");
+	for (int i = 0; i < METHOD_TABLE_SLOTS; i++) {
+		const MethodEntry* entry = &ctx->methods.slots[i];
+		if (entry->name == NULL)
+			continue;
+		JsonWriter_BeginObject(response, entry->name);
+		JsonWriter_Uint(response, "Calls", entry->calls);
+		JsonWriter_Uint(response, "Failures", entry->failures);
+		JsonWriter_EndObject(response);
+	}
+	JsonWriter_Uint(response, "Unknown", ctx->methods.unknownCalls);
+	JsonWriter_EndObject(response);
+	return JsonWriter_EndObject(response) < 0 ? METHOD_FAILED : METHOD_OK;
+}
+
+static void registerMethods(LockContext* ctx)
+{
+	MethodTable* methods = &ctx->methods;
+	MethodTable_Init(methods);
+	MethodTable_Register(methods, "ResetAlarm", resetAlarmMethod, 32);
+	MethodTable_Register(methods, "FactoryReset", factoryResetMethod, 32);
+	MethodTable_Register(methods, "DumpTrace", dumpTraceMethod, TRACE_DUMP_BASE64_MAX_SIZE + 48);
+	MethodTable_Register(methods, "Unlock", unlockMethod, 64);
+	MethodTable_Register(methods, "Lock", lockMethod, 64);
+	MethodTable_Register(methods, "ApplyConfig", applyConfigMethod, 128);
+	MethodTable_Register(methods, "GetStatus", getStatusMethod, 512);
+	MethodTable_Register(methods, "GetPerfCounters", getPerfCountersMethod, 2048);
+	MethodTable_Register(methods, "GetQueueStats", getQueueStatsMethod, 256);
+}
+
+int MethodCallback(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size, void* userContextCallback)
+{
+	Trace_RecordMethod(method_name, payload, size);
+
+	LockContext* ctx = userContextCallback;
+	int status = MethodTable_Call(&ctx->methods, ctx, method_name, payload, size, response, response_size);
+	if (status != METHOD_OK)
+		Log_Debug("WARNING: direct method %s answered %d\n", method_name, status);
+	return status;
+}
+
+static uint32_t countFields(uint32_t fields)
+{
+	uint32_t count = 0;
+	for (; fields != 0; fields &= fields - 1)
+		count++;
+	return count;
+}
+
+//a complete twin comes on every connect, a partial one is a desired-property patch with only
+//the keys that changed and the desired $version it makes, both are read in place by the
+//parser generated from lock_twin.json
+//sections at a $version already applied are skipped, and of the rest only the values that
+//differ from the lock's configuration are applied
+void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
+	size_t payloadSize, void* userContextCallback)
+{
+	LockContext* ctx = userContextCallback;
+
+	Trace_RecordTwin(updateState, payload, payloadSize);
+
+	//the twin is applied even when it can't be parsed, the first one syncs the lock
+	LockTwin twin;
+	LockTwinVersions versions;
+	LockEvent event = { .type = LOCK_EVENT_TWIN, .twin = &twin };
+
+	Log_Debug("%.*s", (int)payloadSize, (const char*)payload);
+
+	if (LockTwin_Parse((const char*)payload, payloadSize, &twin, &versions) < 0) {
+		Log_Debug("WARNING: Cannot parse the string as JSON content.\n");
+		twin.present = 0;
+		goto apply;
+	}
+
+	if (updateState == DEVICE_TWIN_UPDATE_PARTIAL) {
+		ctx->twinStats.partial++;
+		//patches can arrive after the complete twin that already holds them
+		if (versions.desired >= 0 && versions.desired <= ctx->desiredVersion) {
+			Log_Debug("INFO: Twin patch $version %lld is already applied.\n", (long long)versions.desired);
+			ctx->twinStats.ignored++;
+			twin.present = 0;
+			goto apply;
+		}
+		if (versions.desired >= 0)
+			ctx->desiredVersion = versions.desired;
+	}
+	else {
+		ctx->twinStats.complete++;
+		//the complete twin is the hub's truth, so only a version equal to the applied one is
+		//skipped: a lower one means the twin was recreated
+		bool newDesired = versions.desired < 0 || versions.desired != ctx->desiredVersion;
+		bool newReported = versions.reported < 0 || versions.reported != ctx->reportedVersion;
+		if (!newDesired)
+			twin.present &= ~LOCK_TWIN_DESIRED_FIELDS;
+		if (!newReported)
+			twin.present &= ~LOCK_TWIN_REPORTED_FIELDS;
+		if (!newDesired && !newReported)
+			ctx->twinStats.ignored++;
+		if (versions.desired >= 0)
+			ctx->desiredVersion = versions.desired;
+		if (versions.reported >= 0)
+			ctx->reportedVersion = versions.reported;
+	}
+
+	ctx->twinStats.fieldsRead += countFields(twin.present);
+	//the metrics interval is the app's, the core doesn't know it
+	if ((twin.present & LOCK_TWIN_METRICS_INTERVAL) && twin.metricsIntervalSeconds * 1000 != ctx->metrics.intervalMs) {
+		Metrics_SetInterval(&ctx->metrics, twin.metricsIntervalSeconds * 1000);
+		ctx->twinStats.fieldsApplied++;
+		Log_Debug("INFO: metrics summary every %u s\n", twin.metricsIntervalSeconds);
+	}
+	twin.present = LockCore_ChangedTwinFields(&ctx->core, &twin);
+	ctx->twinStats.fieldsApplied += countFields(twin.present);
+
+apply:
+	//once synced, a twin that changes nothing has nothing to do
+	if (!ctx->core.synced || twin.present != 0)
+		step(ctx, &event);
+	//the $versions and the metrics interval are saved too
+	noteConfig(ctx);
+}
+
+static void registerMetrics(LockContext* ctx)
+{
+	Metrics* metrics = &ctx->metrics;
+	Metrics_Init(metrics, defaultMetricsIntervalMs, getTimeMs());
+	LockMetricIds* ids = &ctx->metricIds;
+	ids->unlocks = Metrics_AddCounter(metrics, "Unlocks");
+	ids->badCodes = Metrics_AddCounter(metrics, "BadCodes");
+	ids->alarms = Metrics_AddCounter(metrics, "Alarms");
+	ids->doorCycles = Metrics_AddCounter(metrics, "DoorCycles");
+	ids->reconnects = Metrics_AddCounter(metrics, "Reconnects");
+	ids->stored = Metrics_AddGauge(metrics, "Stored");
+	ids->inFlight = Metrics_AddGauge(metrics, "InFlight");
+	ids->batched = Metrics_AddGauge(metrics, "Batched");
+	ids->doorOpenTime = Metrics_AddHistogram(metrics, "DoorOpenMs", doorOpenMsBounds, sizeof(doorOpenMsBounds) / sizeof(doorOpenMsBounds[0]));
+	ids->unlockLatency = Metrics_AddHistogram(metrics, "UnlockUs", unlockUsBounds, sizeof(unlockUsBounds) / sizeof(unlockUsBounds[0]));
+	ids->runTime = Metrics_AddHistogram(metrics, "RunUs", runUsBounds, sizeof(runUsBounds) / sizeof(runUsBounds[0]));
+}
+
+//the counters come from the telemetry events the core already makes
+static void countTelemetry(LockContext* ctx, uint8_t code)
+{
+	Metrics* metrics = &ctx->metrics;
+	switch (code)
+	{
+	case LOCK_CODE_UNLOCKED:
+		Metrics_Count(metrics, ctx->metricIds.unlocks, 1);
+		break;
+	case LOCK_CODE_INVALID_CODE:
+	case LOCK_CODE_INVALID_STAR_CODE:
+		Metrics_Count(metrics, ctx->metricIds.badCodes, 1);
+		break;
+	case LOCK_CODE_INTRUSION:
+		Metrics_Count(metrics, ctx->metricIds.alarms, 1);
+		break;
+	case LOCK_CODE_DOOR_OPENED:
+		ctx->doorOpenedMs = getTimeMs();
+		break;
+	case LOCK_CODE_DOOR_CLOSED:
+		Metrics_Count(metrics, ctx->metricIds.doorCycles, 1);
+		Metrics_Observe(metrics, ctx->metricIds.doorOpenTime, getTimeMs() - ctx->doorOpenedMs);
+		break;
+	}
+}
+
+static void sampleQueues(LockContext* ctx)
+{
+	Metrics_Set(&ctx->metrics, ctx->metricIds.stored, EventQueue_Count(&ctx->azure.store));
+	Metrics_Set(&ctx->metrics, ctx->metricIds.inFlight, CountDeliveriesInFlight(&ctx->azure));
+	Metrics_Set(&ctx->metrics, ctx->metricIds.batched, ctx->azure.telemetryBatchCount);
+
+	//the first connection isn't a reconnect
+	uint32_t connects = GetHubConnection(&ctx->azure)->connects;
+	if (connects > ctx->connectsCounted) {
+		Lock_BootStage(ctx, LOCK_BOOT_CLOUD);
+		if (ctx->connectsCounted > 0)
+			Metrics_Count(&ctx->metrics, ctx->metricIds.reconnects, connects - ctx->connectsCounted);
+		ctx->connectsCounted = connects;
+	}
+}
+
+//one operational message per interval, none from a door whose counters stayed at 0
+//unlike the events it isn't traced: its timings differ on every run, so a replay couldn't match it
+static void publishMetrics(LockContext* ctx, uint32_t now)
+{
+	if (!Metrics_IsDue(&ctx->metrics, now))
+		return;
+	if (!ctx->metrics.active) {
+		Metrics_Restart(&ctx->metrics, now);
+		return;
+	}
+
+	char message[TELEMETRY_BATCH_SIZE];
+	JsonWriter writer;
+	JsonWriter_Init(&writer, message, sizeof(message));
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_BeginObject(&writer, "Metrics");
+	Metrics_WriteSummary(&ctx->metrics, &writer, now);
+	JsonWriter_EndObject(&writer);
+	JsonWriter_EndObject(&writer);
+	int length = JsonWriter_Finish(&writer);
+	if (length < 0) {
+		Log_Debug("ERROR: metrics summary doesn't fit in %d bytes, dropped\n", TELEMETRY_BATCH_SIZE);
+		return;
+	}
+	SendTelemetryDocument(&ctx->azure, message, (uint16_t)length, TELEMETRY_LANE_OPERATIONAL);
+}
+
+//the configuration as it is saved, with unused bytes zeroed so two can be compared whole
+static void currentConfig(const LockContext* ctx, LockSavedConfig* config)
+{
+	const LockCore* core = &ctx->core;
+	memset(config, 0, sizeof(*config));
+	config->desiredVersion = ctx->desiredVersion;
+	config->reportedVersion = ctx->reportedVersion;
+	config->monoSwitchSeconds = core->monoSwitchTime / 1000;
+	config->metricsIntervalSeconds = ctx->metrics.intervalMs / 1000;
+	config->lockMode = core->lockMode;
+	config->contactMode = core->contactMode;
+	config->displayBacklight = core->displayBacklight;
+	config->flags = (core->alwaysOpen ? 1 : 0) | (core->alwaysClosed ? 2 : 0);
+	memcpy(config->userPassword, core->userPassword, strnlen(core->userPassword, PASSWORD_LENGTH - 1));
+	memcpy(config->adminPassword, core->adminPassword, strnlen(core->adminPassword, PASSWORD_LENGTH - 1));
+}
+
+static void savedTwin(const LockSavedConfig* saved, LockTwin* twin)
+{
+	memset(twin, 0, sizeof(*twin));
+	twin->present = LOCK_TWIN_REPORTED_FIELDS | LOCK_TWIN_ALWAYS_OPEN | LOCK_TWIN_ALWAYS_CLOSED;
+	twin->alwaysOpen = (saved->flags & 1) != 0;
+	twin->alwaysClosed = (saved->flags & 2) != 0;
+	twin->lockMode = saved->lockMode;
+	twin->contactMode = saved->contactMode;
+	twin->displayBacklight = saved->displayBacklight;
+	twin->monoSwitchSeconds = saved->monoSwitchSeconds;
+	memcpy(twin->userPassword, saved->userPassword, PASSWORD_LENGTH - 1);
+	memcpy(twin->adminPassword, saved->adminPassword, PASSWORD_LENGTH - 1);
+}
+
+//loads the saved configuration into savedConfig, false if there is none or it doesn't pass the
+//config checks; the twin that comes on connect then skips the sections at the saved $versions
+//and applies what changed since
+static bool restoreConfig(LockContext* ctx)
+{
+	LockSavedConfig saved;
+	if (ConfigStore_Load(&ctx->configStore, LOCK_CONFIG_FORMAT, &saved, sizeof(saved)) < 0)
+		return false;
+	Trace_RecordConfig(LOCK_CONFIG_FORMAT, &saved, sizeof(saved));
+
+	LockTwin twin;
+	savedTwin(&saved, &twin);
+	const char* reason = LockCore_CheckSavedConfig(&twin);
+	if (reason != NULL) {
+		Log_Debug("ERROR: Saved configuration ignored: %s.\n", reason);
+		return false;
+	}
+	ctx->desiredVersion = saved.desiredVersion;
+	ctx->reportedVersion = saved.reportedVersion;
+	Metrics_SetInterval(&ctx->metrics, saved.metricsIntervalSeconds * 1000);
+	ctx->savedConfig = saved;
+	ctx->configRestored = true;
+	return true;
+}
+
+static const LockTwin* startTwin(const LockContext* ctx, LockTwin* twin)
+{
+	if (!ctx->configRestored)
+		return NULL;
+	savedTwin(&ctx->savedConfig, twin);
+	return twin;
+}
+
+//the level LOCK_EVENT_START leaves the lock relay at, from a copy of the core, so opening the
+//GPIO doesn't drive the relay to another level first
+static GPIO_Value_Type startRelayLevel(const LockContext* ctx)
+{
+	LockCore core = ctx->core;
+	LockTwin saved;
+	LockEvent event = { .type = LOCK_EVENT_START, .twin = startTwin(ctx, &saved) };
+	LockEffects effects;
+	LockCore_Step(&core, &event, getTimeMs(), &effects);
+	return core.relayHigh ? GPIO_Value_High : GPIO_Value_Low;
+}
+
+static void noteConfig(LockContext* ctx)
+{
+	if (!ctx->core.synced || ctx->configStore.fd < 0)
+		return;
+	LockSavedConfig config;
+	currentConfig(ctx, &config);
+	bool changed = memcmp(&config, &ctx->savedConfig, sizeof(config)) != 0;
+	if (changed && !ctx->configDirty)
+		ctx->configChangedMs = getMonotonicMs();
+	ctx->configDirty = changed;
+}
+
+//a failed write is tried again after another delay
+static void saveConfig(LockContext* ctx)
+{
+	LockSavedConfig config;
+	currentConfig(ctx, &config);
+	if (ConfigStore_Save(&ctx->configStore, LOCK_CONFIG_FORMAT, &config, sizeof(config)) < 0) {
+		Log_Debug("ERROR: Could not save the configuration.\n");
+		ctx->configChangedMs = getMonotonicMs();
+		return;
+	}
+	ctx->savedConfig = config;
+	ctx->configDirty = false;
+	Log_Debug("INFO: configuration saved, %u writes since boot.\n", ctx->configStore.saves);
+}
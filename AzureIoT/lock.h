@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "azure.h"
+#include "config_store.h"
+#include "lock_core.h"
+#include "method_table.h"
+#include "metrics.h"
+
+// Mutable storage holds the telemetry store, then the saved configuration.
+#define LOCK_CONFIG_OFFSET TELEMETRY_STORE_SIZE
+
+// The configuration saved in mutable storage, enough to run the door without the twin. Fixed
+// width fields in this order make format LOCK_CONFIG_FORMAT; a change needs a new format.
+#define LOCK_CONFIG_FORMAT 1
+
+typedef struct LockSavedConfig {
+	int64_t desiredVersion;//of the twin sections the configuration came from
+	int64_t reportedVersion;
+	uint32_t monoSwitchSeconds;
+	uint32_t metricsIntervalSeconds;
+	uint8_t lockMode;//enum LockMode
+	uint8_t contactMode;//enum ContactMode
+	uint8_t displayBacklight;//enum DisplayBacklight
+	uint8_t flags;//bit 0 AlwaysOpen, bit 1 AlwaysClosed
+	char userPassword[PASSWORD_LENGTH];
+	char adminPassword[PASSWORD_LENGTH];
+} LockSavedConfig;
+
+// What TwinCallback did with the twin updates it was given.
+typedef struct LockTwinStats {
+	uint32_t complete;//whole twins, on connect
+	uint32_t partial;//desired-property patches
+	uint32_t ignored;//every section was at a $version already applied
+	uint32_t fieldsRead;//configuration values found in new sections
+	uint32_t fieldsApplied;//of those, the ones that differed from the lock's
+} LockTwinStats;
+
+// Ids of the metrics in the summary, as Metrics_Add* returned them: -1 for one that couldn't
+// be registered, which the updates then skip.
+typedef struct LockMetricIds {
+	int unlocks;
+	int badCodes;//wrong user or config password
+	int alarms;//intrusions
+	int doorCycles;//door closed after it was open
+	int reconnects;//hub connections made after the first
+	int stored;//telemetry messages waiting in the store
+	int inFlight;//telemetry messages not confirmed yet
+	int batched;//telemetry events waiting for their batch
+	int doorOpenTime;
+	int unlockLatency;//from the keypad scan that read '#' to the relay
+	int runTime;//of Lock_Run
+} LockMetricIds;
+
+// The stages of a boot, in the order main.c brings them up. Only the lock and its GPIOs come
+// before the door is locked; the keypad is opened next and read from the first tick once the
+// lock is operational, and the display and the cloud client follow.
+typedef enum LockBootStage {
+	LOCK_BOOT_LOCKED,//Lock_Start put the relay at its start level
+	LOCK_BOOT_KEYPAD,//the keypad's GPIOs are open, so the next tick can read it
+	LOCK_BOOT_DISPLAY,//the display shows the lock's screen
+	LOCK_BOOT_CLOUD,//the IoT Hub client connected for the first time
+	LOCK_BOOT_STAGES
+} LockBootStage;
+
+// One door: the lock core with the GPIOs and the IoT Hub client it is wired to. Several
+// doors can run side by side.
+typedef struct LockContext {
+	LockCore core;
+
+	int doorLockFd;
+	int doorSensorFd;
+	int alarmFd;
+
+	AzureClient azure;
+	int64_t desiredVersion;//$version of the twin's desired properties last applied, 0 before the first twin
+	int64_t reportedVersion;//same for the reported properties, which hold the lock's configuration
+	LockTwinStats twinStats;
+	MethodTable methods;//direct methods and their call counts, registered by Lock_Start
+
+	Metrics metrics;//summed up and sent every MetricsInterval
+	LockMetricIds metricIds;
+	uint32_t doorOpenedMs;//when the door last opened
+	bool unlocked;//the relay was opened in this pass of Lock_Run...
+	uint32_t unlockUs;//...at this time
+	uint32_t connectsCounted;//hub connections already counted in the metrics
+
+	ConfigStore configStore;
+	LockSavedConfig savedConfig;//what configStore holds, once the lock has a configuration
+	uint32_t configChangedMs;//when the configuration first differed from savedConfig, on the monotonic clock
+	bool configDirty;//it differs, saved configSaveDelayMs after configChangedMs
+	bool configRestored;//the lock started from the saved configuration
+	bool operational;//the lock has a configuration, saved or from the twin
+	uint32_t startMs;//when Lock_Start ran, on the monotonic clock
+	uint32_t operationalMs;//from Lock_Start until it was operational
+
+	uint32_t bootMs;//when Lock_InitContext ran, on the monotonic clock so a time sync at boot doesn't skew the stages
+	uint32_t bootStageMs[LOCK_BOOT_STAGES];//from bootMs until each stage was reached...
+	uint8_t bootStages;//...if its bit is set here
+	bool displayReady;//screens are drawn, until then the last one is kept in pendingScreen
+	bool screenPending;
+	uint8_t pendingScreen;//LockScreen
+
+	bool keyHeld;//key seen on the previous keypad scan, see checkForKeyPress
+} LockContext;
+
+// Sets the factory defaults.
+void Lock_InitContext(LockContext* ctx);
+
+// Opens the lock, door sensor and alarm GPIOs. The display and keypad are opened separately.
+int Lock_Open(LockContext* ctx);
+void Lock_Close(LockContext* ctx);
+
+// Opens the saved configuration in mutable storage. Without it the door waits for the twin
+// after every boot, as before.
+int Lock_OpenConfigStore(LockContext* ctx);
+
+// Locks the door, clears the alarm and shows the sync screen, once the display is ready. With a saved configuration the
+// door then runs on it at once, and the twin is reconciled with it when it arrives.
+int Lock_Start(LockContext* ctx);
+
+// The display is initialized: draws the screen the lock is on, and every screen after it.
+void Lock_DisplayReady(LockContext* ctx);
+
+// Records when a boot stage was first reached, and logs it.
+void Lock_BootStage(LockContext* ctx, LockBootStage stage);
+
+// One pass of the lock logic, called from the app timer; it also sends the metrics summary
+// when it is due. Returns -1 on a hardware error.
+int Lock_Run(LockContext* ctx);
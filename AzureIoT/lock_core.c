@@ -0,0 +1,964 @@
+#include "lock_core.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lock_twin.h"
+
+static const char defaultUserPassword[PASSWORD_LENGTH] = { '1', '2', '3', '4', '\0' };
+static const char defaultAdminPassword[PASSWORD_LENGTH] = { '1', '2', '3', '4', '5', '\0' };
+
+static const uint32_t defaultMonoSwitchTime = 5000;
+static const uint32_t actionTimeout = 15000;//leave config menu and turn display off in auto mode after this time of inactivity
+static const uint32_t blockLockTimeout = 30000;//keyboard stays blocked this long after 3 invalid attempts
+static const uint32_t failedAttemptsResetTimeout = 30000;//invalid attempt counter is reset after this time
+static const unsigned int maxMonoSwitchSeconds = 999;
+
+const LockTelemetryEvent LockCore_TelemetryEvents[LOCK_CODE_COUNT] = {
+	[LOCK_CODE_DOOR_OPENED] = { LOCK_TELEMETRY_OPERATIONAL, false, "DoorEvent", "Door opened." },
+	[LOCK_CODE_DOOR_CLOSED] = { LOCK_TELEMETRY_OPERATIONAL, false, "DoorEvent", "Door closed." },
+	[LOCK_CODE_LOCKED] = { LOCK_TELEMETRY_OPERATIONAL, false, "LockEvent", "Lock locked." },
+	[LOCK_CODE_UNLOCKED] = { LOCK_TELEMETRY_OPERATIONAL, false, "LockEvent", "Lock unlocked." },
+	[LOCK_CODE_INTRUSION] = { LOCK_TELEMETRY_CRITICAL, false, "LockCritical", "Intrusion!" },
+	[LOCK_CODE_ALARM_CLEARED] = { LOCK_TELEMETRY_CRITICAL, false, "LockCritical", "Alarm cleared." },
+	[LOCK_CODE_INVALID_CODE] = { LOCK_TELEMETRY_OPERATIONAL, false, "ConfigWarning", "Invalid credentials." },
+	[LOCK_CODE_INVALID_STAR_CODE] = { LOCK_TELEMETRY_OPERATIONAL, false, "ConfigWarning", "Invalid credentials for star function." },
+	[LOCK_CODE_KEYPAD_BLOCKED] = { LOCK_TELEMETRY_OPERATIONAL, false, "LockWarning", "Three invalid attempts, lock functionality disabled for 30 seconds.\n" },
+	[LOCK_CODE_USER_PASSWORD_CHANGED] = { LOCK_TELEMETRY_OPERATIONAL, false, "UserEvent", "User password changed." },
+	[LOCK_CODE_CONFIG_PASSWORD_CHANGED] = { LOCK_TELEMETRY_OPERATIONAL, false, "ConfigEvent", "Config password changed." },
+	[LOCK_CODE_FACTORY_RESET] = { LOCK_TELEMETRY_OPERATIONAL, false, "ConfigEvent", "Factory reset performed." },
+	[LOCK_CODE_CONFIG_ACCESSED] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Config accessed." },
+	[LOCK_CODE_CONFIG_EXITED] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Config exited." },
+	[LOCK_CODE_CONFIG_TIMED_OUT] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Config exited due to timeout." },
+	[LOCK_CODE_MONO_SWITCH_TIME] = { LOCK_TELEMETRY_DIAGNOSTIC, true, "ConfigEvent", "Changed mono switch time to %u seconds." },
+	[LOCK_CODE_LOCK_MODE_MONO] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Lock mode changed to monostable." },
+	[LOCK_CODE_LOCK_MODE_BI] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Lock mode changed to bistable." },
+	[LOCK_CODE_CONTACT_NORMAL_OPEN] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Lock contact mode changed to normal open." },
+	[LOCK_CODE_CONTACT_NORMAL_CLOSED] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Lock contact mode changed to normal closed." },
+	[LOCK_CODE_BACKLIGHT_NONE] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Changed display backlight mode to none." },
+	[LOCK_CODE_BACKLIGHT_AUTO] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Changed display backlight mode to auto." },
+	[LOCK_CODE_BACKLIGHT_CONSTANT] = { LOCK_TELEMETRY_DIAGNOSTIC, false, "ConfigEvent", "Changed display backlight mode to constant." }
+};
+
+static const LockMenuOption configOptions[LOCK_MENU_OPTIONS] = {
+	[1] = { LOCK_OPTION_OPEN_MENU, CHANGE_CONFIG_PASSWORD, "Change config password.\n" },
+	[2] = { LOCK_OPTION_OPEN_MENU, CHANGE_LOCK_MODE, "Change lock mode.\n" },
+	[3] = { LOCK_OPTION_OPEN_MENU, CHANGE_LOCK_CONTACT_MODE, "Change lock contact mode.\n" },
+	[4] = { LOCK_OPTION_OPEN_MENU, CHANGE_MONO_SWITCH_TIME, "Change mono switch time.\n" },
+	[5] = { LOCK_OPTION_OPEN_MENU, CHANGE_DISPLAY_BACKLIGHT_MODE, "Change display backlight.\n" },
+	[6] = { LOCK_OPTION_OPEN_MENU, FACTORY_RESET, "Factory reset.\n" }
+};
+
+static const LockMenuOption lockModeOptions[LOCK_MENU_OPTIONS] = {
+	[1] = { LOCK_OPTION_LOCK_MODE, MONO, "Lock mode changed to monostable.\n", "\"Monostable\"", LOCK_CODE_LOCK_MODE_MONO },
+	[2] = { LOCK_OPTION_LOCK_MODE, BI, "Lock mode changed to bistable.\n", "\"Bistable\"", LOCK_CODE_LOCK_MODE_BI }
+};
+
+static const LockMenuOption contactModeOptions[LOCK_MENU_OPTIONS] = {
+	[1] = { LOCK_OPTION_CONTACT_MODE, NORMAL_OPEN, "Lock contact mode changed to normal open.\n", "\"Normal open\"", LOCK_CODE_CONTACT_NORMAL_OPEN },
+	[2] = { LOCK_OPTION_CONTACT_MODE, NORMAL_CLOSED, "Lock contact mode changed to normal closed.\n", "\"Normal closed\"", LOCK_CODE_CONTACT_NORMAL_CLOSED }
+};
+
+static const LockMenuOption displayBacklightOptions[LOCK_MENU_OPTIONS] = {
+	[1] = { LOCK_OPTION_DISPLAY_BACKLIGHT, NONE, "Changed display backlight mode to none.\n", "\"None\"", LOCK_CODE_BACKLIGHT_NONE },
+	[2] = { LOCK_OPTION_DISPLAY_BACKLIGHT, AUTO, "Changed display backlight mode to auto.\n", "\"Auto\"", LOCK_CODE_BACKLIGHT_AUTO },
+	[3] = { LOCK_OPTION_DISPLAY_BACKLIGHT, CONSTANT, "Changed display backlight mode to constant.\n", "\"Constant\"", LOCK_CODE_BACKLIGHT_CONSTANT }
+};
+
+const LockMenu LockCore_DefaultMenus[] = {
+	[NORMAL_OP] = {
+		.screen = LOCK_MENU_STATUS_SCREEN, .parent = NORMAL_OP, .entry = LOCK_ENTRY_CODE, .star = true
+	},
+	[CHANGE_PASSWORD] = {
+		.screen = LOCK_SCREEN_CHANGE_PASSWORD, .parent = NORMAL_OP, .entry = LOCK_ENTRY_USER_PASSWORD, .returns = true,
+		.backLog = "Change password canceled.\n"
+	},
+	[CONFIG] = {
+		.screen = LOCK_SCREEN_CONFIG, .parent = NORMAL_OP, .entry = LOCK_ENTRY_CHOICE, .options = configOptions,
+		.backLog = "Left config menu.\n", .backTelemetry = LOCK_CODE_CONFIG_EXITED
+	},
+	[CHANGE_CONFIG_PASSWORD] = {
+		.screen = LOCK_SCREEN_CHANGE_PASSWORD, .parent = CONFIG, .entry = LOCK_ENTRY_ADMIN_PASSWORD, .returns = true,
+		.backLog = "Config operation canceled.\n"
+	},
+	[CHANGE_LOCK_MODE] = {
+		.screen = LOCK_SCREEN_CHANGE_LOCK_MODE, .parent = CONFIG, .entry = LOCK_ENTRY_CHOICE, .options = lockModeOptions, .returns = true,
+		.backLog = "Config operation canceled.\n"
+	},
+	[CHANGE_LOCK_CONTACT_MODE] = {
+		.screen = LOCK_SCREEN_CHANGE_CONTACT_MODE, .parent = CONFIG, .entry = LOCK_ENTRY_CHOICE, .options = contactModeOptions, .returns = true,
+		.backLog = "Config operation canceled.\n"
+	},
+	[CHANGE_MONO_SWITCH_TIME] = {
+		.screen = LOCK_SCREEN_CHANGE_MONO_SWITCH_TIME, .parent = CONFIG, .entry = LOCK_ENTRY_MONO_SWITCH_TIME, .returns = true,
+		.backLog = "Config operation canceled.\n"
+	},
+	[CHANGE_DISPLAY_BACKLIGHT_MODE] = {
+		.screen = LOCK_SCREEN_CHANGE_DISPLAY_MODE, .parent = CONFIG, .entry = LOCK_ENTRY_CHOICE, .options = displayBacklightOptions, .returns = true,
+		.backLog = "Config operation canceled.\n"
+	},
+	[FACTORY_RESET] = {//the reset itself goes back to normal op
+		.screen = LOCK_SCREEN_FACTORY_RESET, .parent = CONFIG, .entry = LOCK_ENTRY_FACTORY_RESET,
+		.backLog = "Config operation canceled.\n"
+	}
+};
+
+static void tick(LockCore* core, bool doorOpen, char key, uint32_t now, LockEffects* effects);
+static void applyTwin(LockCore* core, const LockTwin* twin, uint32_t now, LockEffects* effects);
+static void applyConfig(LockCore* core, const LockTwin* config, uint32_t now, LockEffects* effects);
+
+static void doStarAction(LockCore* core, uint32_t now, LockEffects* effects);//performed when user pressed '*' on matrix keypad
+static void doHashAction(LockCore* core, uint32_t now, LockEffects* effects);//performed when user pressed '#' on matrix keypad
+static void goBack(LockCore* core, LockEffects* effects);//performed when user pressed 'B' on matrix keypad
+static void enterCode(LockCore* core, uint32_t now, LockEffects* effects);
+static void enterMonoSwitchTime(LockCore* core, LockEffects* effects);
+static void remoteUnlock(LockCore* core, uint32_t now, LockEffects* effects);
+static const LockMenuOption* findOption(const LockMenu* menu, const char* buffer);
+static const LockMenuOption* findChoice(const LockMenuOption* options, uint8_t value);
+static void chooseOption(LockCore* core, const LockMenuOption* option, LockEffects* effects);
+static void openMenu(LockCore* core, uint8_t menu, LockEffects* effects);
+static void invalidAttempt(LockCore* core, uint32_t now, LockEffects* effects, LockTelemetryCode warning);
+
+static bool addToBuffer(LockCore* core, char c);//adds c to buffer if not full
+static void clearBuffer(LockCore* core);//clears buffer used when necessary and when user pressed 'C' on matrix keypad
+static void copyPassword(char* password, const char* value);
+
+static bool isLocked(const LockCore* core);//relay is at the locked level for the contact mode
+static void lock(LockCore* core, LockEffects* effects);//locks the door relay
+static void unlock(LockCore* core, LockEffects* effects);//unlocks the door relay
+static void setContactMode(LockCore* core, uint8_t contactMode, LockEffects* effects);//moves the relay to the new mode's level
+
+static void drawNormalOp(const LockCore* core, LockEffects* effects);//draw locked,unlocked or alarm on display
+
+static void setAlarm(LockCore* core, LockEffects* effects);//opens alarm relay's circuit and triggers alarm on master device
+static void resetAlarm(LockCore* core, LockEffects* effects);//closes alarm relay's circuit and triggers alarm on master device
+
+static void factoryReset(LockCore* core, LockEffects* effects);
+
+static void emitArgument(LockEffects* effects, LockEffectType type, uint8_t value, uint16_t argument,
+	const char* name, const char* text)
+{
+	if (effects->count == LOCK_MAX_EFFECTS)
+	{
+		effects->dropped++;
+		return;
+	}
+	LockEffect* effect = &effects->items[effects->count++];
+	effect->type = (uint8_t)type;
+	effect->value = value;
+	effect->argument = argument;
+	effect->name = name;
+	effect->text = text;
+}
+
+static void emit(LockEffects* effects, LockEffectType type, uint8_t value, const char* name, const char* text)
+{
+	emitArgument(effects, type, value, 0, name, text);
+}
+
+static void logLine(LockEffects* effects, const char* text)
+{
+	emit(effects, LOCK_EFFECT_LOG, 0, NULL, text);
+}
+
+static void report(LockEffects* effects, const char* name, const char* value)
+{
+	emit(effects, LOCK_EFFECT_REPORT, 0, name, value);
+}
+
+static void telemetry(LockEffects* effects, LockTelemetryCode code)
+{
+	const LockTelemetryEvent* event = &LockCore_TelemetryEvents[code];
+	emit(effects, LOCK_EFFECT_TELEMETRY, (uint8_t)code, event->key, event->text);
+}
+
+static void draw(LockEffects* effects, LockScreen screen)
+{
+	emit(effects, LOCK_EFFECT_DRAW, (uint8_t)screen, NULL, NULL);
+}
+
+//formats into the step's text buffer, the result stays valid until the next step
+static const char* format(LockEffects* effects, const char* fmt, ...)
+{
+	char* text = effects->text + effects->textUsed;
+	size_t room = sizeof(effects->text) - effects->textUsed;
+	va_list args;
+	va_start(args, fmt);
+	int length = vsnprintf(text, room, fmt, args);
+	va_end(args);
+	if (length < 0)
+		text[0] = '\0';
+	else
+		effects->textUsed += (uint8_t)((size_t)length < room ? (size_t)length + 1 : room);
+	return text;
+}
+
+static void telemetryArgument(LockEffects* effects, LockTelemetryCode code, uint16_t argument)
+{
+	const LockTelemetryEvent* event = &LockCore_TelemetryEvents[code];
+	emitArgument(effects, LOCK_EFFECT_TELEMETRY, (uint8_t)code, argument, event->key,
+		format(effects, event->text, (unsigned int)argument));
+}
+
+void LockCore_Init(LockCore* core)
+{
+	memset(core, 0, sizeof(*core));
+	core->lockState = CLOSED;
+	core->currentMenu = NORMAL_OP;
+	core->lockMode = MONO;
+	core->contactMode = NORMAL_OPEN;
+	core->displayBacklight = AUTO;
+	strcpy(core->userPassword, defaultUserPassword);
+	strcpy(core->adminPassword, defaultAdminPassword);
+	core->monoSwitchTime = defaultMonoSwitchTime;
+	core->menus = LockCore_DefaultMenus;
+}
+
+void LockCore_Step(LockCore* core, const LockEvent* event, uint32_t now, LockEffects* effects)
+{
+	effects->count = 0;
+	effects->dropped = 0;
+	effects->textUsed = 0;
+
+	switch (event->type)
+	{
+	case LOCK_EVENT_START:
+		lock(core, effects);//lock door on startup
+		resetAlarm(core, effects);//close relay's circuit
+		core->actionStartTime = now;
+		if (event->twin != NULL)//saved configuration, run on it instead of waiting for the twin
+			applyTwin(core, event->twin, now, effects);
+		else
+			draw(effects, LOCK_SCREEN_WAIT);
+		break;
+	case LOCK_EVENT_TICK:
+		tick(core, event->doorOpen, event->key, now, effects);
+		break;
+	case LOCK_EVENT_TWIN:
+		applyTwin(core, event->twin, now, effects);
+		break;
+	case LOCK_EVENT_RESET_ALARM:
+		resetAlarm(core, effects);
+		core->actionStartTime = now;
+		break;
+	case LOCK_EVENT_FACTORY_RESET:
+		factoryReset(core, effects);
+		break;
+	case LOCK_EVENT_UNLOCK:
+		remoteUnlock(core, now, effects);
+		break;
+	case LOCK_EVENT_LOCK:
+		if (core->synced)
+			lock(core, effects);
+		break;
+	case LOCK_EVENT_CONFIG:
+		applyConfig(core, event->twin, now, effects);
+		break;
+	}
+}
+
+static void tick(LockCore* core, bool doorOpen, char key, uint32_t now, LockEffects* effects)
+{
+	if (!core->synced)//if lock hasn't received configuration state from azure yet then don't do nothing
+		return;
+
+	if (core->alwaysOpen)//azure sent always open flag so keep the lock open
+	{
+		unlock(core, effects);
+		core->unlockStartTime = now;//for monostable only to close it after some time when always open goes off
+	}
+
+	if (core->alwaysClosed)//azure sent always closed flag so keep the lock closed
+	{
+		lock(core, effects);
+	}
+
+	//the first sample only sets the reference
+	bool doorChanged = core->doorSampled && core->doorWasOpen != doorOpen;
+	core->doorSampled = true;
+	core->doorWasOpen = doorOpen;
+
+	if (doorChanged)
+	{
+		if (doorOpen)
+		{
+			report(effects, "IsDoorOpen", "true");
+			telemetry(effects, LOCK_CODE_DOOR_OPENED);
+			logLine(effects, "Door opened.\n");
+		}
+		else
+		{
+			report(effects, "IsDoorOpen", "false");
+			telemetry(effects, LOCK_CODE_DOOR_CLOSED);
+			logLine(effects, "Door closed.\n");
+		}
+	}
+
+	//door opened when lock was closed so trigger the alarm
+	//it's triggered only in normal op so it doesn't trigger in any config mode
+	//as if someone has access to config then the person also has access to the lock/unlock function itself
+	if (doorChanged && doorOpen && core->currentMenu == NORMAL_OP && !core->isAlarm && core->lockState == CLOSED)
+	{
+		setAlarm(core, effects);
+		draw(effects, LOCK_SCREEN_ALARM);
+	}
+
+	//close lock if is in mono mode and monoSwitchTime passed since opening
+	if (core->lockState == OPEN && core->lockMode == MONO && now - core->unlockStartTime >= core->monoSwitchTime)
+	{
+		lock(core, effects);
+	}
+
+	//set display to off if it's in none mode
+	if (!core->displayOff && core->displayBacklight == NONE)
+	{
+		core->displayOff = true;
+		draw(effects, LOCK_SCREEN_BLANK);
+	}
+
+	//return to normal op after timeout
+	//and set display to off if is in auto mode
+	if (now - core->actionStartTime >= actionTimeout)
+	{
+		if (core->currentMenu != NORMAL_OP && core->currentMenu != CHANGE_PASSWORD)
+		{
+			telemetry(effects, LOCK_CODE_CONFIG_TIMED_OUT);
+		}
+		if (core->displayBacklight == AUTO && !core->isAlarm)//set display off after timeout
+		{
+			draw(effects, LOCK_SCREEN_BLANK);
+			core->displayOff = true;
+		}
+		if (core->currentMenu != NORMAL_OP)//return to normal op menu and draw normal op if display is set to constant
+		{
+			core->currentMenu = NORMAL_OP;
+			if (core->displayBacklight == CONSTANT)
+			{
+				drawNormalOp(core, effects);
+			}
+		}
+
+		clearBuffer(core);
+	}
+
+	//disable block lock after blockLockTimeout passed
+	if (core->blockLock && now - core->blockLockStartTime >= blockLockTimeout)
+	{
+		core->invalidTries = 0;
+		core->blockLock = false;
+		if (core->displayBacklight == CONSTANT)
+			drawNormalOp(core, effects);
+	}
+
+	//reset failed attempts counter to 0 after some time
+	if (now - core->failedAttemptsResetStartTime >= failedAttemptsResetTimeout)
+	{
+		core->invalidTries = 0;
+	}
+
+	if (!key)
+		return;
+
+	core->actionStartTime = now;//action, keypress happened
+
+	//keys only wake the display while the keyboard is blocked
+	if (core->blockLock)
+	{
+		if (core->displayOff)
+		{
+			core->displayOff = false;
+			draw(effects, LOCK_SCREEN_BLOCK_LOCK);
+		}
+		return;
+	}
+
+	if (core->displayOff)
+	{
+		core->displayOff = false;
+		drawNormalOp(core, effects);
+	}
+
+	switch (key)
+	{
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		addToBuffer(core, key);
+		break;
+	case '*'://star works only in menus that take it, normal op
+		if (core->menus[core->currentMenu].star)
+		{
+			doStarAction(core, now, effects);
+			clearBuffer(core);
+		}
+		break;
+	case '#':
+		doHashAction(core, now, effects);
+		clearBuffer(core);
+		break;
+	case 'B':
+		goBack(core, effects);
+		clearBuffer(core);
+		break;
+	case 'C':
+		clearBuffer(core);
+		break;
+	}
+}
+
+//passwords from the twin are cut to fit, so they are compared as copyPassword would store them
+static bool passwordDiffers(const char* password, const char* value)
+{
+	size_t length = strnlen(value, PASSWORD_LENGTH - 1);
+	return strlen(password) != length || memcmp(password, value, length) != 0;
+}
+
+uint32_t LockCore_ChangedTwinFields(const LockCore* core, const LockTwin* twin)
+{
+	uint32_t changed = 0;
+	if (twin->alwaysOpen != core->alwaysOpen)
+		changed |= LOCK_TWIN_ALWAYS_OPEN;
+	if (twin->alwaysClosed != core->alwaysClosed)
+		changed |= LOCK_TWIN_ALWAYS_CLOSED;
+	if (twin->lockMode != core->lockMode)
+		changed |= LOCK_TWIN_LOCK_MODE;
+	if (twin->contactMode != core->contactMode)
+		changed |= LOCK_TWIN_CONTACT_MODE;
+	if (twin->displayBacklight != core->displayBacklight)
+		changed |= LOCK_TWIN_DISPLAY_BACKLIGHT_MODE;
+	//out of range times are ignored
+	if (twin->monoSwitchSeconds > 0 && twin->monoSwitchSeconds <= UINT32_MAX / 1000 && twin->monoSwitchSeconds * 1000 != core->monoSwitchTime)
+		changed |= LOCK_TWIN_MONO_SWITCH_TIME;
+	if ((twin->present & LOCK_TWIN_USER_PASSWORD) && passwordDiffers(core->userPassword, twin->userPassword))
+		changed |= LOCK_TWIN_USER_PASSWORD;
+	if ((twin->present & LOCK_TWIN_CONFIG_PASSWORD) && passwordDiffers(core->adminPassword, twin->adminPassword))
+		changed |= LOCK_TWIN_CONFIG_PASSWORD;
+	return changed & twin->present;
+}
+
+//only changed fields are applied: a repeated contact mode would relock a door that is open
+static void applyTwin(LockCore* core, const LockTwin* twin, uint32_t now, LockEffects* effects)
+{
+	if (!core->synced)
+		drawNormalOp(core, effects);
+	core->synced = true;
+
+	uint32_t changed = LockCore_ChangedTwinFields(core, twin);
+
+	if (changed & LOCK_TWIN_ALWAYS_OPEN)
+	{
+		core->alwaysOpen = twin->alwaysOpen;
+		core->actionStartTime = now;
+	}
+
+	if (changed & LOCK_TWIN_ALWAYS_CLOSED)
+	{
+		core->alwaysClosed = twin->alwaysClosed;
+		core->actionStartTime = now;
+	}
+
+	if (changed & LOCK_TWIN_LOCK_MODE)
+		core->lockMode = twin->lockMode;
+
+	if (changed & LOCK_TWIN_CONTACT_MODE)
+		setContactMode(core, twin->contactMode, effects);
+
+	if (changed & LOCK_TWIN_DISPLAY_BACKLIGHT_MODE)
+		core->displayBacklight = twin->displayBacklight;
+
+	if (changed & LOCK_TWIN_MONO_SWITCH_TIME)
+		core->monoSwitchTime = twin->monoSwitchSeconds * 1000;
+
+	if (changed & LOCK_TWIN_USER_PASSWORD)
+		copyPassword(core->userPassword, twin->userPassword);
+
+	if (changed & LOCK_TWIN_CONFIG_PASSWORD)
+		copyPassword(core->adminPassword, twin->adminPassword);
+}
+
+//a password the keypad can type
+static bool isKeypadPassword(const char* password)
+{
+	size_t length = strlen(password);
+	if (length == 0 || length > PASSWORD_LENGTH - 1)
+		return false;
+	for (size_t i = 0; i < length; i++)
+	{
+		if (password[i] < '0' || password[i] > '9')
+			return false;
+	}
+	return true;
+}
+
+//the checks of the values `config` sets, with the passwords the lock would end up with
+static const char* checkConfigValues(const LockTwin* config, const char* user, const char* admin)
+{
+	if ((config->present & LOCK_TWIN_MONO_SWITCH_TIME)
+		&& (config->monoSwitchSeconds == 0 || config->monoSwitchSeconds > maxMonoSwitchSeconds))
+		return "MonoSwitchTime must be 1 to 999 seconds";
+	if ((config->present & LOCK_TWIN_USER_PASSWORD) && !isKeypadPassword(config->userPassword))
+		return "UserPassword must be 1 to 11 digits";
+	if ((config->present & LOCK_TWIN_CONFIG_PASSWORD) && !isKeypadPassword(config->adminPassword))
+		return "ConfigPassword must be 1 to 11 digits";
+	if (strcmp(user, admin) == 0)
+		return "UserPassword and ConfigPassword must differ";
+	return NULL;
+}
+
+const char* LockCore_CheckConfig(const LockCore* core, const LockTwin* config)
+{
+	if (!core->synced)
+		return "Not synced";
+	if ((config->present & LOCK_TWIN_REPORTED_FIELDS) == 0)
+		return "Nothing to apply";
+	const char* user = config->present & LOCK_TWIN_USER_PASSWORD ? config->userPassword : core->userPassword;
+	const char* admin = config->present & LOCK_TWIN_CONFIG_PASSWORD ? config->adminPassword : core->adminPassword;
+	return checkConfigValues(config, user, admin);
+}
+
+const char* LockCore_CheckSavedConfig(const LockTwin* config)
+{
+	if ((config->present & LOCK_TWIN_REPORTED_FIELDS) != LOCK_TWIN_REPORTED_FIELDS)
+		return "Incomplete";
+	if (findChoice(lockModeOptions, config->lockMode) == NULL)
+		return "Unknown LockMode";
+	if (findChoice(contactModeOptions, config->contactMode) == NULL)
+		return "Unknown ContactMode";
+	if (findChoice(displayBacklightOptions, config->displayBacklight) == NULL)
+		return "Unknown DisplayBacklightMode";
+	return checkConfigValues(config, config->userPassword, config->adminPassword);
+}
+
+//ApplyConfig: all of it or nothing, in one step, so the settings it changes are reported in
+//one patch; each is logged, reported and sent as telemetry as if it was set on the keypad
+static void applyConfig(LockCore* core, const LockTwin* config, uint32_t now, LockEffects* effects)
+{
+	if (LockCore_CheckConfig(core, config) != NULL)
+		return;
+
+	uint32_t changed = LockCore_ChangedTwinFields(core, config) & LOCK_TWIN_REPORTED_FIELDS;
+	const LockMenuOption* option;
+
+	if ((changed & LOCK_TWIN_LOCK_MODE) && (option = findChoice(lockModeOptions, config->lockMode)) != NULL)
+		chooseOption(core, option, effects);
+
+	if ((changed & LOCK_TWIN_CONTACT_MODE) && (option = findChoice(contactModeOptions, config->contactMode)) != NULL)
+		chooseOption(core, option, effects);
+
+	if ((changed & LOCK_TWIN_DISPLAY_BACKLIGHT_MODE) && (option = findChoice(displayBacklightOptions, config->displayBacklight)) != NULL)
+		chooseOption(core, option, effects);
+
+	if (changed & LOCK_TWIN_MONO_SWITCH_TIME)
+	{
+		core->monoSwitchTime = config->monoSwitchSeconds * 1000;
+		report(effects, "MonoSwitchTime", format(effects, "\"%u\"", (unsigned int)config->monoSwitchSeconds));
+		telemetryArgument(effects, LOCK_CODE_MONO_SWITCH_TIME, (uint16_t)config->monoSwitchSeconds);
+	}
+
+	if (changed & LOCK_TWIN_USER_PASSWORD)
+	{
+		strcpy(core->userPassword, config->userPassword);
+		report(effects, "UserPassword", format(effects, "\"%s\"", core->userPassword));
+		logLine(effects, "User password changed.\n");
+		telemetry(effects, LOCK_CODE_USER_PASSWORD_CHANGED);
+	}
+
+	if (changed & LOCK_TWIN_CONFIG_PASSWORD)
+	{
+		strcpy(core->adminPassword, config->adminPassword);
+		report(effects, "ConfigPassword", format(effects, "\"%s\"", core->adminPassword));
+		logLine(effects, "Config password changed.\n");
+		telemetry(effects, LOCK_CODE_CONFIG_PASSWORD_CHANGED);
+	}
+
+	core->actionStartTime = now;
+}
+
+//'*' in a menu that takes it: the user password opens the password change, the config password opens config
+static void doStarAction(LockCore* core, uint32_t now, LockEffects* effects)
+{
+	if (!strcmp(core->charBuffer, core->userPassword))
+	{
+		if (core->isAlarm)
+		{
+			resetAlarm(core, effects);
+		}
+		openMenu(core, CHANGE_PASSWORD, effects);
+		logLine(effects, "Change user password.\n");
+	}
+	else if (!strcmp(core->charBuffer, core->adminPassword))
+	{
+		if (core->isAlarm)
+		{
+			resetAlarm(core, effects);
+		}
+		openMenu(core, CONFIG, effects);
+		telemetry(effects, LOCK_CODE_CONFIG_ACCESSED);
+		logLine(effects, "Config mode.\n");
+	}
+	else
+	{
+		invalidAttempt(core, now, effects, LOCK_CODE_INVALID_STAR_CODE);
+	}
+}
+
+//'#' hands the char buffer to the current menu's entry
+static void doHashAction(LockCore* core, uint32_t now, LockEffects* effects)
+{
+	const LockMenu* menu = &core->menus[core->currentMenu];
+	switch (menu->entry)
+	{
+	case LOCK_ENTRY_CHOICE:
+	{
+		const LockMenuOption* option = findOption(menu, core->charBuffer);
+		if (option != NULL)
+			chooseOption(core, option, effects);
+		break;
+	}
+	case LOCK_ENTRY_CODE:
+		enterCode(core, now, effects);
+		break;
+	case LOCK_ENTRY_USER_PASSWORD:
+		if (strcmp(core->charBuffer, core->adminPassword))
+		{
+			strcpy(core->userPassword, core->charBuffer);
+			report(effects, "UserPassword", format(effects, "\"%s\"", core->userPassword));
+			logLine(effects, "User password changed.\n");
+			telemetry(effects, LOCK_CODE_USER_PASSWORD_CHANGED);
+		}
+		break;
+	case LOCK_ENTRY_ADMIN_PASSWORD:
+		if (strcmp(core->charBuffer, core->userPassword))
+		{
+			strcpy(core->adminPassword, core->charBuffer);
+			logLine(effects, "Config password changed.\n");
+			report(effects, "ConfigPassword", format(effects, "\"%s\"", core->adminPassword));
+			telemetry(effects, LOCK_CODE_CONFIG_PASSWORD_CHANGED);
+		}
+		break;
+	case LOCK_ENTRY_MONO_SWITCH_TIME:
+		enterMonoSwitchTime(core, effects);
+		break;
+	case LOCK_ENTRY_FACTORY_RESET:
+		factoryReset(core, effects);
+		break;
+	}
+
+	if (menu->returns)
+		openMenu(core, menu->parent, effects);
+}
+
+//a password in normal op unlocks, or locks a bistable lock that is open, and clears the alarm
+static void enterCode(LockCore* core, uint32_t now, LockEffects* effects)
+{
+	if (strcmp(core->charBuffer, core->userPassword) && strcmp(core->charBuffer, core->adminPassword))
+	{
+		invalidAttempt(core, now, effects, LOCK_CODE_INVALID_CODE);
+		return;
+	}
+
+	if (core->isAlarm)
+	{
+		resetAlarm(core, effects);
+		if (core->displayBacklight != NONE)
+			drawNormalOp(core, effects);
+		return;
+	}
+
+	if (core->lockMode == BI && !isLocked(core))//for bistable if door is unlocked then lock
+	{
+		lock(core, effects);
+	}
+	else
+	{
+		unlock(core, effects);
+		core->unlockStartTime = now;//for monostable only to close it after some time
+	}
+	core->invalidTries = 0;//reset invalid tries when correct credentials given
+}
+
+//the Unlock method opens the door whatever the lock mode and leaves the alarm to ResetAlarm,
+//a mono lock closes again after monoSwitchTime
+static void remoteUnlock(LockCore* core, uint32_t now, LockEffects* effects)
+{
+	if (!core->synced)
+		return;
+	unlock(core, effects);
+	core->unlockStartTime = now;
+	core->actionStartTime = now;
+}
+
+static void enterMonoSwitchTime(LockCore* core, LockEffects* effects)
+{
+	if (core->charBuffer[0] == '\0')
+		return;
+
+	//the buffer only holds digits
+	unsigned long long val = 0;
+	for (const char* c = core->charBuffer; *c; c++)
+		val = val * 10 + (unsigned long long)(*c - '0');
+	if (val == 0 || val > maxMonoSwitchSeconds)
+		return;
+
+	core->monoSwitchTime = (uint32_t)val * 1000;
+	report(effects, "MonoSwitchTime", format(effects, "\"%u\"", (unsigned int)val));
+	telemetryArgument(effects, LOCK_CODE_MONO_SWITCH_TIME, (uint16_t)val);
+}
+
+//a choice is a single digit, which indexes the menu's options
+static const LockMenuOption* findOption(const LockMenu* menu, const char* buffer)
+{
+	if (menu->options == NULL || buffer[0] < '0' || buffer[0] > '9' || buffer[1] != '\0')
+		return NULL;
+	const LockMenuOption* option = &menu->options[buffer[0] - '0'];
+	return option->action == LOCK_OPTION_NONE ? NULL : option;
+}
+
+//the option of a setting menu that sets `value`
+static const LockMenuOption* findChoice(const LockMenuOption* options, uint8_t value)
+{
+	for (int i = 0; i < LOCK_MENU_OPTIONS; i++)
+	{
+		if (options[i].action != LOCK_OPTION_NONE && options[i].action != LOCK_OPTION_OPEN_MENU && options[i].value == value)
+			return &options[i];
+	}
+	return NULL;
+}
+
+static void chooseOption(LockCore* core, const LockMenuOption* option, LockEffects* effects)
+{
+	const char* property = NULL;
+	switch (option->action)
+	{
+	case LOCK_OPTION_OPEN_MENU:
+		openMenu(core, option->value, effects);
+		break;
+	case LOCK_OPTION_LOCK_MODE:
+		core->lockMode = option->value;
+		property = "LockMode";
+		break;
+	case LOCK_OPTION_CONTACT_MODE:
+		setContactMode(core, option->value, effects);
+		property = "ContactMode";
+		break;
+	case LOCK_OPTION_DISPLAY_BACKLIGHT:
+		core->displayBacklight = option->value;
+		property = "DisplayBacklightMode";
+		break;
+	}
+
+	if (option->log != NULL)
+		logLine(effects, option->log);
+	if (property != NULL && option->report != NULL)
+		report(effects, property, option->report);
+	if (option->telemetry != LOCK_CODE_NONE)
+		telemetry(effects, option->telemetry);
+}
+
+//goes to the parent menu
+//does nothing in a menu without one, like normal op
+static void goBack(LockCore* core, LockEffects* effects)
+{
+	const LockMenu* menu = &core->menus[core->currentMenu];
+	if (menu->parent == core->currentMenu)
+		return;
+
+	openMenu(core, menu->parent, effects);
+	if (menu->backLog != NULL)
+		logLine(effects, menu->backLog);
+	if (menu->backTelemetry != LOCK_CODE_NONE)
+		telemetry(effects, menu->backTelemetry);
+}
+
+//opens the menu and draws its screen unless display backlight mode is set to none
+static void openMenu(LockCore* core, uint8_t menu, LockEffects* effects)
+{
+	core->currentMenu = menu;
+	if (core->displayBacklight == NONE)
+		return;
+
+	uint8_t screen = core->menus[menu].screen;
+	if (screen == LOCK_MENU_STATUS_SCREEN)
+		drawNormalOp(core, effects);
+	else
+		draw(effects, screen);
+}
+
+//counts a wrong password, after 3 of them the keyboard is blocked for blockLockTimeout
+static void invalidAttempt(LockCore* core, uint32_t now, LockEffects* effects, LockTelemetryCode warning)
+{
+	core->invalidTries++;
+	core->failedAttemptsResetStartTime = now;//reset invalid tries after some time
+
+	telemetry(effects, warning);
+	logLine(effects, "Invalid credentials.\n");
+
+	if (core->invalidTries == 3)
+	{
+		core->blockLock = true;
+		core->blockLockStartTime = now;//return keyboard access after some time
+		if (core->displayBacklight != NONE)
+			draw(effects, LOCK_SCREEN_BLOCK_LOCK);
+
+		logLine(effects, "Three invalid attempts\nLock functionality disabled for 30 seconds.\n");
+		telemetry(effects, LOCK_CODE_KEYPAD_BLOCKED);
+	}
+}
+
+//adds given char to char buffer
+//returns true if char added
+//false if buffer is full
+static bool addToBuffer(LockCore* core, char c)
+{
+	size_t len = strlen(core->charBuffer);
+	if (len == sizeof(core->charBuffer) - 1)//keep the terminator
+		return false;
+	core->charBuffer[len] = c;
+	return true;
+}
+
+//clears char buffer
+static void clearBuffer(LockCore* core)
+{
+	memset(core->charBuffer, 0, sizeof(core->charBuffer));
+}
+
+//passwords from the twin are cut to fit
+static void copyPassword(char* password, const char* value)
+{
+	size_t length = strlen(value);
+	if (length > PASSWORD_LENGTH - 1)
+		length = PASSWORD_LENGTH - 1;
+	memcpy(password, value, length);
+	password[length] = '\0';
+}
+
+static bool isLocked(const LockCore* core)
+{
+	return core->relayHigh == (core->contactMode == NORMAL_CLOSED);
+}
+
+//locks the door relay
+//sets relay open or closed depending on contact mode
+static void lock(LockCore* core, LockEffects* effects)
+{
+	if (core->alwaysOpen)
+		return;
+	//the relay can already be at the locked level after a contact mode change
+	if (!isLocked(core))
+	{
+		core->relayHigh = core->contactMode == NORMAL_CLOSED;
+		emit(effects, LOCK_EFFECT_LOCK, core->relayHigh, NULL, NULL);
+		logLine(effects, "Lock locked.\n");
+		report(effects, "IsLockOpen", "false");
+		telemetry(effects, LOCK_CODE_LOCKED);
+		if (core->displayBacklight != NONE && core->currentMenu == NORMAL_OP)
+			draw(effects, LOCK_SCREEN_LOCKED);
+	}
+	core->lockState = CLOSED;
+}
+
+//unlocks the door relay
+//sets relay open or closed depending on contact mode
+static void unlock(LockCore* core, LockEffects* effects)
+{
+	if (core->alwaysClosed)
+		return;
+	if (isLocked(core))
+	{
+		core->relayHigh = core->contactMode == NORMAL_OPEN;
+		emit(effects, LOCK_EFFECT_UNLOCK, core->relayHigh, NULL, NULL);
+		logLine(effects, "Lock unlocked.\n");
+		report(effects, "IsLockOpen", "true");
+		telemetry(effects, LOCK_CODE_UNLOCKED);
+		if (core->displayBacklight != NONE && core->currentMenu == NORMAL_OP)
+			draw(effects, LOCK_SCREEN_UNLOCKED);
+	}
+	core->lockState = OPEN;
+}
+
+//the relay levels swap meaning with the contact mode, so the door is locked again at the new level
+//or kept open while azure holds it open
+static void setContactMode(LockCore* core, uint8_t contactMode, LockEffects* effects)
+{
+	core->contactMode = contactMode;
+	if (core->alwaysOpen)
+		unlock(core, effects);
+	else
+		lock(core, effects);
+}
+
+//draw normal operation
+//locked/unlocked/alarm
+//doesn't draw if display backlight mode is set to none
+static void drawNormalOp(const LockCore* core, LockEffects* effects)
+{
+	if (core->isAlarm)
+	{
+		draw(effects, LOCK_SCREEN_ALARM);
+		return;
+	}
+
+	if (core->displayBacklight == NONE)
+		return;
+
+	draw(effects, core->lockState == CLOSED ? LOCK_SCREEN_LOCKED : LOCK_SCREEN_UNLOCKED);
+}
+
+//open alarm relay and trigger alarm state in master
+static void setAlarm(LockCore* core, LockEffects* effects)
+{
+	if (core->isAlarm)
+		return;
+	core->isAlarm = true;
+	emit(effects, LOCK_EFFECT_ALARM, 1, NULL, NULL);
+	report(effects, "IsAlarm", "true");
+	logLine(effects, "Alarm!\n");
+	telemetry(effects, LOCK_CODE_INTRUSION);
+}
+
+//close alarm relay
+static void resetAlarm(LockCore* core, LockEffects* effects)
+{
+	if (!core->isAlarm)
+		return;
+	core->isAlarm = false;
+	emit(effects, LOCK_EFFECT_ALARM, 0, NULL, NULL);
+	report(effects, "IsAlarm", "false");
+	logLine(effects, "Alarm cleared.\n");
+	telemetry(effects, LOCK_CODE_ALARM_CLEARED);
+	if (core->displayBacklight != NONE)
+		drawNormalOp(core, effects);
+}
+
+static void factoryReset(LockCore* core, LockEffects* effects)
+{
+	strcpy(core->userPassword, defaultUserPassword);
+	report(effects, "UserPassword", "\"1234\"");
+
+	strcpy(core->adminPassword, defaultAdminPassword);
+	report(effects, "ConfigPassword", "\"12345\"");
+
+	core->lockMode = MONO;
+	report(effects, "LockMode", "\"Monostable\"");
+
+	core->monoSwitchTime = defaultMonoSwitchTime;
+	report(effects, "MonoSwitchTime", "\"5\"");
+
+	setContactMode(core, NORMAL_OPEN, effects);
+	report(effects, "ContactMode", "\"Normal open\"");
+
+	core->displayBacklight = AUTO;
+	report(effects, "DisplayBacklightMode", "\"Auto\"");
+
+	openMenu(core, NORMAL_OP, effects);
+	telemetry(effects, LOCK_CODE_FACTORY_RESET);
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Decision logic of the lock: lock, alarm, menu and keypad rules as a pure transition
+// (state, event, now) -> (state', effects). It makes no system calls and allocates
+// nothing. The caller reads the hardware into an event and carries out the effects
+// (relays, drawing, reported state, telemetry, log lines) in the order they were made.
+
+#define PASSWORD_LENGTH 12
+
+enum LockState {
+	OPEN,
+	CLOSED
+};
+
+//currently selected menu
+enum CurrentMenu {
+	NORMAL_OP,
+	CHANGE_PASSWORD,
+	CONFIG,
+	CHANGE_CONFIG_PASSWORD,
+	CHANGE_LOCK_MODE,
+	CHANGE_LOCK_CONTACT_MODE,
+	CHANGE_MONO_SWITCH_TIME,
+	CHANGE_DISPLAY_BACKLIGHT_MODE,
+	FACTORY_RESET
+};
+
+enum LockMode {
+	BI,
+	MONO
+};
+
+enum ContactMode {
+	NORMAL_OPEN,
+	NORMAL_CLOSED
+};
+
+enum DisplayBacklight {
+	NONE,
+	AUTO,
+	CONSTANT
+};
+
+struct LockMenu;
+
+// State of one door. Fields are ordered by size and the flags are bit-fields, so it
+// stays under 80 bytes.
+typedef struct LockCore {
+	const struct LockMenu* menus;//menu table indexed by CurrentMenu, LockCore_DefaultMenus unless the door has its own
+
+	//points in time in milliseconds, compared by unsigned difference so they survive wrap-around
+	uint32_t unlockStartTime;//used to close the lock after monoSwitchTime in mono lock mode
+	uint32_t actionStartTime;//last action, for display auto mode and leaving config after a timeout
+	uint32_t blockLockStartTime;//when blockLock was set
+	uint32_t failedAttemptsResetStartTime;//last invalid attempt, the counter is reset some time after it
+	uint32_t monoSwitchTime;
+
+	char userPassword[PASSWORD_LENGTH];
+	char adminPassword[PASSWORD_LENGTH];
+	char charBuffer[PASSWORD_LENGTH];//stores keystrokes
+
+	uint8_t lockState;//enum LockState
+	uint8_t currentMenu;//enum CurrentMenu
+	uint8_t lockMode;//enum LockMode
+	uint8_t contactMode;//enum ContactMode
+	uint8_t displayBacklight;//enum DisplayBacklight
+	uint8_t invalidTries;//incremented when hash or star function used with invalid credentials
+
+	bool relayHigh : 1;//level of the lock relay GPIO, locked is low in normal open contact mode
+	bool blockLock : 1;//keyboard is inaccessible after 3 invalid attempts, released after blockLockTimeout
+	bool isAlarm : 1;//door opened when it should be locked -> lock broken or intrusion
+	bool displayOff : 1;//display is off after some time of inactivity in auto backlight mode
+	bool alwaysOpen : 1;//flag received from azure, set lock always open
+	bool alwaysClosed : 1;//flag received from azure, set lock always closed
+	bool synced : 1;//set by the first twin update or a saved configuration, the lock does nothing before that
+	bool doorSampled : 1;//door sensor read at least once
+	bool doorWasOpen : 1;//door sensor value on the previous read
+} LockCore;
+
+// Configuration carried by a twin update, generated from the twin schema into lock_twin.h.
+struct LockTwin;
+
+typedef enum LockEventType {
+	LOCK_EVENT_START,//boot: lock the door, clear the alarm, show the sync screen or apply the saved configuration in `twin`
+	LOCK_EVENT_TICK,//app timer: door sensor sample and the key pressed since the last tick
+	LOCK_EVENT_TWIN,//twin update, the first one syncs the lock
+	LOCK_EVENT_RESET_ALARM,//ResetAlarm direct method
+	LOCK_EVENT_FACTORY_RESET,//FactoryReset direct method
+	LOCK_EVENT_UNLOCK,//Unlock direct method, opens the door like a valid code
+	LOCK_EVENT_LOCK,//Lock direct method
+	LOCK_EVENT_CONFIG//ApplyConfig direct method, the configuration in `twin`
+} LockEventType;
+
+typedef struct LockEvent {
+	uint8_t type;//LockEventType
+	bool doorOpen;//tick
+	char key;//tick, 0 if no key was pressed
+	const struct LockTwin* twin;//twin, config, start if a configuration was saved
+} LockEvent;
+
+typedef enum LockScreen {
+	LOCK_SCREEN_WAIT,
+	LOCK_SCREEN_ALARM,
+	LOCK_SCREEN_BLANK,
+	LOCK_SCREEN_LOCKED,
+	LOCK_SCREEN_UNLOCKED,
+	LOCK_SCREEN_BLOCK_LOCK,
+	LOCK_SCREEN_CONFIG,
+	LOCK_SCREEN_CHANGE_PASSWORD,
+	LOCK_SCREEN_CHANGE_LOCK_MODE,
+	LOCK_SCREEN_CHANGE_CONTACT_MODE,
+	LOCK_SCREEN_CHANGE_MONO_SWITCH_TIME,
+	LOCK_SCREEN_CHANGE_DISPLAY_MODE,
+	LOCK_SCREEN_FACTORY_RESET
+} LockScreen;
+
+typedef enum LockEffectType {
+	LOCK_EFFECT_LOCK,//set the lock relay to `value` (1 = high), the door is locked
+	LOCK_EFFECT_UNLOCK,//set the lock relay to `value`, the door is unlocked
+	LOCK_EFFECT_ALARM,//set the alarm relay, `value` 1 raises the alarm
+	LOCK_EFFECT_DRAW,//draw screen `value` (LockScreen)
+	LOCK_EFFECT_REPORT,//reported property `name` = JSON `text`
+	LOCK_EFFECT_TELEMETRY,//telemetry event `value` (LockTelemetryCode) with `argument`, as JSON `name`: `text`
+	LOCK_EFFECT_LOG//debug log line `text`
+} LockEffectType;
+
+//how urgent a telemetry effect is
+typedef enum LockTelemetryLane {
+	LOCK_TELEMETRY_CRITICAL,//alarm events that can't wait for a batch
+	LOCK_TELEMETRY_OPERATIONAL,//lock, door and security events
+	LOCK_TELEMETRY_DIAGNOSTIC//menu and config chatter, fine to lose
+} LockTelemetryLane;
+
+// Telemetry events of the lock. The code numbers the event in the binary telemetry encoding,
+// so a code is never reused for another event.
+typedef enum LockTelemetryCode {
+	LOCK_CODE_NONE,
+	LOCK_CODE_DOOR_OPENED,
+	LOCK_CODE_DOOR_CLOSED,
+	LOCK_CODE_LOCKED,
+	LOCK_CODE_UNLOCKED,
+	LOCK_CODE_INTRUSION,
+	LOCK_CODE_ALARM_CLEARED,
+	LOCK_CODE_INVALID_CODE,
+	LOCK_CODE_INVALID_STAR_CODE,
+	LOCK_CODE_KEYPAD_BLOCKED,
+	LOCK_CODE_USER_PASSWORD_CHANGED,
+	LOCK_CODE_CONFIG_PASSWORD_CHANGED,
+	LOCK_CODE_FACTORY_RESET,
+	LOCK_CODE_CONFIG_ACCESSED,
+	LOCK_CODE_CONFIG_EXITED,
+	LOCK_CODE_CONFIG_TIMED_OUT,
+	LOCK_CODE_MONO_SWITCH_TIME,//argument: seconds
+	LOCK_CODE_LOCK_MODE_MONO,
+	LOCK_CODE_LOCK_MODE_BI,
+	LOCK_CODE_CONTACT_NORMAL_OPEN,
+	LOCK_CODE_CONTACT_NORMAL_CLOSED,
+	LOCK_CODE_BACKLIGHT_NONE,
+	LOCK_CODE_BACKLIGHT_AUTO,
+	LOCK_CODE_BACKLIGHT_CONSTANT,
+	LOCK_CODE_COUNT
+} LockTelemetryCode;
+
+typedef struct LockTelemetryEvent {
+	uint8_t lane;//LockTelemetryLane
+	bool argument;//`text` formats the argument with %u
+	const char* key;//JSON key
+	const char* text;//JSON value
+} LockTelemetryEvent;
+
+// What each telemetry event is sent as, indexed by LockTelemetryCode.
+extern const LockTelemetryEvent LockCore_TelemetryEvents[LOCK_CODE_COUNT];
+
+typedef struct LockEffect {
+	uint8_t type;//LockEffectType
+	uint8_t value;
+	uint16_t argument;//of a telemetry event
+	const char* name;
+	const char* text;
+} LockEffect;
+
+// Menus are data. Each menu names the screen shown while it is open, the menu 'B' goes back
+// to and what '#' does with the typed digits. In a choice menu the digit indexes `options`
+// directly.
+#define LOCK_MENU_OPTIONS 10//one option per digit
+#define LOCK_MENU_STATUS_SCREEN 0xFF//screen of a menu that shows locked, unlocked or alarm
+
+typedef enum LockMenuEntry {
+	LOCK_ENTRY_CHOICE,//a single digit picks one of the options
+	LOCK_ENTRY_CODE,//a password unlocks, or locks a bistable lock that is open
+	LOCK_ENTRY_USER_PASSWORD,//the digits become the user password
+	LOCK_ENTRY_ADMIN_PASSWORD,//the digits become the config password
+	LOCK_ENTRY_MONO_SWITCH_TIME,//the digits are the mono switch time in seconds
+	LOCK_ENTRY_FACTORY_RESET//'#' confirms the factory reset
+} LockMenuEntry;
+
+typedef enum LockOptionAction {
+	LOCK_OPTION_NONE,//no option for this digit
+	LOCK_OPTION_OPEN_MENU,//value is the CurrentMenu to open
+	LOCK_OPTION_LOCK_MODE,//value is the LockMode
+	LOCK_OPTION_CONTACT_MODE,//value is the ContactMode
+	LOCK_OPTION_DISPLAY_BACKLIGHT//value is the DisplayBacklight
+} LockOptionAction;
+
+typedef struct LockMenuOption {
+	uint8_t action;//LockOptionAction
+	uint8_t value;
+	const char* log;//debug log line
+	const char* report;//reported JSON value of the setting, NULL when the option opens a menu
+	uint8_t telemetry;//LockTelemetryCode, LOCK_CODE_NONE for none
+} LockMenuOption;
+
+typedef struct LockMenu {
+	uint8_t screen;//LockScreen, or LOCK_MENU_STATUS_SCREEN
+	uint8_t parent;//CurrentMenu 'B' goes back to, the menu itself if 'B' does nothing
+	uint8_t entry;//LockMenuEntry
+	bool returns;//'#' goes back to the parent once the entry is handled
+	bool star;//'*' with the user or config password opens their menus
+	const char* backLog;//logged when 'B' leaves
+	uint8_t backTelemetry;//LockTelemetryCode sent when 'B' leaves, LOCK_CODE_NONE for none
+	const LockMenuOption* options;//LOCK_MENU_OPTIONS entries for LOCK_ENTRY_CHOICE
+} LockMenu;
+
+// Keypad menus of the lock, indexed by CurrentMenu.
+extern const LockMenu LockCore_DefaultMenus[];
+
+#define LOCK_MAX_EFFECTS 48
+#define LOCK_EFFECT_TEXT_SIZE 96
+
+// Effects of one step. Texts are string constants or point into `text`, so they are valid
+// until the next step with the same LockEffects.
+typedef struct LockEffects {
+	LockEffect items[LOCK_MAX_EFFECTS];
+	uint8_t count;
+	uint8_t dropped;//effects that did not fit, never expected
+	uint8_t textUsed;
+	char text[LOCK_EFFECT_TEXT_SIZE];
+} LockEffects;
+
+// Sets the factory defaults: locked, mono mode, normal open contact, auto backlight and the
+// default menus.
+void LockCore_Init(LockCore* core);
+
+// Applies one event at time `now` (ms) to the state and lists the resulting effects.
+void LockCore_Step(LockCore* core, const LockEvent* event, uint32_t now, LockEffects* effects);
+
+// The fields flagged in `twin` whose value differs from the core's configuration, as enum
+// LockTwinField bits. A twin that repeats the configuration has no effects.
+uint32_t LockCore_ChangedTwinFields(const LockCore* core, const struct LockTwin* twin);
+
+// Why a LOCK_EVENT_CONFIG with `config` would be ignored, or NULL if it is applied. It must
+// set something, the mono switch time must be 1 to 999 seconds, the passwords must be digits
+// that fit, and the user and config passwords must still differ afterwards.
+const char* LockCore_CheckConfig(const LockCore* core, const struct LockTwin* config);
+
+// Why a saved configuration can't be restored with LOCK_EVENT_START, or NULL if it can. It
+// must set every reported field, the modes must be ones the menus offer, and the rest is
+// checked as by LockCore_CheckConfig.
+const char* LockCore_CheckSavedConfig(const struct LockTwin* config);
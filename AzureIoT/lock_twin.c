@@ -0,0 +1,304 @@
+// Generated by script/twin_codegen.py from lock_twin.json, do not edit.
+#include "lock_twin.h"
+
+#include <string.h>
+
+#include "json_reader.h"
+
+//keys are found by a perfect hash: the seed was picked so that no two keys share a slot
+#define HASH_SEED 0x3D25CAEFu
+#define HASH_BITS 4
+
+typedef enum KeyKind {
+	KEY_PROPERTY,
+	KEY_DESIRED,
+	KEY_REPORTED,
+	KEY_VERSION
+} KeyKind;
+
+typedef struct TwinKey {
+	const char* name;//NULL for an empty slot
+	uint8_t length;
+	uint8_t kind;//KeyKind
+	uint8_t property;//index in the schema, bit in present
+} TwinKey;
+
+static const TwinKey keys[1 << HASH_BITS] = {
+	[1] = { "reported", 8, KEY_REPORTED, 0 },
+	[2] = { "DisplayBacklightMode", 20, KEY_PROPERTY, 4 },
+	[3] = { "desired", 7, KEY_DESIRED, 0 },
+	[4] = { "MetricsInterval", 15, KEY_PROPERTY, 8 },
+	[6] = { "ConfigPassword", 14, KEY_PROPERTY, 7 },
+	[8] = { "AlwaysOpen", 10, KEY_PROPERTY, 0 },
+	[9] = { "ContactMode", 11, KEY_PROPERTY, 3 },
+	[10] = { "$version", 8, KEY_VERSION, 0 },
+	[11] = { "UserPassword", 12, KEY_PROPERTY, 6 },
+	[13] = { "MonoSwitchTime", 14, KEY_PROPERTY, 5 },
+	[14] = { "AlwaysClosed", 12, KEY_PROPERTY, 1 },
+	[15] = { "LockMode", 8, KEY_PROPERTY, 2 }
+};
+
+typedef struct EnumValue {
+	const char* text;
+	uint8_t length;
+	uint8_t value;
+} EnumValue;
+
+static const EnumValue lockModeValues[] = {
+	{ "Monostable", 10, MONO },
+	{ "Bistable", 8, BI }
+};
+
+static const EnumValue contactModeValues[] = {
+	{ "Normal open", 11, NORMAL_OPEN },
+	{ "Normal closed", 13, NORMAL_CLOSED }
+};
+
+static const EnumValue displayBacklightValues[] = {
+	{ "None", 4, NONE },
+	{ "Auto", 4, AUTO },
+	{ "Constant", 8, CONSTANT }
+};
+
+//longest enum text, plus one byte to tell a longer string apart and the terminator
+#define ENUM_TEXT_SIZE 15
+
+static uint32_t hashKey(const char* key, size_t length)
+{
+	uint32_t hash = HASH_SEED;
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+	return hash >> (32 - HASH_BITS);
+}
+
+static const TwinKey* findKey(const char* key, size_t length)
+{
+	const TwinKey* entry = &keys[hashKey(key, length)];
+	if (entry->name == NULL || entry->length != length || memcmp(entry->name, key, length) != 0)
+		return NULL;
+	return entry;
+}
+
+//each reader returns 1 if it set the field, 2 if it set it to a fallback (an enum string that
+//isn't listed, a string cut to fit), 0 if the value was skipped, -1 if the JSON is malformed
+
+//{"value": true}
+static int readFlag(JsonReader* reader, bool* value)
+{
+	if (JsonReader_Peek(reader) != '{')
+		return JsonReader_Skip(reader);
+	JsonReader_BeginObject(reader);
+	int found = 0;
+	const char* key;
+	size_t keyLength;
+	int more;
+	while ((more = JsonReader_NextMember(reader, &key, &keyLength)) > 0) {
+		if (keyLength == 5 && memcmp(key, "value", 5) == 0 && (JsonReader_Peek(reader) == 't' || JsonReader_Peek(reader) == 'f')) {
+			if (JsonReader_Bool(reader, value) < 0)
+				return -1;
+			found = 1;
+		}
+		else if (JsonReader_Skip(reader) < 0)
+			return -1;
+	}
+	return more < 0 ? -1 : found;
+}
+
+static int readEnum(JsonReader* reader, const EnumValue* values, size_t count, uint8_t otherwise, uint8_t* value)
+{
+	if (JsonReader_Peek(reader) != '"')
+		return JsonReader_Skip(reader);
+	char text[ENUM_TEXT_SIZE];
+	if (JsonReader_String(reader, text, sizeof(text)) < 0)
+		return -1;
+	size_t length = strlen(text);
+	for (size_t i = 0; i < count; i++) {
+		if (values[i].length == length && memcmp(values[i].text, text, length) == 0) {
+			*value = values[i].value;
+			return 1;
+		}
+	}
+	*value = otherwise;
+	return 2;
+}
+
+//a number, or a string of digits as the lock reports it
+static int readUint(JsonReader* reader, uint32_t min, uint32_t max, uint32_t* value)
+{
+	int64_t number = -1;
+	char c = JsonReader_Peek(reader);
+	if (c == '"') {
+		char text[12];
+		if (JsonReader_String(reader, text, sizeof(text)) < 0)
+			return -1;
+		if (text[0] != '\0' && strlen(text) < sizeof(text) - 1) {
+			number = 0;
+			for (const char* digit = text; *digit && number >= 0; digit++)
+				number = *digit >= '0' && *digit <= '9' ? number * 10 + (*digit - '0') : -1;
+		}
+	}
+	else if (c == '-' || (c >= '0' && c <= '9')) {
+		if (JsonReader_Int(reader, &number) < 0)
+			return -1;
+	}
+	else
+		return JsonReader_Skip(reader);
+	if (number < (int64_t)min || number > (int64_t)max)
+		return 0;
+	*value = (uint32_t)number;
+	return 1;
+}
+
+static int readString(JsonReader* reader, char* value, size_t size)
+{
+	if (JsonReader_Peek(reader) != '"')
+		return JsonReader_Skip(reader);
+	int length = JsonReader_String(reader, value, size);
+	if (length < 0)
+		return -1;
+	return (size_t)length < size ? 1 : 2;
+}
+
+static int readProperty(JsonReader* reader, uint8_t property, LockTwin* twin)
+{
+	switch (property) {
+	case 0://AlwaysOpen
+		return readFlag(reader, &twin->alwaysOpen);
+	case 1://AlwaysClosed
+		return readFlag(reader, &twin->alwaysClosed);
+	case 2://LockMode
+		return readEnum(reader, lockModeValues, sizeof(lockModeValues) / sizeof(lockModeValues[0]), BI, &twin->lockMode);
+	case 3://ContactMode
+		return readEnum(reader, contactModeValues, sizeof(contactModeValues) / sizeof(contactModeValues[0]), NORMAL_CLOSED, &twin->contactMode);
+	case 4://DisplayBacklightMode
+		return readEnum(reader, displayBacklightValues, sizeof(displayBacklightValues) / sizeof(displayBacklightValues[0]), CONSTANT, &twin->displayBacklight);
+	case 5://MonoSwitchTime
+		return readUint(reader, 1, UINT32_MAX, &twin->monoSwitchSeconds);
+	case 6://UserPassword
+		return readString(reader, twin->userPassword, sizeof(twin->userPassword));
+	case 7://ConfigPassword
+		return readString(reader, twin->adminPassword, sizeof(twin->adminPassword));
+	case 8://MetricsInterval
+		return readUint(reader, 0, 86400, &twin->metricsIntervalSeconds);
+	default:
+		return JsonReader_Skip(reader);
+	}
+}
+
+//reads the members of an object, taking the properties flagged in `accept` and its $version
+//`versions` is set at the top level, where the desired and reported sections are entered
+static int readMembers(JsonReader* reader, uint32_t accept, LockTwin* twin, int64_t* version, LockTwinVersions* versions)
+{
+	const char* key;
+	size_t keyLength;
+	int more;
+	while ((more = JsonReader_NextMember(reader, &key, &keyLength)) > 0) {
+		const TwinKey* entry = findKey(key, keyLength);
+		int found = 0;
+		if (entry != NULL && entry->kind == KEY_PROPERTY && (accept & (1u << entry->property)))
+			found = readProperty(reader, entry->property, twin);
+		else if (entry != NULL && entry->kind == KEY_VERSION && JsonReader_Peek(reader) != '"')
+			found = JsonReader_Int(reader, version);
+		else if (versions != NULL && entry != NULL && (entry->kind == KEY_DESIRED || entry->kind == KEY_REPORTED)
+			&& JsonReader_Peek(reader) == '{') {
+			JsonReader_BeginObject(reader);
+			if (entry->kind == KEY_DESIRED)
+				found = readMembers(reader, LOCK_TWIN_DESIRED_FIELDS, twin, &versions->desired, NULL);
+			else
+				found = readMembers(reader, LOCK_TWIN_REPORTED_FIELDS, twin, &versions->reported, NULL);
+		}
+		else
+			found = JsonReader_Skip(reader);
+		if (found < 0)
+			return -1;
+		if (found > 0 && entry != NULL && entry->kind == KEY_PROPERTY)
+			twin->present |= 1u << entry->property;
+	}
+	return more;
+}
+
+int LockTwin_Parse(const char* json, size_t length, LockTwin* twin, LockTwinVersions* versions)
+{
+	memset(twin, 0, sizeof(*twin));
+	versions->desired = -1;
+	versions->reported = -1;
+	JsonReader reader;
+	JsonReader_Init(&reader, json, length);
+	//a patch has its properties and $version at the top level
+	if (JsonReader_BeginObject(&reader) < 0 || readMembers(&reader, LOCK_TWIN_ALL_FIELDS, twin, &versions->desired, versions) < 0)
+		return -1;
+	return JsonReader_Finish(&reader);
+}
+
+int LockTwin_ParseStrict(const char* json, size_t length, uint32_t accept, LockTwin* twin, const char** property)
+{
+	memset(twin, 0, sizeof(*twin));
+	*property = NULL;
+	JsonReader reader;
+	JsonReader_Init(&reader, json, length);
+	if (JsonReader_BeginObject(&reader) < 0)
+		return -1;
+	const char* key;
+	size_t keyLength;
+	int more;
+	while ((more = JsonReader_NextMember(&reader, &key, &keyLength)) > 0) {
+		const TwinKey* entry = findKey(key, keyLength);
+		if (entry == NULL || entry->kind != KEY_PROPERTY || !(accept & (1u << entry->property)))
+			return -1;
+		if (readProperty(&reader, entry->property, twin) != 1) {
+			*property = reader.error ? NULL : entry->name;
+			return -1;
+		}
+		twin->present |= 1u << entry->property;
+	}
+	if (more < 0)
+		return -1;
+	return JsonReader_Finish(&reader);
+}
+
+//the text of the first value that maps to `value`
+static const char* enumText(const EnumValue* values, size_t count, uint8_t value)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (values[i].value == value)
+			return values[i].text;
+	}
+	return "";
+}
+
+//`digits` holds at least 11 bytes
+static const char* formatUint(char* digits, uint32_t value)
+{
+	char* at = digits + 10;
+	*at = '\0';
+	do {
+		*--at = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+	return at;
+}
+
+int LockTwin_WriteReported(JsonWriter* writer, const LockTwin* twin)
+{
+	int result = 0;
+	if (twin->present & LOCK_TWIN_LOCK_MODE) {
+		result |= JsonWriter_String(writer, "LockMode", enumText(lockModeValues, sizeof(lockModeValues) / sizeof(lockModeValues[0]), twin->lockMode));
+	}
+	if (twin->present & LOCK_TWIN_CONTACT_MODE) {
+		result |= JsonWriter_String(writer, "ContactMode", enumText(contactModeValues, sizeof(contactModeValues) / sizeof(contactModeValues[0]), twin->contactMode));
+	}
+	if (twin->present & LOCK_TWIN_DISPLAY_BACKLIGHT_MODE) {
+		result |= JsonWriter_String(writer, "DisplayBacklightMode", enumText(displayBacklightValues, sizeof(displayBacklightValues) / sizeof(displayBacklightValues[0]), twin->displayBacklight));
+	}
+	if (twin->present & LOCK_TWIN_MONO_SWITCH_TIME) {
+		char digits[11];
+		result |= JsonWriter_String(writer, "MonoSwitchTime", formatUint(digits, twin->monoSwitchSeconds));
+	}
+	if (twin->present & LOCK_TWIN_USER_PASSWORD) {
+		result |= JsonWriter_String(writer, "UserPassword", twin->userPassword);
+	}
+	if (twin->present & LOCK_TWIN_CONFIG_PASSWORD) {
+		result |= JsonWriter_String(writer, "ConfigPassword", twin->adminPassword);
+	}
+	return result;
+}
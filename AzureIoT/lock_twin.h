@@ -0,0 +1,64 @@
+// Generated by script/twin_codegen.py from lock_twin.json, do not edit.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+#include "lock_core.h"
+
+// Twin properties, one bit each in LockTwin.present.
+enum LockTwinField {
+	LOCK_TWIN_ALWAYS_OPEN = 1 << 0,
+	LOCK_TWIN_ALWAYS_CLOSED = 1 << 1,
+	LOCK_TWIN_LOCK_MODE = 1 << 2,
+	LOCK_TWIN_CONTACT_MODE = 1 << 3,
+	LOCK_TWIN_DISPLAY_BACKLIGHT_MODE = 1 << 4,
+	LOCK_TWIN_MONO_SWITCH_TIME = 1 << 5,
+	LOCK_TWIN_USER_PASSWORD = 1 << 6,
+	LOCK_TWIN_CONFIG_PASSWORD = 1 << 7,
+	LOCK_TWIN_METRICS_INTERVAL = 1 << 8
+};
+
+#define LOCK_TWIN_FIELD_COUNT 9
+#define LOCK_TWIN_ALL_FIELDS 0x1FFu
+#define LOCK_TWIN_DESIRED_FIELDS (LOCK_TWIN_ALWAYS_OPEN | LOCK_TWIN_ALWAYS_CLOSED | LOCK_TWIN_METRICS_INTERVAL)
+#define LOCK_TWIN_REPORTED_FIELDS (LOCK_TWIN_LOCK_MODE | LOCK_TWIN_CONTACT_MODE | LOCK_TWIN_DISPLAY_BACKLIGHT_MODE | LOCK_TWIN_MONO_SWITCH_TIME | LOCK_TWIN_USER_PASSWORD | LOCK_TWIN_CONFIG_PASSWORD)
+
+// Configuration carried by a twin update. Only the fields flagged in `present` were found.
+typedef struct LockTwin {
+	uint16_t present;//enum LockTwinField bits
+	bool alwaysOpen;//desired AlwaysOpen
+	bool alwaysClosed;//desired AlwaysClosed
+	uint8_t lockMode;//reported LockMode: Monostable, Bistable
+	uint8_t contactMode;//reported ContactMode: Normal open, Normal closed
+	uint8_t displayBacklight;//reported DisplayBacklightMode: None, Auto, Constant
+	uint32_t monoSwitchSeconds;//reported MonoSwitchTime
+	char userPassword[PASSWORD_LENGTH];//reported UserPassword
+	char adminPassword[PASSWORD_LENGTH];//reported ConfigPassword
+	uint32_t metricsIntervalSeconds;//desired MetricsInterval
+} LockTwin;
+
+// $version of the twin's sections, -1 where there was none.
+typedef struct LockTwinVersions {
+	int64_t desired;//of a complete twin's desired section, or of a desired-property patch
+	int64_t reported;
+} LockTwinVersions;
+
+// Reads a complete twin ({"desired": {..}, "reported": {..}}) or a desired-property patch
+// (the properties and $version at the top level) in one pass. In a complete twin a property
+// is only taken from its own section. Unknown keys and values of the wrong type are skipped.
+// Returns 0, or -1 if the JSON is malformed; `twin` then holds what was read before.
+int LockTwin_Parse(const char* json, size_t length, LockTwin* twin, LockTwinVersions* versions);
+
+// Reads a flat object of the properties flagged in `accept`, with nothing left to a fallback:
+// a key that isn't accepted, a value of the wrong type or out of range, an enum string that
+// isn't listed or a string that doesn't fit fails the whole object. Returns 0, or -1 with
+// `property` set to the name of the property whose value failed, NULL if the JSON is
+// malformed or holds a key that isn't accepted.
+int LockTwin_ParseStrict(const char* json, size_t length, uint32_t accept, LockTwin* twin, const char** property);
+
+// Writes the reported properties flagged in `present` as members of the writer's open
+// object, the way the lock reports them. Returns 0, or -1 if the writer overflowed.
+int LockTwin_WriteReported(JsonWriter* writer, const LockTwin* twin);
@@ -0,0 +1,107 @@
+#include "method_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t hashName(const char* name)
+{
+	uint32_t hash = 2166136261u;//FNV-1a
+	for (const char* c = name; *c; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// The slot holding `name`, or the free slot that ends its probe sequence.
+static MethodEntry* probe(const MethodTable* table, const char* name, uint32_t hash)
+{
+	uint32_t index = hash & (METHOD_TABLE_SLOTS - 1);
+	for (;;) {
+		const MethodEntry* entry = &table->slots[index];
+		if (entry->name == NULL || (entry->hash == hash && strcmp(entry->name, name) == 0))
+			return (MethodEntry*)entry;
+		index = (index + 1) & (METHOD_TABLE_SLOTS - 1);
+	}
+}
+
+void MethodTable_Init(MethodTable* table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+int MethodTable_Register(MethodTable* table, const char* name, MethodHandler handler, size_t responseSize)
+{
+	//a free slot is always left so every probe ends
+	if (table->count == METHOD_TABLE_SLOTS - 1)
+		return -1;
+	uint32_t hash = hashName(name);
+	MethodEntry* entry = probe(table, name, hash);
+	if (entry->name != NULL)
+		return -1;
+	entry->name = name;
+	entry->hash = hash;
+	entry->handler = handler;
+	entry->responseSize = responseSize < METHOD_ERROR_RESPONSE_SIZE ? METHOD_ERROR_RESPONSE_SIZE : responseSize;
+	table->count++;
+	return 0;
+}
+
+const MethodEntry* MethodTable_Find(const MethodTable* table, const char* name)
+{
+	const MethodEntry* entry = probe(table, name, hashName(name));
+	return entry->name != NULL ? entry : NULL;
+}
+
+static const char* errorText(int status)
+{
+	switch (status) {
+	case METHOD_BAD_REQUEST:
+		return "Bad request";
+	case METHOD_NOT_FOUND:
+		return "Unknown method";
+	case METHOD_CONFLICT:
+		return "Not allowed now";
+	default:
+		return "Failed";
+	}
+}
+
+int MethodTable_Call(MethodTable* table, void* context, const char* name, const unsigned char* payload,
+	size_t size, unsigned char** response, size_t* responseSize)
+{
+	MethodEntry* entry = probe(table, name, hashName(name));
+	size_t capacity = entry->name != NULL ? entry->responseSize : METHOD_ERROR_RESPONSE_SIZE;
+	char* buffer = malloc(capacity);
+	*response = (unsigned char*)buffer;
+	*responseSize = 0;
+	if (buffer == NULL)
+		return METHOD_FAILED;
+
+	JsonWriter writer;
+	JsonWriter_Init(&writer, buffer, capacity);
+	int status = METHOD_NOT_FOUND;
+	if (entry->name != NULL) {
+		entry->calls++;
+		status = entry->handler(context, payload, size, &writer);
+		if (status == METHOD_OK && JsonWriter_Finish(&writer) < 0)
+			status = METHOD_FAILED;
+		if (status != METHOD_OK)
+			entry->failures++;
+	}
+	else {
+		table->unknownCalls++;
+	}
+
+	//a handler that fails may explain why in its response, anything else gets the standard one
+	if (status != METHOD_OK && (status == METHOD_FAILED || JsonWriter_Finish(&writer) <= 0)) {
+		JsonWriter_Init(&writer, buffer, capacity);
+		JsonWriter_BeginObject(&writer, NULL);
+		JsonWriter_String(&writer, "Response", "Error");
+		JsonWriter_String(&writer, "Error", errorText(status));
+		JsonWriter_EndObject(&writer);
+	}
+	int length = JsonWriter_Finish(&writer);
+	*responseSize = length > 0 ? (size_t)length : 0;
+	return status;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+// Direct methods by name. Names are hashed once when they are registered, so a call finds
+// its handler in one probe of an open-addressed table instead of comparing every name.
+// The response buffer is allocated at the size the method registered before the handler
+// runs, and the handler writes its JSON straight into it; the IoT SDK frees it after
+// sending. A call that fails answers {"Response": "Error", "Error": ...} with one of the
+// status codes below, unless the handler wrote its own explanation.
+
+#define METHOD_TABLE_SLOTS 16//power of two, at most METHOD_TABLE_SLOTS - 1 methods
+#define METHOD_ERROR_RESPONSE_SIZE 64
+
+typedef enum MethodStatus {
+	METHOD_OK = 200,
+	METHOD_BAD_REQUEST = 400,//the payload isn't what the method takes
+	METHOD_NOT_FOUND = 404,//no method of that name
+	METHOD_CONFLICT = 409,//the lock's state doesn't allow it now
+	METHOD_FAILED = 500//the response didn't fit or couldn't be allocated
+} MethodStatus;
+
+// Handles one call with the context given to MethodTable_Call. Returns a MethodStatus; on
+// METHOD_OK `response` must hold the finished document.
+typedef int (*MethodHandler)(void* context, const unsigned char* payload, size_t size, JsonWriter* response);
+
+typedef struct MethodEntry {
+	const char* name;//NULL for a free slot
+	uint32_t hash;
+	uint32_t calls;
+	uint32_t failures;//calls answered with another status than METHOD_OK
+	size_t responseSize;//largest response, terminator included
+	MethodHandler handler;
+} MethodEntry;
+
+typedef struct MethodTable {
+	MethodEntry slots[METHOD_TABLE_SLOTS];
+	uint8_t count;
+	uint32_t unknownCalls;
+} MethodTable;
+
+void MethodTable_Init(MethodTable* table);
+
+// Adds a method whose response takes at most `responseSize` bytes. `name` must outlive the
+// table. Returns 0, or -1 if the name is taken or the table is full.
+int MethodTable_Register(MethodTable* table, const char* name, MethodHandler handler, size_t responseSize);
+
+// The method of that name, or NULL.
+const MethodEntry* MethodTable_Find(const MethodTable* table, const char* name);
+
+// Runs the method and hands back the response the way IoTHubDeviceClient_LL method
+// callbacks do. Returns its status.
+int MethodTable_Call(MethodTable* table, void* context, const char* name, const unsigned char* payload,
+	size_t size, unsigned char** response, size_t* responseSize);
@@ -0,0 +1,119 @@
+#include "metrics.h"
+
+#include <string.h>
+
+void Metrics_Init(Metrics* metrics, uint32_t intervalMs, uint32_t now)
+{
+	memset(metrics, 0, sizeof(*metrics));
+	metrics->intervalMs = intervalMs;
+	metrics->startMs = now;
+}
+
+static int add(Metrics* metrics, const char* name, MetricType type, const uint32_t* bounds, uint8_t boundCount)
+{
+	if (metrics->count == METRICS_MAX || boundCount >= METRIC_BUCKETS)
+		return -1;
+	Metric* metric = &metrics->items[metrics->count];
+	metric->name = name;
+	metric->type = (uint8_t)type;
+	metric->bounds = bounds;
+	metric->bucketCount = (uint8_t)(boundCount + 1);
+	return metrics->count++;
+}
+
+int Metrics_AddCounter(Metrics* metrics, const char* name)
+{
+	return add(metrics, name, METRIC_COUNTER, NULL, 0);
+}
+
+int Metrics_AddGauge(Metrics* metrics, const char* name)
+{
+	return add(metrics, name, METRIC_GAUGE, NULL, 0);
+}
+
+int Metrics_AddHistogram(Metrics* metrics, const char* name, const uint32_t* bounds, uint8_t boundCount)
+{
+	return add(metrics, name, METRIC_HISTOGRAM, bounds, boundCount);
+}
+
+void Metrics_Count(Metrics* metrics, int id, uint32_t count)
+{
+	if (id < 0)
+		return;
+	metrics->items[id].value += count;
+	metrics->active = true;
+}
+
+void Metrics_Set(Metrics* metrics, int id, uint32_t value)
+{
+	if (id < 0)
+		return;
+	Metric* metric = &metrics->items[id];
+	metric->value = value;
+	if (value > metric->max)
+		metric->max = value;
+}
+
+void Metrics_Observe(Metrics* metrics, int id, uint32_t value)
+{
+	if (id < 0)
+		return;
+	Metric* metric = &metrics->items[id];
+	//at most METRIC_BUCKETS - 1 compares
+	uint8_t bucket = 0;
+	while (bucket < metric->bucketCount - 1 && value >= metric->bounds[bucket])
+		bucket++;
+	metric->buckets[bucket]++;
+}
+
+void Metrics_SetInterval(Metrics* metrics, uint32_t intervalMs)
+{
+	metrics->intervalMs = intervalMs;
+}
+
+bool Metrics_IsDue(const Metrics* metrics, uint32_t now)
+{
+	return metrics->intervalMs > 0 && now - metrics->startMs >= metrics->intervalMs;
+}
+
+int Metrics_WriteSummary(Metrics* metrics, JsonWriter* writer, uint32_t now)
+{
+	JsonWriter_Uint(writer, "Seconds", (now - metrics->startMs + 500) / 1000);
+	for (int i = 0; i < metrics->count; i++) {
+		const Metric* metric = &metrics->items[i];
+		if (metric->type == METRIC_COUNTER) {
+			JsonWriter_Uint(writer, metric->name, metric->value);
+			continue;
+		}
+		JsonWriter_BeginArray(writer, metric->name);
+		if (metric->type == METRIC_GAUGE) {
+			JsonWriter_Uint(writer, NULL, metric->value);
+			JsonWriter_Uint(writer, NULL, metric->max);
+		}
+		else {
+			int used = metric->bucketCount;
+			while (used > 0 && metric->buckets[used - 1] == 0)
+				used--;
+			for (int bucket = 0; bucket < used; bucket++)
+				JsonWriter_Uint(writer, NULL, metric->buckets[bucket]);
+		}
+		JsonWriter_EndArray(writer);
+	}
+	Metrics_Restart(metrics, now);
+	return writer->overflow ? -1 : 0;
+}
+
+void Metrics_Restart(Metrics* metrics, uint32_t now)
+{
+	for (int i = 0; i < metrics->count; i++) {
+		Metric* metric = &metrics->items[i];
+		//a gauge keeps its latest value, its highest starts from there
+		if (metric->type == METRIC_GAUGE)
+			metric->max = metric->value;
+		else
+			metric->value = 0;
+		memset(metric->buckets, 0, sizeof(metric->buckets));
+	}
+	metrics->active = false;
+	metrics->startMs = now;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+
+// Counters, gauges and histograms of one door, summed up over an interval and published as
+// one summary instead of a message per event. A metric is registered once and updated through
+// the id it was given, so an update is an index and a few compares: no name lookup, no
+// allocation. Histograms have fixed buckets, so the summary carries distributions that
+// events one by one can't give without sending every sample.
+
+#define METRICS_MAX 12
+#define METRIC_BUCKETS 8//a histogram has at most METRIC_BUCKETS - 1 bounds, the last bucket counts the rest
+
+typedef enum MetricType {
+	METRIC_COUNTER,//events in the interval
+	METRIC_GAUGE,//latest value and highest in the interval
+	METRIC_HISTOGRAM//values in the interval, per bucket
+} MetricType;
+
+typedef struct Metric {
+	const char* name;//string constant, the summary key
+	uint8_t type;//MetricType
+	uint8_t bucketCount;//histogram: its bounds + 1
+	const uint32_t* bounds;//histogram: ascending, a value below bounds[i] goes to bucket i
+	uint32_t value;//counter: count; gauge: latest
+	uint32_t max;//gauge: highest since the interval started
+	uint32_t buckets[METRIC_BUCKETS];
+} Metric;
+
+typedef struct Metrics {
+	Metric items[METRICS_MAX];
+	uint8_t count;
+	bool active;//a counter counted in this interval
+	uint32_t intervalMs;//0: no summaries
+	uint32_t startMs;//when the interval started
+} Metrics;
+
+void Metrics_Init(Metrics* metrics, uint32_t intervalMs, uint32_t now);
+
+// Add a metric and return its id, or -1 if the registry is full. `name` must outlive the
+// registry, and so must `bounds`, `boundCount` (at most METRIC_BUCKETS - 1) ascending values.
+int Metrics_AddCounter(Metrics* metrics, const char* name);
+int Metrics_AddGauge(Metrics* metrics, const char* name);
+int Metrics_AddHistogram(Metrics* metrics, const char* name, const uint32_t* bounds, uint8_t boundCount);
+
+// Updates of the metric with that id; an id of -1 is ignored, so a metric that couldn't be
+// registered costs nothing.
+void Metrics_Count(Metrics* metrics, int id, uint32_t count);
+void Metrics_Set(Metrics* metrics, int id, uint32_t value);
+void Metrics_Observe(Metrics* metrics, int id, uint32_t value);
+
+// Changes the interval, the current one goes on.
+void Metrics_SetInterval(Metrics* metrics, uint32_t intervalMs);
+
+// Whether the interval is over at `now`.
+bool Metrics_IsDue(const Metrics* metrics, uint32_t now);
+
+// Writes the interval as members of the writer's open object and starts the next one:
+// "Seconds" it lasted, a counter as its count, a gauge as [latest, highest] and a histogram
+// as its bucket counts, without the empty ones at the end. Returns 0, or -1 if the writer
+// overflowed.
+int Metrics_WriteSummary(Metrics* metrics, JsonWriter* writer, uint32_t now);
+
+// Starts the next interval without writing this one.
+void Metrics_Restart(Metrics* metrics, uint32_t now);
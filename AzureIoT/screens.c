@@ -36,6 +36,8 @@ int drawBlank()
 	int result = fillScreen(0);
 	if (result < 0)
 		return -1;
+
+	return 0;
 }
 
 int drawLocked()
@@ -204,4 +206,25 @@ int drawChangeDisplayMode()
 		return -1;
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int drawFactoryReset()
+{
+	int result = fillScreen(0x0000ff);
+	if (result < 0)
+		return -1;
+
+	result = drawText("Factory reset?", 10, 20, 0xFFFFFF);
+	if (result < 0)
+		return -1;
+
+	result = drawText("# to confirm.", 10, 30, 0xFFFFFF);
+	if (result < 0)
+		return -1;
+
+	result = drawText("B to cancel.", 10, 40, 0xFFFFFF);
+	if (result < 0)
+		return -1;
+
+	return 0;
+}
@@ -11,4 +11,5 @@ int drawChangePassword();
 int drawChangeLockMode();
 int drawChangeContactMode();
 int drawChangeMonoSwitchTime();
-int drawChangeDisplayMode();
\ No newline at end of file
+int drawChangeDisplayMode();
+int drawFactoryReset();
\ No newline at end of file
@@ -0,0 +1,519 @@
+#!/usr/bin/env python3
+"""Generates the twin property binding of the lock from its schema.
+
+    python3 script/twin_codegen.py lock_twin.json
+
+writes lock_twin.h and lock_twin.c next to the schema. They are checked in, so the device
+build needs no Python; rerun this after changing the schema (the simulator's `make twin-code`
+does). The schema lists the properties with their twin section, C field and type:
+
+    flag    desired {"value": true/false}, a bool field
+    enum    a string from `values`, mapped to a C constant; any other string is `otherwise`
+    uint    a number, or a string of digits, from `min` (default 0) to `max` (default
+            UINT32_MAX); reported as a string with `reportAsString`
+    string  a char array of `size` bytes, longer values are cut to fit
+
+The generated parser reads a complete twin or a desired-property patch in one pass with
+json_reader.c, and a strict variant reads a flat configuration object (the ApplyConfig
+direct method) and fails on anything it would otherwise skip or fall back on. Property names, the section names and $version are found through a perfect
+hash: a seeded FNV-1a whose seed is searched here so that no two keys share a slot, and one
+memcmp confirms the key. The reported-state serializer writes the fields back with
+json_writer.c under the same names.
+"""
+
+import json
+import os
+import re
+import sys
+
+FNV_PRIME = 16777619
+
+
+def fnv1a(seed, text):
+    value = seed
+    for byte in text.encode('utf-8'):
+        value = ((value ^ byte) * FNV_PRIME) & 0xFFFFFFFF
+    return value
+
+
+def find_perfect_hash(keys):
+    """Returns (seed, bits) such that the top `bits` bits of the hash differ for every key."""
+    bits = max(1, (len(keys) - 1).bit_length())
+    while bits <= 8:
+        for seed in range(1, 200000):
+            seed = (2166136261 + seed * 0x9E3779B1) & 0xFFFFFFFF
+            slots = {fnv1a(seed, key) >> (32 - bits) for key in keys}
+            if len(slots) == len(keys):
+                return seed, bits
+        bits += 1
+    raise SystemExit('twin_codegen: no perfect hash found for %d keys' % len(keys))
+
+
+def upper_snake(name):
+    return re.sub(r'(?<=[a-z0-9])(?=[A-Z])', '_', name).upper()
+
+
+def c_string(text):
+    return '"' + text.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+
+def check_schema(schema):
+    names = set()
+    for prop in schema['properties']:
+        if prop['name'] in names or prop['name'] in ('desired', 'reported', '$version'):
+            raise SystemExit('twin_codegen: duplicate or reserved property %s' % prop['name'])
+        names.add(prop['name'])
+        if prop['section'] not in ('desired', 'reported'):
+            raise SystemExit('twin_codegen: %s: section must be desired or reported' % prop['name'])
+        if prop['type'] not in ('flag', 'enum', 'uint', 'string'):
+            raise SystemExit('twin_codegen: %s: unknown type %s' % (prop['name'], prop['type']))
+        if prop['type'] == 'enum' and prop['otherwise'] not in prop['values'].values():
+            raise SystemExit('twin_codegen: %s: otherwise must be one of the values' % prop['name'])
+    if len(schema['properties']) > 32:
+        raise SystemExit('twin_codegen: at most 32 properties')
+
+
+def fields_type(count):
+    if count <= 8:
+        return 'uint8_t'
+    if count <= 16:
+        return 'uint16_t'
+    return 'uint32_t'
+
+
+def field_declaration(prop):
+    kind = prop['type']
+    if kind == 'flag':
+        return 'bool %s;' % prop['field']
+    if kind == 'enum':
+        return 'uint8_t %s;' % prop['field']
+    if kind == 'uint':
+        return 'uint32_t %s;' % prop['field']
+    return 'char %s[%s];' % (prop['field'], prop['size'])
+
+
+def field_comment(prop):
+    if prop['type'] == 'enum':
+        return '//%s %s: %s' % (prop['section'], prop['name'], ', '.join(prop['values']))
+    return '//%s %s' % (prop['section'], prop['name'])
+
+
+def generate_header(schema, source, hash_info):
+    struct = schema['struct']
+    prefix = upper_snake(struct) + '_'
+    props = schema['properties']
+    bits_type = fields_type(len(props))
+    lines = [
+        '// Generated by script/twin_codegen.py from %s, do not edit.' % source,
+        '#pragma once',
+        '',
+        '#include <stdbool.h>',
+        '#include <stddef.h>',
+        '#include <stdint.h>',
+        '',
+        '#include "json_writer.h"',
+        '#include "%s"' % schema['include'],
+        '',
+        '// Twin properties, one bit each in %s.present.' % struct,
+        'enum %sField {' % struct,
+    ]
+    for index, prop in enumerate(props):
+        comma = ',' if index + 1 < len(props) else ''
+        lines.append('\t%s%s = 1%s << %d%s' % (prefix, upper_snake(prop['name']), 'u' if index >= 16 else '', index, comma))
+    lines.append('};')
+    lines.append('')
+    lines.append('#define %sFIELD_COUNT %d' % (prefix, len(props)))
+    lines.append('#define %sALL_FIELDS 0x%Xu' % (prefix, (1 << len(props)) - 1))
+    for section in ('desired', 'reported'):
+        members = [prefix + upper_snake(p['name']) for p in props if p['section'] == section]
+        lines.append('#define %s%s_FIELDS (%s)' % (prefix, section.upper(), ' | '.join(members) if members else '0'))
+    lines += [
+        '',
+        '// Configuration carried by a twin update. Only the fields flagged in `present` were found.',
+        'typedef struct %s {' % struct,
+        '\t%s present;//enum %sField bits' % (bits_type, struct),
+    ]
+    for prop in props:
+        lines.append('\t%s%s' % (field_declaration(prop), field_comment(prop)))
+    lines += [
+        '} %s;' % struct,
+        '',
+        '// $version of the twin\'s sections, -1 where there was none.',
+        'typedef struct %sVersions {' % struct,
+        '\tint64_t desired;//of a complete twin\'s desired section, or of a desired-property patch',
+        '\tint64_t reported;',
+        '} %sVersions;' % struct,
+        '',
+        '// Reads a complete twin ({"desired": {..}, "reported": {..}}) or a desired-property patch',
+        '// (the properties and $version at the top level) in one pass. In a complete twin a property',
+        '// is only taken from its own section. Unknown keys and values of the wrong type are skipped.',
+        '// Returns 0, or -1 if the JSON is malformed; `twin` then holds what was read before.',
+        'int %s_Parse(const char* json, size_t length, %s* twin, %sVersions* versions);' % (struct, struct, struct),
+        '',
+        '// Reads a flat object of the properties flagged in `accept`, with nothing left to a fallback:',
+        '// a key that isn\'t accepted, a value of the wrong type or out of range, an enum string that',
+        '// isn\'t listed or a string that doesn\'t fit fails the whole object. Returns 0, or -1 with',
+        '// `property` set to the name of the property whose value failed, NULL if the JSON is',
+        '// malformed or holds a key that isn\'t accepted.',
+        'int %s_ParseStrict(const char* json, size_t length, uint32_t accept, %s* twin, const char** property);' % (struct, struct),
+        '',
+        '// Writes the reported properties flagged in `present` as members of the writer\'s open',
+        '// object, the way the lock reports them. Returns 0, or -1 if the writer overflowed.',
+        'int %s_WriteReported(JsonWriter* writer, const %s* twin);' % (struct, struct),
+        '',
+    ]
+    return '\n'.join(lines)
+
+
+def generate_source(schema, source, header, hash_info):
+    struct = schema['struct']
+    prefix = upper_snake(struct) + '_'
+    props = schema['properties']
+    seed, bits = hash_info
+
+    keys = [(p['name'], 'KEY_PROPERTY', index) for index, p in enumerate(props)]
+    keys += [('desired', 'KEY_DESIRED', 0), ('reported', 'KEY_REPORTED', 0), ('$version', 'KEY_VERSION', 0)]
+    slots = {}
+    for name, kind, index in keys:
+        slots[fnv1a(seed, name) >> (32 - bits)] = (name, kind, index)
+
+    lines = [
+        '// Generated by script/twin_codegen.py from %s, do not edit.' % source,
+        '#include "%s"' % header,
+        '',
+        '#include <string.h>',
+        '',
+        '#include "json_reader.h"',
+        '',
+        '//keys are found by a perfect hash: the seed was picked so that no two keys share a slot',
+        '#define HASH_SEED 0x%08Xu' % seed,
+        '#define HASH_BITS %d' % bits,
+        '',
+        'typedef enum KeyKind {',
+        '\tKEY_PROPERTY,',
+        '\tKEY_DESIRED,',
+        '\tKEY_REPORTED,',
+        '\tKEY_VERSION',
+        '} KeyKind;',
+        '',
+        'typedef struct TwinKey {',
+        '\tconst char* name;//NULL for an empty slot',
+        '\tuint8_t length;',
+        '\tuint8_t kind;//KeyKind',
+        '\tuint8_t property;//index in the schema, bit in present',
+        '} TwinKey;',
+        '',
+        'static const TwinKey keys[1 << HASH_BITS] = {',
+    ]
+    for slot in sorted(slots):
+        name, kind, index = slots[slot]
+        lines.append('\t[%d] = { %s, %d, %s, %d },' % (slot, c_string(name), len(name.encode('utf-8')), kind, index))
+    lines[-1] = lines[-1].rstrip(',')
+    lines += [
+        '};',
+        '',
+        'typedef struct EnumValue {',
+        '\tconst char* text;',
+        '\tuint8_t length;',
+        '\tuint8_t value;',
+        '} EnumValue;',
+        '',
+    ]
+    for prop in props:
+        if prop['type'] != 'enum':
+            continue
+        lines.append('static const EnumValue %sValues[] = {' % prop['field'])
+        entries = ['\t{ %s, %d, %s }' % (c_string(text), len(text.encode('utf-8')), value) for text, value in prop['values'].items()]
+        lines.append(',\n'.join(entries))
+        lines.append('};')
+        lines.append('')
+
+    longest_enum = max([len(t.encode('utf-8')) for p in props if p['type'] == 'enum' for t in p['values']] or [1])
+    lines += [
+        '//longest enum text, plus one byte to tell a longer string apart and the terminator',
+        '#define ENUM_TEXT_SIZE %d' % (longest_enum + 2),
+        '',
+        'static uint32_t hashKey(const char* key, size_t length)',
+        '{',
+        '\tuint32_t hash = HASH_SEED;',
+        '\tfor (size_t i = 0; i < length; i++)',
+        '\t\thash = (hash ^ (uint8_t)key[i]) * 16777619u;',
+        '\treturn hash >> (32 - HASH_BITS);',
+        '}',
+        '',
+        'static const TwinKey* findKey(const char* key, size_t length)',
+        '{',
+        '\tconst TwinKey* entry = &keys[hashKey(key, length)];',
+        '\tif (entry->name == NULL || entry->length != length || memcmp(entry->name, key, length) != 0)',
+        '\t\treturn NULL;',
+        '\treturn entry;',
+        '}',
+        '',
+        '//each reader returns 1 if it set the field, 2 if it set it to a fallback (an enum string that',
+        '//isn\'t listed, a string cut to fit), 0 if the value was skipped, -1 if the JSON is malformed',
+        '',
+        '//{"value": true}',
+        'static int readFlag(JsonReader* reader, bool* value)',
+        '{',
+        '\tif (JsonReader_Peek(reader) != \'{\')',
+        '\t\treturn JsonReader_Skip(reader);',
+        '\tJsonReader_BeginObject(reader);',
+        '\tint found = 0;',
+        '\tconst char* key;',
+        '\tsize_t keyLength;',
+        '\tint more;',
+        '\twhile ((more = JsonReader_NextMember(reader, &key, &keyLength)) > 0) {',
+        '\t\tif (keyLength == 5 && memcmp(key, "value", 5) == 0 && (JsonReader_Peek(reader) == \'t\' || JsonReader_Peek(reader) == \'f\')) {',
+        '\t\t\tif (JsonReader_Bool(reader, value) < 0)',
+        '\t\t\t\treturn -1;',
+        '\t\t\tfound = 1;',
+        '\t\t}',
+        '\t\telse if (JsonReader_Skip(reader) < 0)',
+        '\t\t\treturn -1;',
+        '\t}',
+        '\treturn more < 0 ? -1 : found;',
+        '}',
+        '',
+        'static int readEnum(JsonReader* reader, const EnumValue* values, size_t count, uint8_t otherwise, uint8_t* value)',
+        '{',
+        '\tif (JsonReader_Peek(reader) != \'"\')',
+        '\t\treturn JsonReader_Skip(reader);',
+        '\tchar text[ENUM_TEXT_SIZE];',
+        '\tif (JsonReader_String(reader, text, sizeof(text)) < 0)',
+        '\t\treturn -1;',
+        '\tsize_t length = strlen(text);',
+        '\tfor (size_t i = 0; i < count; i++) {',
+        '\t\tif (values[i].length == length && memcmp(values[i].text, text, length) == 0) {',
+        '\t\t\t*value = values[i].value;',
+        '\t\t\treturn 1;',
+        '\t\t}',
+        '\t}',
+        '\t*value = otherwise;',
+        '\treturn 2;',
+        '}',
+        '',
+        '//a number, or a string of digits as the lock reports it',
+        'static int readUint(JsonReader* reader, uint32_t min, uint32_t max, uint32_t* value)',
+        '{',
+        '\tint64_t number = -1;',
+        '\tchar c = JsonReader_Peek(reader);',
+        '\tif (c == \'"\') {',
+        '\t\tchar text[12];',
+        '\t\tif (JsonReader_String(reader, text, sizeof(text)) < 0)',
+        '\t\t\treturn -1;',
+        '\t\tif (text[0] != \'\\0\' && strlen(text) < sizeof(text) - 1) {',
+        '\t\t\tnumber = 0;',
+        '\t\t\tfor (const char* digit = text; *digit && number >= 0; digit++)',
+        '\t\t\t\tnumber = *digit >= \'0\' && *digit <= \'9\' ? number * 10 + (*digit - \'0\') : -1;',
+        '\t\t}',
+        '\t}',
+        '\telse if (c == \'-\' || (c >= \'0\' && c <= \'9\')) {',
+        '\t\tif (JsonReader_Int(reader, &number) < 0)',
+        '\t\t\treturn -1;',
+        '\t}',
+        '\telse',
+        '\t\treturn JsonReader_Skip(reader);',
+        '\tif (number < (int64_t)min || number > (int64_t)max)',
+        '\t\treturn 0;',
+        '\t*value = (uint32_t)number;',
+        '\treturn 1;',
+        '}',
+        '',
+        'static int readString(JsonReader* reader, char* value, size_t size)',
+        '{',
+        '\tif (JsonReader_Peek(reader) != \'"\')',
+        '\t\treturn JsonReader_Skip(reader);',
+        '\tint length = JsonReader_String(reader, value, size);',
+        '\tif (length < 0)',
+        '\t\treturn -1;',
+        '\treturn (size_t)length < size ? 1 : 2;',
+        '}',
+        '',
+        'static int readProperty(JsonReader* reader, uint8_t property, %s* twin)' % struct,
+        '{',
+        '\tswitch (property) {',
+    ]
+    for index, prop in enumerate(props):
+        field = 'twin->' + prop['field']
+        lines.append('\tcase %d://%s' % (index, prop['name']))
+        kind = prop['type']
+        if kind == 'flag':
+            call = 'readFlag(reader, &%s)' % field
+        elif kind == 'enum':
+            call = 'readEnum(reader, %sValues, sizeof(%sValues) / sizeof(%sValues[0]), %s, &%s)' % (
+                prop['field'], prop['field'], prop['field'], prop['otherwise'], field)
+        elif kind == 'uint':
+            call = 'readUint(reader, %s, %s, &%s)' % (prop.get('min', 0), prop.get('max', 'UINT32_MAX'), field)
+        else:
+            call = 'readString(reader, %s, sizeof(%s))' % (field, field)
+        lines.append('\t\treturn %s;' % call)
+    lines += [
+        '\tdefault:',
+        '\t\treturn JsonReader_Skip(reader);',
+        '\t}',
+        '}',
+        '',
+        '//reads the members of an object, taking the properties flagged in `accept` and its $version',
+        '//`versions` is set at the top level, where the desired and reported sections are entered',
+        'static int readMembers(JsonReader* reader, uint32_t accept, %s* twin, int64_t* version, %sVersions* versions)' % (struct, struct),
+        '{',
+        '\tconst char* key;',
+        '\tsize_t keyLength;',
+        '\tint more;',
+        '\twhile ((more = JsonReader_NextMember(reader, &key, &keyLength)) > 0) {',
+        '\t\tconst TwinKey* entry = findKey(key, keyLength);',
+        '\t\tint found = 0;',
+        '\t\tif (entry != NULL && entry->kind == KEY_PROPERTY && (accept & (1u << entry->property)))',
+        '\t\t\tfound = readProperty(reader, entry->property, twin);',
+        '\t\telse if (entry != NULL && entry->kind == KEY_VERSION && JsonReader_Peek(reader) != \'"\')',
+        '\t\t\tfound = JsonReader_Int(reader, version);',
+        '\t\telse if (versions != NULL && entry != NULL && (entry->kind == KEY_DESIRED || entry->kind == KEY_REPORTED)',
+        '\t\t\t&& JsonReader_Peek(reader) == \'{\') {',
+        '\t\t\tJsonReader_BeginObject(reader);',
+        '\t\t\tif (entry->kind == KEY_DESIRED)',
+        '\t\t\t\tfound = readMembers(reader, %sDESIRED_FIELDS, twin, &versions->desired, NULL);' % prefix,
+        '\t\t\telse',
+        '\t\t\t\tfound = readMembers(reader, %sREPORTED_FIELDS, twin, &versions->reported, NULL);' % prefix,
+        '\t\t}',
+        '\t\telse',
+        '\t\t\tfound = JsonReader_Skip(reader);',
+        '\t\tif (found < 0)',
+        '\t\t\treturn -1;',
+        '\t\tif (found > 0 && entry != NULL && entry->kind == KEY_PROPERTY)',
+        '\t\t\ttwin->present |= 1u << entry->property;',
+        '\t}',
+        '\treturn more;',
+        '}',
+        '',
+        'int %s_Parse(const char* json, size_t length, %s* twin, %sVersions* versions)' % (struct, struct, struct),
+        '{',
+        '\tmemset(twin, 0, sizeof(*twin));',
+        '\tversions->desired = -1;',
+        '\tversions->reported = -1;',
+        '\tJsonReader reader;',
+        '\tJsonReader_Init(&reader, json, length);',
+        '\t//a patch has its properties and $version at the top level',
+        '\tif (JsonReader_BeginObject(&reader) < 0 || readMembers(&reader, %sALL_FIELDS, twin, &versions->desired, versions) < 0)' % prefix,
+        '\t\treturn -1;',
+        '\treturn JsonReader_Finish(&reader);',
+        '}',
+        '',
+        'int %s_ParseStrict(const char* json, size_t length, uint32_t accept, %s* twin, const char** property)' % (struct, struct),
+        '{',
+        '\tmemset(twin, 0, sizeof(*twin));',
+        '\t*property = NULL;',
+        '\tJsonReader reader;',
+        '\tJsonReader_Init(&reader, json, length);',
+        '\tif (JsonReader_BeginObject(&reader) < 0)',
+        '\t\treturn -1;',
+        '\tconst char* key;',
+        '\tsize_t keyLength;',
+        '\tint more;',
+        '\twhile ((more = JsonReader_NextMember(&reader, &key, &keyLength)) > 0) {',
+        '\t\tconst TwinKey* entry = findKey(key, keyLength);',
+        '\t\tif (entry == NULL || entry->kind != KEY_PROPERTY || !(accept & (1u << entry->property)))',
+        '\t\t\treturn -1;',
+        '\t\tif (readProperty(&reader, entry->property, twin) != 1) {',
+        '\t\t\t*property = reader.error ? NULL : entry->name;',
+        '\t\t\treturn -1;',
+        '\t\t}',
+        '\t\ttwin->present |= 1u << entry->property;',
+        '\t}',
+        '\tif (more < 0)',
+        '\t\treturn -1;',
+        '\treturn JsonReader_Finish(&reader);',
+        '}',
+        '',
+        'int %s_WriteReported(JsonWriter* writer, const %s* twin)' % (struct, struct),
+        '{',
+        '\tint result = 0;',
+    ]
+    uses_enum_text = False
+    for prop in props:
+        if prop['section'] != 'reported':
+            continue
+        bit = prefix + upper_snake(prop['name'])
+        field = 'twin->' + prop['field']
+        name = c_string(prop['name'])
+        kind = prop['type']
+        lines.append('\tif (twin->present & %s) {' % bit)
+        if kind == 'flag':
+            lines.append('\t\tresult |= JsonWriter_Bool(writer, %s, %s);' % (name, field))
+        elif kind == 'enum':
+            uses_enum_text = True
+            lines.append('\t\tresult |= JsonWriter_String(writer, %s, enumText(%sValues, sizeof(%sValues) / sizeof(%sValues[0]), %s));' % (
+                name, prop['field'], prop['field'], prop['field'], field))
+        elif kind == 'uint' and prop.get('reportAsString'):
+            lines.append('\t\tchar digits[11];')
+            lines.append('\t\tresult |= JsonWriter_String(writer, %s, formatUint(digits, %s));' % (name, field))
+        elif kind == 'uint':
+            lines.append('\t\tresult |= JsonWriter_Uint(writer, %s, %s);' % (name, field))
+        else:
+            lines.append('\t\tresult |= JsonWriter_String(writer, %s, %s);' % (name, field))
+        lines.append('\t}')
+    lines += [
+        '\treturn result;',
+        '}',
+        '',
+    ]
+
+    # Helpers of the serializer go before it, and only the ones it uses.
+    helpers = []
+    if uses_enum_text:
+        helpers += [
+            '//the text of the first value that maps to `value`',
+            'static const char* enumText(const EnumValue* values, size_t count, uint8_t value)',
+            '{',
+            '\tfor (size_t i = 0; i < count; i++) {',
+            '\t\tif (values[i].value == value)',
+            '\t\t\treturn values[i].text;',
+            '\t}',
+            '\treturn "";',
+            '}',
+            '',
+        ]
+    if any(p['type'] == 'uint' and p.get('reportAsString') and p['section'] == 'reported' for p in props):
+        helpers += [
+            '//`digits` holds at least 11 bytes',
+            'static const char* formatUint(char* digits, uint32_t value)',
+            '{',
+            '\tchar* at = digits + 10;',
+            '\t*at = \'\\0\';',
+            '\tdo {',
+            '\t\t*--at = (char)(\'0\' + value % 10);',
+            '\t\tvalue /= 10;',
+            '\t} while (value != 0);',
+            '\treturn at;',
+            '}',
+            '',
+        ]
+    serializer = lines.index('int %s_WriteReported(JsonWriter* writer, const %s* twin)' % (struct, struct))
+    lines[serializer:serializer] = helpers
+    return '\n'.join(lines)
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('usage: twin_codegen.py SCHEMA.json', file=sys.stderr)
+        return 2
+    schema_path = sys.argv[1]
+    with open(schema_path) as schema_file:
+        schema = json.load(schema_file)
+    check_schema(schema)
+
+    base = os.path.splitext(schema_path)[0]
+    source = os.path.basename(schema_path)
+    header = os.path.basename(base) + '.h'
+    keys = [p['name'] for p in schema['properties']] + ['desired', 'reported', '$version']
+    hash_info = find_perfect_hash(keys)
+
+    header_text = generate_header(schema, source, hash_info)
+    with open(base + '.h', 'w', newline='\n') as out:
+        out.write(header_text)
+    with open(base + '.c', 'w', newline='\n') as out:
+        out.write(generate_source(schema, source, header, hash_info))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
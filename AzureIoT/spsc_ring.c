@@ -0,0 +1,94 @@
+#include "spsc_ring.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+static uint32_t recordSize(uint32_t length)
+{
+	return (SPSC_RING_RECORD_OVERHEAD + length + 3u) & ~3u;
+}
+
+static void copyIn(SpscRing* ring, uint32_t position, const void* data, uint32_t length)
+{
+	if (length == 0)
+		return;
+	uint32_t offset = position & (ring->size - 1);
+	uint32_t first = ring->size - offset < length ? ring->size - offset : length;
+	memcpy(ring->buffer + offset, data, first);
+	memcpy(ring->buffer, (const uint8_t*)data + first, length - first);
+}
+
+static void copyOut(const SpscRing* ring, uint32_t position, void* data, uint32_t length)
+{
+	uint32_t offset = position & (ring->size - 1);
+	uint32_t first = ring->size - offset < length ? ring->size - offset : length;
+	memcpy(data, ring->buffer + offset, first);
+	memcpy((uint8_t*)data + first, ring->buffer, length - first);
+}
+
+//only the side that owns a counter writes it, so it doesn't need an atomic increment
+static void count(_Atomic uint32_t* counter)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+int SpscRing_Init(SpscRing* ring, void* buffer, uint32_t size)
+{
+	if (size < 2 * SPSC_RING_RECORD_OVERHEAD || (size & (size - 1)) != 0)
+		return -1;
+	ring->buffer = buffer;
+	ring->size = size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->maxDepth, 0);
+	atomic_init(&ring->dropped, 0);
+	return 0;
+}
+
+int SpscRing_Push(SpscRing* ring, uint8_t type, const void* first, uint16_t firstLength,
+	const void* second, uint16_t secondLength)
+{
+	uint32_t length = (uint32_t)firstLength + secondLength;
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t size = recordSize(length);
+	if (length > UINT16_MAX || size > ring->size - (tail - head)) {
+		count(&ring->dropped);
+		return -1;
+	}
+
+	uint8_t header[SPSC_RING_RECORD_OVERHEAD] = { (uint8_t)length, (uint8_t)(length >> 8), type, 0 };
+	copyIn(ring, tail, header, sizeof(header));
+	copyIn(ring, tail + SPSC_RING_RECORD_OVERHEAD, first, firstLength);
+	copyIn(ring, tail + SPSC_RING_RECORD_OVERHEAD + firstLength, second, secondLength);
+	//the consumer sees the record only once it is complete
+	atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+
+	uint32_t depth = tail + size - head;
+	if (depth > atomic_load_explicit(&ring->maxDepth, memory_order_relaxed))
+		atomic_store_explicit(&ring->maxDepth, depth, memory_order_relaxed);
+	return 0;
+}
+
+int SpscRing_Pop(SpscRing* ring, uint8_t* type, void* buffer, size_t size)
+{
+	for (;;) {
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (head == tail)
+			return -1;
+
+		uint8_t header[SPSC_RING_RECORD_OVERHEAD];
+		copyOut(ring, head, header, sizeof(header));
+		uint32_t length = header[0] | ((uint32_t)header[1] << 8);
+		bool fits = length <= size;
+		if (fits) {
+			copyOut(ring, head + SPSC_RING_RECORD_OVERHEAD, buffer, length);
+			*type = header[2];
+		}
+		//the producer may reuse the space once head moves past it
+		atomic_store_explicit(&ring->head, head + recordSize(length), memory_order_release);
+		if (fits)
+			return (int)length;
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Queue of variable-length records between exactly one producer thread and one consumer
+// thread. Each side only writes its own index, so a push or pop never waits for the other
+// side: a push that doesn't fit fails at once and is counted in `dropped`.
+//
+// A record is a 4-byte header (u16 payload length, u8 type, u8 reserved) followed by the
+// payload, padded to 4 bytes. Records wrap around the end of the buffer.
+
+#define SPSC_RING_RECORD_OVERHEAD 4
+
+typedef struct SpscRing {
+	uint8_t* buffer;
+	uint32_t size;// a power of two
+	_Atomic uint32_t head;// bytes popped since init, written by the consumer
+	_Atomic uint32_t tail;// bytes pushed since init, written by the producer
+	_Atomic uint32_t maxDepth;// most bytes queued at once, written by the producer
+	_Atomic uint32_t dropped;// records that didn't fit, written by the producer
+} SpscRing;
+
+// `size` must be a power of two. Returns 0, or -1 if it isn't.
+int SpscRing_Init(SpscRing* ring, void* buffer, uint32_t size);
+
+// Appends a record made of `first` followed by `second` (either may be empty).
+// Returns 0, or -1 if the ring is full.
+int SpscRing_Push(SpscRing* ring, uint8_t type, const void* first, uint16_t firstLength,
+	const void* second, uint16_t secondLength);
+
+// Removes the oldest record and copies its payload into `buffer`. Returns the payload length,
+// or -1 if the ring is empty. A record longer than `size` is skipped.
+int SpscRing_Pop(SpscRing* ring, uint8_t* type, void* buffer, size_t size);
+
+// Bytes queued, as seen from either side.
+static inline uint32_t SpscRing_Depth(SpscRing* ring)
+{
+	return atomic_load_explicit(&ring->tail, memory_order_acquire)
+		- atomic_load_explicit(&ring->head, memory_order_acquire);
+}
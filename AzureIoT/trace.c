@@ -0,0 +1,266 @@
+#include "trace.h"
+
+#include <string.h>
+#include <time.h>
+
+#if TRACE_BUFFER_SIZE < 2 * (TRACE_RECORD_HEADER_SIZE + TRACE_MAX_PAYLOAD)
+#error TRACE_BUFFER_SIZE must hold at least two records of the largest size
+#endif
+
+static uint8_t ring[TRACE_BUFFER_SIZE];
+static size_t head = 0;//where the next record is written
+static size_t tail = 0;//oldest record
+static size_t used = 0;
+static uint32_t droppedRecords = 0;
+
+static struct timespec startTime;
+
+//inputs are stamped with the start of the timer handler that observed them, so a replay
+//can present each input to the same handler call
+static uint32_t handlerStartMs = 0;
+
+//last appended record, so repeated timer expirations can be counted in place
+static bool lastIsTimer = false;
+static size_t lastPayload = 0;
+static uint8_t lastTimer = 0;
+static uint16_t lastTimerCount = 0;
+
+static int lastDoor = -1;
+static int lastNetwork = -1;
+
+static uint32_t nowMs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((now.tv_sec - startTime.tv_sec) * 1000 + (now.tv_nsec - startTime.tv_nsec) / 1000000);
+}
+
+static void putBytes(size_t at, const uint8_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		ring[(at + i) % TRACE_BUFFER_SIZE] = data[i];
+}
+
+static uint8_t getByte(size_t at)
+{
+	return ring[at % TRACE_BUFFER_SIZE];
+}
+
+static void dropOldest()
+{
+	size_t length = getByte(tail + 5) | (getByte(tail + 6) << 8);
+	size_t size = TRACE_RECORD_HEADER_SIZE + length;
+	tail = (tail + size) % TRACE_BUFFER_SIZE;
+	used -= size;
+	droppedRecords++;
+	if (used == 0)
+		lastIsTimer = false;
+}
+
+//appends a record, payload is given in two parts so callers don't need a scratch buffer
+static void append(uint32_t time, uint8_t type, const uint8_t* first, size_t firstSize, const uint8_t* second, size_t secondSize)
+{
+	if (firstSize + secondSize > TRACE_MAX_PAYLOAD)
+	{
+		secondSize = firstSize < TRACE_MAX_PAYLOAD ? TRACE_MAX_PAYLOAD - firstSize : 0;
+		firstSize = firstSize < TRACE_MAX_PAYLOAD ? firstSize : TRACE_MAX_PAYLOAD;
+	}
+	size_t length = firstSize + secondSize;
+	size_t size = TRACE_RECORD_HEADER_SIZE + length;
+	while (used + size > TRACE_BUFFER_SIZE)
+		dropOldest();
+
+	uint8_t header[TRACE_RECORD_HEADER_SIZE] = {
+		(uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), (uint8_t)(time >> 24),
+		type, (uint8_t)length, (uint8_t)(length >> 8)
+	};
+	putBytes(head, header, sizeof(header));
+	putBytes(head + TRACE_RECORD_HEADER_SIZE, first, firstSize);
+	putBytes(head + TRACE_RECORD_HEADER_SIZE + firstSize, second, secondSize);
+
+	lastPayload = (head + TRACE_RECORD_HEADER_SIZE) % TRACE_BUFFER_SIZE;
+	lastIsTimer = false;
+	head = (head + size) % TRACE_BUFFER_SIZE;
+	used += size;
+}
+
+void Trace_Init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+	head = tail = used = 0;
+	droppedRecords = 0;
+	lastIsTimer = false;
+	handlerStartMs = 0;
+	lastDoor = -1;
+	lastNetwork = -1;
+}
+
+void Trace_RecordKey(char key)
+{
+	uint8_t payload = (uint8_t)key;
+	append(handlerStartMs, TRACE_KEY, &payload, 1, NULL, 0);
+}
+
+void Trace_RecordDoor(bool open)
+{
+	if (lastDoor == open)
+		return;
+	lastDoor = open;
+	uint8_t payload = open;
+	append(handlerStartMs, TRACE_DOOR, &payload, 1, NULL, 0);
+}
+
+//the app timer expires every 10 ms, so a run of expirations is kept as one record with a count
+void Trace_RecordTimer(TraceTimer timer)
+{
+	handlerStartMs = nowMs();
+	if (lastIsTimer && lastTimer == timer && lastTimerCount < UINT16_MAX)
+	{
+		lastTimerCount++;
+		uint8_t count[2] = { (uint8_t)lastTimerCount, (uint8_t)(lastTimerCount >> 8) };
+		putBytes(lastPayload + 1, count, sizeof(count));
+		return;
+	}
+	uint8_t payload[3] = { (uint8_t)timer, 1, 0 };
+	append(handlerStartMs, TRACE_TIMER, payload, sizeof(payload), NULL, 0);
+	lastIsTimer = true;
+	lastTimer = (uint8_t)timer;
+	lastTimerCount = 1;
+}
+
+void Trace_RecordNetwork(bool ready)
+{
+	if (lastNetwork == ready)
+		return;
+	lastNetwork = ready;
+	uint8_t payload = ready;
+	append(handlerStartMs, TRACE_NETWORK, &payload, 1, NULL, 0);
+}
+
+void Trace_RecordTwin(int updateState, const unsigned char* payload, size_t size)
+{
+	uint8_t state = (uint8_t)updateState;
+	append(handlerStartMs, TRACE_TWIN, &state, 1, payload, size);
+}
+
+void Trace_RecordMethod(const char* name, const unsigned char* payload, size_t size)
+{
+	append(handlerStartMs, TRACE_METHOD, (const uint8_t*)name, strlen(name) + 1, payload, size);
+}
+
+void Trace_RecordConfig(uint8_t format, const void* record, size_t size)
+{
+	append(nowMs(), TRACE_CONFIG, &format, 1, record, size);
+}
+
+void Trace_RecordFlag(TraceRecordType type, bool value)
+{
+	uint8_t payload = value;
+	append(nowMs(), (uint8_t)type, &payload, 1, NULL, 0);
+}
+
+void Trace_RecordHash(TraceRecordType type, const char* text)
+{
+	uint32_t hash = 2166136261u;
+	for (const char* c = text; *c; c++)
+	{
+		hash ^= (uint8_t)*c;
+		hash *= 16777619u;
+	}
+	uint8_t payload[4] = { (uint8_t)hash, (uint8_t)(hash >> 8), (uint8_t)(hash >> 16), (uint8_t)(hash >> 24) };
+	append(nowMs(), (uint8_t)type, payload, sizeof(payload), NULL, 0);
+}
+
+static void putU32(uint8_t* at, uint32_t v)
+{
+	at[0] = (uint8_t)v;
+	at[1] = (uint8_t)(v >> 8);
+	at[2] = (uint8_t)(v >> 16);
+	at[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t getU32(const uint8_t* at)
+{
+	return at[0] | (at[1] << 8) | (at[2] << 16) | ((uint32_t)at[3] << 24);
+}
+
+size_t Trace_DumpSize(void)
+{
+	return TRACE_DUMP_HEADER_SIZE + used;
+}
+
+size_t Trace_Dump(uint8_t* buffer, size_t capacity)
+{
+	if (capacity < Trace_DumpSize())
+		return 0;
+
+	memcpy(buffer, "LKTR", 4);
+	buffer[4] = TRACE_VERSION;
+	buffer[5] = buffer[6] = buffer[7] = 0;
+	putU32(buffer + 8, (uint32_t)used);
+	putU32(buffer + 12, droppedRecords);
+	for (size_t i = 0; i < used; i++)
+		buffer[TRACE_DUMP_HEADER_SIZE + i] = getByte(tail + i);
+	return Trace_DumpSize();
+}
+
+size_t Trace_DumpBase64Size(void)
+{
+	return (Trace_DumpSize() + 2) / 3 * 4 + 1;
+}
+
+size_t Trace_DumpBase64(char* buffer, size_t capacity)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	if (capacity < Trace_DumpBase64Size())
+		return 0;
+
+	//encode in place from the end of the buffer so no second copy of the trace is needed
+	size_t size = Trace_DumpSize();
+	size_t encodedLength = Trace_DumpBase64Size() - 1;
+	uint8_t* raw = (uint8_t*)buffer + capacity - size;
+	Trace_Dump(raw, size);
+
+	size_t out = 0;
+	for (size_t i = 0; i < size; i += 3)
+	{
+		uint32_t v = raw[i] << 16;
+		if (i + 1 < size)
+			v |= raw[i + 1] << 8;
+		if (i + 2 < size)
+			v |= raw[i + 2];
+		buffer[out++] = alphabet[(v >> 18) & 63];
+		buffer[out++] = alphabet[(v >> 12) & 63];
+		buffer[out++] = i + 1 < size ? alphabet[(v >> 6) & 63] : '=';
+		buffer[out++] = i + 2 < size ? alphabet[v & 63] : '=';
+	}
+	buffer[encodedLength] = '\0';
+	return encodedLength;
+}
+
+int Trace_ParseHeader(const uint8_t* dump, size_t size, uint32_t* recordBytes, uint32_t* dropped)
+{
+	if (size < TRACE_DUMP_HEADER_SIZE || memcmp(dump, "LKTR", 4) != 0 || dump[4] != TRACE_VERSION)
+		return -1;
+	*recordBytes = getU32(dump + 8);
+	*dropped = getU32(dump + 12);
+	if (*recordBytes > size - TRACE_DUMP_HEADER_SIZE)
+		return -1;
+	return 0;
+}
+
+bool Trace_NextRecord(const uint8_t* records, size_t size, size_t* offset, TraceRecord* record)
+{
+	if (*offset + TRACE_RECORD_HEADER_SIZE > size)
+		return false;
+	const uint8_t* at = records + *offset;
+	record->timeMs = getU32(at);
+	record->type = at[4];
+	record->length = at[5] | (at[6] << 8);
+	if (*offset + TRACE_RECORD_HEADER_SIZE + record->length > size)
+		return false;
+	record->payload = at + TRACE_RECORD_HEADER_SIZE;
+	*offset += TRACE_RECORD_HEADER_SIZE + record->length;
+	return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact binary trace of the application's inputs (and the outputs they caused),
+// kept in a bounded RAM ring buffer. The oldest records are dropped when it is full.
+//
+// Record layout, little endian: u32 time (ms since Trace_Init), u8 type, u16 length, payload.
+// Inputs carry the time of the timer expiration whose handler observed them, outputs the
+// time they were made.
+// A dump starts with a 16 byte header: "LKTR", u8 version, 3 reserved bytes,
+// u32 record bytes, u32 dropped records.
+
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 16384
+#endif
+
+#define TRACE_MAX_PAYLOAD 1024
+#define TRACE_RECORD_HEADER_SIZE 7
+#define TRACE_DUMP_HEADER_SIZE 16
+#define TRACE_VERSION 1
+
+typedef enum TraceRecordType {
+	// inputs
+	TRACE_KEY = 0x01,// u8 key
+	TRACE_DOOR = 0x02,// u8 open, recorded when the sensor sample changes
+	TRACE_TIMER = 0x03,// u8 timer, u16 consecutive expirations
+	TRACE_NETWORK = 0x04,// u8 ready, recorded when it changes
+	TRACE_TWIN = 0x05,// u8 update state, json
+	TRACE_METHOD = 0x06,// method name, '\0', payload
+	TRACE_CONFIG = 0x07,// u8 format, the saved configuration the lock started from
+	// outputs, used to check a replay
+	TRACE_OUT_LOCK = 0x40,// u8 locked
+	TRACE_OUT_ALARM = 0x41,// u8 raised
+	TRACE_OUT_TELEMETRY = 0x42,// u32 FNV-1a hash of the message
+	TRACE_OUT_REPORTED = 0x43// u32 FNV-1a hash of the patch
+} TraceRecordType;
+
+typedef enum TraceTimer {
+	TRACE_TIMER_APP,
+	TRACE_TIMER_AZURE
+} TraceTimer;
+
+typedef struct TraceRecord {
+	uint32_t timeMs;
+	uint8_t type;
+	uint16_t length;
+	const uint8_t* payload;
+} TraceRecord;
+
+#ifndef TRACE_DISABLED
+
+void Trace_Init(void);
+
+void Trace_RecordKey(char key);
+void Trace_RecordDoor(bool open);
+void Trace_RecordTimer(TraceTimer timer);
+void Trace_RecordNetwork(bool ready);
+void Trace_RecordTwin(int updateState, const unsigned char* payload, size_t size);
+void Trace_RecordMethod(const char* name, const unsigned char* payload, size_t size);
+void Trace_RecordConfig(uint8_t format, const void* record, size_t size);
+void Trace_RecordFlag(TraceRecordType type, bool value);
+void Trace_RecordHash(TraceRecordType type, const char* text);
+
+// Copies the header and records, oldest first. Returns the number of bytes written,
+// or 0 if the buffer is smaller than Trace_DumpSize().
+size_t Trace_DumpSize(void);
+size_t Trace_Dump(uint8_t* buffer, size_t capacity);
+
+// Writes the dump as a NUL-terminated base64 string, for the DumpTrace direct method.
+// Returns the string length, or 0 if the buffer is too small.
+size_t Trace_DumpBase64(char* buffer, size_t capacity);
+size_t Trace_DumpBase64Size(void);
+// Trace_DumpBase64Size() once the ring is full.
+#define TRACE_DUMP_BASE64_MAX_SIZE ((TRACE_DUMP_HEADER_SIZE + TRACE_BUFFER_SIZE + 2) / 3 * 4 + 1)
+
+#else
+
+// The buffer is a single global, so builds that run many lock instances in one process
+// (the fleet simulator) compile tracing out.
+static inline void Trace_Init(void) {}
+
+static inline void Trace_RecordKey(char key) { (void)key; }
+static inline void Trace_RecordDoor(bool open) { (void)open; }
+static inline void Trace_RecordTimer(TraceTimer timer) { (void)timer; }
+static inline void Trace_RecordNetwork(bool ready) { (void)ready; }
+static inline void Trace_RecordTwin(int updateState, const unsigned char* payload, size_t size) { (void)updateState; (void)payload; (void)size; }
+static inline void Trace_RecordMethod(const char* name, const unsigned char* payload, size_t size) { (void)name; (void)payload; (void)size; }
+static inline void Trace_RecordConfig(uint8_t format, const void* record, size_t size) { (void)format; (void)record; (void)size; }
+static inline void Trace_RecordFlag(TraceRecordType type, bool value) { (void)type; (void)value; }
+static inline void Trace_RecordHash(TraceRecordType type, const char* text) { (void)type; (void)text; }
+
+static inline size_t Trace_DumpSize(void) { return 0; }
+static inline size_t Trace_Dump(uint8_t* buffer, size_t capacity) { (void)buffer; (void)capacity; return 0; }
+static inline size_t Trace_DumpBase64(char* buffer, size_t capacity) { (void)capacity; buffer[0] = '\0'; return 0; }
+static inline size_t Trace_DumpBase64Size(void) { return 1; }
+#define TRACE_DUMP_BASE64_MAX_SIZE 1
+
+#endif
+
+// Reads a dump produced by Trace_Dump.
+int Trace_ParseHeader(const uint8_t* dump, size_t size, uint32_t* recordBytes, uint32_t* droppedRecords);
+bool Trace_NextRecord(const uint8_t* records, size_t size, size_t* offset, TraceRecord* record);
@@ -0,0 +1,26 @@
+#pragma once
+
+// Host stand-in for the Azure Sphere applibs GPIO API.
+// Pins are backed by the simulator's virtual hardware (see sim_hw.c).
+
+#include <stdint.h>
+
+typedef int GPIO_Id;
+
+typedef uint8_t GPIO_Value_Type;
+enum {
+	GPIO_Value_Low = 0,
+	GPIO_Value_High = 1
+};
+
+typedef uint8_t GPIO_OutputMode_Type;
+enum {
+	GPIO_OutputMode_PushPull = 0,
+	GPIO_OutputMode_OpenDrain = 1,
+	GPIO_OutputMode_OpenSource = 2
+};
+
+int GPIO_OpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode, GPIO_Value_Type initialValue);
+int GPIO_OpenAsInput(GPIO_Id gpioId);
+int GPIO_SetValue(int gpioFd, GPIO_Value_Type value);
+int GPIO_GetValue(int gpioFd, GPIO_Value_Type* outValue);
@@ -0,0 +1,6 @@
+#pragma once
+
+// Host stand-in for the Azure Sphere applibs logging API.
+// Output is suppressed unless the simulator runs with -v.
+
+void Log_Debug(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
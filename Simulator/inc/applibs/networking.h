@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for the Azure Sphere applibs networking API.
+// Network availability is driven by "net up" / "net down" scenario events.
+
+#include <stdbool.h>
+
+int Networking_IsNetworkingReady(bool* outIsNetworkingReady);
@@ -0,0 +1,7 @@
+#pragma once
+
+// Host stand-in for the Azure Sphere applibs storage API.
+// The mutable storage file is the one given to lock_sim with --storage, or a temporary file.
+
+int Storage_OpenMutableFile(void);
+int Storage_DeleteMutableFile(void);
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in for the Azure Sphere device-auth provisioning helper.
+
+#include "iothub_device_client_ll.h"
+
+typedef enum AZURE_SPHERE_PROV_RESULT {
+	AZURE_SPHERE_PROV_RESULT_OK,
+	AZURE_SPHERE_PROV_RESULT_INVALID_PARAM,
+	AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY,
+	AZURE_SPHERE_PROV_RESULT_DEVICEAUTH_NOT_READY,
+	AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR,
+	AZURE_SPHERE_PROV_RESULT_GENERIC_ERROR
+} AZURE_SPHERE_PROV_RESULT;
+
+typedef struct AZURE_SPHERE_PROV_RETURN_VALUE {
+	AZURE_SPHERE_PROV_RESULT result;
+	int prov_device_error;
+	IOTHUB_CLIENT_RESULT iothub_client_error;
+} AZURE_SPHERE_PROV_RETURN_VALUE;
+
+AZURE_SPHERE_PROV_RETURN_VALUE IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(const char* idScope, unsigned int timeout, IOTHUB_DEVICE_CLIENT_LL_HANDLE* handle);
@@ -0,0 +1,6 @@
+#pragma once
+
+// Host stand-in for the Azure IoT C SDK platform init API.
+
+int IoTHub_Init(void);
+void IoTHub_Deinit(void);
@@ -0,0 +1,53 @@
+#pragma once
+
+// Host stand-in for the Azure IoT C SDK common client types (subset used by the app).
+
+#include <stddef.h>
+
+#include "iothub_message.h"
+
+typedef enum IOTHUB_CLIENT_RESULT_TAG {
+	IOTHUB_CLIENT_OK,
+	IOTHUB_CLIENT_INVALID_ARG,
+	IOTHUB_CLIENT_ERROR,
+	IOTHUB_CLIENT_INVALID_SIZE,
+	IOTHUB_CLIENT_INDEFINITE_TIME
+} IOTHUB_CLIENT_RESULT;
+
+typedef enum IOTHUB_CLIENT_CONFIRMATION_RESULT_TAG {
+	IOTHUB_CLIENT_CONFIRMATION_OK,
+	IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY,
+	IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT,
+	IOTHUB_CLIENT_CONFIRMATION_ERROR
+} IOTHUB_CLIENT_CONFIRMATION_RESULT;
+
+typedef enum IOTHUB_CLIENT_STATUS_TAG {
+	IOTHUB_CLIENT_SEND_STATUS_IDLE,
+	IOTHUB_CLIENT_SEND_STATUS_BUSY
+} IOTHUB_CLIENT_STATUS;
+
+typedef enum IOTHUB_CLIENT_CONNECTION_STATUS_TAG {
+	IOTHUB_CLIENT_CONNECTION_AUTHENTICATED,
+	IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED
+} IOTHUB_CLIENT_CONNECTION_STATUS;
+
+typedef enum IOTHUB_CLIENT_CONNECTION_STATUS_REASON_TAG {
+	IOTHUB_CLIENT_CONNECTION_EXPIRED_SAS_TOKEN,
+	IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED,
+	IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL,
+	IOTHUB_CLIENT_CONNECTION_RETRY_EXPIRED,
+	IOTHUB_CLIENT_CONNECTION_NO_NETWORK,
+	IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR,
+	IOTHUB_CLIENT_CONNECTION_OK
+} IOTHUB_CLIENT_CONNECTION_STATUS_REASON;
+
+typedef enum DEVICE_TWIN_UPDATE_STATE_TAG {
+	DEVICE_TWIN_UPDATE_COMPLETE,
+	DEVICE_TWIN_UPDATE_PARTIAL
+} DEVICE_TWIN_UPDATE_STATE;
+
+typedef void (*IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK)(IOTHUB_CLIENT_CONFIRMATION_RESULT result, void* userContextCallback);
+typedef void (*IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK)(IOTHUB_CLIENT_CONNECTION_STATUS result, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason, void* userContextCallback);
+typedef void (*IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK)(DEVICE_TWIN_UPDATE_STATE update_state, const unsigned char* payLoad, size_t size, void* userContextCallback);
+typedef void (*IOTHUB_CLIENT_REPORTED_STATE_CALLBACK)(int status_code, void* userContextCallback);
+typedef int (*IOTHUB_CLIENT_DEVICE_METHOD_CALLBACK_ASYNC)(const char* method_name, const unsigned char* payload, size_t size, unsigned char** response, size_t* response_size, void* userContextCallback);
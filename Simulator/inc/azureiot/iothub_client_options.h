@@ -0,0 +1,6 @@
+#pragma once
+
+// Host stand-in for the Azure IoT C SDK option names (subset used by the app).
+
+#define OPTION_KEEP_ALIVE "keepalive"
+#define OPTION_MESSAGE_TIMEOUT "messageTimeout"
@@ -0,0 +1,23 @@
+#pragma once
+
+// Host stand-in for the Azure IoT C SDK message API (subset used by the app).
+
+#include <stddef.h>
+
+typedef struct IOTHUB_MESSAGE_HANDLE_DATA_TAG* IOTHUB_MESSAGE_HANDLE;
+
+typedef enum IOTHUB_MESSAGE_RESULT_TAG {
+	IOTHUB_MESSAGE_OK,
+	IOTHUB_MESSAGE_INVALID_ARG,
+	IOTHUB_MESSAGE_INVALID_TYPE,
+	IOTHUB_MESSAGE_ERROR
+} IOTHUB_MESSAGE_RESULT;
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char* source);
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromByteArray(const unsigned char* byteArray, size_t size);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_GetByteArray(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle, const unsigned char** buffer, size_t* size);
+const char* IoTHubMessage_GetString(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetContentTypeSystemProperty(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle, const char* contentType);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetContentEncodingSystemProperty(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle, const char* contentEncoding);
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetProperty(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle, const char* key, const char* value);
+void IoTHubMessage_Destroy(IOTHUB_MESSAGE_HANDLE iotHubMessageHandle);
@@ -0,0 +1,3 @@
+#pragma once
+
+// Host stand-in for the Azure IoT C SDK MQTT transport. The simulated hub has no transport.
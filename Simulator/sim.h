@@ -0,0 +1,270 @@
+#pragma once
+
+// Internal interface shared by the simulator modules.
+//
+// The simulator links the unmodified application sources from ../AzureIoT against
+// host stand-ins for applibs (sim_hw.c), the epoll/timerfd helpers (sim_epoll.c) and
+// the IoT Hub low-level client (sim_iothub.c). Everything runs on a virtual clock
+// (sim_clock.c) that only moves when the event loop jumps to the next deadline or when
+// the application blocks (sleeps, SPI transfers, provisioning), so a day of door
+// traffic replays as fast as the host CPU allows. Threads the application starts are
+// coroutines with clocks of their own (sim_epoll.c).
+//
+// The per-device state of the stand-ins lives in a SimDevice, so the fleet simulator
+// (sim_fleet.c) can run many lock contexts in one process.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#define SIM_US_PER_MS 1000ULL
+#define SIM_US_PER_SECOND 1000000ULL
+
+// ---- virtual clock (sim_clock.c) ----
+
+uint64_t Sim_NowUs(void);
+void Sim_AdvanceUs(uint64_t us);
+void Sim_AdvanceToUs(uint64_t us);
+
+// Replacements for the libc time calls made by the application, see sim_device.h.
+int Sim_Gettimeofday(struct timeval* tv, void* tz);
+int Sim_ClockGettime(clockid_t clockId, struct timespec* ts);
+int Sim_Nanosleep(const struct timespec* request, struct timespec* remaining);
+
+// Host monotonic time, used only to measure how much real CPU the application costs.
+uint64_t Sim_HostNowNs(void);
+
+// ---- statistics (sim_stats.c) ----
+
+typedef enum SimSyscall {
+	SIM_SYSCALL_GPIO,
+	SIM_SYSCALL_SPI,
+	SIM_SYSCALL_TIMERFD,
+	SIM_SYSCALL_EPOLL,
+	SIM_SYSCALL_EVENTFD,
+	SIM_SYSCALL_NETWORKING,
+	SIM_SYSCALL_STORAGE,
+	SIM_SYSCALL_LOG,
+	SIM_SYSCALL_SLEEP,
+	SIM_SYSCALL_CLOCK,
+	SIM_SYSCALL_COUNT
+} SimSyscall;
+
+// Log-linear histogram: exact below 8, then 8 sub-buckets per power of two (<= 12.5% error).
+#define SIM_HISTOGRAM_BUCKETS 512
+typedef struct SimHistogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[SIM_HISTOGRAM_BUCKETS];
+} SimHistogram;
+
+void SimHistogram_Add(SimHistogram* histogram, uint64_t value);
+uint64_t SimHistogram_Percentile(const SimHistogram* histogram, double percentile);
+void SimHistogram_Merge(SimHistogram* into, const SimHistogram* from);
+void SimHistogram_Print(const char* name, const SimHistogram* histogram, double scale, const char* unit);
+
+typedef enum SimOutput {
+	SIM_OUTPUT_LOCK,
+	SIM_OUTPUT_ALARM,
+	SIM_OUTPUT_COUNT
+} SimOutput;
+
+// Inputs whose effect on the relays is timed: a '#' or '*' key -> lock relay,
+// a door-open edge -> alarm relay, a twin patch or method call -> either relay.
+typedef enum SimInput {
+	SIM_INPUT_KEYPAD,
+	SIM_INPUT_DOOR,
+	SIM_INPUT_CLOUD,
+	SIM_INPUT_COUNT
+} SimInput;
+
+typedef struct SimStats {
+	uint64_t syscalls[SIM_SYSCALL_COUNT];
+	uint64_t outputChanges[SIM_OUTPUT_COUNT];
+	uint64_t spiBytes;
+	uint64_t inputs[SIM_INPUT_COUNT];
+	SimHistogram inputToActuationUs[SIM_INPUT_COUNT];
+	SimHistogram handlerStallUs;// virtual time spent inside one event handler
+	SimHistogram handlerHostNs;// host CPU time spent inside one event handler
+} SimStats;
+
+// Per thread, so fleet workers count without sharing cache lines; see SimStats_Merge.
+extern _Thread_local SimStats simStats;
+
+void Sim_CountSyscall(SimSyscall kind);
+void Sim_NoteInput(SimInput input);// a scripted input that may cause an actuation was injected
+void Sim_CancelInput(SimInput input);// the pending input can no longer cause an actuation
+void Sim_NoteOutput(SimOutput output);// a relay output changed
+void SimStats_Merge(SimStats* into, const SimStats* from);
+void Sim_PrintStats(uint64_t hostWallNs);
+
+// ---- virtual hardware (sim_hw.c) ----
+
+// Simulated descriptors are numbered from SIM_FD_BASE so they never collide with real ones.
+#define SIM_FD_BASE 1000
+#define SIM_MAX_FDS 64
+#define SIM_MAX_PINS 128
+
+typedef enum SimFdKind {
+	SIM_FD_FREE,
+	SIM_FD_GPIO,
+	SIM_FD_SPI,
+	SIM_FD_TIMER,
+	SIM_FD_EVENT,
+	SIM_FD_EPOLL
+} SimFdKind;
+
+// Everything the stand-ins keep for one device: its clock, descriptors, pin levels,
+// scripted inputs and hub connection. lock_sim runs a single device; the fleet simulator
+// points simDevice at each door in turn, so every worker thread has its own pointer.
+typedef struct SimDevice {
+	uint64_t nowUs;
+	struct {
+		uint8_t kind;// SimFdKind
+		int16_t arg;
+	} fds[SIM_MAX_FDS];
+	struct {
+		bool output;
+		uint8_t value;// GPIO_Value_Type
+	} pins[SIM_MAX_PINS];
+	bool doorOpen;
+	char keyDown;
+	bool networkReady;
+	uint32_t spiBusSpeedHz;
+	int storageFd;// host file behind the mutable storage, -1 if the device has none
+	bool inputPending[SIM_INPUT_COUNT];
+	uint64_t inputTimeUs[SIM_INPUT_COUNT];
+	struct SimHubDevice* hub;// owned by sim_iothub.c, created on first use
+} SimDevice;
+
+extern _Thread_local SimDevice* simDevice;
+
+extern bool simVerbose;
+
+void SimDevice_Init(SimDevice* device);
+
+int Sim_OpenFd(SimFdKind kind, int arg);
+bool Sim_IsSimFd(int fd);
+SimFdKind Sim_FdKind(int fd);
+int Sim_FdArg(int fd);
+void Sim_CloseFd(int fd);
+
+void Sim_SetDoorOpen(bool open);
+void Sim_SetKeyDown(char key);// 0 releases the key
+void Sim_SetNetworkReady(bool ready);
+bool Sim_IsNetworkReady(void);
+
+// ---- event loop (sim_epoll.c) ----
+
+// The loop drives lock_sim's single application instance; the fleet simulator schedules
+// its doors itself.
+
+void SimLoop_SetEndUs(uint64_t endUs);
+// Paces the loop so virtual time runs at most `speed` times faster than the host clock, 0 = unpaced.
+void SimLoop_SetSpeed(double speed);
+void SimLoop_PrintStats(void);
+
+// Replacements for the application's thread and eventfd calls, see sim_device.h. A new
+// thread runs at once, until it waits in WaitForEventAndCallHandler or ends, on a clock that
+// starts at its creator's time; the time it blocks passes for it alone. What a thread writes
+// to an eventfd becomes readable at the writer's time.
+int Sim_PthreadCreate(pthread_t* thread, const pthread_attr_t* attributes, void* (*start)(void*), void* argument);
+int Sim_PthreadJoin(pthread_t thread, void** result);
+int Sim_Eventfd(unsigned int initialValue, int flags);
+int Sim_EventfdRead(int fd, eventfd_t* value);
+int Sim_EventfdWrite(int fd, eventfd_t value);
+
+// ---- IoT Hub model (sim_iothub.c) ----
+
+typedef struct SimHubConfig {
+	uint64_t provisioningUs;// time IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning blocks
+	uint64_t provisioningTimeoutUs;// time it blocks when the hub is unreachable
+	uint64_t roundTripUs;// publish -> acknowledgement
+	// Impairments, all off by default, see sim_iothub.c.
+	uint64_t jitterUs;// up to this much is added to each round trip
+	unsigned int lossPercent;// publishes lost
+	uint64_t disconnectMeanUs;// mean time between random connection drops, 0 for none
+	uint64_t disconnectUs;// how long a drop lasts
+	uint64_t outageAtUs;// the hub goes down for every device at this time...
+	uint64_t outageUs;// ...for this long, 0 for no outage
+	uint32_t seed;// of the impairments' random draws
+} SimHubConfig;
+
+extern SimHubConfig simHubConfig;
+
+typedef struct SimHubStats {
+	uint64_t provisionings;
+	uint64_t provisioningFailures;
+	uint64_t connects;
+	uint64_t disconnects;
+	uint64_t doWorkCalls;
+	uint64_t events;
+	uint64_t eventBytes;
+	uint64_t reportedPatches;
+	uint64_t reportedBytes;
+	uint64_t methodResponseBytes;
+	uint64_t wireBytes;
+	uint64_t twinComplete;
+	uint64_t twinPartial;
+	uint64_t methods;
+	uint64_t methodsAnswered;// with a 2xx status
+	uint64_t confirmations[4];
+	uint64_t rejected;
+	uint64_t lost;// publishes the hub never got
+	uint64_t drops;// random connection drops
+	uint64_t republished;// items published again after a drop
+	uint64_t maxPending;
+	SimHistogram enqueueToHubUs;
+	SimHistogram enqueueToAckUs;
+	SimHistogram outageToConnectUs;// end of the outage -> the device's first connection after it
+	// Messages and patches arriving at the hub, and provisioning calls, per virtual second,
+	// counted while set.
+	uint64_t* publishedPerSecond;
+	uint64_t* provisioningsPerSecond;
+	size_t publishedSeconds;
+} SimHubStats;
+
+// Per thread, like simStats.
+extern _Thread_local SimHubStats simHubStats;
+
+void SimHubStats_Merge(SimHubStats* into, const SimHubStats* from);
+
+void SimHub_SetReachable(bool reachable);
+void SimHub_SetSeed(uint32_t seed);// of the current device's impairments, simHubConfig.seed by default
+void SimHub_SetInitialTwin(const char* json);
+void SimHub_QueueDesiredPatch(const char* json);
+void SimHub_QueueMethod(const char* name, const char* payload);
+// Trace replay: the hub stops sending its own twin on connect and delivers recorded twin
+// payloads verbatim instead.
+void SimHub_SetReplayMode(bool replay);
+void SimHub_QueueTwinUpdate(bool complete, const char* json);
+void SimHub_PrintStats(void);
+void SimHub_Cleanup(void);// frees the current device's hub state
+
+// ---- scenario feed (sim_script.c) ----
+
+int SimScript_Load(const char* path);
+void SimScript_GenerateDay(unsigned int doorCycles, unsigned int seed);
+bool SimScript_NextTimeUs(uint64_t* timeUs);
+void SimScript_DispatchDue(uint64_t nowUs);
+uint64_t SimScript_EndUs(void);
+
+// Used by the trace replayer to schedule recorded inputs.
+void SimScript_AddKeyPress(uint64_t timeUs, char key, uint64_t holdUs);
+void SimScript_AddDoor(uint64_t timeUs, bool open);
+void SimScript_AddNetwork(uint64_t timeUs, bool ready);
+void SimScript_AddTwinUpdate(uint64_t timeUs, bool complete, const char* json);
+void SimScript_AddMethod(uint64_t timeUs, const char* name, const char* payload);
+void SimScript_SetEndUs(uint64_t endUs);
+
+// ---- trace record and replay (sim_replay.c) ----
+
+int SimReplay_Save(const char* path);// writes the application's trace buffer
+int SimReplay_Load(const char* path);// schedules the trace's inputs
+int SimReplay_Check(void);// compares the replay's outputs with the trace, 0 if they match
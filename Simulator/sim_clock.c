@@ -0,0 +1,67 @@
+#include "sim.h"
+
+#include <errno.h>
+
+// Wall-clock origin reported to the application: 2019-10-16 00:00:00 UTC.
+// A fixed origin keeps runs reproducible.
+static const uint64_t epochOriginSeconds = 1571184000ULL;
+
+uint64_t Sim_NowUs(void)
+{
+	return simDevice->nowUs;
+}
+
+void Sim_AdvanceUs(uint64_t us)
+{
+	simDevice->nowUs += us;
+}
+
+void Sim_AdvanceToUs(uint64_t us)
+{
+	if (us > simDevice->nowUs)
+		simDevice->nowUs = us;
+}
+
+int Sim_Gettimeofday(struct timeval* tv, void* tz)
+{
+	(void)tz;
+	Sim_CountSyscall(SIM_SYSCALL_CLOCK);
+	uint64_t nowUs = simDevice->nowUs;
+	tv->tv_sec = (time_t)(epochOriginSeconds + nowUs / SIM_US_PER_SECOND);
+	tv->tv_usec = (suseconds_t)(nowUs % SIM_US_PER_SECOND);
+	return 0;
+}
+
+int Sim_ClockGettime(clockid_t clockId, struct timespec* ts)
+{
+	Sim_CountSyscall(SIM_SYSCALL_CLOCK);
+	uint64_t us = simDevice->nowUs;
+	if (clockId == CLOCK_REALTIME)
+		us += epochOriginSeconds * SIM_US_PER_SECOND;
+	ts->tv_sec = (time_t)(us / SIM_US_PER_SECOND);
+	ts->tv_nsec = (long)(us % SIM_US_PER_SECOND) * 1000;
+	return 0;
+}
+
+// Sleeping blocks the application's only thread, so it costs virtual time.
+int Sim_Nanosleep(const struct timespec* request, struct timespec* remaining)
+{
+	Sim_CountSyscall(SIM_SYSCALL_SLEEP);
+	if (request->tv_sec < 0 || request->tv_nsec < 0 || request->tv_nsec >= 1000000000L) {
+		errno = EINVAL;
+		return -1;
+	}
+	simDevice->nowUs += (uint64_t)request->tv_sec * SIM_US_PER_SECOND + (uint64_t)request->tv_nsec / 1000;
+	if (remaining != NULL) {
+		remaining->tv_sec = 0;
+		remaining->tv_nsec = 0;
+	}
+	return 0;
+}
+
+uint64_t Sim_HostNowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
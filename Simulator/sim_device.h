@@ -0,0 +1,15 @@
+#pragma once
+
+// Force-included into every application translation unit by the simulator build.
+// Routes the application's clock and sleep calls to the virtual clock so that
+// timeouts, mono switch times and display delays run in simulated time, and its
+// threads and eventfds to the event loop (sim_epoll.c).
+
+#define gettimeofday Sim_Gettimeofday
+#define clock_gettime Sim_ClockGettime
+#define nanosleep Sim_Nanosleep
+#define pthread_create Sim_PthreadCreate
+#define pthread_join Sim_PthreadJoin
+#define eventfd Sim_Eventfd
+#define eventfd_read Sim_EventfdRead
+#define eventfd_write Sim_EventfdWrite
@@ -0,0 +1,567 @@
+// Virtual-time implementation of epoll_timerfd_utilities.h.
+//
+// Timers are simulated descriptors with a deadline on the virtual clock. Each
+// WaitForEventAndCallHandler call injects any due scenario events, jumps the clock to
+// the earliest timer deadline and runs that timer's handler, measuring how long the
+// handler blocked the loop (virtual time) and how much host CPU it used.
+//
+// An eventfd is a timer slot that a write arms for a single expiry at the writer's time.
+// Application threads are coroutines, each with its own clock and switched only when one
+// waits, starts, joins or ends a thread. A thread blocked in a call (provisioning, say)
+// moves only its own clock, so a write it makes when the call returns expires at that
+// time while the other threads' loops go on.
+
+#include "sim.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <applibs/log.h>
+
+#include "epoll_timerfd_utilities.h"
+
+#define SIM_MAX_TIMERS 16
+
+typedef struct SimTimer {
+	bool inUse;
+	int fd;
+	int epollFd;// the instance it is registered with
+	EventData* eventData;
+	uint64_t deadlineUs;
+	uint64_t periodUs;// 0 for single expiry
+	uint64_t expirations;
+	bool armed;
+	bool isEvent;// an eventfd, its expirations are the counter
+	uint64_t written;// added to the counter at the deadline
+	// statistics
+	uint64_t calls;
+	uint64_t hostNs;
+	uint64_t maxStallUs;
+	int thread;// that ran the handler
+} SimTimer;
+
+static SimTimer timers[SIM_MAX_TIMERS];
+static uint64_t endUs = UINT64_MAX;
+static bool ended = false;
+static double speed = 0;
+static uint64_t paceStartHostNs = 0;
+
+void SimLoop_SetEndUs(uint64_t us)
+{
+	endUs = us;
+}
+
+void SimLoop_SetSpeed(double s)
+{
+	speed = s;
+}
+
+// Sleeps on the host until virtual time `us` is due at the configured speed.
+static void pace(uint64_t us)
+{
+	if (speed <= 0)
+		return;
+	if (paceStartHostNs == 0)
+		paceStartHostNs = Sim_HostNowNs();
+	uint64_t dueNs = paceStartHostNs + (uint64_t)((double)us * 1e3 / speed);
+	uint64_t nowNs = Sim_HostNowNs();
+	if (dueNs <= nowNs)
+		return;
+	struct timespec wait = { (time_t)((dueNs - nowNs) / 1000000000ULL), (long)((dueNs - nowNs) % 1000000000ULL) };
+	nanosleep(&wait, NULL);
+}
+
+static SimTimer* findTimer(int fd)
+{
+	for (int i = 0; i < SIM_MAX_TIMERS; i++) {
+		if (timers[i].inUse && timers[i].fd == fd)
+			return &timers[i];
+	}
+	return NULL;
+}
+
+static uint64_t timespecToUs(const struct timespec* ts)
+{
+	return (uint64_t)ts->tv_sec * SIM_US_PER_SECOND + (uint64_t)ts->tv_nsec / 1000;
+}
+
+static void armTimer(SimTimer* timer, uint64_t firstUs, uint64_t periodUs)
+{
+	timer->periodUs = periodUs;
+	timer->armed = firstUs != 0;
+	timer->deadlineUs = Sim_NowUs() + firstUs;
+	timer->expirations = 0;
+}
+
+int CreateEpollFd(void)
+{
+	Sim_CountSyscall(SIM_SYSCALL_EPOLL);
+	return Sim_OpenFd(SIM_FD_EPOLL, 0);
+}
+
+int RegisterEventHandlerToEpoll(int epollFd, int eventFd, EventData* persistentEventData,
+	const uint32_t epollEventMask)
+{
+	(void)epollEventMask;
+	Sim_CountSyscall(SIM_SYSCALL_EPOLL);
+	persistentEventData->fd = eventFd;
+	SimTimer* timer = findTimer(eventFd);
+	if (timer == NULL) {
+		Log_Debug("ERROR: Could not register event to epoll instance: %s (%d).\n", strerror(EBADF), EBADF);
+		return -1;
+	}
+	timer->eventData = persistentEventData;
+	timer->epollFd = epollFd;
+	return 0;
+}
+
+int UnregisterEventHandlerFromEpoll(int epollFd, int eventFd)
+{
+	(void)epollFd;
+	Sim_CountSyscall(SIM_SYSCALL_EPOLL);
+	SimTimer* timer = findTimer(eventFd);
+	if (timer != NULL)
+		timer->eventData = NULL;
+	return 0;
+}
+
+int SetTimerFdToPeriod(int timerFd, const struct timespec* period)
+{
+	Sim_CountSyscall(SIM_SYSCALL_TIMERFD);
+	SimTimer* timer = findTimer(timerFd);
+	if (timer == NULL) {
+		Log_Debug("ERROR: Could not set timerfd period: %s (%d).\n", strerror(EBADF), EBADF);
+		return -1;
+	}
+	uint64_t periodUs = timespecToUs(period);
+	armTimer(timer, periodUs, periodUs);
+	return 0;
+}
+
+int SetTimerFdToSingleExpiry(int timerFd, const struct timespec* expiry)
+{
+	Sim_CountSyscall(SIM_SYSCALL_TIMERFD);
+	SimTimer* timer = findTimer(timerFd);
+	if (timer == NULL) {
+		Log_Debug("ERROR: Could not set timerfd interval: %s (%d).\n", strerror(EBADF), EBADF);
+		return -1;
+	}
+	armTimer(timer, timespecToUs(expiry), 0);
+	return 0;
+}
+
+int ConsumeTimerFdEvent(int timerFd)
+{
+	Sim_CountSyscall(SIM_SYSCALL_TIMERFD);
+	SimTimer* timer = findTimer(timerFd);
+	if (timer == NULL || timer->expirations == 0) {
+		int error = timer == NULL ? EBADF : EAGAIN;
+		Log_Debug("ERROR: Could not read timerfd %s (%d).\n", strerror(error), error);
+		return -1;
+	}
+	timer->expirations = 0;
+	return 0;
+}
+
+static SimTimer* openTimer(SimFdKind kind)
+{
+	// Prefer slots that were never used so closed timers keep their statistics.
+	SimTimer* timer = NULL;
+	for (int i = 0; i < SIM_MAX_TIMERS && timer == NULL; i++) {
+		if (!timers[i].inUse && timers[i].calls == 0)
+			timer = &timers[i];
+	}
+	for (int i = 0; i < SIM_MAX_TIMERS && timer == NULL; i++) {
+		if (!timers[i].inUse)
+			timer = &timers[i];
+	}
+	int fd = timer == NULL ? -1 : Sim_OpenFd(kind, 0);
+	if (fd < 0)
+		return NULL;
+	timer->inUse = true;
+	timer->fd = fd;
+	timer->eventData = NULL;
+	timer->isEvent = kind == SIM_FD_EVENT;
+	timer->armed = false;
+	timer->expirations = 0;
+	timer->written = 0;
+	return timer;
+}
+
+int CreateTimerFdAndAddToEpoll(int epollFd, const struct timespec* period,
+	EventData* persistentEventData, const uint32_t epollEventMask)
+{
+	Sim_CountSyscall(SIM_SYSCALL_TIMERFD);
+	SimTimer* timer = openTimer(SIM_FD_TIMER);
+	if (timer == NULL) {
+		Log_Debug("ERROR: Could not create timerfd: %s (%d).\n", strerror(EMFILE), EMFILE);
+		return -1;
+	}
+	int timerFd = timer->fd;
+	if (SetTimerFdToPeriod(timerFd, period) != 0)
+		return -1;
+	if (RegisterEventHandlerToEpoll(epollFd, timerFd, persistentEventData, epollEventMask) != 0)
+		return -1;
+	return timerFd;
+}
+
+// Marks the timer expired at the current time and schedules its next deadline,
+// folding any periods the loop overran into a single expiration count like timerfd does.
+static void expireTimer(SimTimer* timer)
+{
+	uint64_t now = Sim_NowUs();
+	if (!timer->armed || timer->deadlineUs > now)
+		return;
+	if (timer->isEvent) {
+		timer->expirations += timer->written;
+		timer->written = 0;
+		timer->armed = false;
+		return;
+	}
+	if (timer->periodUs == 0) {
+		timer->expirations++;
+		timer->armed = false;
+		return;
+	}
+	uint64_t missed = (now - timer->deadlineUs) / timer->periodUs + 1;
+	timer->expirations += missed;
+	timer->deadlineUs += missed * timer->periodUs;
+}
+
+int Sim_Eventfd(unsigned int initialValue, int flags)
+{
+	(void)flags;
+	Sim_CountSyscall(SIM_SYSCALL_EVENTFD);
+	SimTimer* timer = openTimer(SIM_FD_EVENT);
+	if (timer == NULL) {
+		errno = EMFILE;
+		return -1;
+	}
+	timer->expirations = initialValue;
+	return timer->fd;
+}
+
+int Sim_EventfdWrite(int fd, eventfd_t value)
+{
+	Sim_CountSyscall(SIM_SYSCALL_EVENTFD);
+	SimTimer* timer = findTimer(fd);
+	if (timer == NULL || !timer->isEvent) {
+		errno = EBADF;
+		return -1;
+	}
+	// A write made before an earlier one expired is added to it.
+	if (!timer->armed) {
+		timer->armed = true;
+		timer->deadlineUs = Sim_NowUs();
+		timer->periodUs = 0;
+	}
+	timer->written += value;
+	return 0;
+}
+
+int Sim_EventfdRead(int fd, eventfd_t* value)
+{
+	Sim_CountSyscall(SIM_SYSCALL_EVENTFD);
+	SimTimer* timer = findTimer(fd);
+	if (timer == NULL || !timer->isEvent) {
+		errno = EBADF;
+		return -1;
+	}
+	expireTimer(timer);
+	if (timer->expirations == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	*value = timer->expirations;
+	timer->expirations = 0;
+	return 0;
+}
+
+// Application threads are coroutines on the host thread that runs the app. Each has its own
+// clock, so the time one spends blocked doesn't delay the others.
+#define SIM_MAX_THREADS 8
+#define SIM_THREAD_STACK_SIZE (1024 * 1024)
+
+typedef enum SimThreadState {
+	SIM_THREAD_FREE,
+	SIM_THREAD_RUNNING,
+	SIM_THREAD_WAITING,// in WaitForEventAndCallHandler on epollFd
+	SIM_THREAD_READY,// can go on: it started a thread that has since waited or ended, or joined one that ended
+	SIM_THREAD_JOINING,
+	SIM_THREAD_FINISHED
+} SimThreadState;
+
+typedef struct SimThread {
+	SimThreadState state;
+	bool detached;
+	uint64_t nowUs;// its clock while another thread runs
+	int epollFd;
+	ucontext_t context;
+	void* stack;
+	void* (*start)(void*);
+	void* argument;
+	void* result;
+	int joining;
+} SimThread;
+
+// Thread 0 is the one that called main, the app thread.
+static SimThread threads[SIM_MAX_THREADS] = { [0] = {.state = SIM_THREAD_RUNNING } };
+static int current = 0;
+
+static void switchTo(int next)
+{
+	SimThread* from = &threads[current];
+	from->nowUs = simDevice->nowUs;
+	current = next;
+	threads[next].state = SIM_THREAD_RUNNING;
+	simDevice->nowUs = threads[next].nowUs;
+	swapcontext(&from->context, &threads[next].context);
+}
+
+// The thread waiting on the epoll instance the timer was registered with, or -1.
+static int timerOwner(const SimTimer* timer)
+{
+	for (int i = 0; i < SIM_MAX_THREADS; i++) {
+		if (threads[i].state == SIM_THREAD_WAITING && threads[i].epollFd == timer->epollFd)
+			return i;
+	}
+	return -1;
+}
+
+static uint64_t threadNowUs(int thread)
+{
+	return thread == current ? simDevice->nowUs : threads[thread].nowUs;
+}
+
+// Scenario inputs are applied on the app thread's clock, as if they arrived while it waited.
+static void dispatchScript(uint64_t timeUs)
+{
+	if (current == 0) {
+		Sim_AdvanceToUs(timeUs);
+		SimScript_DispatchDue(Sim_NowUs());
+		return;
+	}
+	uint64_t ownUs = simDevice->nowUs;
+	if (timeUs > threads[0].nowUs)
+		threads[0].nowUs = timeUs;
+	simDevice->nowUs = threads[0].nowUs;
+	SimScript_DispatchDue(simDevice->nowUs);
+	simDevice->nowUs = ownUs;
+}
+
+static void runHandler(SimTimer* timer)
+{
+	expireTimer(timer);
+	uint64_t startUs = Sim_NowUs();
+	uint64_t startNs = Sim_HostNowNs();
+	timer->eventData->eventHandler(timer->eventData);
+	uint64_t hostNs = Sim_HostNowNs() - startNs;
+	uint64_t stallUs = Sim_NowUs() - startUs;
+
+	timer->calls++;
+	timer->hostNs += hostNs;
+	if (stallUs > timer->maxStallUs)
+		timer->maxStallUs = stallUs;
+	timer->thread = current;
+	// Only the app thread's handlers hold up the door.
+	if (current == 0) {
+		SimHistogram_Add(&simStats.handlerHostNs, hostNs);
+		SimHistogram_Add(&simStats.handlerStallUs, stallUs);
+	}
+}
+
+// Runs whatever is due first, in virtual time, until the current thread can go on: one of its
+// handlers ran (epollFd >= 0), or another thread made it ready. A thread that can go on runs
+// before anything else is dispatched, so the state an app handler sees doesn't change under it.
+static void schedule(int epollFd)
+{
+	for (;;) {
+		SimThread* me = &threads[current];
+		if (me->state == SIM_THREAD_RUNNING) {
+			if (epollFd < 0)
+				return;
+			if (ended && current == 0) {
+				Sim_AdvanceToUs(endUs == UINT64_MAX ? Sim_NowUs() : endUs);
+				return;
+			}
+			me->state = SIM_THREAD_WAITING;
+			me->epollFd = epollFd;
+		}
+
+		int ready = -1;
+		for (int i = 0; i < SIM_MAX_THREADS; i++) {
+			if (threads[i].state == SIM_THREAD_READY && (ready < 0 || threads[i].nowUs < threads[ready].nowUs))
+				ready = i;
+		}
+		if (ready >= 0) {
+			switchTo(ready);
+			continue;
+		}
+
+		SimTimer* timer = NULL;
+		int owner = -1;
+		uint64_t timerDue = UINT64_MAX;
+		for (int i = 0; i < SIM_MAX_TIMERS; i++) {
+			SimTimer* candidate = &timers[i];
+			if (!candidate->inUse || candidate->eventData == NULL)
+				continue;
+			if (!candidate->armed && candidate->expirations == 0)
+				continue;
+			int thread = timerOwner(candidate);
+			if (thread < 0)
+				continue;
+			// Overdue timers go in deadline order; each runs once its thread's clock reaches it.
+			uint64_t due = candidate->expirations != 0 ? threadNowUs(thread) : candidate->deadlineUs;
+			if (due < timerDue) {
+				timer = candidate;
+				owner = thread;
+				timerDue = due;
+			}
+		}
+
+		uint64_t scriptDue = UINT64_MAX;
+		SimScript_NextTimeUs(&scriptDue);
+
+		uint64_t next = timerDue < scriptDue ? timerDue : scriptDue;
+		if (!ended && (next >= endUs || next == UINT64_MAX) && threads[0].state == SIM_THREAD_WAITING) {
+			if (current != 0) {
+				switchTo(0);
+				continue;
+			}
+			// End of the scenario: stop the application the same way the OS does.
+			Sim_AdvanceToUs(endUs == UINT64_MAX ? Sim_NowUs() : endUs);
+			ended = true;
+			raise(SIGTERM);
+			me->state = SIM_THREAD_RUNNING;
+			return;
+		}
+		if (next == UINT64_MAX) {
+			fprintf(stderr, "simulated threads deadlocked\n");
+			abort();
+		}
+
+		pace(next);
+		if (scriptDue <= timerDue) {
+			dispatchScript(scriptDue);
+			continue;
+		}
+		if (owner != current) {
+			switchTo(owner);
+			continue;
+		}
+		Sim_AdvanceToUs(timerDue);
+		me->state = SIM_THREAD_RUNNING;
+		runHandler(timer);
+		return;
+	}
+}
+
+static void threadEntry(void)
+{
+	SimThread* thread = &threads[current];
+	thread->result = thread->start(thread->argument);
+	thread->state = SIM_THREAD_FINISHED;
+	for (int i = 0; i < SIM_MAX_THREADS; i++) {
+		if (threads[i].state == SIM_THREAD_JOINING && threads[i].joining == current)
+			threads[i].state = SIM_THREAD_READY;
+	}
+	schedule(-1);// never comes back
+}
+
+int Sim_PthreadCreate(pthread_t* thread, const pthread_attr_t* attributes, void* (*start)(void*), void* argument)
+{
+	int index = -1;
+	for (int i = 1; i < SIM_MAX_THREADS && index < 0; i++) {
+		if (threads[i].state == SIM_THREAD_FREE || (threads[i].state == SIM_THREAD_FINISHED && threads[i].detached))
+			index = i;
+	}
+	if (index < 0)
+		return EAGAIN;
+
+	SimThread* created = &threads[index];
+	int detachState = PTHREAD_CREATE_JOINABLE;
+	if (attributes != NULL)
+		pthread_attr_getdetachstate(attributes, &detachState);
+	// The stack of a finished thread is only freed here, once nothing runs on it.
+	free(created->stack);
+	created->stack = malloc(SIM_THREAD_STACK_SIZE);
+	if (created->stack == NULL)
+		return EAGAIN;
+	getcontext(&created->context);
+	created->context.uc_stack.ss_sp = created->stack;
+	created->context.uc_stack.ss_size = SIM_THREAD_STACK_SIZE;
+	created->context.uc_link = NULL;
+	makecontext(&created->context, threadEntry, 0);
+	created->detached = detachState == PTHREAD_CREATE_DETACHED;
+	created->start = start;
+	created->argument = argument;
+	created->nowUs = simDevice->nowUs;
+	*thread = (pthread_t)index;
+
+	// The new thread runs until it waits or ends, starting at the creator's time.
+	threads[current].state = SIM_THREAD_READY;
+	switchTo(index);
+	return 0;
+}
+
+int Sim_PthreadJoin(pthread_t thread, void** result)
+{
+	int index = (int)thread;
+	if (index <= 0 || index >= SIM_MAX_THREADS || index == current || threads[index].detached
+		|| threads[index].state == SIM_THREAD_FREE)
+		return EINVAL;
+	if (threads[index].state != SIM_THREAD_FINISHED) {
+		threads[current].state = SIM_THREAD_JOINING;
+		threads[current].joining = index;
+		schedule(-1);
+	}
+	if (result != NULL)
+		*result = threads[index].result;
+	threads[index].state = SIM_THREAD_FREE;
+	return 0;
+}
+
+int WaitForEventAndCallHandler(int epollFd)
+{
+	Sim_CountSyscall(SIM_SYSCALL_EPOLL);
+	schedule(epollFd);
+	return 0;
+}
+
+void CloseFdAndPrintError(int fd, const char* fdName)
+{
+	if (fd < 0)
+		return;
+	if (!Sim_IsSimFd(fd)) {
+		if (close(fd) != 0)
+			Log_Debug("ERROR: Could not close fd %s: %s (%d).\n", fdName, strerror(errno), errno);
+		return;
+	}
+	SimTimer* timer = findTimer(fd);
+	if (timer != NULL) {
+		timer->inUse = false;
+		timer->armed = false;
+		timer->eventData = NULL;
+	}
+	Sim_CloseFd(fd);
+}
+
+void SimLoop_PrintStats(void)
+{
+	printf("event loop timers\n");
+	for (int i = 0; i < SIM_MAX_TIMERS; i++) {
+		const SimTimer* timer = &timers[i];
+		if (timer->calls == 0)
+			continue;
+		char name[32];
+		snprintf(name, sizeof(name), "%s %d%s", timer->isEvent ? "event" : "timer", i, timer->thread != 0 ? " (worker)" : "");
+		printf("  %-26s %llu calls, period %.3f s, host cpu %.3f us/call, max stall %.3f ms\n",
+			name, (unsigned long long)timer->calls, (double)timer->periodUs / SIM_US_PER_SECOND,
+			(double)timer->hostNs / (double)timer->calls / 1e3, (double)timer->maxStallUs / 1e3);
+	}
+}
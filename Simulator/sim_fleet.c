@@ -0,0 +1,489 @@
+// lock_fleet: runs thousands of locks in one process against the in-process hub, to
+// load-test the cloud side and measure what one door costs the host.
+//
+//     lock_fleet [--doors N] [--minutes M] [--rate R] [--threads T] [--seed S]
+//                [--provisioning-ms MS] [--rtt-ms MS] [--binary-telemetry] [--jitter-ms MS]
+//                [--loss PCT] [--disconnect-every-s S] [--disconnect-s S]
+//                [--outage-at-s S] [--outage-s S]
+//
+// Every door is a LockContext (../AzureIoT/lock.c) with its own simulated device: clock,
+// descriptors, pin levels and hub connection. The doors are split into one slice per
+// worker thread, and each worker steps its doors through virtual time one second at a
+// time, running the 10 ms app tick, the Azure poll and a Poisson stream of visits (a PIN
+// entry, mostly followed by a door cycle) for each of them.
+//
+// The display and keypad drivers keep their descriptors in globals, so they are opened
+// once on a template device and every door starts from a copy of its descriptor table.
+
+#include "sim.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "azure.h"
+#include "display.h"
+#include "keyboard.h"
+#include "lock.h"
+
+#define FLEET_APP_TICK_US (10 * SIM_US_PER_MS)
+#define FLEET_KEY_HOLD_US (60 * SIM_US_PER_MS)
+#define FLEET_KEY_GAP_US (90 * SIM_US_PER_MS)
+
+typedef enum FleetVisitStep {
+	VISIT_IDLE,
+	VISIT_KEY_DOWN,
+	VISIT_KEY_UP,
+	VISIT_DOOR_OPEN,
+	VISIT_DOOR_CLOSE
+} FleetVisitStep;
+
+typedef struct FleetDoor {
+	LockContext lock;
+	SimDevice device;
+	uint64_t nextAppUs;
+	uint64_t nextAzureUs;
+	uint64_t azurePeriodUs;
+	uint64_t nextVisitUs;
+	uint64_t hostNs;// host CPU spent on this door
+	uint64_t ticks;
+	const char* keys;// PIN of the current visit
+	uint32_t random;
+	uint8_t keyIndex;
+	uint8_t visitStep;// FleetVisitStep
+	bool opensDoor;
+} FleetDoor;
+
+typedef struct FleetWorker {
+	pthread_t thread;
+	FleetDoor* doors;
+	size_t doorCount;
+	size_t firstIndex;// of its first door in the fleet, seeds the visit streams
+} FleetWorker;
+
+static unsigned int minutes = 1;
+static double visitsPerHour = 20;
+static unsigned int seed = 1;
+static bool binaryTelemetry = false;
+static SimDevice templateDevice;
+
+// Totals of the workers' thread-local statistics, merged when each worker ends.
+static pthread_mutex_t totalsMutex = PTHREAD_MUTEX_INITIALIZER;
+static SimStats totalStats;
+static SimHubStats totalHubStats;
+static SimHistogram doorHostNs;// host CPU per door per virtual second
+static uint64_t totalTicks;
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static uint64_t randomUs(FleetDoor* door, uint64_t maxUs)
+{
+	return (uint64_t)nextRandom(&door->random) * maxUs / UINT32_MAX;
+}
+
+// CPU time of the calling thread, so doors are not charged for time their worker was preempted.
+static uint64_t threadCpuNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Exponentially distributed gap, so visits to each door form a Poisson process.
+static uint64_t nextVisitGapUs(FleetDoor* door)
+{
+	double uniform = ((double)nextRandom(&door->random) + 1.0) / ((double)UINT32_MAX + 2.0);
+	return (uint64_t)(-log(uniform) * 3600.0 * SIM_US_PER_SECOND / visitsPerHour);
+}
+
+// Next expiration of a periodic timer after a handler that may have blocked past several
+// periods; like a timerfd, the missed expirations are folded into one.
+static uint64_t nextDeadline(uint64_t deadlineUs, uint64_t periodUs, uint64_t nowUs)
+{
+	deadlineUs += periodUs;
+	if (deadlineUs <= nowUs)
+		deadlineUs += ((nowUs - deadlineUs) / periodUs + 1) * periodUs;
+	return deadlineUs;
+}
+
+static void startVisit(FleetDoor* door)
+{
+	unsigned int kind = nextRandom(&door->random) % 100;
+	door->keys = kind < 90 ? "1234#" : "9999#";
+	door->opensDoor = kind < 90;
+	door->keyIndex = 0;
+	door->visitStep = VISIT_KEY_DOWN;
+}
+
+static void endVisit(FleetDoor* door, uint64_t nowUs)
+{
+	door->visitStep = VISIT_IDLE;
+	door->nextVisitUs = nowUs + nextVisitGapUs(door);
+}
+
+// Same bookkeeping as the scenario feed, so keypad and door latencies are comparable with lock_sim's.
+static void stepVisit(FleetDoor* door, uint64_t nowUs)
+{
+	switch (door->visitStep) {
+	case VISIT_IDLE:
+		startVisit(door);
+		stepVisit(door, nowUs);
+		return;
+	case VISIT_KEY_DOWN: {
+		char key = door->keys[door->keyIndex];
+		if (key == '#' || key == '*')
+			Sim_NoteInput(SIM_INPUT_KEYPAD);
+		else
+			Sim_CancelInput(SIM_INPUT_KEYPAD);
+		Sim_SetKeyDown(key);
+		door->visitStep = VISIT_KEY_UP;
+		door->nextVisitUs = nowUs + FLEET_KEY_HOLD_US;
+		return;
+	}
+	case VISIT_KEY_UP:
+		Sim_SetKeyDown(0);
+		door->keyIndex++;
+		if (door->keys[door->keyIndex] != '\0') {
+			door->visitStep = VISIT_KEY_DOWN;
+			door->nextVisitUs = nowUs + FLEET_KEY_GAP_US;
+		}
+		else if (door->opensDoor) {
+			door->visitStep = VISIT_DOOR_OPEN;
+			door->nextVisitUs = nowUs + 1500 * SIM_US_PER_MS + randomUs(door, SIM_US_PER_SECOND);
+		}
+		else {
+			endVisit(door, nowUs);
+		}
+		return;
+	case VISIT_DOOR_OPEN:
+		Sim_NoteInput(SIM_INPUT_DOOR);
+		Sim_SetDoorOpen(true);
+		door->visitStep = VISIT_DOOR_CLOSE;
+		door->nextVisitUs = nowUs + 2 * SIM_US_PER_SECOND + randomUs(door, 4 * SIM_US_PER_SECOND);
+		return;
+	case VISIT_DOOR_CLOSE:
+		Sim_CancelInput(SIM_INPUT_DOOR);
+		Sim_SetDoorOpen(false);
+		endVisit(door, nowUs);
+		return;
+	}
+}
+
+static int startDoor(FleetDoor* door, size_t index)
+{
+	SimDevice_Init(&door->device);
+	memcpy(door->device.fds, templateDevice.fds, sizeof(templateDevice.fds));
+	memcpy(door->device.pins, templateDevice.pins, sizeof(templateDevice.pins));
+	door->device.networkReady = true;
+	door->random = (uint32_t)(seed * 2654435761u + index * 40503u) | 1;
+
+	// Doors boot at different times within the first second, so their ticks don't line up.
+	door->device.nowUs = randomUs(door, SIM_US_PER_SECOND);
+	simDevice = &door->device;
+	SimHub_SetSeed(simHubConfig.seed + (uint32_t)index);
+
+	Lock_InitContext(&door->lock);
+	if (binaryTelemetry)
+		SetTelemetryEncoding(&door->lock.azure, TELEMETRY_ENCODING_BINARY);
+	if (Lock_Open(&door->lock) < 0 || Lock_Start(&door->lock) < 0)
+		return -1;
+	Lock_BootStage(&door->lock, LOCK_BOOT_KEYPAD);
+	Lock_DisplayReady(&door->lock);
+
+	uint64_t bootUs = door->device.nowUs;
+	door->nextAppUs = bootUs + FLEET_APP_TICK_US;
+	door->azurePeriodUs = (uint64_t)AzureIoTDefaultPollPeriodSeconds * SIM_US_PER_SECOND;
+	door->nextAzureUs = bootUs + door->azurePeriodUs;
+	door->visitStep = VISIT_IDLE;
+	door->nextVisitUs = bootUs + 10 * SIM_US_PER_SECOND + nextVisitGapUs(door);
+	return 0;
+}
+
+// Runs the door's handlers and visits that are due before endUs, earliest first.
+static void runDoor(FleetDoor* door, uint64_t endUs)
+{
+	simDevice = &door->device;
+	for (;;) {
+		uint64_t dueUs = door->nextAppUs;
+		if (door->nextAzureUs < dueUs)
+			dueUs = door->nextAzureUs;
+		if (door->nextVisitUs < dueUs)
+			dueUs = door->nextVisitUs;
+		if (dueUs >= endUs)
+			break;
+		Sim_AdvanceToUs(dueUs);
+
+		if (dueUs == door->nextVisitUs) {
+			stepVisit(door, Sim_NowUs());
+		}
+		else if (dueUs == door->nextAppUs) {
+			Lock_Run(&door->lock);
+			door->ticks++;
+			door->nextAppUs = nextDeadline(door->nextAppUs, FLEET_APP_TICK_US, Sim_NowUs());
+		}
+		else {
+			int period = PollAzureClient(&door->lock.azure);
+			if (period > 0)
+				door->azurePeriodUs = (uint64_t)period * SIM_US_PER_SECOND;
+			door->nextAzureUs = nextDeadline(door->nextAzureUs, door->azurePeriodUs, Sim_NowUs());
+		}
+	}
+}
+
+static void* runWorker(void* argument)
+{
+	FleetWorker* worker = argument;
+	size_t seconds = (size_t)minutes * 60;
+	simHubStats.publishedPerSecond = calloc(seconds + 1, sizeof(uint64_t));
+	simHubStats.provisioningsPerSecond = calloc(seconds + 1, sizeof(uint64_t));
+	simHubStats.publishedSeconds = simHubStats.publishedPerSecond != NULL && simHubStats.provisioningsPerSecond != NULL
+		? seconds + 1 : 0;
+
+	for (size_t i = 0; i < worker->doorCount; i++) {
+		if (startDoor(&worker->doors[i], worker->firstIndex + i) < 0)
+			fprintf(stderr, "lock_fleet: door failed to start\n");
+	}
+
+	for (size_t second = 1; second <= seconds; second++) {
+		for (size_t i = 0; i < worker->doorCount; i++) {
+			FleetDoor* door = &worker->doors[i];
+			uint64_t startNs = threadCpuNs();
+			runDoor(door, second * SIM_US_PER_SECOND);
+			door->hostNs += threadCpuNs() - startNs;
+		}
+	}
+
+	SimHistogram hostNs = { 0 };
+	uint64_t ticks = 0;
+	for (size_t i = 0; i < worker->doorCount; i++) {
+		FleetDoor* door = &worker->doors[i];
+		SimHistogram_Add(&hostNs, door->hostNs / seconds);
+		ticks += door->ticks;
+		simDevice = &door->device;
+		SimHub_Cleanup();
+	}
+
+	pthread_mutex_lock(&totalsMutex);
+	SimStats_Merge(&totalStats, &simStats);
+	SimHubStats_Merge(&totalHubStats, &simHubStats);
+	SimHistogram_Merge(&doorHostNs, &hostNs);
+	totalTicks += ticks;
+	pthread_mutex_unlock(&totalsMutex);
+
+	free(simHubStats.publishedPerSecond);
+	free(simHubStats.provisioningsPerSecond);
+	return NULL;
+}
+
+// How the doors came back after the outage: the provisioning calls they made per second from
+// its start, and when each connected again.
+static void printOutage(size_t seconds)
+{
+	size_t startSecond = (size_t)(simHubConfig.outageAtUs / SIM_US_PER_SECOND);
+	size_t endSecond = (size_t)((simHubConfig.outageAtUs + simHubConfig.outageUs) / SIM_US_PER_SECOND);
+	uint64_t during = 0;
+	uint64_t after = 0;
+	uint64_t peakPerSecond = 0;
+	for (size_t i = startSecond; i <= seconds; i++) {
+		uint64_t count = totalHubStats.provisioningsPerSecond[i];
+		if (i < endSecond) {
+			during += count;
+			continue;
+		}
+		after += count;
+		if (count > peakPerSecond)
+			peakPerSecond = count;
+	}
+	printf("outage (%llu s from %llu s)\n", (unsigned long long)(simHubConfig.outageUs / SIM_US_PER_SECOND),
+		(unsigned long long)(simHubConfig.outageAtUs / SIM_US_PER_SECOND));
+	printf("  %-26s %llu during, %llu after, peak %llu in one second after\n", "provisioning calls",
+		(unsigned long long)during, (unsigned long long)after, (unsigned long long)peakPerSecond);
+	SimHistogram_Print("outage end -> connected", &totalHubStats.outageToConnectUs, 1e-3, "ms");
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [--doors N] [--minutes M] [--rate R] [--threads T] [--seed S]\n"
+		"       [--provisioning-ms MS] [--rtt-ms MS] [--binary-telemetry] [--jitter-ms MS]\n"
+		"       [--loss PCT] [--disconnect-every-s S] [--disconnect-s S]\n"
+		"       [--outage-at-s S] [--outage-s S]\n"
+		"  --doors N           locks to run (default 10000)\n"
+		"  --minutes M         virtual minutes to run (default 1)\n"
+		"  --rate R            visits per door per hour (default 20)\n"
+		"  --threads T         worker threads (default one per online CPU)\n"
+		"  --seed S            seed for the visit streams and the hub impairments (default 1)\n"
+		"  --provisioning-ms   time device provisioning blocks the caller (default 1500)\n"
+		"  --rtt-ms            hub acknowledgement round trip (default 80)\n"
+		"  --jitter-ms MS      up to this much extra round trip per publish, at random (default 0)\n"
+		"  --loss PCT          percentage of publishes the hub loses (default 0)\n"
+		"  --disconnect-every-s S  drop the hub connection at random, every S seconds on average\n"
+		"  --disconnect-s S    how long each drop lasts (default 0)\n"
+		"  --outage-at-s S     take the hub down for every door at this time (default 30)\n"
+		"  --outage-s S        ...for this long, and report how the doors come back (default 0)\n"
+		"  --binary-telemetry  send telemetry in the binary encoding instead of JSON\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t doorCount = 10000;
+	long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "--doors") == 0 && hasValue) {
+			doorCount = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--minutes") == 0 && hasValue) {
+			minutes = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--rate") == 0 && hasValue) {
+			visitsPerHour = strtod(argv[++i], NULL);
+		}
+		else if (strcmp(arg, "--threads") == 0 && hasValue) {
+			threadCount = strtol(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--seed") == 0 && hasValue) {
+			seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--provisioning-ms") == 0 && hasValue) {
+			simHubConfig.provisioningUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--rtt-ms") == 0 && hasValue) {
+			simHubConfig.roundTripUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--jitter-ms") == 0 && hasValue) {
+			simHubConfig.jitterUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--loss") == 0 && hasValue) {
+			simHubConfig.lossPercent = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--disconnect-every-s") == 0 && hasValue) {
+			simHubConfig.disconnectMeanUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--disconnect-s") == 0 && hasValue) {
+			simHubConfig.disconnectUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--outage-at-s") == 0 && hasValue) {
+			simHubConfig.outageAtUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--outage-s") == 0 && hasValue) {
+			simHubConfig.outageUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--binary-telemetry") == 0) {
+			binaryTelemetry = true;
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (doorCount == 0 || minutes == 0 || visitsPerHour <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	simHubConfig.seed = seed;
+	if (simHubConfig.outageUs > 0 && simHubConfig.outageAtUs == 0)
+		simHubConfig.outageAtUs = 30 * SIM_US_PER_SECOND;
+	if (threadCount < 1)
+		threadCount = 1;
+	if ((size_t)threadCount > doorCount)
+		threadCount = (long)doorCount;
+
+	strncpy(scopeId, "sim-scope-id", SCOPEID_LENGTH);
+	SimDevice_Init(&templateDevice);
+	simDevice = &templateDevice;
+	if (initDisplay() < 0 || initKeyboard() < 0) {
+		fprintf(stderr, "lock_fleet: display or keypad failed to open\n");
+		return 1;
+	}
+
+	FleetDoor* doors = calloc(doorCount, sizeof(FleetDoor));
+	FleetWorker* workers = calloc((size_t)threadCount, sizeof(FleetWorker));
+	if (doors == NULL || workers == NULL) {
+		fprintf(stderr, "lock_fleet: out of memory\n");
+		return 1;
+	}
+	size_t seconds = (size_t)minutes * 60;
+	totalHubStats.publishedPerSecond = calloc(seconds + 1, sizeof(uint64_t));
+	totalHubStats.provisioningsPerSecond = calloc(seconds + 1, sizeof(uint64_t));
+	totalHubStats.publishedSeconds = seconds + 1;
+
+	uint64_t startNs = Sim_HostNowNs();
+	size_t first = 0;
+	for (long i = 0; i < threadCount; i++) {
+		size_t count = doorCount / (size_t)threadCount + ((size_t)i < doorCount % (size_t)threadCount);
+		workers[i].doors = doors + first;
+		workers[i].doorCount = count;
+		workers[i].firstIndex = first;
+		first += count;
+		if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+			fprintf(stderr, "lock_fleet: cannot start worker %ld\n", i);
+			return 1;
+		}
+	}
+	for (long i = 0; i < threadCount; i++)
+		pthread_join(workers[i].thread, NULL);
+	uint64_t hostWallNs = Sim_HostNowNs() - startNs;
+
+	uint64_t peakPerSecond = 0;
+	uint64_t published = 0;
+	for (size_t i = 0; i < totalHubStats.publishedSeconds; i++) {
+		published += totalHubStats.publishedPerSecond[i];
+		if (totalHubStats.publishedPerSecond[i] > peakPerSecond)
+			peakPerSecond = totalHubStats.publishedPerSecond[i];
+	}
+
+	double hostSeconds = (double)hostWallNs / 1e9;
+	double doorSeconds = (double)doorCount * (double)seconds;
+	printf("=== lock_fleet report (%zu doors, %ld threads) ===\n", doorCount, threadCount);
+	printf("time\n");
+	printf("  virtual                    %zu s\n", seconds);
+	printf("  host wall                  %.3f s (%.1fx real time)\n", hostSeconds,
+		hostSeconds > 0 ? (double)seconds / hostSeconds : 0.0);
+	printf("  memory per door            %zu bytes (LockContext %zu, device %zu)\n",
+		sizeof(FleetDoor), sizeof(LockContext), sizeof(SimDevice));
+	printf("host cpu\n");
+	SimHistogram_Print("per door per second", &doorHostNs, 1e-3, "us");
+	printf("  %-26s %.3f us\n", "per app tick",
+		totalTicks > 0 ? (double)doorHostNs.sum * (double)seconds / (double)totalTicks / 1e3 : 0.0);
+	printf("  %-26s %.0f doors per core at real time\n", "capacity",
+		doorHostNs.sum > 0 ? 1e9 * (double)doorHostNs.count / (double)doorHostNs.sum : 0.0);
+	printf("hardware\n");
+	printf("  %-26s %llu changes\n", "lock relay", (unsigned long long)totalStats.outputChanges[SIM_OUTPUT_LOCK]);
+	printf("  %-26s %llu changes\n", "alarm relay", (unsigned long long)totalStats.outputChanges[SIM_OUTPUT_ALARM]);
+	printf("  %-26s %llu\n", "keypad visits", (unsigned long long)totalStats.inputs[SIM_INPUT_KEYPAD]);
+	printf("latency\n");
+	SimHistogram_Print("keypad -> lock relay", &totalStats.inputToActuationUs[SIM_INPUT_KEYPAD], 1e-3, "ms");
+	printf("hub ingress\n");
+	printf("  %-26s %.1f messages/s, peak %llu in one second\n", "rate",
+		(double)published / (double)seconds, (unsigned long long)peakPerSecond);
+	printf("  %-26s %.3f messages per door per minute\n", "per door",
+		(double)published / doorSeconds * 60.0);
+
+	if (simHubConfig.outageUs > 0)
+		printOutage(seconds);
+
+	simHubStats = totalHubStats;
+	SimHub_PrintStats();
+
+	free(totalHubStats.publishedPerSecond);
+	free(totalHubStats.provisioningsPerSecond);
+	free(workers);
+	free(doors);
+	return 0;
+}
@@ -0,0 +1,277 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <applibs/gpio.h>
+#include <applibs/log.h>
+#include <applibs/networking.h>
+#include <applibs/spi.h>
+#include <applibs/storage.h>
+
+#include <hw/sample_hardware.h>
+
+// Pin assignment of the lock, mirrors main.c.
+#define SIM_DOOR_LOCK_PIN MT3620_GPIO0
+#define SIM_DOOR_SENSOR_PIN MT3620_GPIO42
+#define SIM_ALARM_PIN MT3620_GPIO29
+
+// Keypad wiring, defined in keyboard.c.
+extern const int columnPins[4];
+extern const int rowPins[4];
+extern const signed char matrix[4][4];
+
+bool simVerbose = false;
+
+static SimDevice defaultDevice = { .spiBusSpeedHz = 1000000, .storageFd = -1 };
+_Thread_local SimDevice* simDevice = &defaultDevice;
+
+void SimDevice_Init(SimDevice* device)
+{
+	memset(device, 0, sizeof(*device));
+	device->spiBusSpeedHz = 1000000;
+	device->storageFd = -1;
+}
+
+int Sim_OpenFd(SimFdKind kind, int arg)
+{
+	for (int i = 0; i < SIM_MAX_FDS; i++) {
+		if (simDevice->fds[i].kind == SIM_FD_FREE) {
+			simDevice->fds[i].kind = (uint8_t)kind;
+			simDevice->fds[i].arg = (int16_t)arg;
+			return SIM_FD_BASE + i;
+		}
+	}
+	errno = EMFILE;
+	return -1;
+}
+
+bool Sim_IsSimFd(int fd)
+{
+	return fd >= SIM_FD_BASE && fd < SIM_FD_BASE + SIM_MAX_FDS;
+}
+
+SimFdKind Sim_FdKind(int fd)
+{
+	if (!Sim_IsSimFd(fd))
+		return SIM_FD_FREE;
+	return simDevice->fds[fd - SIM_FD_BASE].kind;
+}
+
+int Sim_FdArg(int fd)
+{
+	return simDevice->fds[fd - SIM_FD_BASE].arg;
+}
+
+void Sim_CloseFd(int fd)
+{
+	if (Sim_IsSimFd(fd))
+		simDevice->fds[fd - SIM_FD_BASE].kind = SIM_FD_FREE;
+}
+
+void Sim_SetDoorOpen(bool open)
+{
+	simDevice->doorOpen = open;
+}
+
+void Sim_SetKeyDown(char key)
+{
+	simDevice->keyDown = key;
+}
+
+void Sim_SetNetworkReady(bool ready)
+{
+	simDevice->networkReady = ready;
+}
+
+bool Sim_IsNetworkReady(void)
+{
+	return simDevice->networkReady;
+}
+
+// A keypad row reads low while the held key sits in that row and its column is driven low.
+static GPIO_Value_Type readKeypadRow(int row)
+{
+	if (simDevice->keyDown == 0)
+		return GPIO_Value_High;
+	for (int col = 0; col < 4; col++) {
+		if (matrix[row][col] == simDevice->keyDown && simDevice->pins[columnPins[col]].value == GPIO_Value_Low)
+			return GPIO_Value_Low;
+	}
+	return GPIO_Value_High;
+}
+
+static GPIO_Value_Type readPin(int pin)
+{
+	if (simDevice->pins[pin].output)
+		return simDevice->pins[pin].value;
+	if (pin == SIM_DOOR_SENSOR_PIN)
+		return simDevice->doorOpen ? GPIO_Value_High : GPIO_Value_Low;
+	for (int row = 0; row < 4; row++) {
+		if (rowPins[row] == pin)
+			return readKeypadRow(row);
+	}
+	return GPIO_Value_High;
+}
+
+static int lookupPin(int gpioFd)
+{
+	if (Sim_FdKind(gpioFd) != SIM_FD_GPIO) {
+		errno = EBADF;
+		return -1;
+	}
+	return Sim_FdArg(gpioFd);
+}
+
+int GPIO_OpenAsOutput(GPIO_Id gpioId, GPIO_OutputMode_Type outputMode, GPIO_Value_Type initialValue)
+{
+	(void)outputMode;
+	Sim_CountSyscall(SIM_SYSCALL_GPIO);
+	if (gpioId < 0 || gpioId >= SIM_MAX_PINS) {
+		errno = EINVAL;
+		return -1;
+	}
+	simDevice->pins[gpioId].output = true;
+	simDevice->pins[gpioId].value = initialValue;
+	return Sim_OpenFd(SIM_FD_GPIO, gpioId);
+}
+
+int GPIO_OpenAsInput(GPIO_Id gpioId)
+{
+	Sim_CountSyscall(SIM_SYSCALL_GPIO);
+	if (gpioId < 0 || gpioId >= SIM_MAX_PINS) {
+		errno = EINVAL;
+		return -1;
+	}
+	simDevice->pins[gpioId].output = false;
+	return Sim_OpenFd(SIM_FD_GPIO, gpioId);
+}
+
+int GPIO_SetValue(int gpioFd, GPIO_Value_Type value)
+{
+	Sim_CountSyscall(SIM_SYSCALL_GPIO);
+	int pin = lookupPin(gpioFd);
+	if (pin < 0)
+		return -1;
+	if (!simDevice->pins[pin].output) {
+		errno = EPERM;
+		return -1;
+	}
+	if (simDevice->pins[pin].value != value) {
+		if (pin == SIM_DOOR_LOCK_PIN)
+			Sim_NoteOutput(SIM_OUTPUT_LOCK);
+		else if (pin == SIM_ALARM_PIN)
+			Sim_NoteOutput(SIM_OUTPUT_ALARM);
+	}
+	simDevice->pins[pin].value = value;
+	return 0;
+}
+
+int GPIO_GetValue(int gpioFd, GPIO_Value_Type* outValue)
+{
+	Sim_CountSyscall(SIM_SYSCALL_GPIO);
+	int pin = lookupPin(gpioFd);
+	if (pin < 0)
+		return -1;
+	*outValue = readPin(pin);
+	return 0;
+}
+
+int SPIMaster_InitConfig(SPIMaster_Config* config)
+{
+	config->z__magicAndVersion = 0;
+	config->csPolarity = SPI_ChipSelectPolarity_Invalid;
+	return 0;
+}
+
+int SPIMaster_Open(SPI_InterfaceId interfaceId, SPI_ChipSelectId chipSelectId, const SPIMaster_Config* config)
+{
+	(void)chipSelectId;
+	(void)config;
+	Sim_CountSyscall(SIM_SYSCALL_SPI);
+	return Sim_OpenFd(SIM_FD_SPI, interfaceId);
+}
+
+int SPIMaster_SetBusSpeed(int fd, uint32_t speedInHz)
+{
+	Sim_CountSyscall(SIM_SYSCALL_SPI);
+	if (Sim_FdKind(fd) != SIM_FD_SPI || speedInHz == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	simDevice->spiBusSpeedHz = speedInHz;
+	return 0;
+}
+
+int SPIMaster_InitTransfers(SPIMaster_Transfer* transfers, size_t transferCount)
+{
+	for (size_t i = 0; i < transferCount; i++) {
+		transfers[i].z__magicAndVersion = 0;
+		transfers[i].flags = SPI_TransferFlags_None;
+		transfers[i].writeData = NULL;
+		transfers[i].readData = NULL;
+		transfers[i].length = 0;
+	}
+	return 0;
+}
+
+// The transfer blocks the caller for as long as the bytes take on the wire.
+ssize_t SPIMaster_TransferSequential(int fd, const SPIMaster_Transfer* transfers, size_t transferCount)
+{
+	Sim_CountSyscall(SIM_SYSCALL_SPI);
+	if (Sim_FdKind(fd) != SIM_FD_SPI) {
+		errno = EBADF;
+		return -1;
+	}
+	size_t bytes = 0;
+	for (size_t i = 0; i < transferCount; i++)
+		bytes += transfers[i].length;
+	simStats.spiBytes += bytes;
+	Sim_AdvanceUs((uint64_t)bytes * 8 * SIM_US_PER_SECOND / simDevice->spiBusSpeedHz);
+	return (ssize_t)bytes;
+}
+
+int Networking_IsNetworkingReady(bool* outIsNetworkingReady)
+{
+	Sim_CountSyscall(SIM_SYSCALL_NETWORKING);
+	*outIsNetworkingReady = simDevice->networkReady;
+	return 0;
+}
+
+// Each open gets its own descriptor on the host file, like the device hands out one per call.
+int Storage_OpenMutableFile(void)
+{
+	Sim_CountSyscall(SIM_SYSCALL_STORAGE);
+	if (simDevice->storageFd < 0) {
+		errno = EACCES;// no MutableStorage capability
+		return -1;
+	}
+	return dup(simDevice->storageFd);
+}
+
+int Storage_DeleteMutableFile(void)
+{
+	Sim_CountSyscall(SIM_SYSCALL_STORAGE);
+	if (simDevice->storageFd < 0) {
+		errno = EACCES;
+		return -1;
+	}
+	return ftruncate(simDevice->storageFd, 0);
+}
+
+void Log_Debug(const char* fmt, ...)
+{
+	Sim_CountSyscall(SIM_SYSCALL_LOG);
+	if (!simVerbose)
+		return;
+	uint64_t now = Sim_NowUs();
+	printf("[%8llu.%03llu] ", (unsigned long long)(now / SIM_US_PER_SECOND),
+		(unsigned long long)(now % SIM_US_PER_SECOND / SIM_US_PER_MS));
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
@@ -0,0 +1,817 @@
+// In-process stand-in for the IoT Hub low-level device client.
+//
+// The hub keeps a device twin (desired and reported sections, each with a $version)
+// and delivers scenario-injected desired patches and direct method calls on the
+// application's next DoWork call, the same way the MQTT transport does. Outbound
+// events and reported-state patches are "published" on the DoWork after they were
+// queued and acknowledged roundTripUs later, so the report shows how long the
+// application lets cloud traffic sit in the client before it is sent.
+//
+// A worse network is configured in simHubConfig: jitterUs adds a random delay to each round
+// trip, lossPercent loses publishes, which are answered with an error after the round trip,
+// and disconnectMeanUs drops the connection at random for disconnectUs at a time. A dropped
+// connection loses the acknowledgements in flight, the client publishes those items again once
+// it is back. outageUs takes the hub down for every device at once, from outageAtUs, to show
+// how a fleet comes back. The draws come from a generator per device seeded from simHubConfig.seed, or
+// SimHub_SetSeed when several devices must differ, so a run repeats exactly. With the
+// defaults nothing is drawn and the hub is the ideal one above.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iothub_device_client_ll.h>
+#include <azure_sphere_provisioning.h>
+#include <iothub_client_options.h>
+
+#include "parson.h"
+
+// Rough MQTT framing cost per publish: fixed header, packet id and topic name.
+#define SIM_EVENT_FRAMING_BYTES 48
+#define SIM_REPORTED_FRAMING_BYTES 64
+
+#define SIM_MAX_PENDING 4096
+
+SimHubConfig simHubConfig = {
+	.provisioningUs = 1500 * SIM_US_PER_MS,
+	.provisioningTimeoutUs = 10000 * SIM_US_PER_MS,
+	.roundTripUs = 80 * SIM_US_PER_MS,
+};
+
+struct IOTHUB_MESSAGE_HANDLE_DATA_TAG {
+	unsigned char* data;
+	size_t size;
+};
+
+typedef enum SimOutboundKind {
+	SIM_OUTBOUND_EVENT,
+	SIM_OUTBOUND_REPORTED
+} SimOutboundKind;
+
+typedef struct SimOutbound {
+	SimOutboundKind kind;
+	bool lost;// the hub never got the last publish
+	size_t size;
+	uint64_t enqueueUs;
+	uint64_t sentUs;// 0 until published
+	uint64_t ackUs;// when the acknowledgement of the publish arrives
+	JSON_Value* patch;// reported state, applied to the twin when the hub gets it
+	IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK eventCallback;
+	IOTHUB_CLIENT_REPORTED_STATE_CALLBACK reportedCallback;
+	void* context;
+} SimOutbound;
+
+struct IOTHUB_CLIENT_CORE_LL_HANDLE_DATA_TAG {
+	bool connected;
+	IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK statusCallback;
+	void* statusContext;
+	IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK twinCallback;
+	void* twinContext;
+	IOTHUB_CLIENT_DEVICE_METHOD_CALLBACK_ASYNC methodCallback;
+	void* methodContext;
+	SimOutbound* pending;// grows on demand up to SIM_MAX_PENDING, most clients hold a few items
+	size_t pendingCount;
+	size_t pendingCapacity;
+	uint64_t messageTimeoutUs;// OPTION_MESSAGE_TIMEOUT, 0 for none
+};
+
+typedef struct SimInbound {
+	bool isMethod;
+	bool complete;// recorded complete twin
+	char* name;
+	char* payload;
+	struct SimInbound* next;
+} SimInbound;
+
+typedef struct SimHubDevice {
+	bool reachable;
+	bool replay;
+	IOTHUB_DEVICE_CLIENT_LL_HANDLE client;
+	JSON_Value* desired;
+	JSON_Value* reported;
+	double desiredVersion;
+	double reportedVersion;
+	SimInbound* inboundHead;
+	SimInbound* inboundTail;
+	uint32_t random;// xorshift state of the impairments
+	uint64_t nextDropUs;// when the connection drops next, 0 until scheduled
+	uint64_t downUntilUs;// the last drop lasts until then
+	bool outageConnected;// connected again since the outage ended
+} SimHubDevice;
+
+_Thread_local SimHubStats simHubStats;
+
+// The hub side of the current device.
+static SimHubDevice* currentHub(void)
+{
+	if (simDevice->hub == NULL) {
+		SimHubDevice* hub = calloc(1, sizeof(SimHubDevice));
+		hub->reachable = true;
+		hub->desiredVersion = 1;
+		hub->reportedVersion = 1;
+		hub->random = simHubConfig.seed * 2654435761u | 1;
+		simDevice->hub = hub;
+	}
+	return simDevice->hub;
+}
+
+static uint32_t nextRandom(SimHubDevice* hub)
+{
+	uint32_t x = hub->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	hub->random = x;
+	return x;
+}
+
+// Uniform in [0, maxUs]; draws nothing when maxUs is 0.
+static uint64_t randomUs(SimHubDevice* hub, uint64_t maxUs)
+{
+	return maxUs == 0 ? 0 : (uint64_t)nextRandom(hub) * maxUs / UINT32_MAX;
+}
+
+// Whether a random drop holds the connection down now. Drops come at uniformly random gaps
+// of disconnectMeanUs on average.
+static bool isDropped(SimHubDevice* hub)
+{
+	uint64_t now = Sim_NowUs();
+	if (simHubConfig.outageUs > 0 && now >= simHubConfig.outageAtUs
+		&& now < simHubConfig.outageAtUs + simHubConfig.outageUs)
+		return true;
+	if (simHubConfig.disconnectMeanUs == 0)
+		return false;
+	if (hub->nextDropUs == 0)
+		hub->nextDropUs = now + randomUs(hub, 2 * simHubConfig.disconnectMeanUs);
+	while (now >= hub->nextDropUs) {
+		simHubStats.drops++;
+		hub->downUntilUs = hub->nextDropUs + simHubConfig.disconnectUs;
+		hub->nextDropUs = hub->downUntilUs + randomUs(hub, 2 * simHubConfig.disconnectMeanUs);
+	}
+	return now < hub->downUntilUs;
+}
+
+static void ensureTwin(void)
+{
+	SimHubDevice* hub = currentHub();
+	if (hub->desired == NULL)
+		hub->desired = json_value_init_object();
+	if (hub->reported == NULL)
+		hub->reported = json_value_init_object();
+}
+
+static void mergeObject(JSON_Value* target, const JSON_Value* patch)
+{
+	JSON_Object* targetObject = json_value_get_object(target);
+	const JSON_Object* patchObject = json_value_get_object(patch);
+	if (targetObject == NULL || patchObject == NULL)
+		return;
+	for (size_t i = 0; i < json_object_get_count(patchObject); i++) {
+		const char* name = json_object_get_name(patchObject, i);
+		json_object_set_value(targetObject, name, json_value_deep_copy(json_object_get_value_at(patchObject, i)));
+	}
+}
+
+void SimHub_SetReachable(bool reachable)
+{
+	SimHubDevice* hub = currentHub();
+	hub->reachable = reachable;
+}
+
+void SimHub_SetSeed(uint32_t seed)
+{
+	SimHubDevice* hub = currentHub();
+	hub->random = seed * 2654435761u | 1;
+}
+
+void SimHub_SetInitialTwin(const char* json)
+{
+	SimHubDevice* hub = currentHub();
+	JSON_Value* root = json_parse_string(json);
+	if (root == NULL) {
+		fprintf(stderr, "sim: invalid initial twin: %s\n", json);
+		return;
+	}
+	ensureTwin();
+	JSON_Object* rootObject = json_value_get_object(root);
+	JSON_Value* desired = json_object_get_value(rootObject, "desired");
+	JSON_Value* reported = json_object_get_value(rootObject, "reported");
+	if (desired != NULL)
+		mergeObject(hub->desired, desired);
+	if (reported != NULL)
+		mergeObject(hub->reported, reported);
+	json_value_free(root);
+}
+
+static void queueInbound(bool isMethod, bool complete, const char* name, const char* payload)
+{
+	SimHubDevice* hub = currentHub();
+	SimInbound* inbound = calloc(1, sizeof(SimInbound));
+	inbound->isMethod = isMethod;
+	inbound->complete = complete;
+	inbound->name = name == NULL ? NULL : strdup(name);
+	inbound->payload = strdup(payload);
+	if (hub->inboundTail == NULL)
+		hub->inboundHead = inbound;
+	else
+		hub->inboundTail->next = inbound;
+	hub->inboundTail = inbound;
+}
+
+void SimHub_QueueDesiredPatch(const char* json)
+{
+	SimHubDevice* hub = currentHub();
+	JSON_Value* patch = json_parse_string(json);
+	if (patch == NULL || json_value_get_object(patch) == NULL) {
+		fprintf(stderr, "sim: invalid desired patch: %s\n", json);
+		json_value_free(patch);
+		return;
+	}
+	ensureTwin();
+	mergeObject(hub->desired, patch);
+	hub->desiredVersion++;
+	json_object_set_number(json_value_get_object(patch), "$version", hub->desiredVersion);
+	char* serialized = json_serialize_to_string(patch);
+	queueInbound(false, false, NULL, serialized);
+	json_free_serialized_string(serialized);
+	json_value_free(patch);
+}
+
+void SimHub_QueueMethod(const char* name, const char* payload)
+{
+	queueInbound(true, false, name, payload == NULL ? "{}" : payload);
+}
+
+void SimHub_SetReplayMode(bool replay)
+{
+	SimHubDevice* hub = currentHub();
+	hub->replay = replay;
+}
+
+void SimHub_QueueTwinUpdate(bool complete, const char* json)
+{
+	queueInbound(false, complete, NULL, json);
+}
+
+static char* serializeFullTwin(void)
+{
+	SimHubDevice* hub = currentHub();
+	ensureTwin();
+	JSON_Value* root = json_value_init_object();
+	JSON_Value* desired = json_value_deep_copy(hub->desired);
+	JSON_Value* reported = json_value_deep_copy(hub->reported);
+	json_object_set_number(json_value_get_object(desired), "$version", hub->desiredVersion);
+	json_object_set_number(json_value_get_object(reported), "$version", hub->reportedVersion);
+	json_object_set_value(json_value_get_object(root), "desired", desired);
+	json_object_set_value(json_value_get_object(root), "reported", reported);
+	char* serialized = json_serialize_to_string(root);
+	json_value_free(root);
+	return serialized;
+}
+
+AZURE_SPHERE_PROV_RETURN_VALUE IoTHubDeviceClient_LL_CreateWithAzureSphereDeviceAuthProvisioning(
+	const char* idScope, unsigned int timeout, IOTHUB_DEVICE_CLIENT_LL_HANDLE* handle)
+{
+	SimHubDevice* hub = currentHub();
+	AZURE_SPHERE_PROV_RETURN_VALUE result = { AZURE_SPHERE_PROV_RESULT_OK, 0, IOTHUB_CLIENT_OK };
+	simHubStats.provisionings++;
+	uint64_t second = Sim_NowUs() / SIM_US_PER_SECOND;
+	if (simHubStats.provisioningsPerSecond != NULL && second < simHubStats.publishedSeconds)
+		simHubStats.provisioningsPerSecond[second]++;
+
+	if (idScope == NULL || handle == NULL) {
+		result.result = AZURE_SPHERE_PROV_RESULT_INVALID_PARAM;
+		simHubStats.provisioningFailures++;
+		return result;
+	}
+	*handle = NULL;
+	if (!Sim_IsNetworkReady()) {
+		result.result = AZURE_SPHERE_PROV_RESULT_NETWORK_NOT_READY;
+		simHubStats.provisioningFailures++;
+		return result;
+	}
+	if (!hub->reachable || isDropped(hub)) {
+		// The call blocks for the full timeout before giving up.
+		uint64_t timeoutUs = (uint64_t)timeout * SIM_US_PER_MS;
+		Sim_AdvanceUs(timeoutUs < simHubConfig.provisioningTimeoutUs ? timeoutUs : simHubConfig.provisioningTimeoutUs);
+		result.result = AZURE_SPHERE_PROV_RESULT_PROV_DEVICE_ERROR;
+		simHubStats.provisioningFailures++;
+		return result;
+	}
+
+	Sim_AdvanceUs(simHubConfig.provisioningUs);
+	*handle = calloc(1, sizeof(**handle));
+	hub->client = *handle;
+	return result;
+}
+
+void IoTHubDeviceClient_LL_Destroy(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	SimHubDevice* hub = currentHub();
+	if (handle == NULL)
+		return;
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		json_value_free(item->patch);
+		if (item->kind != SIM_OUTBOUND_EVENT)
+			continue;
+		simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY]++;
+		if (item->eventCallback != NULL) {
+			item->eventCallback(IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY, item->context);
+		}
+	}
+	if (hub->client == handle)
+		hub->client = NULL;
+	free(handle->pending);
+	free(handle);
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SetOption(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	const char* optionName, const void* value)
+{
+	if (handle == NULL || optionName == NULL || value == NULL)
+		return IOTHUB_CLIENT_INVALID_ARG;
+	if (strcmp(optionName, OPTION_MESSAGE_TIMEOUT) == 0)
+		handle->messageTimeoutUs = *(const uint64_t*)value * SIM_US_PER_MS;
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SetConnectionStatusCallback(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	IOTHUB_CLIENT_CONNECTION_STATUS_CALLBACK callback, void* context)
+{
+	if (handle == NULL)
+		return IOTHUB_CLIENT_INVALID_ARG;
+	handle->statusCallback = callback;
+	handle->statusContext = context;
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SetDeviceTwinCallback(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	IOTHUB_CLIENT_DEVICE_TWIN_CALLBACK callback, void* context)
+{
+	if (handle == NULL)
+		return IOTHUB_CLIENT_INVALID_ARG;
+	handle->twinCallback = callback;
+	handle->twinContext = context;
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SetDeviceMethodCallback(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	IOTHUB_CLIENT_DEVICE_METHOD_CALLBACK_ASYNC callback, void* context)
+{
+	if (handle == NULL)
+		return IOTHUB_CLIENT_INVALID_ARG;
+	handle->methodCallback = callback;
+	handle->methodContext = context;
+	return IOTHUB_CLIENT_OK;
+}
+
+static IOTHUB_CLIENT_RESULT enqueue(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle, SimOutbound* item)
+{
+	if (handle->pendingCount == SIM_MAX_PENDING) {
+		simHubStats.rejected++;
+		return IOTHUB_CLIENT_ERROR;
+	}
+	if (handle->pendingCount == handle->pendingCapacity) {
+		size_t capacity = handle->pendingCapacity == 0 ? 4 : handle->pendingCapacity * 2;
+		SimOutbound* pending = realloc(handle->pending, capacity * sizeof(SimOutbound));
+		if (pending == NULL) {
+			simHubStats.rejected++;
+			return IOTHUB_CLIENT_ERROR;
+		}
+		handle->pending = pending;
+		handle->pendingCapacity = capacity;
+	}
+	item->enqueueUs = Sim_NowUs();
+	item->sentUs = 0;
+	handle->pending[handle->pendingCount++] = *item;
+	if (handle->pendingCount > simHubStats.maxPending)
+		simHubStats.maxPending = handle->pendingCount;
+	return IOTHUB_CLIENT_OK;
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SendEventAsync(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	IOTHUB_MESSAGE_HANDLE message, IOTHUB_CLIENT_EVENT_CONFIRMATION_CALLBACK callback, void* context)
+{
+	if (handle == NULL || message == NULL) {
+		simHubStats.rejected++;
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	SimOutbound item = { .kind = SIM_OUTBOUND_EVENT, .size = message->size,
+		.eventCallback = callback, .context = context };
+	return enqueue(handle, &item);
+}
+
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_SendReportedState(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle,
+	const unsigned char* reportedState, size_t size, IOTHUB_CLIENT_REPORTED_STATE_CALLBACK callback, void* context)
+{
+	if (handle == NULL || reportedState == NULL || size == 0) {
+		simHubStats.rejected++;
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	// The hub applies the patch when it is published; parse it now while the buffer is valid.
+	char* json = strndup((const char*)reportedState, size);
+	JSON_Value* patch = json_parse_string(json);
+	free(json);
+	if (patch == NULL) {
+		simHubStats.rejected++;
+		return IOTHUB_CLIENT_INVALID_ARG;
+	}
+	SimOutbound item = { .kind = SIM_OUTBOUND_REPORTED, .size = size, .patch = patch,
+		.reportedCallback = callback, .context = context };
+	IOTHUB_CLIENT_RESULT result = enqueue(handle, &item);
+	if (result != IOTHUB_CLIENT_OK)
+		json_value_free(patch);
+	return result;
+}
+
+static void setConnected(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle, bool connected, IOTHUB_CLIENT_CONNECTION_STATUS_REASON reason)
+{
+	SimHubDevice* hub = currentHub();
+	if (handle->connected == connected)
+		return;
+	handle->connected = connected;
+	if (connected)
+		simHubStats.connects++;
+	else
+		simHubStats.disconnects++;
+	uint64_t outageEndUs = simHubConfig.outageAtUs + simHubConfig.outageUs;
+	if (connected && simHubConfig.outageUs > 0 && !hub->outageConnected && Sim_NowUs() >= outageEndUs) {
+		hub->outageConnected = true;
+		SimHistogram_Add(&simHubStats.outageToConnectUs, Sim_NowUs() - outageEndUs);
+	}
+	if (handle->statusCallback != NULL) {
+		handle->statusCallback(connected ? IOTHUB_CLIENT_CONNECTION_AUTHENTICATED : IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED,
+			reason, handle->statusContext);
+	}
+	if (connected && handle->twinCallback != NULL && !hub->replay) {
+		char* twin = serializeFullTwin();
+		simHubStats.twinComplete++;
+		handle->twinCallback(DEVICE_TWIN_UPDATE_COMPLETE, (const unsigned char*)twin, strlen(twin), handle->twinContext);
+		json_free_serialized_string(twin);
+	}
+}
+
+static void publishPending(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	SimHubDevice* hub = currentHub();
+	uint64_t now = Sim_NowUs();
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->sentUs != 0)
+			continue;
+		item->sentUs = now;
+		item->ackUs = now + simHubConfig.roundTripUs + randomUs(hub, simHubConfig.jitterUs);
+		item->lost = simHubConfig.lossPercent > 0 && nextRandom(hub) % 100 < simHubConfig.lossPercent;
+		simHubStats.wireBytes += item->size + (item->kind == SIM_OUTBOUND_EVENT ? SIM_EVENT_FRAMING_BYTES
+			: SIM_REPORTED_FRAMING_BYTES);
+		if (item->lost) {
+			simHubStats.lost++;
+			continue;
+		}
+		SimHistogram_Add(&simHubStats.enqueueToHubUs, now - item->enqueueUs);
+		if (now / SIM_US_PER_SECOND < simHubStats.publishedSeconds)
+			simHubStats.publishedPerSecond[now / SIM_US_PER_SECOND]++;
+		if (item->kind == SIM_OUTBOUND_EVENT) {
+			simHubStats.events++;
+			simHubStats.eventBytes += item->size;
+		}
+		else {
+			simHubStats.reportedPatches++;
+			simHubStats.reportedBytes += item->size;
+		}
+		// A patch published again after a drop was applied the first time.
+		if (item->patch != NULL) {
+			ensureTwin();
+			mergeObject(hub->reported, item->patch);
+			json_value_free(item->patch);
+			item->patch = NULL;
+			hub->reportedVersion++;
+		}
+	}
+}
+
+static void deliverAcknowledgements(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	uint64_t now = Sim_NowUs();
+	size_t dueCount = 0;
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->sentUs != 0 && now >= item->ackUs)
+			dueCount++;
+	}
+	if (dueCount == 0)
+		return;
+
+	SimOutbound* due = malloc(dueCount * sizeof(SimOutbound));
+	if (due == NULL)
+		return;
+	dueCount = 0;
+	size_t kept = 0;
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->sentUs != 0 && now >= item->ackUs)
+			due[dueCount++] = *item;
+		else
+			handle->pending[kept++] = *item;
+	}
+	handle->pendingCount = kept;
+
+	// Callbacks may enqueue more work, so they run only after the queue is compacted.
+	for (size_t i = 0; i < dueCount; i++) {
+		SimOutbound* item = &due[i];
+		json_value_free(item->patch);// lost
+		if (!item->lost)
+			SimHistogram_Add(&simHubStats.enqueueToAckUs, now - item->enqueueUs);
+		if (item->kind == SIM_OUTBOUND_EVENT) {
+			IOTHUB_CLIENT_CONFIRMATION_RESULT result = item->lost ? IOTHUB_CLIENT_CONFIRMATION_ERROR
+				: IOTHUB_CLIENT_CONFIRMATION_OK;
+			simHubStats.confirmations[result]++;
+			if (item->eventCallback != NULL)
+				item->eventCallback(result, item->context);
+		}
+		else if (item->reportedCallback != NULL) {
+			item->reportedCallback(item->lost ? 503 : 204, item->context);
+		}
+	}
+	free(due);
+}
+
+static void deliverInbound(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	SimHubDevice* hub = currentHub();
+	while (hub->inboundHead != NULL && hub->client == handle) {
+		SimInbound* inbound = hub->inboundHead;
+		hub->inboundHead = inbound->next;
+		if (hub->inboundHead == NULL)
+			hub->inboundTail = NULL;
+
+		size_t payloadSize = strlen(inbound->payload);
+		if (inbound->isMethod) {
+			simHubStats.methods++;
+			if (handle->methodCallback != NULL) {
+				unsigned char* response = NULL;
+				size_t responseSize = 0;
+				int status = handle->methodCallback(inbound->name, (const unsigned char*)inbound->payload, payloadSize,
+					&response, &responseSize, handle->methodContext);
+				if (status >= 200 && status < 300)
+					simHubStats.methodsAnswered++;
+				simHubStats.methodResponseBytes += responseSize;
+				simHubStats.wireBytes += responseSize + SIM_REPORTED_FRAMING_BYTES;
+				free(response);
+			}
+		}
+		else {
+			if (inbound->complete)
+				simHubStats.twinComplete++;
+			else
+				simHubStats.twinPartial++;
+			if (handle->twinCallback != NULL) {
+				handle->twinCallback(inbound->complete ? DEVICE_TWIN_UPDATE_COMPLETE : DEVICE_TWIN_UPDATE_PARTIAL,
+					(const unsigned char*)inbound->payload, payloadSize, handle->twinContext);
+			}
+		}
+		free(inbound->name);
+		free(inbound->payload);
+		free(inbound);
+	}
+}
+
+// Busy while events or patches wait to be published or acknowledged.
+IOTHUB_CLIENT_RESULT IoTHubDeviceClient_LL_GetSendStatus(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle, IOTHUB_CLIENT_STATUS* status)
+{
+	if (handle == NULL || status == NULL)
+		return IOTHUB_CLIENT_INVALID_ARG;
+	*status = handle->pendingCount > 0 ? IOTHUB_CLIENT_SEND_STATUS_BUSY : IOTHUB_CLIENT_SEND_STATUS_IDLE;
+	return IOTHUB_CLIENT_OK;
+}
+
+// Like the SDK, DoWork times out events older than OPTION_MESSAGE_TIMEOUT whether or not
+// the hub can be reached.
+static void expireEvents(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	uint64_t now = Sim_NowUs();
+	size_t kept = 0;
+	size_t expiredCount = 0;
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->kind == SIM_OUTBOUND_EVENT && now - item->enqueueUs >= handle->messageTimeoutUs)
+			expiredCount++;
+	}
+	if (expiredCount == 0)
+		return;
+
+	SimOutbound* expired = malloc(expiredCount * sizeof(SimOutbound));
+	if (expired == NULL)
+		return;
+	expiredCount = 0;
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->kind == SIM_OUTBOUND_EVENT && now - item->enqueueUs >= handle->messageTimeoutUs)
+			expired[expiredCount++] = *item;
+		else
+			handle->pending[kept++] = *item;
+	}
+	handle->pendingCount = kept;
+
+	for (size_t i = 0; i < expiredCount; i++) {
+		simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT]++;
+		if (expired[i].eventCallback != NULL)
+			expired[i].eventCallback(IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT, expired[i].context);
+	}
+	free(expired);
+}
+
+// The acknowledgements in flight are lost with a dropped connection, so what was published
+// and not acknowledged is published again after the reconnect.
+static void republishAfterDrop(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	for (size_t i = 0; i < handle->pendingCount; i++) {
+		SimOutbound* item = &handle->pending[i];
+		if (item->sentUs == 0)
+			continue;
+		item->sentUs = 0;
+		simHubStats.republished++;
+	}
+}
+
+void IoTHubDeviceClient_LL_DoWork(IOTHUB_DEVICE_CLIENT_LL_HANDLE handle)
+{
+	SimHubDevice* hub = currentHub();
+	if (handle == NULL)
+		return;
+	simHubStats.doWorkCalls++;
+	if (handle->messageTimeoutUs != 0)
+		expireEvents(handle);
+
+	bool dropped = isDropped(hub);
+	if (dropped && handle->connected)
+		republishAfterDrop(handle);
+	if (!Sim_IsNetworkReady() || !hub->reachable || dropped) {
+		setConnected(handle, false, Sim_IsNetworkReady() ? IOTHUB_CLIENT_CONNECTION_COMMUNICATION_ERROR
+			: IOTHUB_CLIENT_CONNECTION_NO_NETWORK);
+		return;
+	}
+	setConnected(handle, true, IOTHUB_CLIENT_CONNECTION_OK);
+	if (hub->client != handle)
+		return;
+
+	publishPending(handle);
+	deliverAcknowledgements(handle);
+	if (hub->client != handle)
+		return;
+	deliverInbound(handle);
+}
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromByteArray(const unsigned char* byteArray, size_t size)
+{
+	IOTHUB_MESSAGE_HANDLE message = calloc(1, sizeof(*message));
+	if (message == NULL)
+		return NULL;
+	message->data = malloc(size == 0 ? 1 : size);
+	if (message->data == NULL) {
+		free(message);
+		return NULL;
+	}
+	memcpy(message->data, byteArray, size);
+	message->size = size;
+	return message;
+}
+
+IOTHUB_MESSAGE_HANDLE IoTHubMessage_CreateFromString(const char* source)
+{
+	if (source == NULL)
+		return NULL;
+	return IoTHubMessage_CreateFromByteArray((const unsigned char*)source, strlen(source));
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_GetByteArray(IOTHUB_MESSAGE_HANDLE message, const unsigned char** buffer, size_t* size)
+{
+	if (message == NULL || buffer == NULL || size == NULL)
+		return IOTHUB_MESSAGE_INVALID_ARG;
+	*buffer = message->data;
+	*size = message->size;
+	return IOTHUB_MESSAGE_OK;
+}
+
+const char* IoTHubMessage_GetString(IOTHUB_MESSAGE_HANDLE message)
+{
+	return message == NULL ? NULL : (const char*)message->data;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetContentTypeSystemProperty(IOTHUB_MESSAGE_HANDLE message, const char* contentType)
+{
+	return message == NULL || contentType == NULL ? IOTHUB_MESSAGE_INVALID_ARG : IOTHUB_MESSAGE_OK;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetContentEncodingSystemProperty(IOTHUB_MESSAGE_HANDLE message, const char* contentEncoding)
+{
+	return message == NULL || contentEncoding == NULL ? IOTHUB_MESSAGE_INVALID_ARG : IOTHUB_MESSAGE_OK;
+}
+
+IOTHUB_MESSAGE_RESULT IoTHubMessage_SetProperty(IOTHUB_MESSAGE_HANDLE message, const char* key, const char* value)
+{
+	return message == NULL || key == NULL || value == NULL ? IOTHUB_MESSAGE_INVALID_ARG : IOTHUB_MESSAGE_OK;
+}
+
+void IoTHubMessage_Destroy(IOTHUB_MESSAGE_HANDLE message)
+{
+	if (message == NULL)
+		return;
+	free(message->data);
+	free(message);
+}
+
+int IoTHub_Init(void)
+{
+	return 0;
+}
+
+void IoTHub_Deinit(void)
+{
+}
+
+void SimHubStats_Merge(SimHubStats* into, const SimHubStats* from)
+{
+	into->provisionings += from->provisionings;
+	into->provisioningFailures += from->provisioningFailures;
+	into->connects += from->connects;
+	into->disconnects += from->disconnects;
+	into->doWorkCalls += from->doWorkCalls;
+	into->events += from->events;
+	into->eventBytes += from->eventBytes;
+	into->reportedPatches += from->reportedPatches;
+	into->reportedBytes += from->reportedBytes;
+	into->methodResponseBytes += from->methodResponseBytes;
+	into->wireBytes += from->wireBytes;
+	into->twinComplete += from->twinComplete;
+	into->twinPartial += from->twinPartial;
+	into->methods += from->methods;
+	into->methodsAnswered += from->methodsAnswered;
+	for (int i = 0; i < 4; i++)
+		into->confirmations[i] += from->confirmations[i];
+	into->rejected += from->rejected;
+	into->lost += from->lost;
+	into->drops += from->drops;
+	into->republished += from->republished;
+	if (from->maxPending > into->maxPending)
+		into->maxPending = from->maxPending;
+	SimHistogram_Merge(&into->enqueueToHubUs, &from->enqueueToHubUs);
+	SimHistogram_Merge(&into->enqueueToAckUs, &from->enqueueToAckUs);
+	SimHistogram_Merge(&into->outageToConnectUs, &from->outageToConnectUs);
+	for (size_t i = 0; i < into->publishedSeconds && i < from->publishedSeconds; i++) {
+		into->publishedPerSecond[i] += from->publishedPerSecond[i];
+		if (into->provisioningsPerSecond != NULL && from->provisioningsPerSecond != NULL)
+			into->provisioningsPerSecond[i] += from->provisioningsPerSecond[i];
+	}
+}
+
+void SimHub_PrintStats(void)
+{
+	printf("cloud\n");
+	printf("  %-26s %llu (%llu failed), %llu connects, %llu disconnects\n", "provisioning calls",
+		(unsigned long long)simHubStats.provisionings, (unsigned long long)simHubStats.provisioningFailures,
+		(unsigned long long)simHubStats.connects, (unsigned long long)simHubStats.disconnects);
+	printf("  %-26s %llu\n", "DoWork calls", (unsigned long long)simHubStats.doWorkCalls);
+	printf("  %-26s %llu messages, %llu payload bytes\n", "telemetry sent",
+		(unsigned long long)simHubStats.events, (unsigned long long)simHubStats.eventBytes);
+	printf("  %-26s %llu patches, %llu payload bytes\n", "reported state sent",
+		(unsigned long long)simHubStats.reportedPatches, (unsigned long long)simHubStats.reportedBytes);
+	printf("  %-26s %llu 2xx, %llu bytes\n", "method responses",
+		(unsigned long long)simHubStats.methodsAnswered, (unsigned long long)simHubStats.methodResponseBytes);
+	printf("  %-26s %llu bytes (payload + ~%d/%d bytes MQTT framing)\n", "total sent",
+		(unsigned long long)simHubStats.wireBytes, SIM_EVENT_FRAMING_BYTES, SIM_REPORTED_FRAMING_BYTES);
+	printf("  %-26s %llu complete, %llu partial, %llu methods\n", "received",
+		(unsigned long long)simHubStats.twinComplete, (unsigned long long)simHubStats.twinPartial,
+		(unsigned long long)simHubStats.methods);
+	printf("  %-26s %llu ok, %llu destroyed, %llu timeout, %llu error, %llu rejected\n", "confirmations",
+		(unsigned long long)simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_OK],
+		(unsigned long long)simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_BECAUSE_DESTROY],
+		(unsigned long long)simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_MESSAGE_TIMEOUT],
+		(unsigned long long)simHubStats.confirmations[IOTHUB_CLIENT_CONFIRMATION_ERROR],
+		(unsigned long long)simHubStats.rejected);
+	printf("  %-26s %llu publishes lost, %llu connection drops, %llu published again\n", "impairments",
+		(unsigned long long)simHubStats.lost, (unsigned long long)simHubStats.drops,
+		(unsigned long long)simHubStats.republished);
+	printf("  %-26s %llu\n", "max client queue depth", (unsigned long long)simHubStats.maxPending);
+	SimHistogram_Print("enqueue -> hub", &simHubStats.enqueueToHubUs, 1e-3, "ms");
+	SimHistogram_Print("enqueue -> acknowledged", &simHubStats.enqueueToAckUs, 1e-3, "ms");
+}
+
+void SimHub_Cleanup(void)
+{
+	SimHubDevice* hub = currentHub();
+	while (hub->inboundHead != NULL) {
+		SimInbound* inbound = hub->inboundHead;
+		hub->inboundHead = inbound->next;
+		free(inbound->name);
+		free(inbound->payload);
+		free(inbound);
+	}
+	json_value_free(hub->desired);
+	json_value_free(hub->reported);
+	free(hub);
+	simDevice->hub = NULL;
+}
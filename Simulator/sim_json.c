@@ -0,0 +1,257 @@
+// lock_json: checks and benchmark of the JSON writer (../AzureIoT/json_writer.c).
+//
+//     lock_json [--events N] [--seed S]
+//
+// The writer is linked on its own. The checks compare escaping, numbers and timestamps with
+// known output and gmtime, and write a document into every buffer size shorter than it to
+// make sure each one reports the overflow and stays terminated. The benchmark builds N
+// telemetry events the way SendTelemetry does, N with a typed payload (string, integers,
+// bool, timestamp) and N reported-state patches, and compares the first with the snprintf
+// the app used before. The first failed check prints what differed and exits with 1.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json_writer.h"
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static uint64_t nowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static bool expect(const char* what, const char* actual, const char* expected)
+{
+	if (strcmp(actual, expected) == 0)
+		return true;
+	printf("FAILED %s:\n  got      %s\n  expected %s\n", what, actual, expected);
+	return false;
+}
+
+static size_t fillBase64(char* buffer, size_t capacity)
+{
+	if (capacity < 5)
+		return capacity;
+	memcpy(buffer, "QUJD", 5);
+	return 4;
+}
+
+// A document with every kind of member, so overflow is checked at each step.
+static int writeSample(char* buffer, size_t size)
+{
+	JsonWriter writer;
+	JsonWriter_Init(&writer, buffer, size);
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_String(&writer, "Text", "say \"hi\"\\\n\t\x01");
+	JsonWriter_Int(&writer, "Min", INT64_MIN);
+	JsonWriter_Uint(&writer, "Max", UINT64_MAX);
+	JsonWriter_Bool(&writer, "Open", false);
+	JsonWriter_Timestamp(&writer, "At", 1571239591123ULL);
+	JsonWriter_StringFill(&writer, "Fill", fillBase64);
+	JsonWriter_BeginArray(&writer, "List");
+	JsonWriter_Int(&writer, NULL, -7);
+	JsonWriter_Raw(&writer, NULL, "{\"a\":null}");
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_EndObject(&writer);
+	JsonWriter_EndArray(&writer);
+	JsonWriter_EndObject(&writer);
+	return JsonWriter_Finish(&writer);
+}
+
+static bool checkSample(void)
+{
+	static const char expected[] = "{\"Text\":\"say \\\"hi\\\"\\\\\\n\\t\\u0001\",\"Min\":-9223372036854775808,"
+		"\"Max\":18446744073709551615,\"Open\":false,\"At\":\"2019-10-16T15:26:31.123Z\",\"Fill\":\"QUJD\","
+		"\"List\":[-7,{\"a\":null},{}]}";
+	char buffer[256];
+	int length = writeSample(buffer, sizeof(buffer));
+	if (!expect("sample document", buffer, expected))
+		return false;
+	if (length != (int)strlen(expected)) {
+		printf("FAILED sample length %d, expected %zu\n", length, strlen(expected));
+		return false;
+	}
+
+	// Every shorter buffer overflows, keeps a terminated prefix and writes nothing past it.
+	for (size_t size = 1; size <= strlen(expected); size++) {
+		char small[sizeof(buffer) + 1];
+		memset(small, '#', sizeof(small));
+		if (writeSample(small, size) != -1) {
+			printf("FAILED overflow not reported with %zu bytes\n", size);
+			return false;
+		}
+		size_t written = strlen(small);
+		if (written >= size || strncmp(small, expected, written) != 0 || small[size] != '#') {
+			printf("FAILED overflow with %zu bytes left %s\n", size, small);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool checkNesting(void)
+{
+	char buffer[64];
+	JsonWriter writer;
+	JsonWriter_Init(&writer, buffer, sizeof(buffer));
+	JsonWriter_BeginObject(&writer, NULL);
+	if (JsonWriter_Finish(&writer) != -1) {
+		printf("FAILED an open object finished\n");
+		return false;
+	}
+	JsonWriter_EndObject(&writer);
+	if (JsonWriter_EndObject(&writer) != -1 || JsonWriter_Finish(&writer) != -1) {
+		printf("FAILED an extra close was accepted\n");
+		return false;
+	}
+	JsonWriter_Init(&writer, buffer, sizeof(buffer));
+	for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++)
+		JsonWriter_BeginArray(&writer, NULL);
+	if (JsonWriter_Finish(&writer) != -1) {
+		printf("FAILED nesting deeper than %d was accepted\n", JSON_WRITER_MAX_DEPTH);
+		return false;
+	}
+	return true;
+}
+
+static bool checkTimestamps(uint32_t* random)
+{
+	uint64_t samples[1000] = { 0, 951782400000ULL, 4107542399999ULL };// epoch, 2000-02-29, 2100-02-28 end
+	for (size_t i = 3; i < sizeof(samples) / sizeof(samples[0]); i++)
+		samples[i] = ((uint64_t)nextRandom(random) << 10 | nextRandom(random) % 1024) % 8000000000000ULL;
+	for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		char actual[40];
+		JsonWriter writer;
+		JsonWriter_Init(&writer, actual, sizeof(actual));
+		JsonWriter_Timestamp(&writer, NULL, samples[i]);
+
+		time_t seconds = (time_t)(samples[i] / 1000);
+		struct tm utc;
+		gmtime_r(&seconds, &utc);
+		char expected[40];
+		size_t length = strftime(expected, sizeof(expected), "\"%Y-%m-%dT%H:%M:%S", &utc);
+		snprintf(expected + length, sizeof(expected) - length, ".%03uZ\"", (unsigned int)(samples[i] % 1000));
+		if (!expect("timestamp", actual, expected))
+			return false;
+	}
+	return true;
+}
+
+static void printRate(const char* name, unsigned long count, uint64_t ns, size_t bytes)
+{
+	printf("  %-28s %10.0f events/s  %6.1f ns/event  %3zu bytes\n", name,
+		(double)count * 1e9 / (double)ns, (double)ns / (double)count, bytes);
+}
+
+static void benchmark(unsigned long events)
+{
+	static const char* const keys[] = { "DoorEvent", "LockEvent", "ConfigWarning", "LockCritical" };
+	static const char* const values[] = { "Door opened.", "Lock unlocked.", "Invalid credentials.", "Intrusion!" };
+	char buffer[256];
+	volatile size_t sink = 0;// keeps the loops from being optimized away
+
+	uint64_t start = nowNs();
+	for (unsigned long i = 0; i < events; i++) {
+		int length = snprintf(buffer, 100, "{ \"%s\": \"%s\" }", keys[i & 3], values[i & 3]);
+		sink += (size_t)length;
+	}
+	printRate("snprintf event (before)", events, nowNs() - start, strlen(buffer));
+
+	start = nowNs();
+	for (unsigned long i = 0; i < events; i++) {
+		JsonWriter writer;
+		JsonWriter_Init(&writer, buffer, 100);
+		JsonWriter_BeginObject(&writer, NULL);
+		JsonWriter_String(&writer, keys[i & 3], values[i & 3]);
+		JsonWriter_EndObject(&writer);
+		sink += (size_t)JsonWriter_Finish(&writer);
+	}
+	printRate("writer event", events, nowNs() - start, strlen(buffer));
+
+	start = nowNs();
+	for (unsigned long i = 0; i < events; i++) {
+		JsonWriter writer;
+		JsonWriter_Init(&writer, buffer, sizeof(buffer));
+		JsonWriter_BeginObject(&writer, NULL);
+		JsonWriter_String(&writer, "Event", values[i & 3]);
+		JsonWriter_Uint(&writer, "Code", i & 0x7F);
+		JsonWriter_Int(&writer, "Offset", -(int64_t)(i % 5000));
+		JsonWriter_Bool(&writer, "Critical", (i & 3) == 3);
+		JsonWriter_Timestamp(&writer, "Time", 1571239591123ULL + i);
+		JsonWriter_EndObject(&writer);
+		sink += (size_t)JsonWriter_Finish(&writer);
+	}
+	printRate("writer typed event", events, nowNs() - start, strlen(buffer));
+
+	static const char* const names[] = { "LockMode", "ContactMode", "DisplayBacklightMode", "MonoSwitchTime",
+		"UserPassword", "ConfigPassword", "IsLockOpen", "IsDoorOpen", "IsAlarm" };
+	static const char* const reported[] = { "\"Monostable\"", "\"Normal open\"", "\"Auto\"", "\"5\"",
+		"\"1234\"", "\"12345\"", "false", "true", "false" };
+	start = nowNs();
+	for (unsigned long i = 0; i < events; i++) {
+		JsonWriter writer;
+		JsonWriter_Init(&writer, buffer, sizeof(buffer));
+		JsonWriter_BeginObject(&writer, NULL);
+		for (size_t p = 0; p < sizeof(names) / sizeof(names[0]); p++)
+			JsonWriter_Raw(&writer, names[p], reported[p]);
+		JsonWriter_EndObject(&writer);
+		sink += (size_t)JsonWriter_Finish(&writer);
+	}
+	printRate("writer reported patch", events, nowNs() - start, strlen(buffer));
+	(void)sink;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [--events N] [--seed S]\n"
+		"  --events N   events per benchmark (default 2000000)\n"
+		"  --seed S     seed for the timestamp checks (default 1)\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long events = 2000000;
+	uint32_t random = 1;
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--events") == 0 && hasValue) {
+			events = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+			random = (uint32_t)strtoul(argv[++i], NULL, 10) | 1;
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (events == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	printf("=== lock_json ===\n");
+	if (!checkSample() || !checkNesting() || !checkTimestamps(&random))
+		return 1;
+	printf("escaping, numbers, nesting, overflow and timestamps checked\n");
+	benchmark(events);
+	return 0;
+}
@@ -0,0 +1,307 @@
+// lock_load: throughput and latency benchmark of the lock's IoT Hub client (../AzureIoT/azure.c)
+// against the in-process hub, at increasing offered rates.
+//
+//     lock_load [-v] [--rates R,R,...] [--seconds S] [--rtt-ms MS] [--jitter-ms MS] [--loss PCT]
+//               [--disconnect-every-s S] [--disconnect-s S] [--seed S]
+//
+// For each rate a new door with its own telemetry store is started and connected, then given
+// that many door events per virtual second for S seconds: SendTelemetry on the operational
+// lane and the IsDoorOpen change through TwinReportState, as a door cycle makes them. S more
+// seconds without load follow, for the backlog to drain.
+//
+// Per rate the report shows, per second while loaded, the events handed to the client and put
+// in the telemetry store and the messages that reached the hub; then the most messages the
+// store held, those left in it at the end and those it evicted when full, the deepest the
+// client's queue got, the events dropped, the confirmation latency of telemetry messages and
+// reported-state patches and the hub's enqueue -> acknowledged p99. The device
+// falls behind at the first rate where it hands the client less than 95% of the events offered
+// while loaded, the rest being stored or dropped. The hub impairments are sim_iothub.c's.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "azure.h"
+#include "display.h"
+#include "event_queue.h"
+#include "keyboard.h"
+#include "lock.h"
+
+#define LOAD_APP_TICK_US (10 * SIM_US_PER_MS)
+#define LOAD_WARMUP_US (10 * SIM_US_PER_SECOND)
+#define LOAD_MAX_RATES 32
+#define LOAD_BEHIND_PERCENT 95
+
+typedef struct LoadDoor {
+	LockContext lock;
+	SimDevice device;
+	FILE* storage;
+	uint64_t nextAppUs;
+	uint64_t nextAzureUs;
+	uint64_t azurePeriodUs;
+	uint64_t nextEventUs;// UINT64_MAX without load
+	uint64_t loadStartUs;
+	uint64_t events;// offered since loadStartUs
+	double rate;
+	unsigned int maxStored;
+} LoadDoor;
+
+typedef struct LoadResult {
+	double offered;
+	double sent;// events handed to the client per second while loaded
+	double stored;// events put in the telemetry store per second while loaded
+	double published;// messages reaching the hub per second while loaded
+	unsigned int maxStored;
+	unsigned int leftStored;
+	uint32_t evicted;// stored messages lost to a full store
+	uint64_t maxPending;
+	uint32_t dropped;
+	uint32_t telemetryP50Ms;
+	uint32_t telemetryP99Ms;
+	uint32_t reportedP99Ms;
+	uint64_t hubAckP99Us;
+} LoadResult;
+
+static SimDevice templateDevice;
+
+// Same as the fleet's: a timer that fired late folds the missed expirations into one.
+static uint64_t nextDeadline(uint64_t deadlineUs, uint64_t periodUs, uint64_t nowUs)
+{
+	deadlineUs += periodUs;
+	if (deadlineUs <= nowUs)
+		deadlineUs += ((nowUs - deadlineUs) / periodUs + 1) * periodUs;
+	return deadlineUs;
+}
+
+static void offerEvent(LoadDoor* door)
+{
+	LockTelemetryCode code = (door->events & 1) == 0 ? LOCK_CODE_DOOR_OPENED : LOCK_CODE_DOOR_CLOSED;
+	const LockTelemetryEvent* event = &LockCore_TelemetryEvents[code];
+	SendTelemetry(&door->lock.azure, (uint8_t)code, 0, event->key, event->text,
+		TELEMETRY_LANE_OPERATIONAL);
+	TwinReportState(&door->lock.azure, "IsDoorOpen", code == LOCK_CODE_DOOR_OPENED ? "true" : "false");
+	door->events++;
+	door->nextEventUs = door->loadStartUs + (uint64_t)((double)door->events * SIM_US_PER_SECOND / door->rate);
+}
+
+// Runs the app tick, the Azure poll and the offered events due before endUs, earliest first.
+static void runDoor(LoadDoor* door, uint64_t endUs)
+{
+	for (;;) {
+		uint64_t dueUs = door->nextAppUs;
+		if (door->nextAzureUs < dueUs)
+			dueUs = door->nextAzureUs;
+		if (door->nextEventUs < dueUs)
+			dueUs = door->nextEventUs;
+		if (dueUs >= endUs)
+			break;
+		Sim_AdvanceToUs(dueUs);
+
+		if (dueUs == door->nextEventUs) {
+			offerEvent(door);
+		}
+		else if (dueUs == door->nextAppUs) {
+			Lock_Run(&door->lock);
+			unsigned int stored = EventQueue_Count(&door->lock.azure.store);
+			if (stored > door->maxStored)
+				door->maxStored = stored;
+			door->nextAppUs = nextDeadline(door->nextAppUs, LOAD_APP_TICK_US, Sim_NowUs());
+		}
+		else {
+			int period = PollAzureClient(&door->lock.azure);
+			if (period > 0)
+				door->azurePeriodUs = (uint64_t)period * SIM_US_PER_SECOND;
+			door->nextAzureUs = nextDeadline(door->nextAzureUs, door->azurePeriodUs, Sim_NowUs());
+		}
+	}
+}
+
+static int startDoor(LoadDoor* door)
+{
+	memset(door, 0, sizeof(*door));
+	SimDevice_Init(&door->device);
+	memcpy(door->device.fds, templateDevice.fds, sizeof(templateDevice.fds));
+	memcpy(door->device.pins, templateDevice.pins, sizeof(templateDevice.pins));
+	door->device.networkReady = true;
+	door->storage = tmpfile();
+	if (door->storage == NULL)
+		return -1;
+	door->device.storageFd = fileno(door->storage);
+	simDevice = &door->device;
+	simHubStats = (SimHubStats){ 0 };
+
+	Lock_InitContext(&door->lock);
+	if (OpenTelemetryStore(&door->lock.azure) < 0 || Lock_Open(&door->lock) < 0 || Lock_Start(&door->lock) < 0)
+		return -1;
+	Lock_BootStage(&door->lock, LOCK_BOOT_KEYPAD);
+	Lock_DisplayReady(&door->lock);
+	door->nextAppUs = LOAD_APP_TICK_US;
+	door->azurePeriodUs = (uint64_t)AzureIoTDefaultPollPeriodSeconds * SIM_US_PER_SECOND;
+	door->nextAzureUs = 0;// connect right away
+	door->nextEventUs = UINT64_MAX;
+	runDoor(door, LOAD_WARMUP_US);
+	return door->lock.azure.authenticated ? 0 : -1;
+}
+
+static void stopDoor(LoadDoor* door)
+{
+	Lock_Close(&door->lock);
+	CloseTelemetryStore(&door->lock.azure);
+	SimHub_Cleanup();
+	fclose(door->storage);
+}
+
+static int runRate(double rate, unsigned int seconds, LoadResult* result)
+{
+	static LoadDoor door;
+	if (startDoor(&door) < 0) {
+		fprintf(stderr, "lock_load: the door failed to connect\n");
+		return -1;
+	}
+	const TelemetryLaneStats* lane = &door.lock.azure.lanes[TELEMETRY_LANE_OPERATIONAL];
+	TelemetryLaneStats before = *lane;
+	uint64_t eventsBefore = simHubStats.events;
+
+	door.rate = rate;
+	door.loadStartUs = Sim_NowUs();
+	door.nextEventUs = door.loadStartUs;
+	uint64_t loadEndUs = door.loadStartUs + seconds * SIM_US_PER_SECOND;
+	runDoor(&door, loadEndUs);
+	result->sent = (double)(lane->sent - before.sent) / seconds;
+	result->stored = (double)(lane->stored - before.stored) / seconds;
+	result->published = (double)(simHubStats.events - eventsBefore) / seconds;
+
+	door.nextEventUs = UINT64_MAX;
+	runDoor(&door, loadEndUs + seconds * SIM_US_PER_SECOND);
+
+	const AzureClient* client = &door.lock.azure;
+	result->offered = rate;
+	result->maxStored = door.maxStored;
+	result->leftStored = (unsigned int)EventQueue_Count(&client->store);
+	result->evicted = client->store.dropped[EVENT_PRIORITY_NORMAL];
+	result->maxPending = simHubStats.maxPending;
+	result->dropped = lane->dropped - before.dropped;
+	result->telemetryP50Ms = GetDeliveryPercentileMs(&client->telemetryDelivery, 50);
+	result->telemetryP99Ms = GetDeliveryPercentileMs(&client->telemetryDelivery, 99);
+	result->reportedP99Ms = GetDeliveryPercentileMs(&client->reportedDelivery, 99);
+	result->hubAckP99Us = SimHistogram_Percentile(&simHubStats.enqueueToAckUs, 99);
+	stopDoor(&door);
+	return 0;
+}
+
+static size_t parseRates(const char* text, double* rates)
+{
+	size_t count = 0;
+	char* end;
+	while (count < LOAD_MAX_RATES) {
+		double rate = strtod(text, &end);
+		if (end == text || rate <= 0)
+			return 0;
+		rates[count++] = rate;
+		if (*end != ',')
+			break;
+		text = end + 1;
+	}
+	return *end == '\0' ? count : 0;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [--rates R,R,...] [--seconds S] [--rtt-ms MS] [--jitter-ms MS] [--loss PCT]\n"
+		"       [--disconnect-every-s S] [--disconnect-s S] [--seed S]\n"
+		"  -v                  print the application's Log_Debug output with virtual timestamps\n"
+		"  --rates R,R,...     door events offered per second, one run each (default 1,2,5,10,20,50,100,200,500)\n"
+		"  --seconds S         virtual seconds of load per rate, and as long again to drain (default 60)\n"
+		"  --rtt-ms            hub acknowledgement round trip (default 80)\n"
+		"  --jitter-ms MS      up to this much extra round trip per publish, at random (default 0)\n"
+		"  --loss PCT          percentage of publishes the hub loses (default 0)\n"
+		"  --disconnect-every-s S  drop the hub connection at random, every S seconds on average\n"
+		"  --disconnect-s S    how long each drop lasts (default 0)\n"
+		"  --seed S            seed for the hub impairments (default 1)\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	double rates[LOAD_MAX_RATES] = { 1, 2, 5, 10, 20, 50, 100, 200, 500 };
+	size_t rateCount = 9;
+	unsigned int seconds = 60;
+	simHubConfig.seed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-v") == 0) {
+			simVerbose = true;
+		}
+		else if (strcmp(arg, "--rates") == 0 && hasValue) {
+			rateCount = parseRates(argv[++i], rates);
+		}
+		else if (strcmp(arg, "--seconds") == 0 && hasValue) {
+			seconds = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--rtt-ms") == 0 && hasValue) {
+			simHubConfig.roundTripUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--jitter-ms") == 0 && hasValue) {
+			simHubConfig.jitterUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--loss") == 0 && hasValue) {
+			simHubConfig.lossPercent = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--disconnect-every-s") == 0 && hasValue) {
+			simHubConfig.disconnectMeanUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--disconnect-s") == 0 && hasValue) {
+			simHubConfig.disconnectUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--seed") == 0 && hasValue) {
+			simHubConfig.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (rateCount == 0 || seconds == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	strncpy(scopeId, "sim-scope-id", SCOPEID_LENGTH);
+	SimDevice_Init(&templateDevice);
+	simDevice = &templateDevice;
+	if (initDisplay() < 0 || initKeyboard() < 0) {
+		fprintf(stderr, "lock_load: display or keypad failed to open\n");
+		return 1;
+	}
+
+	printf("=== lock_load (%u s per rate, rtt %llu ms, jitter %llu ms, loss %u%%, drops every %llu s for %llu s) ===\n",
+		seconds, (unsigned long long)(simHubConfig.roundTripUs / SIM_US_PER_MS),
+		(unsigned long long)(simHubConfig.jitterUs / SIM_US_PER_MS), simHubConfig.lossPercent,
+		(unsigned long long)(simHubConfig.disconnectMeanUs / SIM_US_PER_SECOND),
+		(unsigned long long)(simHubConfig.disconnectUs / SIM_US_PER_SECOND));
+	printf("%9s %8s %8s %8s %6s %6s %7s %8s %7s %9s %9s %9s %9s\n", "offered/s", "sent/s", "stored/s", "msgs/s",
+		"store", "left", "evicted", "client q", "dropped", "tel p50", "tel p99", "rep p99", "hub p99");
+	double behindRate = 0;
+	for (size_t i = 0; i < rateCount; i++) {
+		LoadResult result;
+		if (runRate(rates[i], seconds, &result) < 0)
+			return 1;
+		printf("%9.1f %8.1f %8.1f %8.1f %6u %6u %7u %8llu %7u %6u ms %6u ms %6u ms %6.0f ms\n", result.offered,
+			result.sent, result.stored, result.published, result.maxStored, result.leftStored, result.evicted,
+			(unsigned long long)result.maxPending, result.dropped, result.telemetryP50Ms, result.telemetryP99Ms, result.reportedP99Ms,
+			(double)result.hubAckP99Us / SIM_US_PER_MS);
+		if (behindRate == 0 && result.sent * 100 < result.offered * LOAD_BEHIND_PERCENT)
+			behindRate = result.offered;
+	}
+	if (behindRate > 0)
+		printf("falls behind at %.1f events/s: less than %d%% of the offered events reach the client\n",
+			behindRate, LOAD_BEHIND_PERCENT);
+	else
+		printf("kept up with every rate\n");
+	return 0;
+}
@@ -0,0 +1,179 @@
+// lock_sim: runs the lock application from ../AzureIoT on virtual hardware.
+//
+//     lock_sim [-v] [--day N] [--seed S] [--provisioning-ms MS] [--rtt-ms MS]
+//              [--record FILE] [--replay FILE] [--speed X] [--storage FILE] [--iot-worker]
+//              [--binary-telemetry] [--jitter-ms MS] [--loss PCT] [--disconnect-every-s S]
+//              [--disconnect-s S] [scenario.txt]
+//
+// With a scenario file the inputs come from the file (see sim_script.c for the format);
+// with --day the simulator generates 24 hours of traffic with N door cycles; with --replay
+// the inputs come from a recorded trace (see sim_replay.c). At the end it prints latency,
+// syscall and bytes-sent statistics. Telemetry stored while offline survives into the next
+// run when --storage names the same file.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parson.h"
+
+// main() of the application, renamed by the simulator build.
+int LockApp_Main(int argc, char* argv[]);
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [--day N] [--seed S] [--provisioning-ms MS] [--rtt-ms MS]\n"
+		"       [--record FILE] [--replay FILE] [--speed X] [--storage FILE] [--iot-worker]\n"
+		"       [--binary-telemetry] [--jitter-ms MS] [--loss PCT] [--disconnect-every-s S]\n"
+		"       [--disconnect-s S] [scenario.txt]\n"
+		"  -v                  print the application's Log_Debug output with virtual timestamps\n"
+		"  --day N             generate a day of traffic with N door cycles instead of a scenario\n"
+		"  --seed S            seed for --day and the hub impairments (default 1)\n"
+		"  --provisioning-ms   time device provisioning blocks the caller (default 1500)\n"
+		"  --rtt-ms            hub acknowledgement round trip (default 80)\n"
+		"  --jitter-ms MS      up to this much extra round trip per publish, at random (default 0)\n"
+		"  --loss PCT          percentage of publishes the hub loses (default 0)\n"
+		"  --disconnect-every-s S  drop the hub connection at random, every S seconds on average\n"
+		"  --disconnect-s S    how long each drop lasts (default 0)\n"
+		"  --record FILE       write the application's input trace to FILE at the end\n"
+		"  --replay FILE       replay a recorded trace and check the outputs match\n"
+		"  --speed X           run at most X times faster than real time (default unpaced)\n"
+		"  --storage FILE      mutable storage file, kept between runs (default a new temporary file)\n"
+		"  --iot-worker        run the app's IoT Hub client on its worker thread\n"
+		"  --binary-telemetry  send telemetry in the app's binary encoding instead of JSON\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* scenario = NULL;
+	const char* recordPath = NULL;
+	const char* replayPath = NULL;
+	const char* storagePath = NULL;
+	unsigned int dayCycles = 0;
+	unsigned int seed = 1;
+	bool iotWorker = false;
+	bool binaryTelemetry = false;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "-v") == 0) {
+			simVerbose = true;
+		}
+		else if (strcmp(arg, "--day") == 0 && hasValue) {
+			dayCycles = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--seed") == 0 && hasValue) {
+			seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--provisioning-ms") == 0 && hasValue) {
+			simHubConfig.provisioningUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--rtt-ms") == 0 && hasValue) {
+			simHubConfig.roundTripUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--jitter-ms") == 0 && hasValue) {
+			simHubConfig.jitterUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_MS;
+		}
+		else if (strcmp(arg, "--loss") == 0 && hasValue) {
+			simHubConfig.lossPercent = (unsigned int)strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--disconnect-every-s") == 0 && hasValue) {
+			simHubConfig.disconnectMeanUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--disconnect-s") == 0 && hasValue) {
+			simHubConfig.disconnectUs = strtoull(argv[++i], NULL, 10) * SIM_US_PER_SECOND;
+		}
+		else if (strcmp(arg, "--record") == 0 && hasValue) {
+			recordPath = argv[++i];
+		}
+		else if (strcmp(arg, "--replay") == 0 && hasValue) {
+			replayPath = argv[++i];
+		}
+		else if (strcmp(arg, "--speed") == 0 && hasValue) {
+			SimLoop_SetSpeed(strtod(argv[++i], NULL));
+		}
+		else if (strcmp(arg, "--storage") == 0 && hasValue) {
+			storagePath = argv[++i];
+		}
+		else if (strcmp(arg, "--iot-worker") == 0) {
+			iotWorker = true;
+		}
+		else if (strcmp(arg, "--binary-telemetry") == 0) {
+			binaryTelemetry = true;
+		}
+		else if (arg[0] != '-' && scenario == NULL) {
+			scenario = arg;
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if ((scenario != NULL) + (dayCycles != 0) + (replayPath != NULL) != 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	simHubConfig.seed = seed;
+
+	FILE* temporaryStorage = NULL;
+	if (storagePath != NULL) {
+		simDevice->storageFd = open(storagePath, O_RDWR | O_CREAT, 0644);
+	}
+	else if ((temporaryStorage = tmpfile()) != NULL) {
+		simDevice->storageFd = fileno(temporaryStorage);
+	}
+	if (simDevice->storageFd < 0) {
+		perror(storagePath != NULL ? storagePath : "tmpfile");
+		return 1;
+	}
+
+	Sim_SetNetworkReady(true);
+	if (replayPath != NULL) {
+		if (SimReplay_Load(replayPath) != 0)
+			return 1;
+	}
+	else if (scenario != NULL) {
+		if (SimScript_Load(scenario) != 0)
+			return 1;
+	}
+	else {
+		SimScript_GenerateDay(dayCycles, seed);
+	}
+	SimLoop_SetEndUs(SimScript_EndUs());
+
+	char program[] = "app";
+	char scopeId[] = "sim-scope-id";
+	char workerOption[] = "--iot-worker";
+	char binaryOption[] = "--binary-telemetry";
+	char* appArgv[4] = { program, scopeId };
+	int appArgc = 2;
+	if (iotWorker)
+		appArgv[appArgc++] = workerOption;
+	if (binaryTelemetry)
+		appArgv[appArgc++] = binaryOption;
+
+	uint64_t startNs = Sim_HostNowNs();
+	int result = LockApp_Main(appArgc, appArgv);
+	uint64_t hostWallNs = Sim_HostNowNs() - startNs;
+
+	const char* source = replayPath != NULL ? replayPath : scenario != NULL ? scenario : "generated day";
+	printf("=== lock_sim report (%s) ===\n", source);
+	printf("application exit code        %d\n", result);
+	Sim_PrintStats(hostWallNs);
+	SimLoop_PrintStats();
+	SimHub_PrintStats();
+	SimHub_Cleanup();
+	if (recordPath != NULL && SimReplay_Save(recordPath) != 0)
+		result = -1;
+	if (replayPath != NULL && SimReplay_Check() != 0)
+		result = -1;
+	return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,439 @@
+// lock_props: property test of the lock core (../AzureIoT/lock_core.c).
+//
+//     lock_props [--seeds N] [--steps N] [--seed S]
+//
+// The core is linked on its own, without the simulated device or any applibs stub, so the
+// build itself shows the state machine needs no I/O. Each seed drives a fresh core through
+// a random sequence of 10 ms ticks, door flips, typed codes, menu keys, time jumps, twin
+// updates and direct methods, and every step is checked against the invariants below. The
+// first violation prints the seed, step and event and exits with 1.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lock_core.h"
+#include "lock_twin.h"
+
+#define PROPS_TICK_MS 10
+#define PROPS_MAX_PHRASE 24
+
+typedef struct PropsRun {
+	LockCore core;
+	LockEffects effects;
+	uint32_t random;
+	uint32_t now;
+	bool doorOpen;
+	char phrase[PROPS_MAX_PHRASE];// keys still to be typed, one per tick
+	uint8_t phraseIndex;
+} PropsRun;
+
+typedef struct PropsCoverage {
+	uint64_t steps;
+	uint64_t alarms;
+	uint64_t unlocks;
+	uint64_t blocks;
+	uint64_t menus;
+	uint64_t reports;
+	uint64_t configs;//ApplyConfig events that were accepted
+} PropsCoverage;
+
+static PropsCoverage coverage;
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// True with probability 1/n.
+static bool oneIn(PropsRun* run, uint32_t n)
+{
+	return nextRandom(&run->random) % n == 0;
+}
+
+static void randomDigits(PropsRun* run, char* out, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+		out[i] = (char)('0' + nextRandom(&run->random) % 10);
+	out[length] = '\0';
+}
+
+// Picks what the person at the keypad types next: a code followed by '#' or '*', a menu
+// choice, a wrong code, a code longer than the buffer, or 'B' / 'C'.
+static void choosePhrase(PropsRun* run)
+{
+	char* phrase = run->phrase;
+	char digits[PROPS_MAX_PHRASE - 1];
+	switch (nextRandom(&run->random) % 9) {
+	case 0:
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s#", run->core.userPassword);
+		break;
+	case 1:
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s#", run->core.adminPassword);
+		break;
+	case 2:
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s*", run->core.userPassword);
+		break;
+	case 3:
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s*", run->core.adminPassword);
+		break;
+	case 4:// menu entry or mode choice
+		snprintf(phrase, PROPS_MAX_PHRASE, "%c#", (char)('0' + nextRandom(&run->random) % 8));
+		break;
+	case 5:// wrong or new code
+		randomDigits(run, digits, 1 + nextRandom(&run->random) % 6);
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s%c", digits, oneIn(run, 2) ? '#' : '*');
+		break;
+	case 6:// overflows the key buffer
+		randomDigits(run, digits, sizeof(digits) - 1);
+		snprintf(phrase, PROPS_MAX_PHRASE, "%s#", digits);
+		break;
+	case 7:
+		strcpy(phrase, "B");
+		break;
+	default:
+		strcpy(phrase, "C");
+		break;
+	}
+	run->phraseIndex = 0;
+}
+
+static void randomTwin(PropsRun* run, LockTwin* twin)
+{
+	memset(twin, 0, sizeof(*twin));
+	for (int field = 0; field < LOCK_TWIN_FIELD_COUNT; field++) {
+		if (oneIn(run, 3))
+			twin->present |= 1u << field;
+	}
+	// The cloud holds the lock open or closed, never both at once, and sends the two flags
+	// together.
+	if (twin->present & (LOCK_TWIN_ALWAYS_OPEN | LOCK_TWIN_ALWAYS_CLOSED))
+		twin->present |= LOCK_TWIN_ALWAYS_OPEN | LOCK_TWIN_ALWAYS_CLOSED;
+	switch (nextRandom(&run->random) % 4) {
+	case 0:
+		twin->alwaysOpen = true;
+		break;
+	case 1:
+		twin->alwaysClosed = true;
+		break;
+	}
+	twin->lockMode = (uint8_t)(nextRandom(&run->random) % 2);
+	twin->contactMode = (uint8_t)(nextRandom(&run->random) % 2);
+	twin->displayBacklight = (uint8_t)(nextRandom(&run->random) % 3);
+	twin->monoSwitchSeconds = nextRandom(&run->random) % 1001;
+	randomDigits(run, twin->userPassword, nextRandom(&run->random) % sizeof(twin->userPassword));
+	randomDigits(run, twin->adminPassword, nextRandom(&run->random) % sizeof(twin->adminPassword));
+}
+
+// Mostly ticks; a key is typed on roughly every tenth tick, and now and then the time
+// jumps ahead past the lock's timeouts.
+static void nextEvent(PropsRun* run, LockEvent* event, LockTwin* twin)
+{
+	memset(event, 0, sizeof(*event));
+	uint32_t pick = nextRandom(&run->random) % 1000;
+	if (pick < 20) {
+		event->type = LOCK_EVENT_TWIN;
+		randomTwin(run, twin);
+		event->twin = twin;
+		return;
+	}
+	if (pick < 25) {
+		event->type = LOCK_EVENT_RESET_ALARM;
+		return;
+	}
+	if (pick < 26) {
+		event->type = LOCK_EVENT_FACTORY_RESET;
+		return;
+	}
+	if (pick < 31) {
+		event->type = oneIn(run, 2) ? LOCK_EVENT_UNLOCK : LOCK_EVENT_LOCK;
+		return;
+	}
+	if (pick < 36) {
+		// ApplyConfig with some of the settings, often one it refuses
+		event->type = LOCK_EVENT_CONFIG;
+		randomTwin(run, twin);
+		twin->present &= LOCK_TWIN_REPORTED_FIELDS;
+		event->twin = twin;
+		return;
+	}
+
+	event->type = LOCK_EVENT_TICK;
+	run->now += PROPS_TICK_MS;
+	if (oneIn(run, 500))
+		run->now += nextRandom(&run->random) % 40000;
+	if (oneIn(run, 50))
+		run->doorOpen = !run->doorOpen;
+	event->doorOpen = run->doorOpen;
+	if (oneIn(run, 10)) {
+		if (run->phrase[run->phraseIndex] == '\0')
+			choosePhrase(run);
+		event->key = run->phrase[run->phraseIndex++];
+	}
+}
+
+static const char* eventName(const LockEvent* event)
+{
+	switch (event->type) {
+	case LOCK_EVENT_START:
+		return "start";
+	case LOCK_EVENT_TICK:
+		return "tick";
+	case LOCK_EVENT_TWIN:
+		return "twin";
+	case LOCK_EVENT_RESET_ALARM:
+		return "reset alarm";
+	case LOCK_EVENT_FACTORY_RESET:
+		return "factory reset";
+	case LOCK_EVENT_UNLOCK:
+		return "unlock";
+	case LOCK_EVENT_LOCK:
+		return "lock";
+	case LOCK_EVENT_CONFIG:
+		return "apply config";
+	default:
+		return "?";
+	}
+}
+
+static bool terminated(const char* text)
+{
+	return memchr(text, '\0', PASSWORD_LENGTH) != NULL;
+}
+
+static bool relayAtLockedLevel(const LockCore* core)
+{
+	return core->relayHigh == (core->contactMode == NORMAL_CLOSED);
+}
+
+static bool sameConfig(const LockCore* a, const LockCore* b)
+{
+	return a->lockMode == b->lockMode && a->contactMode == b->contactMode && a->displayBacklight == b->displayBacklight
+		&& a->monoSwitchTime == b->monoSwitchTime && strcmp(a->userPassword, b->userPassword) == 0
+		&& strcmp(a->adminPassword, b->adminPassword) == 0;
+}
+
+// ApplyConfig is all or nothing, and each setting it changes is reported once.
+static const char* checkConfig(const LockCore* before, const LockCore* after, const LockTwin* config,
+	const LockEffects* effects)
+{
+	if (LockCore_CheckConfig(before, config) != NULL)
+		return effects->count == 0 && sameConfig(before, after) ? NULL : "a configuration that is refused changes nothing";
+	uint32_t changed = LockCore_ChangedTwinFields(before, config);
+	if (LockCore_ChangedTwinFields(after, config) != 0)
+		return "an accepted configuration is applied whole";
+	int reports = 0;
+	for (int i = 0; i < effects->count; i++)
+		reports += effects->items[i].type == LOCK_EFFECT_REPORT && strcmp(effects->items[i].name, "IsLockOpen") != 0;
+	int expected = 0;
+	for (uint32_t bits = changed; bits != 0; bits &= bits - 1)
+		expected++;
+	return reports == expected ? NULL : "ApplyConfig reports each setting it changes once";
+}
+
+// Checks one step from `before` to run->core with the effects it made. Returns the
+// violated invariant, or NULL.
+static const char* check(const PropsRun* run, const LockCore* before, const LockEvent* event)
+{
+	const LockCore* after = &run->core;
+	const LockEffects* effects = &run->effects;
+
+	if (effects->dropped != 0)
+		return "every effect fits in LockEffects";
+	if (event->type == LOCK_EVENT_TICK && !before->synced && effects->count != 0)
+		return "nothing happens before the first twin";
+	if (event->type == LOCK_EVENT_TWIN && before->synced && LockCore_ChangedTwinFields(before, event->twin) == 0
+		&& effects->count != 0)
+		return "a twin that repeats the configuration has no effects";
+
+	bool alarmRaised = false;
+	bool alarmChanged = false;
+	bool criticalSent = false;
+	bool unlocked = false;
+	bool isAlarm = before->isAlarm;
+	bool relayHigh = before->relayHigh;
+	for (int i = 0; i < effects->count; i++) {
+		const LockEffect* effect = &effects->items[i];
+		switch (effect->type) {
+		case LOCK_EFFECT_LOCK:
+		case LOCK_EFFECT_UNLOCK:
+			if (effect->value == relayHigh)
+				return "relay effects always change the level";
+			relayHigh = effect->value;
+			unlocked |= effect->type == LOCK_EFFECT_UNLOCK;
+			break;
+		case LOCK_EFFECT_ALARM:
+			if (effect->value == isAlarm)
+				return "alarm effects always change the alarm relay";
+			isAlarm = effect->value;
+			alarmRaised |= effect->value;
+			alarmChanged = true;
+			break;
+		case LOCK_EFFECT_TELEMETRY:
+			if (effect->value == LOCK_CODE_NONE || effect->value >= LOCK_CODE_COUNT)
+				return "telemetry events are in the catalog";
+			if (effect->argument != 0 && !LockCore_TelemetryEvents[effect->value].argument)
+				return "only events with an argument carry one";
+			criticalSent |= LockCore_TelemetryEvents[effect->value].lane == LOCK_TELEMETRY_CRITICAL;
+			// fall through
+		case LOCK_EFFECT_REPORT:
+			if (effect->name == NULL || effect->text == NULL)
+				return "messages have a name and a text";
+			break;
+		case LOCK_EFFECT_LOG:
+			if (effect->text == NULL)
+				return "log lines have a text";
+			break;
+		}
+	}
+	if (isAlarm != after->isAlarm)
+		return "isAlarm follows the alarm relay";
+	if (alarmChanged != criticalSent)
+		return "the alarm relay changes with a critical telemetry event, and only then";
+	if (relayHigh != after->relayHigh)
+		return "relayHigh follows the lock relay";
+
+	// The alarm is raised if and only if the door opens while it is locked in normal op.
+	// Within a tick the always open / closed flags act on the lock before the door is read.
+	bool lockedAtDoorCheck = before->lockState == CLOSED;
+	if (before->alwaysOpen && !before->alwaysClosed)
+		lockedAtDoorCheck = false;
+	if (before->alwaysClosed && !before->alwaysOpen)
+		lockedAtDoorCheck = true;
+	bool intrusion = event->type == LOCK_EVENT_TICK && before->synced && before->doorSampled
+		&& !before->doorWasOpen && event->doorOpen && before->currentMenu == NORMAL_OP
+		&& !before->isAlarm && lockedAtDoorCheck;
+	if (alarmRaised != intrusion)
+		return "alarm raised iff the door opens while locked in normal op";
+
+	if (event->type == LOCK_EVENT_TICK && !after->alwaysOpen && relayAtLockedLevel(after) != (after->lockState == CLOSED))
+		return "lockState matches the relay level for the contact mode";
+	if (unlocked && before->blockLock && after->blockLock && !after->alwaysOpen && event->type != LOCK_EVENT_UNLOCK)
+		return "the keypad can't unlock while it is blocked";
+	if ((event->type == LOCK_EVENT_UNLOCK || event->type == LOCK_EVENT_LOCK) && !before->synced && effects->count != 0)
+		return "the Lock and Unlock methods do nothing before the first twin";
+	if (event->type == LOCK_EVENT_UNLOCK && before->synced && after->lockState != (before->alwaysClosed ? before->lockState : OPEN))
+		return "Unlock opens the lock unless AlwaysClosed holds it";
+	if (event->type == LOCK_EVENT_LOCK && before->synced && after->lockState != (before->alwaysOpen ? before->lockState : CLOSED))
+		return "Lock closes the lock unless AlwaysOpen holds it";
+	if (event->type == LOCK_EVENT_CONFIG) {
+		const char* why = checkConfig(before, after, event->twin, effects);
+		if (why != NULL)
+			return why;
+	}
+	if (event->type == LOCK_EVENT_TICK && after->lockState == OPEN && after->lockMode == MONO && !after->alwaysOpen
+		&& run->now - after->unlockStartTime >= after->monoSwitchTime)
+		return "mono lock relocks after monoSwitchTime";
+	if (after->invalidTries > 3)
+		return "at most three invalid attempts";
+	if (!terminated(after->charBuffer) || !terminated(after->userPassword) || !terminated(after->adminPassword))
+		return "key buffer and passwords stay terminated";
+	return NULL;
+}
+
+static void countCoverage(const LockCore* before, const LockCore* after, const LockEvent* event, const LockEffects* effects)
+{
+	coverage.configs += event->type == LOCK_EVENT_CONFIG && LockCore_CheckConfig(before, event->twin) == NULL;
+	for (int i = 0; i < effects->count; i++) {
+		const LockEffect* effect = &effects->items[i];
+		coverage.alarms += effect->type == LOCK_EFFECT_ALARM && effect->value;
+		coverage.unlocks += effect->type == LOCK_EFFECT_UNLOCK;
+		coverage.reports += effect->type == LOCK_EFFECT_REPORT;
+	}
+	coverage.blocks += !before->blockLock && after->blockLock;
+	coverage.menus += before->currentMenu != after->currentMenu;
+}
+
+// Returns false after printing the first violation.
+static bool runSeed(uint32_t seed, uint64_t steps)
+{
+	PropsRun run;
+	memset(&run, 0, sizeof(run));
+	run.random = seed * 2654435761u + 1;
+	LockCore_Init(&run.core);
+
+	LockTwin twin;
+	LockEvent event = { .type = LOCK_EVENT_START };
+	for (uint64_t step = 0; step < steps; step++) {
+		if (step > 0)
+			nextEvent(&run, &event, &twin);
+		LockCore before = run.core;
+		LockCore_Step(&run.core, &event, run.now, &run.effects);
+		const char* violation = check(&run, &before, &event);
+		if (violation != NULL) {
+			printf("seed %u step %llu at %u ms: %s event (door %s, key '%c'): %s\n", seed,
+				(unsigned long long)step, run.now, eventName(&event), event.doorOpen ? "open" : "closed",
+				event.key ? event.key : ' ', violation);
+			return false;
+		}
+		countCoverage(&before, &run.core, &event, &run.effects);
+	}
+	coverage.steps += steps;
+	return true;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [--seeds N] [--steps N] [--seed S]\n"
+		"  --seeds N   random sequences to run (default 100)\n"
+		"  --steps N   events per sequence (default 100000)\n"
+		"  --seed S    first seed (default 1)\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long seeds = 100;
+	unsigned long long steps = 100000;
+	uint32_t firstSeed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "--seeds") == 0 && hasValue) {
+			seeds = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--steps") == 0 && hasValue) {
+			steps = strtoull(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--seed") == 0 && hasValue) {
+			firstSeed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < seeds; i++) {
+		if (!runSeed(firstSeed + (uint32_t)i, steps))
+			return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("lock core properties\n");
+	printf("  sequences                  %lu x %llu events\n", seeds, steps);
+	printf("  steps                      %llu in %.2f s, %.2f million steps/s\n",
+		(unsigned long long)coverage.steps, seconds, seconds > 0 ? (double)coverage.steps / seconds / 1e6 : 0.0);
+	printf("  alarms raised              %llu\n", (unsigned long long)coverage.alarms);
+	printf("  unlocks                    %llu\n", (unsigned long long)coverage.unlocks);
+	printf("  keypad blocks              %llu\n", (unsigned long long)coverage.blocks);
+	printf("  menu changes               %llu\n", (unsigned long long)coverage.menus);
+	printf("  reported properties        %llu\n", (unsigned long long)coverage.reports);
+	printf("  configurations applied     %llu\n", (unsigned long long)coverage.configs);
+	printf("all invariants held\n");
+	return 0;
+}
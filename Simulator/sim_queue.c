@@ -0,0 +1,311 @@
+// lock_queue: benchmark and power-loss test of the telemetry store (../AzureIoT/event_queue.c).
+//
+//     lock_queue [--file PATH] [--records N] [--trials N] [--seed S]
+//
+// The queue is linked on its own and works on a real host file, 16 KiB like the app's
+// store. The benchmark times appends (each synced to storage, evicting once the queue is
+// full), draining (peek and pop, with a head commit every EVENT_QUEUE_COMMIT_EVERY pops)
+// and recovery of a full queue on open. The power-loss test runs random pushes and pops on
+// a small ring, tears the last write at a random byte, reopens the file and checks that
+// exactly the records the queue had committed come back, intact and in order. The first
+// failure prints the trial and exits with 1.
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_queue.h"
+
+#define QUEUE_STORE_SIZE (16 * 1024)// TELEMETRY_STORE_SIZE in azure.h
+#define QUEUE_TRIAL_SIZE 1024// small ring, so trials wrap and evict often
+#define QUEUE_MAX_PAYLOAD 256
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static uint64_t nowNs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int compareU64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void printLatency(const char* name, uint64_t* samples, size_t count)
+{
+	qsort(samples, count, sizeof(*samples), compareU64);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += samples[i];
+	printf("  %-26s n=%-8zu mean=%.1f p50=%.1f p99=%.1f max=%.1f us\n", name, count,
+		(double)sum / (double)count / 1e3, (double)samples[count / 2] / 1e3,
+		(double)samples[count * 99 / 100] / 1e3, (double)samples[count - 1] / 1e3);
+}
+
+// Payload of record `seq`: its length and bytes follow from the sequence number, so a
+// recovered record can be checked without keeping a copy.
+static uint16_t payloadFor(uint32_t seq, uint8_t* payload)
+{
+	uint16_t length = (uint16_t)(16 + (seq * 37u) % (QUEUE_MAX_PAYLOAD - 16));
+	for (uint16_t i = 0; i < length; i++)
+		payload[i] = (uint8_t)(seq * 31u + i);
+	return length;
+}
+
+static bool resetFile(int fd)
+{
+	return ftruncate(fd, 0) == 0;
+}
+
+static bool benchmark(int fd, unsigned long records)
+{
+	EventQueue queue;
+	uint8_t payload[QUEUE_MAX_PAYLOAD];
+	uint64_t* samples = malloc(records * sizeof(*samples));
+	if (samples == NULL || !resetFile(fd) || EventQueue_Open(&queue, fd, 0, QUEUE_STORE_SIZE) != 0)
+		return false;
+
+	// appends of one-event messages, the queue fills after ~140 and evicts from then on
+	static const char message[] = "{ \"LockEvent\": \"Lock unlocked.\" }, padded to a typical single event...";
+	uint64_t bytes = 0;
+	for (unsigned long i = 0; i < records; i++) {
+		uint64_t start = nowNs();
+		int result = EventQueue_Push(&queue, EVENT_PRIORITY_NORMAL, message, sizeof(message) - 1);
+		samples[i] = nowNs() - start;
+		if (result != 0) {
+			printf("append %lu failed\n", i);
+			return false;
+		}
+		bytes += sizeof(message) - 1;
+	}
+	printf("telemetry store (%u KiB, %zu-byte messages)\n", QUEUE_STORE_SIZE / 1024, sizeof(message) - 1);
+	printLatency("append + fsync", samples, records);
+	printf("  %-26s %u queued, %u evicted\n", "after appends", EventQueue_Count(&queue),
+		queue.dropped[EVENT_PRIORITY_NORMAL]);
+
+	// recovery of the full queue, as on boot
+	uint64_t start = nowNs();
+	int recovered = EventQueue_Open(&queue, fd, 0, QUEUE_STORE_SIZE);
+	uint64_t openNs = nowNs() - start;
+	printf("  %-26s %d records in %.1f us\n", "open (recovery scan)", recovered, (double)openNs / 1e3);
+
+	// drain: peek and pop until empty, refilled until `records` have been drained
+	unsigned long drained = 0;
+	uint64_t drainNs = 0;
+	bytes = 0;
+	while (drained < records) {
+		while (EventQueue_Push(&queue, EVENT_PRIORITY_NORMAL, message, sizeof(message) - 1) == 0
+			&& queue.dropped[EVENT_PRIORITY_NORMAL] == 0) {
+		}
+		queue.dropped[EVENT_PRIORITY_NORMAL] = 0;
+		start = nowNs();
+		int length;
+		while (drained < records && (length = EventQueue_Peek(&queue, payload, sizeof(payload), NULL)) >= 0) {
+			uint64_t popStart = nowNs();
+			if (EventQueue_Pop(&queue) != 0)
+				return false;
+			samples[drained++] = nowNs() - popStart;
+			bytes += (uint64_t)length;
+		}
+		drainNs += nowNs() - start;
+	}
+	printLatency("pop (commit every 8)", samples, records);
+	printf("  %-26s %.0f records/s, %.1f KiB/s\n", "drain (peek + pop)",
+		(double)records / ((double)drainNs / 1e9), (double)bytes / 1024.0 / ((double)drainNs / 1e9));
+	free(samples);
+	return true;
+}
+
+typedef struct QueueTrial {
+	EventQueue queue;
+	uint32_t random;
+	uint32_t committedSeq;// head the queue had committed before the last write
+	uint32_t tailSeq;
+	uint32_t tearAt;// file offset of the last write
+	uint32_t tearSize;// 0 if the last step wrote nothing
+	bool tearHeader;// the last write was a header slot, otherwise a record
+} QueueTrial;
+
+// One random push or pop. Remembers where the last write went, so it can be torn.
+static bool step(QueueTrial* trial)
+{
+	EventQueue* queue = &trial->queue;
+	uint8_t payload[QUEUE_MAX_PAYLOAD];
+	uint8_t read[QUEUE_MAX_PAYLOAD];
+	uint32_t generation = queue->generation;
+
+	if (EventQueue_Count(queue) > 0 && nextRandom(&trial->random) % 3 == 0) {
+		uint32_t seq = queue->headSeq;
+		int length = EventQueue_Peek(queue, read, sizeof(read), NULL);
+		if (length != payloadFor(seq, payload) || memcmp(read, payload, (size_t)length) != 0) {
+			printf("record %u reads back wrong\n", seq);
+			return false;
+		}
+		if (EventQueue_Pop(queue) != 0)
+			return false;
+		if (queue->generation != generation) {
+			trial->tearAt = (queue->generation & 1) * 32;
+			trial->tearSize = 24;
+			trial->tearHeader = true;
+		}
+	}
+	else {
+		uint8_t priority = nextRandom(&trial->random) % 8 == 0 ? EVENT_PRIORITY_CRITICAL : EVENT_PRIORITY_NORMAL;
+		uint16_t length = payloadFor(queue->tailSeq, payload);
+		uint32_t tailSeq = queue->tailSeq;
+		if (EventQueue_Push(queue, priority, payload, length) == 0) {
+			trial->tearAt = EVENT_QUEUE_HEADER_SIZE + queue->tailOffset - EVENT_QUEUE_RECORD_OVERHEAD - length;
+			trial->tearSize = EVENT_QUEUE_RECORD_OVERHEAD + length;
+			trial->tearHeader = false;
+		}
+		else if (queue->tailSeq != tailSeq) {
+			printf("a dropped record took sequence number %u\n", tailSeq);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs random operations, then tears the last write: every byte after a random point is
+// changed, as if power failed while it was written. Reopens and checks the recovered queue.
+static bool runTrial(int fd, uint32_t seed)
+{
+	QueueTrial trial = { .random = seed * 2654435761u | 1 };
+	if (!resetFile(fd) || EventQueue_Open(&trial.queue, fd, 0, QUEUE_TRIAL_SIZE) != 0)
+		return false;
+
+	unsigned int steps = 1 + nextRandom(&trial.random) % 400;
+	for (unsigned int i = 0; i < steps; i++) {
+		trial.committedSeq = trial.queue.committedSeq;
+		trial.tailSeq = trial.queue.tailSeq;
+		trial.tearSize = 0;
+		if (!step(&trial)) {
+			printf("trial %u step %u\n", seed, i);
+			return false;
+		}
+	}
+
+	// Before the tear the queue holds committedSeq..tailSeq. A torn record is lost and a torn
+	// header slot falls back to the head committed before it; anything else stays.
+	uint32_t expectHead = trial.queue.committedSeq;
+	uint32_t expectTail = trial.queue.tailSeq;
+	if (trial.tearSize > 0) {
+		uint32_t keep = nextRandom(&trial.random) % trial.tearSize;
+		uint8_t torn[EVENT_QUEUE_RECORD_OVERHEAD + QUEUE_MAX_PAYLOAD];
+		if (pread(fd, torn, trial.tearSize, trial.tearAt) != (ssize_t)trial.tearSize)
+			return false;
+		for (uint32_t i = keep; i < trial.tearSize; i++)
+			torn[i] ^= (uint8_t)(1 + nextRandom(&trial.random) % 255);
+		if (pwrite(fd, torn + keep, trial.tearSize - keep, trial.tearAt + keep) < 0)
+			return false;
+		if (trial.tearHeader)
+			expectHead = trial.committedSeq;
+		else
+			expectTail = trial.tailSeq;
+	}
+
+	EventQueue reopened;
+	int count = EventQueue_Open(&reopened, fd, 0, QUEUE_TRIAL_SIZE);
+	if (reopened.headSeq != expectHead || reopened.tailSeq != expectTail) {
+		printf("trial %u: recovered records %u..%u, expected %u..%u (%d steps, %u-byte tear at %u)\n", seed,
+			reopened.headSeq, reopened.tailSeq, expectHead, expectTail, steps, trial.tearSize, trial.tearAt);
+		return false;
+	}
+	uint8_t payload[QUEUE_MAX_PAYLOAD];
+	uint8_t read[QUEUE_MAX_PAYLOAD];
+	for (int i = 0; i < count; i++) {
+		uint32_t seq = reopened.headSeq;
+		int length = EventQueue_Peek(&reopened, read, sizeof(read), NULL);
+		if (length != payloadFor(seq, payload) || memcmp(read, payload, (size_t)length) != 0
+			|| EventQueue_Pop(&reopened) != 0) {
+			printf("trial %u: recovered record %u is damaged\n", seed, seq);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [--file PATH] [--records N] [--trials N] [--seed S]\n"
+		"  --file PATH   file the queue is kept in (default a temporary file)\n"
+		"  --records N   records appended and drained by the benchmark (default 2000)\n"
+		"  --trials N    power-loss trials (default 1000)\n"
+		"  --seed S      first trial seed (default 1)\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* path = NULL;
+	unsigned long records = 2000;
+	unsigned long trials = 1000;
+	uint32_t firstSeed = 1;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (strcmp(arg, "--file") == 0 && hasValue) {
+			path = argv[++i];
+		}
+		else if (strcmp(arg, "--records") == 0 && hasValue) {
+			records = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--trials") == 0 && hasValue) {
+			trials = strtoul(argv[++i], NULL, 10);
+		}
+		else if (strcmp(arg, "--seed") == 0 && hasValue) {
+			firstSeed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (records == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	FILE* temporary = NULL;
+	int fd = path != NULL ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+	if (path == NULL && (temporary = tmpfile()) != NULL)
+		fd = fileno(temporary);
+	if (fd < 0) {
+		perror(path != NULL ? path : "tmpfile");
+		return 1;
+	}
+
+	if (!benchmark(fd, records)) {
+		printf("benchmark failed\n");
+		return 1;
+	}
+
+	uint64_t start = nowNs();
+	for (unsigned long i = 0; i < trials; i++) {
+		if (!runTrial(fd, firstSeed + (uint32_t)i))
+			return 1;
+	}
+	printf("  %-26s %lu in %.2f s\n", "power-loss trials", trials, (double)(nowNs() - start) / 1e9);
+	printf("all trials recovered\n");
+	return 0;
+}
@@ -0,0 +1,250 @@
+// Trace record and replay.
+//
+// --record writes the application's trace buffer (trace.c) when the run ends. --replay
+// reads a trace, from the simulator or decoded from a device's DumpTrace response, and
+// schedules its inputs so each one reaches the same handler call that saw it on the
+// recording: keys and door changes around the app timer expiration, network changes, twin
+// payloads and method calls ahead of the Azure timer expiration. A saved configuration the lock
+// started from is written to mutable storage before the app boots. After the run the outputs the
+// application traced during the replay (relays, telemetry and reported-state hashes) are
+// compared with the recorded ones, in order.
+//
+// A replay assumes the hub is reachable whenever the network is up, and starts from boot,
+// so traces that lost their oldest records to the ring buffer are replayed on a best
+// effort basis.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iothub_client_core_common.h>
+
+#include "config_store.h"
+#include "lock.h"
+#include "trace.h"
+
+// Handler start times drift by a few hundred microseconds between runs (the recording is
+// truncated to milliseconds, and blocking calls take slightly different time), so inputs
+// are applied ahead of the expiration that saw them: by less than half the app timer
+// period for keypad and door, and half the Azure poll period for cloud inputs. A key is
+// held for less than one period so the next scan sees it released.
+#define SIM_APP_TIMER_PERIOD_MS 10
+#define SIM_REPLAY_TICK_LEAD_US (4 * SIM_US_PER_MS)
+#define SIM_REPLAY_KEY_HOLD_US (8 * SIM_US_PER_MS)
+#define SIM_REPLAY_CLOUD_LEAD_US (2500 * SIM_US_PER_MS)
+
+static uint64_t ahead(uint64_t timeUs, uint64_t leadUs)
+{
+	return timeUs > leadUs ? timeUs - leadUs : 0;
+}
+
+static uint8_t* recorded = NULL;
+static size_t recordedSize = 0;
+static uint32_t recordedBytes = 0;
+
+static uint8_t* readFile(const char* path, size_t* size)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* data = malloc(length > 0 ? (size_t)length : 1);
+	if (data == NULL || fread(data, 1, (size_t)length, file) != (size_t)length) {
+		fprintf(stderr, "%s: read failed\n", path);
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	*size = (size_t)length;
+	return data;
+}
+
+int SimReplay_Save(const char* path)
+{
+	size_t size = Trace_DumpSize();
+	uint8_t* dump = malloc(size);
+	if (dump == NULL)
+		return -1;
+	Trace_Dump(dump, size);
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		perror(path);
+		free(dump);
+		return -1;
+	}
+	size_t written = fwrite(dump, 1, size, file);
+	fclose(file);
+	free(dump);
+	if (written != size) {
+		fprintf(stderr, "%s: write failed\n", path);
+		return -1;
+	}
+	printf("trace: %zu bytes written to %s\n", size, path);
+	return 0;
+}
+
+int SimReplay_Load(const char* path)
+{
+	recorded = readFile(path, &recordedSize);
+	if (recorded == NULL)
+		return -1;
+	uint32_t dropped;
+	if (Trace_ParseHeader(recorded, recordedSize, &recordedBytes, &dropped) != 0) {
+		fprintf(stderr, "%s: not a lock trace\n", path);
+		return -1;
+	}
+	if (dropped != 0)
+		fprintf(stderr, "%s: %u oldest records were dropped, the replay may diverge\n", path, dropped);
+
+	SimHub_SetReplayMode(true);
+
+	const uint8_t* records = recorded + TRACE_DUMP_HEADER_SIZE;
+	size_t offset = 0;
+	uint64_t lastUs = 0;
+	TraceRecord record;
+	while (Trace_NextRecord(records, recordedBytes, &offset, &record)) {
+		if (record.length == 0)
+			continue;
+		uint64_t timeUs = (uint64_t)record.timeMs * SIM_US_PER_MS;
+		uint64_t coveredUs = timeUs;
+		switch (record.type) {
+		case TRACE_KEY:
+			SimScript_AddKeyPress(ahead(timeUs, SIM_REPLAY_TICK_LEAD_US), (char)record.payload[0], SIM_REPLAY_KEY_HOLD_US);
+			break;
+		case TRACE_DOOR:
+			SimScript_AddDoor(ahead(timeUs, SIM_REPLAY_TICK_LEAD_US), record.payload[0] != 0);
+			break;
+		case TRACE_NETWORK:
+			SimScript_AddNetwork(ahead(timeUs, SIM_REPLAY_CLOUD_LEAD_US), record.payload[0] != 0);
+			break;
+		case TRACE_TIMER:
+			if (record.payload[0] == TRACE_TIMER_APP) {
+				uint16_t count = record.payload[1] | (record.payload[2] << 8);
+				coveredUs += (uint64_t)(count - 1) * SIM_APP_TIMER_PERIOD_MS * SIM_US_PER_MS;
+			}
+			break;
+		case TRACE_TWIN: {
+			char* json = strndup((const char*)record.payload + 1, record.length - 1u);
+			SimScript_AddTwinUpdate(ahead(timeUs, SIM_REPLAY_CLOUD_LEAD_US), record.payload[0] == DEVICE_TWIN_UPDATE_COMPLETE, json);
+			free(json);
+			break;
+		}
+		case TRACE_METHOD: {
+			size_t nameLength = strnlen((const char*)record.payload, record.length);
+			char* name = strndup((const char*)record.payload, nameLength);
+			char* payload = nameLength < record.length
+				? strndup((const char*)record.payload + nameLength + 1, record.length - nameLength - 1) : strdup("");
+			SimScript_AddMethod(ahead(timeUs, SIM_REPLAY_CLOUD_LEAD_US), name, payload);
+			free(name);
+			free(payload);
+			break;
+		}
+		case TRACE_CONFIG: {
+			ConfigStore store;
+			if (ConfigStore_Open(&store, dup(simDevice->storageFd), LOCK_CONFIG_OFFSET) == 0) {
+				ConfigStore_Save(&store, record.payload[0], record.payload + 1, record.length - 1u);
+				ConfigStore_Close(&store);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+		if (coveredUs > lastUs)
+			lastUs = coveredUs;
+	}
+	if (offset != recordedBytes)
+		fprintf(stderr, "%s: truncated record at offset %zu\n", path, offset);
+
+	// Run through the last recorded tick.
+	SimScript_SetEndUs(lastUs + SIM_US_PER_MS);
+	return 0;
+}
+
+static bool isOutput(uint8_t type)
+{
+	return type >= TRACE_OUT_LOCK;
+}
+
+static const char* outputName(uint8_t type)
+{
+	switch (type) {
+	case TRACE_OUT_LOCK:
+		return "lock";
+	case TRACE_OUT_ALARM:
+		return "alarm";
+	case TRACE_OUT_TELEMETRY:
+		return "telemetry";
+	case TRACE_OUT_REPORTED:
+		return "reported";
+	default:
+		return "output";
+	}
+}
+
+static bool nextOutput(const uint8_t* records, size_t size, size_t* offset, TraceRecord* record)
+{
+	while (Trace_NextRecord(records, size, offset, record)) {
+		if (isOutput(record->type))
+			return true;
+	}
+	return false;
+}
+
+int SimReplay_Check(void)
+{
+	size_t replayedSize = Trace_DumpSize();
+	uint8_t* replayed = malloc(replayedSize);
+	if (replayed == NULL)
+		return -1;
+	Trace_Dump(replayed, replayedSize);
+	uint32_t replayedBytes;
+	uint32_t replayedDropped;
+	Trace_ParseHeader(replayed, replayedSize, &replayedBytes, &replayedDropped);
+
+	const uint8_t* expected = recorded + TRACE_DUMP_HEADER_SIZE;
+	const uint8_t* actual = replayed + TRACE_DUMP_HEADER_SIZE;
+	size_t expectedOffset = 0;
+	size_t actualOffset = 0;
+	uint64_t matched = 0;
+	uint64_t maxSkewMs = 0;
+	int result = 0;
+	for (;;) {
+		TraceRecord want;
+		TraceRecord got;
+		bool haveWant = nextOutput(expected, recordedBytes, &expectedOffset, &want);
+		bool haveGot = nextOutput(actual, replayedBytes, &actualOffset, &got);
+		if (!haveWant && !haveGot)
+			break;
+		if (!haveWant || !haveGot || want.type != got.type || want.length != got.length
+			|| memcmp(want.payload, got.payload, want.length) != 0) {
+			printf("replay: output %llu differs: recorded %s at %u ms, replayed %s at %u ms\n",
+				(unsigned long long)matched,
+				haveWant ? outputName(want.type) : "nothing", haveWant ? want.timeMs : 0,
+				haveGot ? outputName(got.type) : "nothing", haveGot ? got.timeMs : 0);
+			result = -1;
+			break;
+		}
+		uint64_t skew = want.timeMs > got.timeMs ? want.timeMs - got.timeMs : got.timeMs - want.timeMs;
+		if (skew > maxSkewMs)
+			maxSkewMs = skew;
+		matched++;
+	}
+	if (result == 0) {
+		printf("replay: %llu outputs match the trace, max time skew %llu ms\n",
+			(unsigned long long)matched, (unsigned long long)maxSkewMs);
+	}
+	free(replayed);
+	free(recorded);
+	recorded = NULL;
+	return result;
+}
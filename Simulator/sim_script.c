@@ -0,0 +1,409 @@
+// Scenario feed: a time-ordered queue of inputs injected into the virtual hardware and hub.
+//
+// Scenario file format, one event per line (lines starting with '#' are comments):
+//
+//     <time> key <keys>          press each key for 80 ms with 120 ms between keys
+//     <time> door open|close     door sensor edge
+//     <time> net up|down         network availability
+//     <time> hub up|down         hub reachability (network stays up)
+//     <time> twin <json>         desired-property patch
+//     <time> twin-init <json>    initial twin document ({"desired":{..},"reported":{..}})
+//     <time> method <name> [json]
+//     <time> end                 stop the simulation
+//
+// <time> is milliseconds from the start, optionally with an s, m or h suffix, and may be
+// prefixed with '+' to make it relative to the previous line.
+
+#include "sim.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_KEY_HOLD_US (80 * SIM_US_PER_MS)
+#define SIM_KEY_GAP_US (120 * SIM_US_PER_MS)
+#define SIM_DEFAULT_TAIL_US (60 * SIM_US_PER_SECOND)
+
+typedef enum SimEventType {
+	SIM_EVENT_KEY_DOWN,
+	SIM_EVENT_KEY_UP,
+	SIM_EVENT_DOOR,
+	SIM_EVENT_NET,
+	SIM_EVENT_HUB,
+	SIM_EVENT_TWIN,
+	SIM_EVENT_TWIN_UPDATE,// delivered verbatim, flag set for a complete twin
+	SIM_EVENT_METHOD
+} SimEventType;
+
+typedef struct SimEvent {
+	uint64_t timeUs;
+	uint64_t sequence;// keeps events with equal times in file order
+	SimEventType type;
+	char key;
+	bool flag;
+	char* name;
+	char* payload;
+} SimEvent;
+
+static SimEvent* heap = NULL;
+static size_t heapCount = 0;
+static size_t heapCapacity = 0;
+static uint64_t nextSequence = 0;
+static uint64_t lastEventUs = 0;
+static uint64_t explicitEndUs = 0;
+
+static bool eventBefore(const SimEvent* a, const SimEvent* b)
+{
+	if (a->timeUs != b->timeUs)
+		return a->timeUs < b->timeUs;
+	return a->sequence < b->sequence;
+}
+
+static void pushEvent(SimEvent event)
+{
+	if (heapCount == heapCapacity) {
+		heapCapacity = heapCapacity == 0 ? 256 : heapCapacity * 2;
+		heap = realloc(heap, heapCapacity * sizeof(SimEvent));
+		if (heap == NULL) {
+			fprintf(stderr, "sim: out of memory\n");
+			exit(1);
+		}
+	}
+	event.sequence = nextSequence++;
+	size_t i = heapCount++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!eventBefore(&event, &heap[parent]))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = event;
+	if (event.timeUs > lastEventUs)
+		lastEventUs = event.timeUs;
+}
+
+static SimEvent popEvent(void)
+{
+	SimEvent top = heap[0];
+	SimEvent last = heap[--heapCount];
+	size_t i = 0;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= heapCount)
+			break;
+		if (child + 1 < heapCount && eventBefore(&heap[child + 1], &heap[child]))
+			child++;
+		if (!eventBefore(&heap[child], &last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (heapCount > 0)
+		heap[i] = last;
+	return top;
+}
+
+static void scheduleKeys(uint64_t timeUs, const char* keys)
+{
+	for (const char* k = keys; *k != '\0'; k++) {
+		if (isspace((unsigned char)*k))
+			continue;
+		pushEvent((SimEvent) { .timeUs = timeUs, .type = SIM_EVENT_KEY_DOWN, .key = *k });
+		pushEvent((SimEvent) { .timeUs = timeUs + SIM_KEY_HOLD_US, .type = SIM_EVENT_KEY_UP });
+		timeUs += SIM_KEY_HOLD_US + SIM_KEY_GAP_US;
+	}
+}
+
+void SimScript_AddKeyPress(uint64_t timeUs, char key, uint64_t holdUs)
+{
+	pushEvent((SimEvent) { .timeUs = timeUs, .type = SIM_EVENT_KEY_DOWN, .key = key });
+	pushEvent((SimEvent) { .timeUs = timeUs + holdUs, .type = SIM_EVENT_KEY_UP });
+}
+
+static void scheduleFlag(uint64_t timeUs, SimEventType type, bool flag)
+{
+	pushEvent((SimEvent) { .timeUs = timeUs, .type = type, .flag = flag });
+}
+
+static void scheduleTwin(uint64_t timeUs, const char* json)
+{
+	pushEvent((SimEvent) { .timeUs = timeUs, .type = SIM_EVENT_TWIN, .payload = strdup(json) });
+}
+
+void SimScript_AddDoor(uint64_t timeUs, bool open)
+{
+	scheduleFlag(timeUs, SIM_EVENT_DOOR, open);
+}
+
+void SimScript_AddNetwork(uint64_t timeUs, bool ready)
+{
+	scheduleFlag(timeUs, SIM_EVENT_NET, ready);
+}
+
+void SimScript_AddTwinUpdate(uint64_t timeUs, bool complete, const char* json)
+{
+	pushEvent((SimEvent) { .timeUs = timeUs, .type = SIM_EVENT_TWIN_UPDATE, .flag = complete,
+		.payload = strdup(json) });
+}
+
+static void scheduleMethod(uint64_t timeUs, const char* name, const char* payload)
+{
+	pushEvent((SimEvent) { .timeUs = timeUs, .type = SIM_EVENT_METHOD, .name = strdup(name),
+		.payload = strdup(payload == NULL || *payload == '\0' ? "{}" : payload) });
+}
+
+void SimScript_AddMethod(uint64_t timeUs, const char* name, const char* payload)
+{
+	scheduleMethod(timeUs, name, payload);
+}
+
+void SimScript_SetEndUs(uint64_t endUs)
+{
+	explicitEndUs = endUs;
+}
+
+// Parses "<number>[ms|s|m|h]" into microseconds, returns false on malformed input.
+static bool parseTime(const char* text, uint64_t* us)
+{
+	char* end;
+	double value = strtod(text, &end);
+	if (end == text || value < 0)
+		return false;
+	double scale = (double)SIM_US_PER_MS;
+	if (strcmp(end, "s") == 0)
+		scale = (double)SIM_US_PER_SECOND;
+	else if (strcmp(end, "m") == 0)
+		scale = 60.0 * SIM_US_PER_SECOND;
+	else if (strcmp(end, "h") == 0)
+		scale = 3600.0 * SIM_US_PER_SECOND;
+	else if (*end != '\0' && strcmp(end, "ms") != 0)
+		return false;
+	*us = (uint64_t)(value * scale);
+	return true;
+}
+
+static char* skipSpaces(char* s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+	return s;
+}
+
+static char* nextToken(char** cursor)
+{
+	char* start = skipSpaces(*cursor);
+	char* end = start;
+	while (*end != '\0' && !isspace((unsigned char)*end))
+		end++;
+	if (*end != '\0')
+		*end++ = '\0';
+	*cursor = end;
+	return start;
+}
+
+int SimScript_Load(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	char line[4096];
+	int lineNumber = 0;
+	uint64_t previousUs = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		lineNumber++;
+		// '#' is also a keypad key, so it only starts a comment at the beginning of a line.
+		char* cursor = skipSpaces(line);
+		if (*cursor == '\0' || *cursor == '#')
+			continue;
+		size_t length = strlen(cursor);
+		while (length > 0 && isspace((unsigned char)cursor[length - 1]))
+			cursor[--length] = '\0';
+
+		char* timeText = nextToken(&cursor);
+		char* verb = nextToken(&cursor);
+		char* rest = skipSpaces(cursor);
+
+		bool relative = timeText[0] == '+';
+		uint64_t timeUs;
+		if (!parseTime(relative ? timeText + 1 : timeText, &timeUs)) {
+			fprintf(stderr, "%s:%d: bad time '%s'\n", path, lineNumber, timeText);
+			fclose(file);
+			return -1;
+		}
+		if (relative)
+			timeUs += previousUs;
+		previousUs = timeUs;
+
+		if (strcmp(verb, "key") == 0) {
+			scheduleKeys(timeUs, rest);
+		}
+		else if (strcmp(verb, "door") == 0) {
+			scheduleFlag(timeUs, SIM_EVENT_DOOR, strcmp(rest, "open") == 0);
+		}
+		else if (strcmp(verb, "net") == 0) {
+			scheduleFlag(timeUs, SIM_EVENT_NET, strcmp(rest, "up") == 0);
+		}
+		else if (strcmp(verb, "hub") == 0) {
+			scheduleFlag(timeUs, SIM_EVENT_HUB, strcmp(rest, "up") == 0);
+		}
+		else if (strcmp(verb, "twin") == 0) {
+			scheduleTwin(timeUs, rest);
+		}
+		else if (strcmp(verb, "twin-init") == 0) {
+			SimHub_SetInitialTwin(rest);
+		}
+		else if (strcmp(verb, "method") == 0) {
+			char* name = nextToken(&rest);
+			scheduleMethod(timeUs, name, skipSpaces(rest));
+		}
+		else if (strcmp(verb, "end") == 0) {
+			explicitEndUs = timeUs;
+		}
+		else {
+			fprintf(stderr, "%s:%d: unknown event '%s'\n", path, lineNumber, verb);
+			fclose(file);
+			return -1;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static int compareTimes(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// Generates a day of typical office door traffic: mostly PIN entries followed by a door
+// cycle, some wrong PINs, config visits and the odd intrusion, plus an always-open window
+// during business hours and a short network outage.
+void SimScript_GenerateDay(unsigned int doorCycles, unsigned int seed)
+{
+	const uint64_t hourUs = 3600 * SIM_US_PER_SECOND;
+	const uint64_t startUs = 60 * SIM_US_PER_SECOND;// leave time to connect and sync
+	uint32_t state = seed == 0 ? 0x2545F491u : seed;
+
+	uint64_t* times = calloc(doorCycles == 0 ? 1 : doorCycles, sizeof(uint64_t));
+	for (unsigned int i = 0; i < doorCycles; i++)
+		times[i] = startUs + (uint64_t)nextRandom(&state) % (24 * hourUs - startUs - hourUs);
+	qsort(times, doorCycles, sizeof(uint64_t), compareTimes);
+
+	uint64_t busyUntilUs = 0;
+	for (unsigned int i = 0; i < doorCycles; i++) {
+		uint64_t t = times[i] < busyUntilUs ? busyUntilUs : times[i];
+		unsigned int kind = nextRandom(&state) % 100;
+		uint64_t openAfterUs = 1500 * SIM_US_PER_MS + (nextRandom(&state) % 1000) * SIM_US_PER_MS;
+		uint64_t openForUs = 2 * SIM_US_PER_SECOND + (nextRandom(&state) % 4000) * SIM_US_PER_MS;
+
+		if (kind < 85) {
+			scheduleKeys(t, "1234#");
+		}
+		else if (kind < 95) {
+			scheduleKeys(t, "9999#");
+			t += 3 * SIM_US_PER_SECOND;
+			scheduleKeys(t, "1234#");
+		}
+		else if (kind < 98) {
+			scheduleKeys(t, "12345*");
+			scheduleKeys(t + 4 * SIM_US_PER_SECOND, "B");
+			busyUntilUs = t + 10 * SIM_US_PER_SECOND;
+			continue;
+		}
+		else {
+			// Door forced while locked: alarm, then an operator clears it remotely.
+			scheduleFlag(t + openAfterUs, SIM_EVENT_DOOR, true);
+			scheduleFlag(t + openAfterUs + openForUs, SIM_EVENT_DOOR, false);
+			scheduleMethod(t + 60 * SIM_US_PER_SECOND, "ResetAlarm", "{}");
+			busyUntilUs = t + 70 * SIM_US_PER_SECOND;
+			continue;
+		}
+		scheduleFlag(t + openAfterUs, SIM_EVENT_DOOR, true);
+		scheduleFlag(t + openAfterUs + openForUs, SIM_EVENT_DOOR, false);
+		busyUntilUs = t + openAfterUs + openForUs + SIM_US_PER_SECOND;
+	}
+	free(times);
+
+	scheduleTwin(8 * hourUs, "{\"AlwaysOpen\":{\"value\":true}}");
+	scheduleTwin(9 * hourUs, "{\"AlwaysOpen\":{\"value\":false}}");
+	scheduleFlag(13 * hourUs, SIM_EVENT_NET, false);
+	scheduleFlag(13 * hourUs + 2 * 60 * SIM_US_PER_SECOND, SIM_EVENT_NET, true);
+	explicitEndUs = 24 * hourUs;
+}
+
+bool SimScript_NextTimeUs(uint64_t* timeUs)
+{
+	if (heapCount == 0)
+		return false;
+	*timeUs = heap[0].timeUs;
+	return true;
+}
+
+uint64_t SimScript_EndUs(void)
+{
+	if (explicitEndUs != 0)
+		return explicitEndUs;
+	return lastEventUs + SIM_DEFAULT_TAIL_US;
+}
+
+void SimScript_DispatchDue(uint64_t nowUs)
+{
+	while (heapCount > 0 && heap[0].timeUs <= nowUs) {
+		SimEvent event = popEvent();
+		switch (event.type) {
+		case SIM_EVENT_KEY_DOWN:
+			if (event.key == '#' || event.key == '*')
+				Sim_NoteInput(SIM_INPUT_KEYPAD);
+			else
+				Sim_CancelInput(SIM_INPUT_KEYPAD);
+			Sim_SetKeyDown(event.key);
+			break;
+		case SIM_EVENT_KEY_UP:
+			Sim_SetKeyDown(0);
+			break;
+		case SIM_EVENT_DOOR:
+			if (event.flag)
+				Sim_NoteInput(SIM_INPUT_DOOR);
+			else
+				Sim_CancelInput(SIM_INPUT_DOOR);
+			Sim_SetDoorOpen(event.flag);
+			break;
+		case SIM_EVENT_NET:
+			Sim_SetNetworkReady(event.flag);
+			break;
+		case SIM_EVENT_HUB:
+			SimHub_SetReachable(event.flag);
+			break;
+		case SIM_EVENT_TWIN:
+			Sim_NoteInput(SIM_INPUT_CLOUD);
+			SimHub_QueueDesiredPatch(event.payload);
+			break;
+		case SIM_EVENT_TWIN_UPDATE:
+			Sim_NoteInput(SIM_INPUT_CLOUD);
+			SimHub_QueueTwinUpdate(event.flag, event.payload);
+			break;
+		case SIM_EVENT_METHOD:
+			Sim_NoteInput(SIM_INPUT_CLOUD);
+			SimHub_QueueMethod(event.name, event.payload);
+			break;
+		}
+		free(event.name);
+		free(event.payload);
+	}
+}
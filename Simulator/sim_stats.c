@@ -0,0 +1,193 @@
+#include "sim.h"
+
+#include <stdio.h>
+
+_Thread_local SimStats simStats;
+
+static const char* const syscallNames[SIM_SYSCALL_COUNT] = {
+	[SIM_SYSCALL_GPIO] = "gpio",
+	[SIM_SYSCALL_SPI] = "spi",
+	[SIM_SYSCALL_TIMERFD] = "timerfd",
+	[SIM_SYSCALL_EPOLL] = "epoll",
+	[SIM_SYSCALL_EVENTFD] = "eventfd",
+	[SIM_SYSCALL_NETWORKING] = "networking",
+	[SIM_SYSCALL_STORAGE] = "storage",
+	[SIM_SYSCALL_LOG] = "log",
+	[SIM_SYSCALL_SLEEP] = "sleep",
+	[SIM_SYSCALL_CLOCK] = "clock",
+};
+
+static const char* const outputNames[SIM_OUTPUT_COUNT] = {
+	[SIM_OUTPUT_LOCK] = "lock relay",
+	[SIM_OUTPUT_ALARM] = "alarm relay",
+};
+
+static const char* const inputNames[SIM_INPUT_COUNT] = {
+	[SIM_INPUT_KEYPAD] = "keypad -> lock relay",
+	[SIM_INPUT_DOOR] = "door open -> alarm relay",
+	[SIM_INPUT_CLOUD] = "cloud -> relay",
+};
+
+// Actuations later than this are not attributed to the input (e.g. a mono-mode relock).
+// Cloud inputs wait for the next DoWork, so they get a longer window.
+static const uint64_t responseWindowUs[SIM_INPUT_COUNT] = {
+	[SIM_INPUT_KEYPAD] = 2 * SIM_US_PER_SECOND,
+	[SIM_INPUT_DOOR] = 2 * SIM_US_PER_SECOND,
+	[SIM_INPUT_CLOUD] = 10 * SIM_US_PER_SECOND,
+};
+
+static unsigned int bucketIndex(uint64_t value)
+{
+	if (value < 8)
+		return (unsigned int)value;
+	unsigned int exponent = 63 - (unsigned int)__builtin_clzll(value);
+	unsigned int sub = (unsigned int)(value >> (exponent - 3)) & 7;
+	return (exponent - 2) * 8 + sub;
+}
+
+static uint64_t bucketLowerBound(unsigned int index)
+{
+	if (index < 8)
+		return index;
+	unsigned int exponent = index / 8 + 2;
+	unsigned int sub = index % 8;
+	return (8ULL + sub) << (exponent - 3);
+}
+
+void SimHistogram_Add(SimHistogram* histogram, uint64_t value)
+{
+	if (histogram->count == 0 || value < histogram->min)
+		histogram->min = value;
+	if (value > histogram->max)
+		histogram->max = value;
+	histogram->count++;
+	histogram->sum += value;
+	histogram->buckets[bucketIndex(value)]++;
+}
+
+uint64_t SimHistogram_Percentile(const SimHistogram* histogram, double percentile)
+{
+	if (histogram->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->count);
+	if (rank >= histogram->count)
+		rank = histogram->count - 1;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < SIM_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen > rank) {
+			uint64_t bound = bucketLowerBound(i);
+			if (bound < histogram->min)
+				return histogram->min;
+			return bound > histogram->max ? histogram->max : bound;
+		}
+	}
+	return histogram->max;
+}
+
+void SimHistogram_Merge(SimHistogram* into, const SimHistogram* from)
+{
+	if (from->count == 0)
+		return;
+	if (into->count == 0 || from->min < into->min)
+		into->min = from->min;
+	if (from->max > into->max)
+		into->max = from->max;
+	into->count += from->count;
+	into->sum += from->sum;
+	for (unsigned int i = 0; i < SIM_HISTOGRAM_BUCKETS; i++)
+		into->buckets[i] += from->buckets[i];
+}
+
+void SimHistogram_Print(const char* name, const SimHistogram* histogram, double scale, const char* unit)
+{
+	if (histogram->count == 0) {
+		printf("  %-26s n=0\n", name);
+		return;
+	}
+	printf("  %-26s n=%-9llu mean=%.3f p50=%.3f p99=%.3f max=%.3f %s\n", name,
+		(unsigned long long)histogram->count,
+		(double)histogram->sum / (double)histogram->count * scale,
+		(double)SimHistogram_Percentile(histogram, 50) * scale,
+		(double)SimHistogram_Percentile(histogram, 99) * scale,
+		(double)histogram->max * scale, unit);
+}
+
+void Sim_CountSyscall(SimSyscall kind)
+{
+	simStats.syscalls[kind]++;
+}
+
+void Sim_NoteInput(SimInput input)
+{
+	simStats.inputs[input]++;
+	simDevice->inputPending[input] = true;
+	simDevice->inputTimeUs[input] = Sim_NowUs();
+}
+
+void Sim_CancelInput(SimInput input)
+{
+	simDevice->inputPending[input] = false;
+}
+
+static void completeInput(SimInput input)
+{
+	if (!simDevice->inputPending[input])
+		return;
+	simDevice->inputPending[input] = false;
+	if (Sim_NowUs() - simDevice->inputTimeUs[input] > responseWindowUs[input])
+		return;
+	SimHistogram_Add(&simStats.inputToActuationUs[input], Sim_NowUs() - simDevice->inputTimeUs[input]);
+}
+
+void Sim_NoteOutput(SimOutput output)
+{
+	simStats.outputChanges[output]++;
+	completeInput(output == SIM_OUTPUT_LOCK ? SIM_INPUT_KEYPAD : SIM_INPUT_DOOR);
+	completeInput(SIM_INPUT_CLOUD);
+}
+
+void SimStats_Merge(SimStats* into, const SimStats* from)
+{
+	for (int i = 0; i < SIM_SYSCALL_COUNT; i++)
+		into->syscalls[i] += from->syscalls[i];
+	for (int i = 0; i < SIM_OUTPUT_COUNT; i++)
+		into->outputChanges[i] += from->outputChanges[i];
+	into->spiBytes += from->spiBytes;
+	for (int i = 0; i < SIM_INPUT_COUNT; i++) {
+		into->inputs[i] += from->inputs[i];
+		SimHistogram_Merge(&into->inputToActuationUs[i], &from->inputToActuationUs[i]);
+	}
+	SimHistogram_Merge(&into->handlerStallUs, &from->handlerStallUs);
+	SimHistogram_Merge(&into->handlerHostNs, &from->handlerHostNs);
+}
+
+void Sim_PrintStats(uint64_t hostWallNs)
+{
+	double virtualSeconds = (double)Sim_NowUs() / SIM_US_PER_SECOND;
+	double hostSeconds = (double)hostWallNs / 1e9;
+
+	printf("time\n");
+	printf("  virtual                    %.3f s\n", virtualSeconds);
+	printf("  host wall                  %.3f s (%.0fx real time)\n", hostSeconds,
+		hostSeconds > 0 ? virtualSeconds / hostSeconds : 0.0);
+
+	uint64_t total = 0;
+	for (int i = 0; i < SIM_SYSCALL_COUNT; i++)
+		total += simStats.syscalls[i];
+	printf("syscalls                     %llu (%.1f per virtual second)\n", (unsigned long long)total,
+		virtualSeconds > 0 ? (double)total / virtualSeconds : 0.0);
+	for (int i = 0; i < SIM_SYSCALL_COUNT; i++)
+		printf("  %-26s %llu\n", syscallNames[i], (unsigned long long)simStats.syscalls[i]);
+
+	printf("hardware\n");
+	for (int i = 0; i < SIM_OUTPUT_COUNT; i++)
+		printf("  %-26s %llu changes\n", outputNames[i], (unsigned long long)simStats.outputChanges[i]);
+	printf("  %-26s %llu bytes\n", "display spi", (unsigned long long)simStats.spiBytes);
+
+	printf("latency\n");
+	for (int i = 0; i < SIM_INPUT_COUNT; i++)
+		SimHistogram_Print(inputNames[i], &simStats.inputToActuationUs[i], 1e-3, "ms");
+	SimHistogram_Print("handler stall (virtual)", &simStats.handlerStallUs, 1e-3, "ms");
+	SimHistogram_Print("handler cpu (host)", &simStats.handlerHostNs, 1e-3, "us");
+}
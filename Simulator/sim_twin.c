@@ -0,0 +1,330 @@
+// lock_twin: benchmark of twin updates through the lock's TwinCallback (../AzureIoT/lock.c)
+// and of the twin parser generated from ../AzureIoT/lock_twin.json.
+//
+//     lock_twin [--updates N]
+//
+// The parser is checked first: a twin written by LockTwin_WriteReported reads back the same,
+// escapes, numbers given as strings and values of the wrong type are handled, and malformed
+// documents are rejected, and the strict reading of an ApplyConfig document fails on what the
+// twin reading lets go. Then a complete twin and a patch are parsed N times each, by the
+// generated parser and by the parson DOM lookups TwinCallback used before, to show the parse
+// cost per document.
+//
+// One door, synced by a complete twin, is given N updates of each kind: the complete twin it
+// gets on every connect, once with new $versions and once repeated, a desired-property patch
+// that toggles AlwaysOpen and a patch at a $version already applied. For each kind the report
+// shows the host time per update and, from the lock's LockTwinStats, how many configuration
+// values were read and how many differed and were applied. The updates are formatted before
+// the clock starts.
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iothub_device_client_ll.h>
+
+#include "display.h"
+#include "json_writer.h"
+#include "keyboard.h"
+#include "lock.h"
+#include "lock_twin.h"
+#include "parson.h"
+
+#define TWIN_TEXT_SIZE 384
+
+extern void TwinCallback(DEVICE_TWIN_UPDATE_STATE updateState, const unsigned char* payload,
+	size_t payloadSize, void* userContextCallback);
+
+static const char completeTwin[] = "{\"desired\":{\"AlwaysOpen\":{\"value\":false},\"$version\":%lu},"
+	"\"reported\":{\"LockMode\":\"Monostable\",\"ContactMode\":\"Normal open\",\"DisplayBacklightMode\":\"Auto\","
+	"\"MonoSwitchTime\":5,\"UserPassword\":\"1234\",\"ConfigPassword\":\"12345\",\"IsLockOpen\":false,"
+	"\"IsDoorOpen\":false,\"IsAlarm\":false,\"$version\":%lu}}";
+static const char desiredPatch[] = "{\"AlwaysOpen\":{\"value\":%s},\"$version\":%lu}";
+
+typedef enum TwinKind {
+	TWIN_COMPLETE_NEW,
+	TWIN_COMPLETE_REPEATED,
+	TWIN_PARTIAL,
+	TWIN_PARTIAL_STALE,
+	TWIN_KIND_COUNT
+} TwinKind;
+
+static const char* const kindNames[TWIN_KIND_COUNT] = {
+	[TWIN_COMPLETE_NEW] = "complete twin, new $version",
+	[TWIN_COMPLETE_REPEATED] = "complete twin, repeated",
+	[TWIN_PARTIAL] = "partial patch",
+	[TWIN_PARTIAL_STALE] = "partial patch, stale"
+};
+
+// Update `i` of a kind; the door was synced at desired and reported $version 1.
+static int formatUpdate(char* text, TwinKind kind, unsigned long i)
+{
+	switch (kind) {
+	case TWIN_COMPLETE_NEW:
+		return snprintf(text, TWIN_TEXT_SIZE, completeTwin, 1 + i + 1, 1 + i + 1);
+	case TWIN_COMPLETE_REPEATED:
+		return snprintf(text, TWIN_TEXT_SIZE, completeTwin, 1UL, 1UL);
+	case TWIN_PARTIAL:
+		return snprintf(text, TWIN_TEXT_SIZE, desiredPatch, (i & 1) == 0 ? "true" : "false", 1 + i + 1);
+	default:
+		return snprintf(text, TWIN_TEXT_SIZE, desiredPatch, "true", 1UL);
+	}
+}
+
+static bool checkParser(void)
+{
+	LockTwin written = { .present = LOCK_TWIN_REPORTED_FIELDS, .lockMode = BI, .contactMode = NORMAL_CLOSED,
+		.displayBacklight = CONSTANT, .monoSwitchSeconds = 42, .userPassword = "98\"7", .adminPassword = "\\0" };
+	char text[TWIN_TEXT_SIZE];
+	JsonWriter writer;
+	JsonWriter_Init(&writer, text, sizeof(text));
+	JsonWriter_BeginObject(&writer, NULL);
+	JsonWriter_BeginObject(&writer, "reported");
+	LockTwin_WriteReported(&writer, &written);
+	JsonWriter_Int(&writer, "$version", 7);
+	JsonWriter_EndObject(&writer);
+	JsonWriter_EndObject(&writer);
+	int length = JsonWriter_Finish(&writer);
+
+	LockTwin read;
+	LockTwinVersions versions;
+	if (length < 0 || LockTwin_Parse(text, (size_t)length, &read, &versions) < 0 || versions.reported != 7
+		|| versions.desired != -1 || memcmp(&read, &written, sizeof(read)) != 0) {
+		printf("FAILED reported properties don't read back: %s\n", text);
+		return false;
+	}
+
+	// Desired keys count only in the desired section, wrong types and unknown keys are skipped,
+	// long strings are cut and a flag needs a boolean "value".
+	static const char mixed[] = "{\"desired\":{\"AlwaysOpen\":{\"value\":true,\"x\":[1,{}]},\"LockMode\":\"Bistable\","
+		"\"AlwaysClosed\":{\"value\":1},\"$version\":3},\"reported\":{\"MonoSwitchTime\":\"x5\",\"ContactMode\":7,"
+		"\"UserPassword\":\"1234567890123456\",\"Other\":null,\"DisplayBacklightMode\":\"\\u0041uto\"}}";
+	if (LockTwin_Parse(mixed, sizeof(mixed) - 1, &read, &versions) < 0
+		|| read.present != (LOCK_TWIN_ALWAYS_OPEN | LOCK_TWIN_USER_PASSWORD | LOCK_TWIN_DISPLAY_BACKLIGHT_MODE)
+		|| !read.alwaysOpen || strcmp(read.userPassword, "12345678901") != 0 || read.displayBacklight != AUTO
+		|| versions.desired != 3 || versions.reported != -1) {
+		printf("FAILED mixed twin read as present 0x%x\n", read.present);
+		return false;
+	}
+
+	static const char* const malformed[] = { "", "[]", "{", "{\"a\":1,}", "{\"a\" 1}", "{\"a\":tru}",
+		"{\"UserPassword\":\"12}", "{\"a\":1} x", "{\"a\":{\"b\":1}" };
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		if (LockTwin_Parse(malformed[i], strlen(malformed[i]), &read, &versions) == 0) {
+			printf("FAILED malformed twin accepted: %s\n", malformed[i]);
+			return false;
+		}
+	}
+
+	// The ApplyConfig reading takes the same values and fails on anything the twin reading
+	// skips or falls back on, naming the property when it can.
+	static const char config[] = "{\"LockMode\":\"Bistable\",\"MonoSwitchTime\":\"9\",\"UserPassword\":\"4321\"}";
+	const char* property;
+	if (LockTwin_ParseStrict(config, sizeof(config) - 1, LOCK_TWIN_REPORTED_FIELDS, &read, &property) < 0
+		|| read.present != (LOCK_TWIN_LOCK_MODE | LOCK_TWIN_MONO_SWITCH_TIME | LOCK_TWIN_USER_PASSWORD)
+		|| read.lockMode != BI || read.monoSwitchSeconds != 9 || strcmp(read.userPassword, "4321") != 0) {
+		printf("FAILED configuration read as present 0x%x\n", read.present);
+		return false;
+	}
+	static const struct {
+		const char* json;
+		const char* property;
+	} rejected[] = {
+		{ "{\"LockMode\":\"Bistabel\"}", "LockMode" },
+		{ "{\"ContactMode\":7}", "ContactMode" },
+		{ "{\"MonoSwitchTime\":0}", "MonoSwitchTime" },
+		{ "{\"UserPassword\":\"1234567890123456\"}", "UserPassword" },
+		{ "{\"AlwaysOpen\":{\"value\":true}}", NULL },
+		{ "{\"Other\":1}", NULL },
+		{ "{\"LockMode\":\"Bistable\"", NULL }
+	};
+	for (size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++) {
+		if (LockTwin_ParseStrict(rejected[i].json, strlen(rejected[i].json), LOCK_TWIN_REPORTED_FIELDS, &read, &property) == 0
+			|| (property == NULL) != (rejected[i].property == NULL)
+			|| (property != NULL && strcmp(property, rejected[i].property) != 0)) {
+			printf("FAILED configuration not rejected as expected: %s\n", rejected[i].json);
+			return false;
+		}
+	}
+	return true;
+}
+
+// What TwinCallback did before the generated parser: copy, build the DOM, look each property up.
+static void parsonParse(const char* text, size_t length, LockTwin* twin)
+{
+	char* copy = malloc(length + 1);
+	memcpy(copy, text, length);
+	copy[length] = '\0';
+	JSON_Value* root = json_parse_string(copy);
+	JSON_Object* rootObject = json_value_get_object(root);
+	JSON_Object* desired = json_object_dotget_object(rootObject, "desired");
+	if (desired == NULL)
+		desired = rootObject;
+	JSON_Object* reported = json_object_dotget_object(rootObject, "reported");
+	if (reported == NULL)
+		reported = rootObject;
+	twin->present = 0;
+	JSON_Object* flag = json_object_dotget_object(desired, "AlwaysOpen");
+	if (flag != NULL) {
+		twin->present |= LOCK_TWIN_ALWAYS_OPEN;
+		twin->alwaysOpen = (bool)json_object_get_boolean(flag, "value");
+	}
+	flag = json_object_dotget_object(desired, "AlwaysClosed");
+	if (flag != NULL) {
+		twin->present |= LOCK_TWIN_ALWAYS_CLOSED;
+		twin->alwaysClosed = (bool)json_object_get_boolean(flag, "value");
+	}
+	const char* val = json_object_dotget_string(reported, "LockMode");
+	if (val != NULL)
+		twin->lockMode = !strcmp(val, "Monostable") ? MONO : BI;
+	val = json_object_dotget_string(reported, "ContactMode");
+	if (val != NULL)
+		twin->contactMode = !strcmp(val, "Normal open") ? NORMAL_OPEN : NORMAL_CLOSED;
+	val = json_object_dotget_string(reported, "DisplayBacklightMode");
+	if (val != NULL)
+		twin->displayBacklight = !strcmp(val, "None") ? NONE : !strcmp(val, "Auto") ? AUTO : CONSTANT;
+	twin->monoSwitchSeconds = (uint32_t)json_object_dotget_number(reported, "MonoSwitchTime");
+	val = json_object_dotget_string(reported, "UserPassword");
+	if (val != NULL)
+		twin->present |= LOCK_TWIN_USER_PASSWORD;
+	val = json_object_dotget_string(reported, "ConfigPassword");
+	if (val != NULL)
+		twin->present |= LOCK_TWIN_CONFIG_PASSWORD;
+	json_value_free(root);
+	free(copy);
+}
+
+static void benchmarkParse(const char* name, const char* text, unsigned long documents)
+{
+	size_t length = strlen(text);
+	LockTwin twin;
+	LockTwinVersions versions;
+	volatile uint32_t sink = 0;// keeps the loops from being optimized away
+
+	uint64_t startNs = Sim_HostNowNs();
+	for (unsigned long i = 0; i < documents; i++) {
+		parsonParse(text, length, &twin);
+		sink += twin.present;
+	}
+	uint64_t parsonNs = Sim_HostNowNs() - startNs;
+
+	startNs = Sim_HostNowNs();
+	for (unsigned long i = 0; i < documents; i++) {
+		LockTwin_Parse(text, length, &twin, &versions);
+		sink += twin.present;
+	}
+	uint64_t generatedNs = Sim_HostNowNs() - startNs;
+	(void)sink;
+
+	printf("  %-28s %7.3f us parson  %7.3f us generated  %5.1fx  %zu bytes\n", name,
+		(double)parsonNs / (double)documents / 1e3, (double)generatedNs / (double)documents / 1e3,
+		generatedNs > 0 ? (double)parsonNs / (double)generatedNs : 0.0, length);
+}
+
+static int startDoor(LockContext* lock, SimDevice* device)
+{
+	SimDevice_Init(device);
+	device->networkReady = true;
+	simDevice = device;
+	if (initDisplay() < 0 || initKeyboard() < 0)
+		return -1;
+	Lock_InitContext(lock);
+	if (Lock_Open(lock) < 0 || Lock_Start(lock) < 0)
+		return -1;
+	Lock_BootStage(lock, LOCK_BOOT_KEYPAD);
+	Lock_DisplayReady(lock);
+	char text[TWIN_TEXT_SIZE];
+	int length = formatUpdate(text, TWIN_COMPLETE_REPEATED, 0);
+	TwinCallback(DEVICE_TWIN_UPDATE_COMPLETE, (const unsigned char*)text, (size_t)length, lock);
+	return lock->core.synced ? 0 : -1;
+}
+
+static int runKind(TwinKind kind, unsigned long updates)
+{
+	char* texts = malloc(updates * TWIN_TEXT_SIZE);
+	size_t* lengths = malloc(updates * sizeof(size_t));
+	if (texts == NULL || lengths == NULL) {
+		fprintf(stderr, "lock_twin: out of memory\n");
+		return -1;
+	}
+	size_t bytes = 0;
+	for (unsigned long i = 0; i < updates; i++) {
+		lengths[i] = (size_t)formatUpdate(texts + i * TWIN_TEXT_SIZE, kind, i);
+		bytes += lengths[i];
+	}
+
+	static LockContext lock;
+	static SimDevice device;
+	if (startDoor(&lock, &device) < 0) {
+		fprintf(stderr, "lock_twin: the door failed to start\n");
+		return -1;
+	}
+	DEVICE_TWIN_UPDATE_STATE state = kind == TWIN_COMPLETE_NEW || kind == TWIN_COMPLETE_REPEATED ?
+		DEVICE_TWIN_UPDATE_COMPLETE : DEVICE_TWIN_UPDATE_PARTIAL;
+	LockTwinStats before = lock.twinStats;
+
+	uint64_t startNs = Sim_HostNowNs();
+	for (unsigned long i = 0; i < updates; i++)
+		TwinCallback(state, (const unsigned char*)(texts + i * TWIN_TEXT_SIZE), lengths[i], &lock);
+	uint64_t ns = Sim_HostNowNs() - startNs;
+
+	const LockTwinStats* after = &lock.twinStats;
+	double count = (double)updates;
+	printf("  %-28s %7.2f us  %5.1f bytes  %4.2f read  %4.2f applied  %4.2f ignored\n",
+		kindNames[kind], (double)ns / count / 1e3, (double)bytes / count,
+		(double)(after->fieldsRead - before.fieldsRead) / count,
+		(double)(after->fieldsApplied - before.fieldsApplied) / count,
+		(double)(after->ignored - before.ignored) / count);
+
+	Lock_Close(&lock);
+	free(lengths);
+	free(texts);
+	return 0;
+}
+
+static void usage(const char* program)
+{
+	fprintf(stderr,
+		"usage: %s [--updates N]\n"
+		"  --updates N   updates of each kind (default 20000)\n",
+		program);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long updates = 20000;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--updates") == 0 && i + 1 < argc) {
+			updates = strtoul(argv[++i], NULL, 10);
+		}
+		else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (updates == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	printf("=== lock_twin ===\n");
+	if (!checkParser())
+		return 1;
+	printf("generated parser checked: round trip, sections, types, escapes, malformed documents, strict configuration\n");
+
+	printf("parse cost per document (%lu documents)\n", updates);
+	char text[TWIN_TEXT_SIZE];
+	formatUpdate(text, TWIN_COMPLETE_NEW, 0);
+	benchmarkParse("complete twin", text, updates);
+	formatUpdate(text, TWIN_PARTIAL, 0);
+	benchmarkParse("partial patch", text, updates);
+
+	printf("TwinCallback per update (%lu updates of each kind)\n", updates);
+	for (int kind = 0; kind < TWIN_KIND_COUNT; kind++) {
+		if (runKind((TwinKind)kind, updates) < 0)
+			return 1;
+	}
+	return 0;
+}